@@ -0,0 +1,14 @@
+// Stage-2 updater for writestk500 -z.  Build it for the "(nRF24 boot)"
+// platform with the text section moved to the top 1K of flash, e.g. for an
+// ATtiny1614:
+//
+//     -Wl,--section-start=.text=0x3C00
+//
+// and pass the resulting hex to writestk500 with -z.  It needs at least
+// 512 bytes of SRAM.
+#include <megaTinyNrfUpdater.h>
+
+int main()
+{
+	mtnrf::Updater::run();
+}
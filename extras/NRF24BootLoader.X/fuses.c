@@ -1,5 +1,10 @@
 #include <avr/io.h>
 
+// 1 for the 512 byte build with the read memory command (see main.S)
+#ifndef EXTENDED_BOOTLOADER
+#define EXTENDED_BOOTLOADER 0
+#endif
+
 const uint8_t userrow[] __attribute__ ((section (".user_signatures"))) = 
 {
     '0', '0', '1', // address
@@ -15,5 +20,5 @@ FUSES = {
 	.SYSCFG0 = 0xC4,		/* System Configuration 0 */
 	.SYSCFG1 = 0x04,		/* System Configuration 1 */
 	.APPEND = 0x00,			/* Application Code Section End */
-	.BOOTEND = 0x01			/* Boot Section End */
+	.BOOTEND = EXTENDED_BOOTLOADER ? 0x02 : 0x01 /* Boot Section End */
 };
@@ -34,7 +34,11 @@ def main():
 
     ih = IntelHex()
     ih.loadhex(args.filename)
-    data = ih.tobinstr(start=0, size=0x100)
+    # the CRC covers the boot section, BOOTEND fuse * 256 bytes
+    bootsize = 0x100
+    if 0x820008 in ih.addresses():
+        bootsize = ih[0x820008] * 0x100
+    data = ih.tobinstr(start=0, size=bootsize)
     offset = data.find(b'\xCC\xCC')
     if offset < 0:
         return
@@ -42,7 +46,7 @@ def main():
     print('Patching with CRC of %04X' % crc)
     ih[offset] = crc >> 8
     ih[offset + 1] = crc & 255
-    #data = ih.tobinstr(start=0, size=0x100)
+    #data = ih.tobinstr(start=0, size=bootsize)
     #print('Final CRC = %04X' % crc16(data))
     ih.write_hex_file(args.filename)
 
@@ -0,0 +1,947 @@
+// Assembles the bootloader (extras/NRF24BootLoader.X/main.S) on the host so
+// its EXTENDED_BOOTLOADER and PACKED_WRITES builds can be checked without an
+// AVR toolchain.  The input has already been through the C preprocessor, as
+// avr-gcc -x assembler-with-cpp does before avr-as, with asm/avr/io.h
+// standing in for avr-libc's.  Only what main.S uses is supported: labels,
+// .org, .byte, .word and the instructions statement() encodes, with avr-as's
+// operator precedence and lo8()/hi8().
+//
+//   avrasm [-b boot size] [-f hex] [-c hex] [-s header -p prefix] input output.hex
+//
+//   -b  boot section size, the CRC of which is made 0xFFFF by patching the
+//       0xCC, 0xCC bytes in it as patchcrc.py does (default 256)
+//   -f  copy the fuses and USERROW from this hex (the production one, built
+//       with fuses.c) into the output, with BOOTEND set for the boot size
+//   -c  fail if the flash differs from this hex
+//   -s  write the word address of each label and the boot section's words
+//       to a header, as <prefix>_<label> and <prefix>_WORDS
+//
+// The exit code is non-zero for anything it can't assemble and when the code
+// runs past an .org, which is how main.S's .org BOOT_SIZE reports a boot
+// section that has grown too big.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <cctype>
+#include <map>
+#include <string>
+#include <vector>
+
+struct Line
+{
+    std::string file;
+    int line;
+    std::vector<std::string> labels;
+    std::string mnemonic;
+    std::vector<std::string> operands;
+};
+
+struct Error
+{
+    std::string message;
+};
+
+class Assembler
+{
+public:
+    bool assemble(const std::vector<Line>& lines);
+    const std::vector<uint8_t>& flash() const { return m_Flash; }
+    const std::map<std::string, uint32_t>& symbols() const { return m_Symbols; }
+    // where the code had got to when an .org moved on to 'address'
+    uint32_t codeBefore(uint32_t address) const;
+
+private:
+    void pass(const std::vector<Line>& lines, bool final);
+    void statement(const Line& line, bool final);
+    void emit(uint16_t word);
+    void emitByte(uint8_t value);
+
+    // expressions, lowest precedence first as avr-as has them
+    long expression(const std::string& text);
+    long parseAdditive();
+    long parseBitwise();
+    long parseMultiplicative();
+    long parseUnary();
+    long parsePrimary();
+    void skipSpaces();
+    bool accept(const char* op);
+
+    int reg(const std::string& text, int low = 0, int high = 31);
+    long branchOffset(const std::string& text, int bits);
+    uint16_t loadStore(const std::string& mnemonic, const std::string& pointer, int r);
+
+    std::map<std::string, uint32_t> m_Symbols;
+    std::vector<uint8_t> m_Flash;
+    std::map<uint32_t, uint32_t> m_Orgs;
+    uint32_t m_Pc = 0;
+    bool m_Final = false;
+    const char* m_Text = nullptr;
+};
+
+[[noreturn]] static void fail(const std::string& message)
+{
+    throw Error{ message };
+}
+
+static std::string lower(std::string s)
+{
+    for (char& c : s)
+        c = tolower((unsigned char) c);
+    return s;
+}
+
+static std::string trim(const std::string& s)
+{
+    size_t start = s.find_first_not_of(" \t\r\n");
+    if (start == std::string::npos)
+        return std::string();
+    size_t end = s.find_last_not_of(" \t\r\n");
+    return s.substr(start, end - start + 1);
+}
+
+static bool isSymbolChar(char c)
+{
+    return isalnum((unsigned char) c) || c == '_' || c == '.' || c == '$';
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// source
+
+// split the preprocessed source into statements, following the line markers
+// back to main.S and the headers for error messages
+static bool readSource(const char* filename, std::vector<Line>& lines)
+{
+    FILE* file = fopen(filename, "r");
+    if (!file)
+        return false;
+    std::string current = filename;
+    int number = 0;
+    char buffer[1024];
+    while (fgets(buffer, sizeof(buffer), file))
+    {
+        ++number;
+        std::string text = buffer;
+        if (text[0] == '#')
+        {
+            int marker;
+            char name[512];
+            if (sscanf(text.c_str(), "# %d \"%511[^\"]\"", &marker, name) == 2)
+            {
+                current = name;
+                number = marker - 1;
+            }
+            continue;
+        }
+        // ; starts a comment unless it's in a character constant
+        bool quoted = false;
+        for (size_t i = 0; i < text.size(); ++i)
+        {
+            if (text[i] == '\'')
+                quoted = !quoted;
+            else if (text[i] == ';' && !quoted)
+            {
+                text.resize(i);
+                break;
+            }
+        }
+        Line line;
+        line.file = current;
+        line.line = number;
+        text = trim(text);
+        // labels
+        for (;;)
+        {
+            size_t end = 0;
+            while (end < text.size() && isSymbolChar(text[end]))
+                ++end;
+            if (end == 0 || end >= text.size() || text[end] != ':')
+                break;
+            line.labels.push_back(text.substr(0, end));
+            text = trim(text.substr(end + 1));
+        }
+        size_t end = 0;
+        while (end < text.size() && !isspace((unsigned char) text[end]))
+            ++end;
+        line.mnemonic = lower(text.substr(0, end));
+        text = trim(text.substr(end));
+        // operands are split at commas outside brackets and quotes
+        int depth = 0;
+        quoted = false;
+        std::string operand;
+        for (char c : text)
+        {
+            if (c == '\'')
+                quoted = !quoted;
+            else if (!quoted && c == '(')
+                ++depth;
+            else if (!quoted && c == ')')
+                --depth;
+            if (c == ',' && depth == 0 && !quoted)
+            {
+                line.operands.push_back(trim(operand));
+                operand.clear();
+            }
+            else
+                operand += c;
+        }
+        if (!trim(operand).empty())
+            line.operands.push_back(trim(operand));
+        if (!line.labels.empty() || !line.mnemonic.empty())
+            lines.push_back(line);
+    }
+    fclose(file);
+    return true;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// expressions
+
+long Assembler::expression(const std::string& text)
+{
+    std::string copy = text;
+    m_Text = copy.c_str();
+    long value = parseAdditive();
+    skipSpaces();
+    if (*m_Text)
+        fail("can't make sense of '" + text + "'");
+    return value;
+}
+
+void Assembler::skipSpaces()
+{
+    while (*m_Text == ' ' || *m_Text == '\t')
+        ++m_Text;
+}
+
+bool Assembler::accept(const char* op)
+{
+    skipSpaces();
+    size_t length = strlen(op);
+    if (strncmp(m_Text, op, length) != 0)
+        return false;
+    // << and >> aren't < and >, || isn't |
+    if (length == 1 && (m_Text[1] == op[0] && (op[0] == '<' || op[0] == '>' || op[0] == '|' || op[0] == '&')))
+        return false;
+    m_Text += length;
+    return true;
+}
+
+long Assembler::parseAdditive()
+{
+    long value = parseBitwise();
+    for (;;)
+    {
+        if (accept("+"))
+            value += parseBitwise();
+        else if (accept("-"))
+            value -= parseBitwise();
+        else
+            return value;
+    }
+}
+
+long Assembler::parseBitwise()
+{
+    long value = parseMultiplicative();
+    for (;;)
+    {
+        if (accept("|"))
+            value |= parseMultiplicative();
+        else if (accept("&"))
+            value &= parseMultiplicative();
+        else if (accept("^"))
+            value ^= parseMultiplicative();
+        else
+            return value;
+    }
+}
+
+long Assembler::parseMultiplicative()
+{
+    long value = parseUnary();
+    for (;;)
+    {
+        if (accept("*"))
+            value *= parseUnary();
+        else if (accept("/") || accept("%"))
+        {
+            char op = m_Text[-1];
+            long divisor = parseUnary();
+            if (divisor == 0)
+                fail("division by zero");
+            value = op == '/' ? value / divisor : value % divisor;
+        }
+        else if (accept("<<"))
+            value <<= parseUnary();
+        else if (accept(">>"))
+            value >>= parseUnary();
+        else
+            return value;
+    }
+}
+
+long Assembler::parseUnary()
+{
+    if (accept("-"))
+        return -parseUnary();
+    if (accept("~"))
+        return ~parseUnary();
+    if (accept("!"))
+        return !parseUnary();
+    if (accept("+"))
+        return parseUnary();
+    return parsePrimary();
+}
+
+long Assembler::parsePrimary()
+{
+    skipSpaces();
+    if (accept("("))
+    {
+        long value = parseAdditive();
+        if (!accept(")"))
+            fail("missing )");
+        return value;
+    }
+    if (m_Text[0] == '\'' && m_Text[1] && m_Text[2] == '\'')
+    {
+        long value = (unsigned char) m_Text[1];
+        m_Text += 3;
+        return value;
+    }
+    if (isdigit((unsigned char) *m_Text))
+    {
+        char* end;
+        long value = strtol(m_Text, &end, 0);
+        m_Text = end;
+        return value;
+    }
+    const char* start = m_Text;
+    while (isSymbolChar(*m_Text))
+        ++m_Text;
+    if (start == m_Text)
+        fail(std::string("unexpected '") + start + "'");
+    std::string name(start, m_Text);
+    std::string function = lower(name);
+    if (function == "lo8" || function == "hi8")
+    {
+        if (!accept("("))
+            fail(name + " needs ()");
+        long value = parseAdditive();
+        if (!accept(")"))
+            fail("missing )");
+        return function == "lo8" ? value & 255 : (value >> 8) & 255;
+    }
+    auto symbol = m_Symbols.find(name);
+    if (symbol != m_Symbols.end())
+        return symbol->second;
+    // labels further on aren't known until the final pass
+    if (m_Final)
+        fail("undefined symbol " + name);
+    return 0;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// operands
+
+int Assembler::reg(const std::string& text, int low, int high)
+{
+    static const struct { const char* name; int number; } aliases[] =
+    {
+        { "xl", 26 }, { "xh", 27 }, { "yl", 28 }, { "yh", 29 }, { "zl", 30 }, { "zh", 31 },
+        { "x", 26 }, { "y", 28 }, { "z", 30 },
+    };
+    std::string name = lower(trim(text));
+    int number = -1;
+    if (name.size() >= 2 && name[0] == 'r' && isdigit((unsigned char) name[1]))
+    {
+        char* end;
+        number = strtol(name.c_str() + 1, &end, 10);
+        if (*end)
+            number = -1;
+    }
+    for (const auto& alias : aliases)
+        if (name == alias.name)
+            number = alias.number;
+    if (number < low || number > high)
+        fail("'" + text + "' isn't a register from r" + std::to_string(low) + " to r" + std::to_string(high));
+    return number;
+}
+
+long Assembler::branchOffset(const std::string& text, int bits)
+{
+    long target = expression(text);
+    long offset = (target - (long) (m_Pc + 2)) / 2;
+    long range = 1L << (bits - 1);
+    if (m_Final && (offset < -range || offset >= range))
+        fail(text + " is out of range");
+    return offset & ((1L << bits) - 1);
+}
+
+static long range(long value, long low, long high, const std::string& text)
+{
+    if (value < low || value > high)
+        fail(text + " = " + std::to_string(value) + " is out of range");
+    return value;
+}
+
+// ld/st/ldd/std with X, Y or Z, post-increment, pre-decrement or displacement
+uint16_t Assembler::loadStore(const std::string& mnemonic, const std::string& pointer, int r)
+{
+    std::string p;
+    for (char c : pointer)
+        if (!isspace((unsigned char) c))
+            p += tolower((unsigned char) c);
+    bool store = mnemonic[0] == 's';
+    bool displacement = mnemonic.size() == 3;
+    uint16_t op = (r << 4) | (store ? 0x0200 : 0);
+    if (displacement)
+    {
+        if (p.size() < 3 || (p[0] != 'y' && p[0] != 'z') || p[1] != '+')
+            fail(mnemonic + " needs Y + q or Z + q");
+        long q = m_Final ? range(expression(pointer.substr(pointer.find('+') + 1)), 0, 63, pointer) : 0;
+        return 0x8000 | op | (p[0] == 'y' ? 8 : 0) | ((q & 0x20) << 8) | ((q & 0x18) << 7) | (q & 7);
+    }
+    if (p == "x")
+        return 0x900C | op;
+    if (p == "x+")
+        return 0x900D | op;
+    if (p == "-x")
+        return 0x900E | op;
+    if (p == "y" || p == "z")
+        return 0x8000 | op | (p == "y" ? 8 : 0);
+    if (p == "y+" || p == "z+")
+        return 0x9000 | op | (p == "y+" ? 9 : 1);
+    if (p == "-y" || p == "-z")
+        return 0x9000 | op | (p == "-y" ? 0xA : 2);
+    fail(mnemonic + " can't use " + pointer);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// statements
+
+void Assembler::emit(uint16_t word)
+{
+    emitByte(word & 255);
+    emitByte(word >> 8);
+}
+
+void Assembler::emitByte(uint8_t value)
+{
+    if (m_Final)
+    {
+        if (m_Flash.size() <= m_Pc)
+            m_Flash.resize(m_Pc + 1, 0);
+        m_Flash[m_Pc] = value;
+    }
+    ++m_Pc;
+}
+
+void Assembler::statement(const Line& line, bool final)
+{
+    const std::string& m = line.mnemonic;
+    const std::vector<std::string>& o = line.operands;
+    auto operands = [&](size_t count) {
+        if (o.size() != count)
+            fail(m + " takes " + std::to_string(count) + " operand" + (count == 1 ? "" : "s"));
+    };
+    auto value = [&](const std::string& text) { return final ? expression(text) : 0; };
+    // Rd, Rr in the usual two register layout
+    auto twoRegisters = [&](uint16_t base) {
+        operands(2);
+        int d = reg(o[0]);
+        int r = reg(o[1]);
+        emit(base | ((r & 0x10) << 5) | (d << 4) | (r & 15));
+    };
+    auto immediate = [&](uint16_t base) {
+        operands(2);
+        int d = reg(o[0], 16, 31);
+        // avr-as takes anything down to -255 as its low byte, main.S's
+        // subi r24, 0xA - CPU_CCP_IOREG_gc relies on that
+        long k = final ? range(expression(o[1]), -255, 255, o[1]) & 255 : 0;
+        emit(base | ((k & 0xF0) << 4) | ((d - 16) << 4) | (k & 15));
+    };
+    auto singleRegister = [&](uint16_t base) {
+        operands(1);
+        emit(base | (reg(o[0]) << 4));
+    };
+    auto branch = [&](uint16_t base) {
+        operands(1);
+        emit(base | (branchOffset(o[0], 7) << 3));
+    };
+    auto ioBit = [&](uint16_t base) {
+        operands(2);
+        long a = final ? range(expression(o[0]), 0, 31, o[0]) : 0;
+        long b = final ? range(expression(o[1]), 0, 7, o[1]) : 0;
+        emit(base | (a << 3) | b);
+    };
+    auto registerBit = [&](uint16_t base) {
+        operands(2);
+        long b = final ? range(expression(o[1]), 0, 7, o[1]) : 0;
+        emit(base | (reg(o[0]) << 4) | b);
+    };
+
+    static const struct { const char* name; uint16_t op; } branches[] =
+    {
+        { "brcs", 0xF000 }, { "brlo", 0xF000 }, { "breq", 0xF001 }, { "brmi", 0xF002 },
+        { "brvs", 0xF003 }, { "brlt", 0xF004 }, { "brhs", 0xF005 }, { "brts", 0xF006 },
+        { "brie", 0xF007 }, { "brcc", 0xF400 }, { "brsh", 0xF400 }, { "brne", 0xF401 },
+        { "brpl", 0xF402 }, { "brvc", 0xF403 }, { "brge", 0xF404 }, { "brhc", 0xF405 },
+        { "brtc", 0xF406 }, { "brid", 0xF407 },
+    };
+    for (const auto& b : branches)
+        if (m == b.name)
+            return branch(b.op);
+    static const struct { const char* name; uint16_t op; } fixed[] =
+    {
+        { "nop", 0x0000 }, { "ret", 0x9508 }, { "reti", 0x9518 }, { "wdr", 0x95A8 },
+        { "sleep", 0x9588 }, { "ijmp", 0x9409 }, { "icall", 0x9509 }, { "cli", 0x94F8 },
+        { "sei", 0x9478 }, { "clc", 0x9488 }, { "sec", 0x9408 }, { "clt", 0x94E8 },
+        { "set", 0x9468 },
+    };
+    for (const auto& f : fixed)
+        if (m == f.name)
+        {
+            operands(0);
+            return emit(f.op);
+        }
+    static const struct { const char* name; uint16_t op; } pairs[] =
+    {
+        { "cpc", 0x0400 }, { "sbc", 0x0800 }, { "add", 0x0C00 }, { "cpse", 0x1000 },
+        { "cp", 0x1400 }, { "sub", 0x1800 }, { "adc", 0x1C00 }, { "and", 0x2000 },
+        { "eor", 0x2400 }, { "or", 0x2800 }, { "mov", 0x2C00 },
+    };
+    for (const auto& p : pairs)
+        if (m == p.name)
+            return twoRegisters(p.op);
+    static const struct { const char* name; uint16_t op; } immediates[] =
+    {
+        { "cpi", 0x3000 }, { "sbci", 0x4000 }, { "subi", 0x5000 }, { "ori", 0x6000 },
+        { "sbr", 0x6000 }, { "andi", 0x7000 }, { "ldi", 0xE000 },
+    };
+    for (const auto& i : immediates)
+        if (m == i.name)
+            return immediate(i.op);
+    static const struct { const char* name; uint16_t op; } singles[] =
+    {
+        { "com", 0x9400 }, { "neg", 0x9401 }, { "swap", 0x9402 }, { "inc", 0x9403 },
+        { "asr", 0x9405 }, { "lsr", 0x9406 }, { "ror", 0x9407 }, { "dec", 0x940A },
+        { "pop", 0x900F }, { "push", 0x920F },
+    };
+    for (const auto& s : singles)
+        if (m == s.name)
+            return singleRegister(s.op);
+
+    if (m == "rjmp" || m == "rcall")
+    {
+        operands(1);
+        return emit((m == "rjmp" ? 0xC000 : 0xD000) | branchOffset(o[0], 12));
+    }
+    if (m == "clr" || m == "tst" || m == "lsl" || m == "rol")
+    {
+        // the same register twice
+        operands(1);
+        int d = reg(o[0]);
+        uint16_t base = m == "clr" ? 0x2400 : m == "tst" ? 0x2000 : m == "lsl" ? 0x0C00 : 0x1C00;
+        return emit(base | ((d & 0x10) << 5) | (d << 4) | (d & 15));
+    }
+    if (m == "ser")
+    {
+        operands(1);
+        return emit(0xEF0F | ((reg(o[0], 16, 31) - 16) << 4));
+    }
+    if (m == "movw")
+    {
+        operands(2);
+        int d = reg(o[0]);
+        int r = reg(o[1]);
+        if ((d | r) & 1)
+            fail("movw needs even registers");
+        return emit(0x0100 | ((d / 2) << 4) | (r / 2));
+    }
+    if (m == "adiw" || m == "sbiw")
+    {
+        operands(2);
+        int d = reg(o[0], 24, 30);
+        if (d & 1)
+            fail(m + " needs r24, r26, r28 or r30");
+        long k = final ? range(expression(o[1]), 0, 63, o[1]) : 0;
+        return emit((m == "adiw" ? 0x9600 : 0x9700) | ((k & 0x30) << 2) | (((d - 24) / 2) << 4) | (k & 15));
+    }
+    if (m == "in" || m == "out")
+    {
+        operands(2);
+        bool out = m == "out";
+        int r = reg(out ? o[1] : o[0]);
+        long a = final ? range(expression(out ? o[0] : o[1]), 0, 63, out ? o[0] : o[1]) : 0;
+        return emit((out ? 0xB800 : 0xB000) | ((a & 0x30) << 5) | (r << 4) | (a & 15));
+    }
+    if (m == "lds" || m == "sts")
+    {
+        operands(2);
+        bool store = m == "sts";
+        int r = reg(store ? o[1] : o[0]);
+        long k = final ? range(expression(store ? o[0] : o[1]), 0, 0xFFFF, store ? o[0] : o[1]) : 0;
+        emit((store ? 0x9200 : 0x9000) | (r << 4));
+        return emit(k);
+    }
+    if (m == "ld" || m == "ldd")
+    {
+        operands(2);
+        return emit(loadStore(m, o[1], reg(o[0])));
+    }
+    if (m == "st" || m == "std")
+    {
+        operands(2);
+        return emit(loadStore(m, o[0], reg(o[1])));
+    }
+    if (m == "cbi")
+        return ioBit(0x9800);
+    if (m == "sbic")
+        return ioBit(0x9900);
+    if (m == "sbi")
+        return ioBit(0x9A00);
+    if (m == "sbis")
+        return ioBit(0x9B00);
+    if (m == "sbrc")
+        return registerBit(0xFC00);
+    if (m == "sbrs")
+        return registerBit(0xFE00);
+
+    // directives
+    if (m == ".byte")
+    {
+        for (const std::string& item : o)
+        {
+            long v = value(item);
+            if (final && (v < -128 || v > 255))
+                fail(item + " doesn't fit in a byte");
+            emitByte(v & 255);
+        }
+        return;
+    }
+    if (m == ".word")
+    {
+        for (const std::string& item : o)
+            emit(value(item) & 0xFFFF);
+        return;
+    }
+    if (m == ".org")
+    {
+        operands(1);
+        // labels before it are all known by now
+        long to = expression(o[0]);
+        if (to < (long) m_Pc)
+        {
+            char message[100];
+            snprintf(message, sizeof(message), ".org 0x%lX is behind the code, which has reached 0x%X", to, m_Pc);
+            fail(message);
+        }
+        m_Orgs[to] = m_Pc;
+        while (m_Pc < (uint32_t) to)
+            emitByte(0);
+        return;
+    }
+    if (m == ".text" || m == ".global" || m == ".globl" || m == ".end")
+        return;
+    fail("unsupported " + m);
+}
+
+void Assembler::pass(const std::vector<Line>& lines, bool final)
+{
+    m_Pc = 0;
+    m_Final = final;
+    for (const Line& line : lines)
+    {
+        try
+        {
+            for (const std::string& label : line.labels)
+            {
+                if (!final && m_Symbols.count(label))
+                    fail("duplicate label " + label);
+                m_Symbols[label] = m_Pc;
+            }
+            if (!line.mnemonic.empty())
+                statement(line, final);
+            if (line.mnemonic == ".end")
+                break;
+        }
+        catch (const Error& e)
+        {
+            throw Error{ line.file + ":" + std::to_string(line.line) + ": " + e.message };
+        }
+    }
+}
+
+uint32_t Assembler::codeBefore(uint32_t address) const
+{
+    auto org = m_Orgs.find(address);
+    return org != m_Orgs.end() ? org->second : address;
+}
+
+bool Assembler::assemble(const std::vector<Line>& lines)
+{
+    try
+    {
+        // every instruction has its size from its mnemonic alone, so one
+        // pass finds the labels and the next one encodes
+        pass(lines, false);
+        pass(lines, true);
+        return true;
+    }
+    catch (const Error& e)
+    {
+        fprintf(stderr, "%s\n", e.message.c_str());
+        return false;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// output
+
+// all data records of an Intel HEX file by address
+static bool readHex(const char* filename, std::map<uint32_t, uint8_t>& memory)
+{
+    FILE* file = fopen(filename, "r");
+    if (!file)
+        return false;
+    char line[600];
+    uint32_t base = 0;
+    while (fgets(line, sizeof(line), file))
+    {
+        unsigned count, address, type;
+        if (line[0] != ':' || sscanf(line + 1, "%2x%4x%2x", &count, &address, &type) != 3)
+            continue;
+        std::vector<uint8_t> data(count);
+        for (unsigned i = 0; i < count; ++i)
+        {
+            unsigned byte;
+            if (sscanf(line + 9 + i * 2, "%2x", &byte) != 1)
+            {
+                fclose(file);
+                return false;
+            }
+            data[i] = byte;
+        }
+        if (type == 1)
+            break;
+        if (type == 4 && count == 2)
+            base = (data[0] << 24) | (data[1] << 16);
+        else if (type == 0)
+            for (unsigned i = 0; i < count; ++i)
+                memory[base + address + i] = data[i];
+    }
+    fclose(file);
+    return true;
+}
+
+static uint16_t crc16(const uint8_t* data, size_t size, uint16_t crc = 0xFFFF)
+{
+    while (size--)
+    {
+        crc ^= *data++ << 8;
+        for (int i = 0; i < 8; ++i)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// patchcrc.py: the two bytes that bring the CRC from what comes before them
+// to 0xFFFF through what comes after them
+static void patchCrc(std::vector<uint8_t>& flash, uint16_t bootSize)
+{
+    for (size_t at = 0; at + 1 < bootSize; ++at)
+    {
+        if (flash[at] != 0xCC || flash[at + 1] != 0xCC)
+            continue;
+        uint16_t before = crc16(flash.data(), at);
+        // run the CRC backwards from 0xFFFF over the rest of the section
+        uint32_t crc = 0xFFFF;
+        std::vector<uint8_t> tail = { (uint8_t) (before >> 8), (uint8_t) before };
+        tail.insert(tail.end(), flash.begin() + at + 2, flash.begin() + bootSize);
+        for (size_t i = tail.size(); i-- > 0; )
+        {
+            for (int b = 0; b < 8; ++b)
+            {
+                if (crc & 1)
+                    crc ^= 0x11021;
+                crc >>= 1;
+            }
+            crc ^= tail[i] << 8;
+        }
+        flash[at] = crc >> 8;
+        flash[at + 1] = crc & 255;
+        return;
+    }
+}
+
+static void writeRecord(FILE* file, uint16_t address, uint8_t type, const uint8_t* data, uint8_t count)
+{
+    uint8_t sum = count + (address >> 8) + address + type;
+    fprintf(file, ":%02X%04X%02X", count, address, type);
+    for (uint8_t i = 0; i < count; ++i)
+    {
+        fprintf(file, "%02X", data[i]);
+        sum += data[i];
+    }
+    fprintf(file, "%02X\n", (uint8_t) -sum);
+}
+
+static bool writeHex(const char* filename, const std::map<uint32_t, uint8_t>& memory)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file)
+        return false;
+    uint32_t segment = ~0u;
+    for (auto it = memory.begin(); it != memory.end(); )
+    {
+        uint32_t address = it->first;
+        if (address >> 16 != segment)
+        {
+            segment = address >> 16;
+            uint8_t base[2] = { (uint8_t) (segment >> 8), (uint8_t) segment };
+            writeRecord(file, 0, 4, base, 2);
+        }
+        uint8_t data[16];
+        uint8_t count = 0;
+        while (it != memory.end() && it->first == address + count && count < 16 &&
+            ((address + count) & 0xFFFF) >= (address & 0xFFFF))
+        {
+            data[count++] = it->second;
+            ++it;
+        }
+        writeRecord(file, address & 0xFFFF, 0, data, count);
+    }
+    writeRecord(file, 0, 1, nullptr, 0);
+    return fclose(file) == 0;
+}
+
+static bool writeHeader(const char* filename, const char* prefix, const char* input,
+    const Assembler& assembler, uint16_t bootSize)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file)
+        return false;
+    const std::vector<uint8_t>& flash = assembler.flash();
+    fprintf(file, "// generated by avrasm from %s, word addresses\n#pragma once\n\n", input);
+    std::vector<std::pair<uint32_t, std::string>> labels;
+    for (const auto& symbol : assembler.symbols())
+        labels.emplace_back(symbol.second, symbol.first);
+    std::sort(labels.begin(), labels.end());
+    for (const auto& label : labels)
+        fprintf(file, "#define %s_%s 0x%04X\n", prefix, label.second.c_str(), label.first / 2);
+    fprintf(file, "\n#define %s_WORDS \\\n{", prefix);
+    for (uint16_t at = 0; at < bootSize; at += 2)
+        fprintf(file, "%s0x%04X,", at % 16 ? " " : " \\\n    ", flash[at] | (flash[at + 1] << 8));
+    fprintf(file, " \\\n}\n");
+    return fclose(file) == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    uint16_t bootSize = 256;
+    const char* fusesHex = nullptr;
+    const char* compareHex = nullptr;
+    const char* header = nullptr;
+    const char* prefix = "BOOT";
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (argv[i][0] == '-' && argv[i][1] && !argv[i][2] && i + 1 < argc)
+        {
+            const char* arg = argv[++i];
+            switch (argv[i - 1][1])
+            {
+            case 'b': bootSize = strtol(arg, nullptr, 0); continue;
+            case 'f': fusesHex = arg; continue;
+            case 'c': compareHex = arg; continue;
+            case 's': header = arg; continue;
+            case 'p': prefix = arg; continue;
+            }
+            --i;
+        }
+        else if (argv[i][0] != '-')
+        {
+            files.push_back(argv[i]);
+            continue;
+        }
+        files.clear();
+        break;
+    }
+    if (files.size() != 2 || bootSize == 0 || bootSize % 256)
+    {
+        printf("usage: avrasm [-b boot size] [-f hex] [-c hex] [-s header -p prefix] input output.hex\n");
+        return 1;
+    }
+
+    std::vector<Line> lines;
+    if (!readSource(files[0], lines))
+    {
+        fprintf(stderr, "can't read %s\n", files[0]);
+        return 1;
+    }
+    Assembler assembler;
+    if (!assembler.assemble(lines))
+        return 1;
+    std::vector<uint8_t> flash = assembler.flash();
+    if (flash.size() < bootSize)
+    {
+        fprintf(stderr, "%s: the code ends at 0x%X, before the end of the %u byte boot section\n",
+            files[0], (unsigned) flash.size(), bootSize);
+        return 1;
+    }
+    printf("%s: %u of %u boot section bytes used\n", files[1], assembler.codeBefore(bootSize), bootSize);
+    patchCrc(flash, bootSize);
+
+    std::map<uint32_t, uint8_t> memory;
+    for (size_t i = 0; i < flash.size(); ++i)
+        memory[i] = flash[i];
+    if (fusesHex)
+    {
+        std::map<uint32_t, uint8_t> fuses;
+        if (!readHex(fusesHex, fuses))
+        {
+            fprintf(stderr, "can't read %s\n", fusesHex);
+            return 1;
+        }
+        for (const auto& byte : fuses)
+            if (byte.first >= 0x800000)
+                memory[byte.first] = byte.second;
+        memory[0x820008] = bootSize / 256; // BOOTEND
+    }
+    if (compareHex)
+    {
+        std::map<uint32_t, uint8_t> reference;
+        if (!readHex(compareHex, reference))
+        {
+            fprintf(stderr, "can't read %s\n", compareHex);
+            return 1;
+        }
+        for (size_t i = 0; i < flash.size(); ++i)
+        {
+            auto byte = reference.find(i);
+            if (byte == reference.end() || byte->second != flash[i])
+            {
+                fprintf(stderr, "%s: 0x%04X is %02X where %s has ", files[0], (unsigned) i, flash[i], compareHex);
+                if (byte == reference.end())
+                    fprintf(stderr, "nothing\n");
+                else
+                    fprintf(stderr, "%02X\n", byte->second);
+                return 1;
+            }
+        }
+    }
+    if (!writeHex(files[1], memory))
+    {
+        fprintf(stderr, "can't write %s\n", files[1]);
+        return 1;
+    }
+    if (header && !writeHeader(header, prefix, files[0], assembler, bootSize))
+    {
+        fprintf(stderr, "can't write %s\n", header);
+        return 1;
+    }
+    return 0;
+}
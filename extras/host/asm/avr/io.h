@@ -0,0 +1,31 @@
+// Stand-in for avr-libc's <avr/io.h> when avrasm assembles main.S on the
+// host: the ATtiny1614 (iotn1614.h) registers and bits main.S uses, as the
+// assembler sees them with __SFR_OFFSET 0.  The 256 byte build is checked
+// against the production hex, so a wrong value here fails the build.
+#pragma once
+
+#define _BV(bit) (1 << (bit))
+
+#define VPORTA_DIR 0x0000
+#define VPORTA_OUT 0x0001
+#define VPORTB_DIR 0x0004
+#define VPORTB_OUT 0x0005
+#define CPU_CCP 0x0034
+#define RSTCTRL_RSTFR 0x0040
+#define RSTCTRL_SWRR 0x0041
+#define PORTMUX_CTRLB 0x0201
+#define SPI0_CTRLA 0x0820
+#define SPI0_CTRLB 0x0821
+#define SPI0_INTCTRL 0x0822
+#define SPI0_INTFLAGS 0x0823
+#define SPI0_DATA 0x0824
+#define NVMCTRL_CTRLA 0x1000
+#define USER_SIGNATURES_START 0x1300
+#define MAPPED_PROGMEM_START 0x8000
+
+#define RSTCTRL_WDRF_bp 3
+#define SPI_ENABLE_bm 0x01
+#define SPI_SSD_bm 0x04
+#define SPI_CLK2X_bm 0x10
+#define SPI_MASTER_bm 0x20
+#define SPI_RXCIF_bp 7
@@ -0,0 +1,297 @@
+// Runs the assembled bootloader hex instruction by instruction on an
+// emulated tinyAVR (VirtualTarget::useInstructionEmulator) and programs a
+// full flash image into it through the bridge's BootLoader, so a change to
+// main.S can be tried without hardware or UPDI.  Reports the CPU cycles
+// spent in each wait_for_packet iteration, on each received packet (by
+// payload width, from the poll that saw it to the next wait_for_packet or
+// write_nvm) and on each page commit (write_nvm until it waits again, with
+// the time the CPU was halted), next to the estimates VirtualTarget's model
+// uses.
+//
+//   avrbench [-d device] [hex]
+//
+// It also checks what patchcrc.py arranges: the CRC of the boot section is
+// 0xFFFF, so a CRC appended to the application covers the whole flash.  The
+// image carries one, zero padded to the end of flash as writestk500 writes
+// it, and the emulated CRCSCAN has to pass it.  The exit code is non-zero
+// if that or the programming fails.
+
+#include <megaTinyNrfBoot.h>
+#include "VirtualTarget.h"
+#include <chrono>
+#include <map>
+#include <random>
+#include <vector>
+
+using namespace mtnrf;
+using namespace mtnrf::host;
+
+#ifndef MTNRF_BOOTLOADER_HEX
+#define MTNRF_BOOTLOADER_HEX "NRF24BootLoader.X.production.hex"
+#endif
+
+static const uint8_t CE_PIN = 1;
+static const uint8_t CSN_PIN = 2;
+static const uint8_t CPU_CCP = 0x34;
+static const uint8_t CPU_CCP_SPM = 0x9D;
+static const uint16_t NVMCTRL_CTRLA = 0x1000;
+
+struct Spread
+{
+    uint32_t count = 0;
+    uint64_t total = 0;
+    uint64_t min = ~(uint64_t)0;
+    uint64_t max = 0;
+
+    void add(uint64_t value)
+    {
+        ++count;
+        total += value;
+        min = value < min ? value : min;
+        max = value > max ? value : max;
+    }
+    double mean() const { return count ? (double) total / count : 0; }
+};
+
+// where the time goes in the bootloader, from the instruction hook
+struct Probe
+{
+    uint16_t waitForPacket = 0;     // byte addresses
+    uint16_t writeNvm = 0;
+    uint8_t ccpRegister = 0;        // out CPU_CCP, rN at write_nvm
+    uint16_t appStart = 0;
+
+    enum State { IDLE, POLL, PACKET, COMMIT };
+    State state = IDLE;
+    uint64_t since = 0;
+    Nanos haltedSince = 0;
+
+    Spread poll;
+    std::map<uint8_t, Spread> packets;
+    Spread commit;
+    Spread halted;                  // microseconds
+};
+
+static Probe probe;
+
+static void onInstruction(const VirtualTarget& target)
+{
+    const AvrCpu& cpu = target.getCpu();
+    uint16_t pc = cpu.getPc();
+    uint64_t cycles = cpu.getCycles();
+    Probe& p = probe;
+    auto endPacket = [&]()
+    {
+        if (p.state == Probe::PACKET)
+            p.packets[cpu.getRegister(22)].add(cycles - p.since);
+    };
+    if (pc == p.waitForPacket)
+    {
+        if (p.state == Probe::POLL)
+            p.poll.add(cycles - p.since);
+        else if (p.state == Probe::COMMIT)
+        {
+            p.commit.add(cycles - p.since);
+            p.halted.add((target.getStats().nvmBusyTime - p.haltedSince) / 1000);
+        }
+        endPacket();
+        p.state = Probe::POLL;
+        p.since = cycles;
+    }
+    else if (pc == p.waitForPacket + 6 && p.state == Probe::POLL)
+    {
+        // the poll found a packet
+        p.state = Probe::PACKET;
+    }
+    else if (pc == p.writeNvm)
+    {
+        endPacket();
+        // the first time through after a reset r21 isn't the CCP value
+        bool writing = cpu.getRegister(p.ccpRegister) == CPU_CCP_SPM;
+        p.state = writing ? Probe::COMMIT : Probe::IDLE;
+        p.since = cycles;
+        p.haltedSince = target.getStats().nvmBusyTime;
+    }
+    else if (pc >= p.appStart || pc == 0)
+    {
+        endPacket();
+        p.state = Probe::IDLE;
+    }
+}
+
+// wait_for_packet is the target of the brhc two instructions after it and
+// write_nvm the out CPU_CCP that comes just before sts NVMCTRL_CTRLA
+static bool findLabels(VirtualTarget& target, Probe& p)
+{
+    const std::vector<uint8_t>& flash = target.flash();
+    auto word = [&](uint16_t i) { return (uint16_t) (flash[i * 2] | (flash[i * 2 + 1] << 8)); };
+    p.appStart = target.getAppStart();
+    bool foundWait = false, foundWrite = false;
+    for (uint16_t i = 2; i + 2 < p.appStart / 2; ++i)
+    {
+        uint16_t op = word(i);
+        if ((op & 0xFC07) == 0xF405 && ((op >> 3) & 0x7F) == 0x7D)
+        {
+            p.waitForPacket = (i - 2) * 2;
+            foundWait = true;
+        }
+        uint8_t io = (op & 15) | ((op >> 5) & 0x30);
+        if ((op & 0xF800) == 0xB800 && io == CPU_CCP && (word(i + 1) & 0xFE0F) == 0x9200 && word(i + 2) == NVMCTRL_CTRLA)
+        {
+            p.writeNvm = i * 2;
+            p.ccpRegister = (op >> 4) & 31;
+            foundWrite = true;
+        }
+    }
+    return foundWait && foundWrite;
+}
+
+static uint16_t crc16(const uint8_t* data, size_t size, uint16_t crc = 0xFFFF)
+{
+    while (size--)
+    {
+        crc ^= *data++ << 8;
+        for (int i = 0; i < 8; ++i)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+int main(int argc, char* argv[])
+{
+    const TargetDevice* device = TargetDevice::find("ATtiny1614");
+    const char* hexFile = MTNRF_BOOTLOADER_HEX;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            device = TargetDevice::find(argv[++i]);
+            if (!device)
+            {
+                printf("unknown device %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        if (argv[i][0] == '-')
+        {
+            printf("usage: avrbench [-d device] [hex]\n");
+            return 1;
+        }
+        hexFile = argv[i];
+    }
+    auto wallStart = std::chrono::steady_clock::now();
+
+    VirtualEther ether;
+    VirtualNrf24 bridgeRadio(ether, "bridge");
+    bridgeRadio.attach(CE_PIN, CSN_PIN);
+    VirtualTarget target(ether, *device);
+    if (!target.loadHex(hexFile))
+    {
+        printf("can't read %s\n", hexFile);
+        return 1;
+    }
+    uint16_t appStart = target.getAppStart();
+    printf("%s on an emulated %s, %u byte boot section\n\n", hexFile, device->name, appStart);
+
+    // patchcrc.py's invariant
+    uint16_t bootCrc = target.flashCrc(0, appStart);
+    bool ok = bootCrc == 0xFFFF;
+    printf("boot section CRC %04X: %s\n", bootCrc, ok ? "OK" : "FAILED, run patchcrc.py on the hex");
+
+    if (!findLabels(target, probe))
+    {
+        printf("can't find wait_for_packet and write_nvm in the boot section\n");
+        return 1;
+    }
+    printf("wait_for_packet at 0x%04X, write_nvm at 0x%04X\n", probe.waitForPacket, probe.writeNvm);
+
+    // the image starts with the application in the hex (main.S's dummy app)
+    // so the device still answers a reset packet once it's running
+    std::vector<uint8_t> image;
+    for (uint16_t i = appStart; i + 1 < device->flashSize && (target.flash()[i] != 0xFF || target.flash()[i + 1] != 0xFF); i += 2)
+    {
+        image.push_back(target.flash()[i]);
+        image.push_back(target.flash()[i + 1]);
+    }
+    if (image.empty())
+    {
+        printf("no application in the hex to keep the device reachable\n");
+        return 1;
+    }
+    std::mt19937 random(device->flashSize);
+    size_t appSize = device->flashSize - appStart;
+    while (image.size() < appSize - 2)
+        image.push_back((uint8_t) random());
+    uint16_t appCrc = crc16(image.data(), image.size());
+    image.push_back(appCrc >> 8);
+    image.push_back(appCrc & 255);
+
+    target.setInstructionHook(onInstruction);
+    target.useInstructionEmulator();
+    target.powerOn();
+
+    Radio radio(CE_PIN, CSN_PIN);
+    BootLoader bootLoader(radio);
+    Config config("001", 3, 50, RF24_2MBPS);
+    config.setRetries(0, 15, 16);
+    if (!radio.begin(config))
+    {
+        printf("radio not connected\n");
+        return 1;
+    }
+    // the bootloader times out into the application first
+    delay(1500);
+    bool inApp = !target.inBootLoader();
+    printf("started application after the watchdog timeout: %s\n", inApp ? "OK" : "FAILED");
+    ok &= inApp;
+
+    Nanos start = now();
+    uint8_t signature[3] = {};
+    bool programmed = bootLoader.enterBootLoader() && bootLoader.readDeviceSignature(signature) &&
+        memcmp(signature, device->signature, 3) == 0 &&
+        bootLoader.writeMemoryLong(0x8000 + appStart, image.data(), image.size()) && bootLoader.flushWrites();
+    double seconds = (now() - start) / 1e9;
+    programmed &= bootLoader.exitBootLoader();
+    delay(10);
+    bool verified = programmed && memcmp(&target.flash()[appStart], image.data(), image.size()) == 0;
+    printf("programmed %zu bytes in %.3fs: %s\n", image.size(), seconds,
+        verified ? "OK" : programmed ? "FAILED, flash differs" : "FAILED");
+    ok &= verified;
+    bool running = programmed && !target.inBootLoader();
+    printf("started the new application: %s\n", running ? "OK" : "FAILED");
+    ok &= running;
+
+    // as the bridge's crc command does it, in a session of its own
+    bool crcCheck = bootLoader.enterBootLoader() && bootLoader.performCrcCheck() && bootLoader.exitBootLoader();
+    printf("CRCSCAN of the whole flash: %s\n", crcCheck ? "OK" : "FAILED");
+    ok &= crcCheck;
+
+    const BootLoaderTiming model;
+    printf("\n%-22s %7s %9s %7s %7s %7s\n", "cycles", "count", "mean", "min", "max", "model");
+    printf("%-22s %7u %9.1f %7llu %7llu %7u\n", "wait_for_packet poll", probe.poll.count, probe.poll.mean(),
+        (unsigned long long) probe.poll.min, (unsigned long long) probe.poll.max, model.pollCycles);
+    for (const auto& entry : probe.packets)
+    {
+        char name[32];
+        snprintf(name, sizeof(name), "packet, %u bytes", entry.first);
+        const Spread& s = entry.second;
+        uint32_t estimate = model.pollCycles + model.readCycles + entry.first * model.readByteCycles;
+        printf("%-22s %7u %9.1f %7llu %7llu %7u\n", name, s.count, s.mean(),
+            (unsigned long long) s.min, (unsigned long long) s.max, estimate);
+    }
+    printf("%-22s %7u %9.1f %7llu %7llu %7u\n", "page commit", probe.commit.count, probe.commit.mean(),
+        (unsigned long long) probe.commit.min, (unsigned long long) probe.commit.max, model.writeNvmCycles);
+    printf("%-22s %7u %9.1f %7llu %7llu %7llu\n", "  halted (us)", probe.halted.count, probe.halted.mean(),
+        (unsigned long long) probe.halted.min, (unsigned long long) probe.halted.max,
+        (unsigned long long) (model.flashPageWrite / 1000));
+
+    const VirtualTarget::Stats& stats = target.getStats();
+    printf("\n%u page writes, %u resets (%u by watchdog), %u illegal opcodes, %llu cycles at %.3fMHz\n",
+        stats.flashPageWrites, stats.resets, stats.watchdogResets, target.getCpu().getIllegalOpcodes(),
+        (unsigned long long) target.getCpu().getCycles(), target.getCpuClock() / 1e6);
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    printf("simulated %.3fs in %.3fs\n", now() / 1e9, wall);
+    printf("\n%s\n", ok ? "OK" : "FAILED");
+    return ok ? 0 : 1;
+}
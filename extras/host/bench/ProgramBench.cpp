@@ -0,0 +1,674 @@
+// Programs a full flash image through the complete bridge stack (Console,
+// Stk500, BootLoader, Radio) into a simulated target running the bootloader
+// and reports how long each phase takes in virtual time.  With -x the target
+// runs the extended bootloader and the image is read back with STK_READ_PAGE
+// as avrdude's verify does, -p runs its PACKED_WRITES build which takes
+// pages that follow on from the last without a command.  With -z the image goes LZ compressed through a
+// stage-2 updater resident in the top 1K of flash, as writestk500 -z sends it.
+// With -m the link loses more frames the faster the bitrate, like a device at
+// the edge of range, and -l lets the bridge slow the link down ("link 1").
+// -t <file> saves the bridge's packet trace of the last run for tracedecode
+// (progbench_trace, progbench is built without the trace like a sketch).
+
+#include <megaTinyNrfConsole.h>
+#include "VirtualSerial.h"
+#include "VirtualTarget.h"
+#include "Compress.hpp"
+#include <stk500.h>
+#include <chrono>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace mtnrf;
+using namespace mtnrf::host;
+
+#ifndef MTNRF_BOOTLOADER_HEX
+#define MTNRF_BOOTLOADER_HEX "NRF24BootLoader.X.production.hex"
+#endif
+
+static const uint8_t CE_PIN = 1;
+static const uint8_t CSN_PIN = 2;
+static const uint16_t UPDATER_SIZE = 0x400;
+
+// a device at the edge of range: most frames get through at 250kbps and
+// fewer the faster the link goes
+class MarginalLink : public LinkModel
+{
+public:
+    MarginalLink(std::mt19937& random) : m_Random(random) {}
+    bool deliver(const AirPacket& packet, const VirtualNrf24&) override
+    {
+        double loss = packet.dataRate & _BV(RF_DR_LOW) ? 0.01 : packet.dataRate & _BV(RF_DR_HIGH) ? 0.35 : 0.08;
+        return std::uniform_real_distribution<double>(0, 1)(m_Random) >= loss;
+    }
+
+private:
+    std::mt19937& m_Random;
+};
+
+// writes the trace frame to a file
+class FilePrint : public Print
+{
+public:
+    FilePrint(FILE* file) : m_File(file) {}
+    size_t write(uint8_t c) override { return fwrite(&c, 1, 1, m_File); }
+
+private:
+    FILE* m_File;
+};
+
+static uint16_t crc16(const uint8_t* data, size_t size)
+{
+    uint16_t crc = 0xFFFF;
+    while (size--)
+    {
+        crc ^= *data++ << 8;
+        for (int i = 0; i < 8; ++i)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+// something shaped like compiled AVR code rather than noise: instructions
+// from a small set of opcodes with random registers and constants, and now
+// and then a repeat of an earlier sequence like an inlined helper
+static std::vector<uint8_t> makeProgram(std::mt19937& random, size_t size)
+{
+    struct Op { uint16_t opcode, operands; };
+    static const Op ops[] =
+    {
+        { 0xE000, 0x0FFF }, // ldi
+        { 0x2C00, 0x03FF }, // mov
+        { 0x0C00, 0x03FF }, // add
+        { 0x1C00, 0x03FF }, // adc
+        { 0x5000, 0x0FFF }, // subi
+        { 0x3000, 0x0FFF }, // cpi
+        { 0x9000, 0x01F0 }, // lds
+        { 0x9200, 0x01F0 }, // sts
+        { 0x8000, 0x01F8 }, // ld/st Y/Z
+        { 0x920F, 0x01F0 }, // push
+        { 0x900F, 0x01F0 }, // pop
+        { 0xD000, 0x0FFF }, // rcall
+        { 0xC000, 0x00FF }, // rjmp
+        { 0xF000, 0x03FF }, // brbs/brbc
+        { 0x9508, 0x0000 }, // ret
+    };
+    std::vector<uint8_t> code;
+    while (code.size() < size)
+    {
+        if (random() % 100 < 15 && code.size() > 64)
+        {
+            size_t length = 4 + random() % 28;
+            size_t from = code.size() - 2 - ((random() % std::min<size_t>(code.size() - 2, 2048)) & ~1);
+            for (size_t i = 0; i < length && code.size() < size; ++i)
+                code.push_back(code[from + i]);
+            continue;
+        }
+        const Op& op = ops[random() % (sizeof(ops) / sizeof(ops[0]))];
+        uint16_t insn = op.opcode | (random() & op.operands);
+        code.push_back(insn & 255);
+        code.push_back(insn >> 8);
+        // lds/sts take an SRAM address
+        if (op.opcode == 0x9000 || op.opcode == 0x9200)
+        {
+            code.push_back(random() & 0x7F);
+            code.push_back(0x38 + (random() & 3));
+        }
+    }
+    code.resize(size);
+    return code;
+}
+
+// PC side of the serial link, sending what writestk500 sends
+class Programmer
+{
+public:
+    // lockStep waits for each page to be answered before sending the next
+    // one, as avrdude does
+    Programmer(VirtualSerial& serial, bool lockStep = false)
+    :   m_Serial(serial)
+    ,   m_LockStep(lockStep)
+    {}
+
+    enum Phase
+    {
+        PHASE_CONNECT,
+        PHASE_SIGNATURE,
+        PHASE_PROGRAM,
+        PHASE_VERIFY,
+        PHASE_LEAVE,
+        PHASE_CONFIG,
+        PHASE_LINK_STATS,
+        PHASE_CRC_CHECK,
+        PHASE_DONE,
+        PHASE_FAILED,
+    };
+
+    void start(const std::vector<uint8_t>& image, uint16_t appStart, uint8_t pageSize, bool verify, uint16_t updater = 0)
+    {
+        m_Image = image;
+        m_AppStart = appStart;
+        m_PageSize = pageSize;
+        m_Verify = verify;
+        m_Updater = updater;
+        begin(PHASE_CONNECT);
+        m_Serial.hostWrite("0 0 ");
+    }
+
+    Phase getPhase() const { return m_Phase; }
+    Nanos getPhaseTime(Phase phase) const { return m_PhaseTime[phase + 1] - m_PhaseTime[phase]; }
+    // console output from the CRC check and the stats printed before it
+    const std::string& getResult() const { return m_Result; }
+    const std::string& getStats() const { return m_Stats; }
+    // output of "stats"
+    const std::string& getLinkStats() const { return m_LinkStats; }
+    const uint8_t* getSignature() const { return m_Signature; }
+    // image as read back by the verify phase
+    const std::vector<uint8_t>& getReadBack() const { return m_ReadBack; }
+    // stream sent to the stage-2 updater
+    const std::vector<uint8_t>& getCompressed() const { return m_Compressed; }
+
+    void poll()
+    {
+        int c;
+        while ((c = m_Serial.hostRead()) >= 0)
+            receive((uint8_t) c);
+        if (m_Phase < PHASE_DONE && now() - m_PhaseTime[m_Phase] > millis(10000))
+        {
+            printf("timed out in phase %i\n", m_Phase);
+            fail();
+        }
+    }
+
+private:
+    void begin(Phase phase)
+    {
+        // skipped phases take no time
+        for (int p = m_Phase + 1; p <= phase && m_Phase < PHASE_DONE; ++p)
+            m_PhaseTime[p] = now();
+        m_Phase = phase;
+        m_PhaseTime[phase] = now();
+        m_Response.clear();
+        m_Text.clear();
+    }
+    void fail()
+    {
+        m_PhaseTime[PHASE_DONE] = now();
+        m_Phase = PHASE_FAILED;
+    }
+
+    void receive(uint8_t c)
+    {
+        m_Response.push_back(c);
+        m_Text += (char) c;
+        switch (m_Phase)
+        {
+        case PHASE_CONNECT:
+        {
+            // INSYNC OK INSYNC then OK once the target is in the bootloader
+            static const uint8_t sync[] = { STK_INSYNC, STK_OK, STK_INSYNC };
+            size_t pos = m_Response.size();
+            if (pos >= 4 && memcmp(&m_Response[pos - 4], sync, 3) == 0)
+            {
+                if (c != STK_OK)
+                {
+                    fail();
+                    return;
+                }
+                begin(PHASE_SIGNATURE);
+                m_Serial.hostWrite("u ");
+            }
+            break;
+        }
+        case PHASE_SIGNATURE:
+            if (m_Response.size() == 5)
+            {
+                if (m_Response[0] != STK_INSYNC || m_Response[4] != STK_OK)
+                {
+                    fail();
+                    return;
+                }
+                memcpy(m_Signature, &m_Response[1], 3);
+                begin(PHASE_PROGRAM);
+                if (m_Updater)
+                    sendCompressed();
+                else
+                    sendPages();
+            }
+            break;
+        case PHASE_PROGRAM:
+            if ((m_Response.size() & 1) == 0 && c != STK_OK)
+            {
+                printf("page write failed\n");
+                fail();
+                return;
+            }
+            if (m_LockStep && (m_Response.size() & 3) == 0 && m_Response.size() < m_ExpectedResponse)
+                sendPage(m_Response.size() / 4 * m_PageSize);
+            if (m_Response.size() == m_ExpectedResponse)
+            {
+                if (m_Verify)
+                {
+                    begin(PHASE_VERIFY);
+                    readPages();
+                }
+                else
+                {
+                    begin(PHASE_LEAVE);
+                    m_Serial.hostWrite("Q ");
+                }
+            }
+            break;
+        case PHASE_VERIFY:
+            if (m_Response.size() == m_ExpectedResponse)
+            {
+                // INSYNC OK for the address then INSYNC data OK per page
+                m_ReadBack.clear();
+                size_t pos = 0;
+                for (size_t page = 0; page < m_Image.size(); page += m_PageSize)
+                {
+                    size_t size = std::min<size_t>(m_PageSize, m_Image.size() - page);
+                    if (m_Response[pos + 3 + size] != STK_OK)
+                    {
+                        printf("page read failed\n");
+                        fail();
+                        return;
+                    }
+                    m_ReadBack.insert(m_ReadBack.end(), &m_Response[pos + 3], &m_Response[pos + 3 + size]);
+                    pos += 4 + size;
+                }
+                begin(PHASE_LEAVE);
+                m_Serial.hostWrite("Q ");
+            }
+            break;
+        case PHASE_LEAVE:
+            if (m_Response.size() == 2)
+            {
+                if (m_Response[1] != STK_OK)
+                {
+                    printf("leaving programming mode failed\n");
+                    fail();
+                    return;
+                }
+                // back to the console to run a CRC check
+                begin(PHASE_CONFIG);
+                m_Serial.hostWrite("*cfg\n");
+            }
+            break;
+        case PHASE_CONFIG:
+            if (m_Text.find("\n>") != std::string::npos)
+            {
+                m_Stats = m_Text;
+                begin(PHASE_LINK_STATS);
+                m_Serial.hostWrite("stats\n");
+            }
+            break;
+        case PHASE_LINK_STATS:
+            if (c == '>')
+            {
+                m_LinkStats = m_Text;
+                begin(PHASE_CRC_CHECK);
+                m_Serial.hostWrite("crc\n");
+            }
+            break;
+        case PHASE_CRC_CHECK:
+            if (c == '>')
+            {
+                m_Result = m_Text;
+                begin(PHASE_DONE);
+            }
+            break;
+        default:
+            break;
+        }
+    }
+
+    void sendPages()
+    {
+        // the whole image is written up front, the serial link holds it
+        // back while the bridge is busy
+        m_ExpectedResponse = 0;
+        for (size_t pos = 0; pos < m_Image.size(); pos += m_PageSize)
+        {
+            if (!m_LockStep || pos == 0)
+                sendPage(pos);
+            m_ExpectedResponse += 4;
+        }
+    }
+
+    void sendPage(size_t pos)
+    {
+        // byte addresses, as writestk500 sends them
+        uint16_t address = (uint16_t) (m_AppStart + pos);
+        uint8_t size = (uint8_t) std::min<size_t>(m_PageSize, m_Image.size() - pos);
+        uint8_t header[] =
+        {
+            STK_LOAD_ADDRESS, (uint8_t) (address & 255), (uint8_t) (address >> 8), CRC_EOP,
+            STK_PROG_PAGE, 0, size, 'F'
+        };
+        m_Serial.hostWrite(header, sizeof(header));
+        m_Serial.hostWrite(&m_Image[pos], size);
+        m_Serial.hostWrite(" ");
+    }
+
+    void sendCompressed()
+    {
+        // start the updater, then the stream in pages ending with an empty one
+        uint16_t end = m_Updater;
+        uint8_t header[] =
+        {
+            STK_LOAD_ADDRESS, (uint8_t) (end & 255), (uint8_t) (end >> 8), CRC_EOP,
+            STK_PROG_PAGE, 0, 4, 'S',
+            (uint8_t) (m_AppStart & 255), (uint8_t) (m_AppStart >> 8), (uint8_t) (end & 255), (uint8_t) (end >> 8), CRC_EOP
+        };
+        m_Serial.hostWrite(header, sizeof(header));
+        m_ExpectedResponse = 4;
+        m_Compressed = LzCompress(m_Image);
+        for (size_t pos = 0;;)
+        {
+            uint8_t size = (uint8_t) std::min<size_t>(128, m_Compressed.size() - pos);
+            uint8_t page[] = { STK_PROG_PAGE, 0, size, 'Z' };
+            m_Serial.hostWrite(page, sizeof(page));
+            m_Serial.hostWrite(&m_Compressed[pos], size);
+            m_Serial.hostWrite(" ");
+            m_ExpectedResponse += 2;
+            if (size == 0)
+                break;
+            pos += size;
+        }
+    }
+
+    void readPages()
+    {
+        m_ExpectedResponse = 0;
+        for (size_t pos = 0; pos < m_Image.size(); pos += m_PageSize)
+        {
+            uint16_t address = (uint16_t) (m_AppStart + pos);
+            uint8_t size = (uint8_t) std::min<size_t>(m_PageSize, m_Image.size() - pos);
+            uint8_t request[] =
+            {
+                STK_LOAD_ADDRESS, (uint8_t) (address & 255), (uint8_t) (address >> 8), CRC_EOP,
+                STK_READ_PAGE, 0, size, 'F', CRC_EOP
+            };
+            m_Serial.hostWrite(request, sizeof(request));
+            m_ExpectedResponse += 4 + size;
+        }
+    }
+
+    VirtualSerial& m_Serial;
+    bool m_LockStep;
+    std::vector<uint8_t> m_Image;
+    std::vector<uint8_t> m_ReadBack;
+    std::vector<uint8_t> m_Compressed;
+    uint16_t m_AppStart = 0x100;
+    uint16_t m_Updater = 0;
+    uint8_t m_PageSize = 64;
+    bool m_Verify = false;
+    Phase m_Phase = PHASE_DONE;
+    Nanos m_PhaseTime[PHASE_FAILED + 1] = {};
+    std::vector<uint8_t> m_Response;
+    size_t m_ExpectedResponse = 0;
+    std::string m_Text;
+    std::string m_Stats;
+    std::string m_LinkStats;
+    std::string m_Result;
+    uint8_t m_Signature[3] = {};
+};
+
+static bool run(const TargetDevice& device, uint32_t seed, bool extended, bool packed, bool compressed, bool pipelined,
+    bool lockStep, bool marginal, bool adaptive)
+{
+    Scheduler::instance().reset();
+    detachAllDevices();
+#if MTNB_TRACE_SIZE
+    Trace::clear();
+#endif
+
+    VirtualEther ether;
+    MarginalLink link(ether.random());
+    if (marginal)
+        ether.setLinkModel(&link);
+    VirtualNrf24 bridgeRadio(ether, "bridge");
+    bridgeRadio.attach(CE_PIN, CSN_PIN);
+    VirtualTarget target(ether, device);
+    if (!target.loadHex(MTNRF_BOOTLOADER_HEX))
+    {
+        printf("can't read %s\n", MTNRF_BOOTLOADER_HEX);
+        return false;
+    }
+    if (packed ? !target.usePackedWrites() : extended && !target.useExtendedBootLoader())
+    {
+        printf("can't read the assembled EXTENDED_BOOTLOADER build\n");
+        return false;
+    }
+    target.powerOn();
+    const uint16_t appStart = target.getAppStart();
+
+    // the ProgrammingBridge sketch
+    VirtualSerial serial(500000);
+    Radio radio(CE_PIN, CSN_PIN);
+    BootLoader bootLoader(radio);
+    Console console(bootLoader);
+    Config config("001", 3, 50, RF24_2MBPS);
+    config.setRetries(0, 15, 16);
+    if (!radio.begin(config))
+    {
+        printf("radio not connected\n");
+        return false;
+    }
+    console.begin(serial);
+    std::string settings;
+    if (!pipelined)
+        settings += "pipe 0\n";
+    if (adaptive)
+        settings += "link 1\n";
+    bool configured = settings.empty();
+    if (!configured)
+        serial.hostWrite("*cfg\n");
+
+    // let the target time out into its application first
+    while (now() < millis(1500))
+    {
+        console.handle();
+        serial.hostRead();
+        // the console drops anything that came in with *cfg
+        if (!configured && now() >= millis(100))
+        {
+            serial.hostWrite((settings + "q\n").c_str());
+            configured = true;
+        }
+    }
+
+    // application filling the whole app section, CRC at the end
+    std::mt19937 random(seed);
+    uint16_t updater = compressed ? device.flashSize - UPDATER_SIZE : 0;
+    std::vector<uint8_t> image = makeProgram(random, (compressed ? updater : device.flashSize) - appStart - 2);
+    uint16_t crc = crc16(image.data(), image.size());
+    if (compressed)
+    {
+        // resident updater, the CRC fix up accounts for it like writestk500 does
+        std::vector<uint8_t> resident = makeProgram(random, UPDATER_SIZE * 3 / 4);
+        resident.resize(UPDATER_SIZE, 0);
+        std::copy(resident.begin(), resident.end(), target.flash().begin() + updater);
+        crc = CrcFixup(crc, resident);
+    }
+    image.push_back(crc >> 8);
+    image.push_back(crc & 255);
+
+    Programmer programmer(serial, lockStep);
+    programmer.start(image, appStart, device.pageSize, extended, updater);
+    auto wallStart = std::chrono::steady_clock::now();
+    Nanos start = now();
+    while (programmer.getPhase() < Programmer::PHASE_DONE)
+    {
+        console.handle();
+        programmer.poll();
+    }
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+
+    bool finished = programmer.getPhase() == Programmer::PHASE_DONE;
+    bool verified = memcmp(&target.flash()[appStart], image.data(), image.size()) == 0;
+    bool crcPassed = programmer.getResult().find("passed OK") != std::string::npos;
+    bool readBack = !extended || programmer.getReadBack() == image;
+    bool ok = finished && verified && crcPassed && readBack;
+    double programSeconds = programmer.getPhaseTime(Programmer::PHASE_PROGRAM) / 1e9;
+    const VirtualTarget::Stats& stats = target.getStats();
+    const VirtualNrf24::Stats& rf = bridgeRadio.getStats();
+
+    printf("%s%s%s%s%s%s%s%s: %s\n", device.name, extended ? " (extended bootloader)" : "",
+        packed ? " (packed writes)" : "", compressed ? " (stage-2 updater)" : "", pipelined ? "" : " (page at a time)",
+        lockStep ? " (lock step host)" : "", marginal ? " (marginal link)" : "", adaptive ? " (link adaptation)" : "",
+        ok ? "OK" : "FAILED");
+    // the bridge answered every page and Q with STK_OK, so a host would
+    // have believed it
+    if (finished && !verified)
+        printf("  *** flash doesn't match the image although the session reported success ***\n");
+    printf("  enter bootloader  %8.1f ms\n", programmer.getPhaseTime(Programmer::PHASE_CONNECT) / 1e6);
+    printf("  read signature    %8.1f ms\n", programmer.getPhaseTime(Programmer::PHASE_SIGNATURE) / 1e6);
+    printf("  program %5zu B   %8.1f ms  (%.0f bytes/s)\n", image.size(), programSeconds * 1e3,
+        programSeconds > 0 ? image.size() / programSeconds : 0.0);
+    if (compressed)
+        printf("  compressed        %5zu B (%.0f%%), updater ran %u times\n", programmer.getCompressed().size(),
+            100.0 * programmer.getCompressed().size() / image.size(), stats.updaterEntries);
+    if (extended)
+    {
+        double verifySeconds = programmer.getPhaseTime(Programmer::PHASE_VERIFY) / 1e9;
+        printf("  verify  %5zu B   %8.1f ms  (%.0f bytes/s, %s)\n", image.size(), verifySeconds * 1e3,
+            verifySeconds > 0 ? image.size() / verifySeconds : 0.0, readBack ? "matches" : "MISMATCH");
+    }
+    printf("  leave bootloader  %8.1f ms\n", programmer.getPhaseTime(Programmer::PHASE_LEAVE) / 1e6);
+    printf("  crc check         %8.1f ms  (%s)\n", programmer.getPhaseTime(Programmer::PHASE_CRC_CHECK) / 1e6,
+        crcPassed ? "passed" : "failed");
+    printf("  flash contents    %s, %u page writes, %.1f ms CPU halted for NVM\n",
+        verified ? "verified" : "MISMATCH", stats.flashPageWrites, stats.nvmBusyTime / 1e6);
+    if (packed)
+        printf("  packed writes     %u of %u pages without a command\n", stats.pagesWithoutCommand,
+            stats.flashPageWrites);
+    printf("  radio             %u packets, %u retransmits, %u max retries, %u resets, %u watchdog resets\n",
+        rf.txPackets, rf.retransmits, rf.maxRetries, stats.resets, stats.watchdogResets);
+    const std::string& consoleStats = programmer.getStats();
+    size_t line = consoleStats.find(" retransmits for ");
+    if (line != std::string::npos)
+    {
+        size_t begin = consoleStats.rfind('\n', line) + 1;
+        printf("  bridge            %s\n", consoleStats.substr(begin, consoleStats.find('\n', line) - begin).c_str());
+    }
+    // histograms of the programming session, which "Q" ended
+    const std::string& linkStats = programmer.getLinkStats();
+    line = linkStats.find("session open=0");
+    if (line != std::string::npos)
+    {
+        std::string session = linkStats.substr(line, linkStats.find('\n', line) - line);
+        for (const char* key : { " pages=", " reads=" })
+        {
+            size_t begin = session.find(key);
+            if (begin != std::string::npos)
+                printf("  %-18s%s  (under 0.5, 1, 2 ... 32ms, longer)\n", key[1] == 'p' ? "page times" : "read times",
+                    session.substr(begin + strlen(key), session.find_first_of(" \r", begin + 1) - begin - strlen(key)).c_str());
+        }
+    }
+    printf("  simulated %.3fs in %.3fs\n\n", (now() - start) / 1e9, wall);
+    return ok;
+}
+
+static int usage()
+{
+    printf("usage: progbench [-x] [-p] [-z] [-s] [-a] [-m] [-l] [-t file] [device]...\n");
+    return 1;
+}
+
+int main(int argc, char* argv[])
+{
+    std::vector<const TargetDevice*> devices;
+    bool extended = false;
+    bool packed = false;
+    bool compressed = false;
+    bool pipelined = true;
+    bool lockStep = false;
+    bool marginal = false;
+    bool adaptive = false;
+    const char* traceFile = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-x") == 0)
+        {
+            extended = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-p") == 0)
+        {
+            extended = packed = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-z") == 0)
+        {
+            compressed = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-s") == 0)
+        {
+            pipelined = false;
+            continue;
+        }
+        if (strcmp(argv[i], "-a") == 0)
+        {
+            lockStep = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-t") == 0)
+        {
+            if (i + 1 == argc)
+                return usage();
+#if MTNB_TRACE_SIZE
+            traceFile = argv[++i];
+            continue;
+#else
+            printf("-t needs the packet trace, use progbench_trace\n");
+            return 1;
+#endif
+        }
+        if (strcmp(argv[i], "-m") == 0)
+        {
+            marginal = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-l") == 0)
+        {
+            adaptive = true;
+            continue;
+        }
+        if (argv[i][0] == '-')
+            return usage();
+        const TargetDevice* device = TargetDevice::find(argv[i]);
+        if (!device)
+        {
+            printf("unknown device %s\n", argv[i]);
+            return usage();
+        }
+        devices.push_back(device);
+    }
+    if (devices.empty())
+    {
+        devices.push_back(TargetDevice::find("ATtiny1614"));
+        devices.push_back(TargetDevice::find("ATtiny3216"));
+    }
+    bool ok = true;
+    for (const TargetDevice* device : devices)
+        ok &= run(*device, 1614, extended, packed, compressed, pipelined, lockStep, marginal, adaptive);
+    if (traceFile)
+    {
+        FILE* file = fopen(traceFile, "wb");
+        if (!file)
+        {
+            printf("can't write %s\n", traceFile);
+            return 1;
+        }
+#if MTNB_TRACE_SIZE
+        FilePrint out(file);
+        Trace::writeFrame(out);
+#endif
+        fclose(file);
+    }
+    return ok ? 0 : 1;
+}
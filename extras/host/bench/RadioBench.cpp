@@ -0,0 +1,316 @@
+// Measures the cost of the mtnrf radio and bootloader transfer functions on
+// a simulated nRF24L01+ link, in virtual time, with no hardware attached.
+// nrf24bench_irq is built with MTNB_RADIO_IRQ and adds a burst received
+// through the interrupt driven queue.
+
+#include <megaTinyNrfBoot.h>
+#include <megaTinyNrfFastRadio.h>
+#include "VirtualNrf24.h"
+#include <chrono>
+#include <vector>
+
+using namespace mtnrf;
+using namespace mtnrf::host;
+
+static const uint8_t CE_PIN = 1;
+static const uint8_t CSN_PIN = 2;
+static const uint8_t IRQ_PIN = 3;
+
+// remote radio configured like the bootloader which just pulls packets out
+// of its RX FIFO every few microseconds
+class PacketSink : public Component
+{
+public:
+    PacketSink(VirtualEther& ether, const char* address, uint8_t channel, Nanos drainInterval)
+    :   m_Radio(ether, "sink")
+    ,   m_DrainInterval(drainInterval)
+    {
+        m_Radio.writeRegister(EN_AA, 0x3F);
+        m_Radio.writeRegister(SETUP_AW, 1);
+        m_Radio.writeRegister(SETUP_RETR, 0x7F);
+        m_Radio.writeRegister(RF_SETUP, _BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH) | _BV(RF_DR_HIGH));
+        m_Radio.writeRegister(DYNPD, 0x3F);
+        m_Radio.writeRegister(RX_ADDR_P5, 'P');
+        m_Radio.writeRegister(FEATURE, _BV(EN_DPL) | _BV(EN_ACK_PAY) | _BV(EN_DYN_ACK));
+        m_Radio.writeRegister(TX_ADDR, address, 3);
+        m_Radio.writeRegister(RX_ADDR_P0, address, 3);
+        m_Radio.writeRegister(RX_ADDR_P1, address, 3);
+        m_Radio.writeRegister(RF_CH, channel);
+        m_Radio.writeRegister(EN_RXADDR, _BV(5));
+        m_Radio.writeRegister(CONFIG, _BV(CRCO) | _BV(EN_CRC) | _BV(PWR_UP) | _BV(PRIM_RX));
+        m_Radio.setCe(true);
+        m_Next = now() + m_DrainInterval;
+        Scheduler::instance().add(this);
+    }
+    ~PacketSink() { Scheduler::instance().remove(this); }
+
+    Nanos nextEvent() const override { return m_Next; }
+    void process(Nanos t) override
+    {
+        while ((m_Radio.readRegister(FIFO_STATUS) & _BV(RX_EMPTY)) == 0)
+        {
+            uint8_t payload[32];
+            m_Radio.command(R_RX_PAYLOAD, payload, sizeof(payload));
+        }
+        m_Next = t + m_DrainInterval;
+    }
+    VirtualNrf24& radio() { return m_Radio; }
+
+private:
+    VirtualNrf24 m_Radio;
+    Nanos m_DrainInterval;
+    Nanos m_Next;
+};
+
+// remote radio sending numbered no-ack packets at a fixed interval, faster
+// than an application that only looks at the radio every few milliseconds
+class BurstSource : public Component
+{
+public:
+    BurstSource(VirtualEther& ether, const char* address, uint8_t channel, Nanos interval)
+    :   m_Radio(ether, "burst")
+    ,   m_Interval(interval)
+    {
+        m_Radio.writeRegister(SETUP_AW, 1);
+        m_Radio.writeRegister(RF_SETUP, _BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH) | _BV(RF_DR_HIGH));
+        m_Radio.writeRegister(DYNPD, 0x3F);
+        m_Radio.writeRegister(FEATURE, _BV(EN_DPL) | _BV(EN_ACK_PAY) | _BV(EN_DYN_ACK));
+        m_Radio.writeRegister(TX_ADDR, address, 3);
+        m_Radio.writeRegister(RF_CH, channel);
+        m_Radio.writeRegister(CONFIG, _BV(CRCO) | _BV(EN_CRC) | _BV(PWR_UP));
+        m_Radio.setCe(true);
+        Scheduler::instance().add(this);
+    }
+    ~BurstSource() { Scheduler::instance().remove(this); }
+
+    void start(int count)
+    {
+        m_Sequence = 0;
+        m_Count = count;
+        m_Next = now();
+    }
+    Nanos nextEvent() const override { return m_Sequence < m_Count ? m_Next : NEVER; }
+    void process(Nanos t) override
+    {
+        uint8_t payload[32] = { m_Sequence++ };
+        m_Radio.command(W_TX_PAYLOAD_NO_ACK, payload, sizeof(payload));
+        m_Next = t + m_Interval;
+    }
+
+private:
+    VirtualNrf24 m_Radio;
+    Nanos m_Interval;
+    Nanos m_Next = NEVER;
+    uint8_t m_Sequence = 0;
+    uint8_t m_Count = 0;
+};
+
+// receive a burst while the application only checks the radio every 2ms
+static void receiveBurst(Radio& radio, BurstSource& source, bool useInterrupts)
+{
+    static const int BURST = 64;
+#if MTNB_RADIO_IRQ
+    RxPacket queue[16];
+    if (useInterrupts)
+    {
+        radio.beginInterrupts(IRQ_PIN, queue, 16);
+        // TX_DS left over from the writes above
+        radio.takeEvents();
+    }
+    double waited = 0;
+#endif
+    source.start(BURST);
+    int received = 0;
+    Nanos start = now();
+    while (now() - start < millis(40))
+    {
+        delay(2);
+        while (radio.available())
+        {
+#if MTNB_RADIO_IRQ
+            if (useInterrupts)
+                waited += micros() - radio.peek()->time;
+#endif
+            uint8_t payload[32];
+            radio.read(payload);
+            ++received;
+        }
+    }
+    printf("%-36s %5i of %i", useInterrupts ? "burst receive, IRQ queue" : "burst receive, polled", received, BURST);
+#if MTNB_RADIO_IRQ
+    if (useInterrupts)
+    {
+        printf(", %.0f us average wait in queue, events 0x%02X", received ? waited / received : 0.0, radio.takeEvents());
+        radio.endInterrupts();
+    }
+#endif
+    printf("\n");
+}
+
+// cost of single commands through the SPI library and with FastRadio's
+// direct register access, in cycles of the 20MHz bridge.  these come from
+// the host core's cost model of each call, not cycles measured on an AVR.
+static void compareCommands(Radio& radio, Radio& fastRadio, int iterations)
+{
+    struct Command
+    {
+        const char* name;
+        void (*run)(Radio& radio);
+    };
+    static const Command commands[] =
+    {
+        { "status", [](Radio& r) { r.status(); } },
+        { "readRegister", [](Radio& r) { r.readRegister(RF_CH); } },
+        { "writeRegister", [](Radio& r) { r.writeRegister(RF_CH, 50); } },
+        { "readRegister(5)", [](Radio& r) { uint8_t a[5]; r.readRegister(RX_ADDR_P1, a, 5); } },
+        { "W_TX_PAYLOAD(32) + FLUSH_TX", [](Radio& r) { uint8_t p[32] = {}; r.commandLong(W_TX_PAYLOAD, p, 32); r.clearWriteFifo(); } },
+        { "ce", [](Radio& r) { r.ce(HIGH); } },
+    };
+    printf("%-36s %11s %11s %7s\n", "command cycles (modeled)", "Radio", "FastRadio", "ratio");
+    for (const Command& command : commands)
+    {
+        double cycles[2];
+        Radio* radios[2] = { &radio, &fastRadio };
+        for (int i = 0; i < 2; ++i)
+        {
+            Nanos start = now();
+            for (int n = 0; n < iterations; ++n)
+                command.run(*radios[i]);
+            cycles[i] = (now() - start) / 50.0 / iterations;
+        }
+        printf("%-36s %11.0f %11.0f %6.1fx\n", command.name, cycles[0], cycles[1], cycles[0] / cycles[1]);
+    }
+}
+
+struct Snapshot
+{
+    Nanos time;
+    SpiStats spi;
+    VirtualNrf24::Stats radio;
+
+    static Snapshot take(const VirtualNrf24& radio)
+    {
+        return { now(), spiStats(), radio.getStats() };
+    }
+};
+
+static void report(const char* name, int iterations, uint32_t bytesPerIteration,
+    const Snapshot& before, const Snapshot& after)
+{
+    double us = (after.time - before.time) / 1000.0 / iterations;
+    double spiTransactions = double(after.spi.transactions - before.spi.transactions) / iterations;
+    double spiBytes = double(after.spi.bytes - before.spi.bytes) / iterations;
+    double frames = double(after.radio.txFrames - before.radio.txFrames) / iterations;
+    double retransmits = double(after.radio.retransmits - before.radio.retransmits) / iterations;
+    printf("%-36s %8.1f us %8.1f %8.1f %7.2f %7.2f", name, us, spiTransactions, spiBytes, frames, retransmits);
+    if (bytesPerIteration)
+        printf(" %9.0f", bytesPerIteration / (us / 1e6));
+    printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+    int iterations = argc > 1 ? atoi(argv[1]) : 200;
+    auto wallStart = std::chrono::steady_clock::now();
+
+    VirtualEther ether;
+    VirtualNrf24 bridgeRadio(ether, "bridge");
+    bridgeRadio.attach(CE_PIN, CSN_PIN, IRQ_PIN);
+    PacketSink sink(ether, "001", 50, micros(20));
+
+    Radio radio(CE_PIN, CSN_PIN);
+    Config config("001", 3, 50, RF24_2MBPS);
+    config.setRetries(0, 15, 16);
+    if (!radio.begin(config))
+    {
+        printf("radio not connected\n");
+        return 1;
+    }
+    BootLoader bootLoader(radio);
+    radio.powerDown();
+    radio.openWritingPipe('P');
+    radio.stopListening();
+    delay(5);
+
+    printf("%-36s %11s %8s %8s %7s %7s %9s\n", "operation", "time/op", "spi txn", "spi B", "frames", "resend", "bytes/s");
+
+    uint8_t data[16384];
+    for (size_t i = 0; i < sizeof(data); ++i)
+        data[i] = (uint8_t) (i * 7 + (i >> 8));
+
+    Snapshot before = Snapshot::take(bridgeRadio);
+    for (int i = 0; i < iterations; ++i)
+        radio.status();
+    report("Radio::status", iterations, 0, before, Snapshot::take(bridgeRadio));
+
+    before = Snapshot::take(bridgeRadio);
+    for (int i = 0; i < iterations; ++i)
+    {
+        radio.write(data, 32);
+        radio.flush();
+    }
+    report("Radio::write(32) + flush", iterations, 32, before, Snapshot::take(bridgeRadio));
+
+    // same radio through the other bus
+    FastRadio<CE_PIN, CSN_PIN> fastRadio;
+    fastRadio.begin(config);
+    fastRadio.powerDown();
+    fastRadio.openWritingPipe('P');
+    fastRadio.stopListening();
+    delay(5);
+    before = Snapshot::take(bridgeRadio);
+    for (int i = 0; i < iterations; ++i)
+    {
+        fastRadio.write(data, 32);
+        fastRadio.flush();
+    }
+    report("FastRadio::write(32) + flush", iterations, 32, before, Snapshot::take(bridgeRadio));
+
+    Nanos flushTime = 0;
+    before = Snapshot::take(bridgeRadio);
+    for (int i = 0; i < iterations; ++i)
+    {
+        radio.writeImmediate(data, 32);
+        radio.writeImmediate(data, 32);
+        radio.writeImmediate(data, 32);
+        Nanos t = now();
+        radio.flush();
+        flushTime += now() - t;
+    }
+    report("3 x writeImmediate(32) + flush", iterations, 96, before, Snapshot::take(bridgeRadio));
+    printf("%-36s %8.1f us\n", "  of which Radio::flush", flushTime / 1000.0 / iterations);
+
+    before = Snapshot::take(bridgeRadio);
+    for (int i = 0; i < iterations; ++i)
+    {
+        radio.writeLong(data, 128);
+        radio.flush();
+    }
+    report("Radio::writeLong(128) + flush", iterations, 128, before, Snapshot::take(bridgeRadio));
+
+    int images = iterations / 50 + 1;
+    before = Snapshot::take(bridgeRadio);
+    for (int i = 0; i < images; ++i)
+    {
+        bootLoader.writeMemoryLong(0, data, sizeof(data));
+        bootLoader.flushWrites();
+    }
+    report("BootLoader::writeMemoryLong(16K)", images, sizeof(data), before, Snapshot::take(bridgeRadio));
+
+    printf("\n");
+    BurstSource source(ether, "rx1", 50, micros(400));
+    radio.setAddress("rx1", 3);
+    radio.startListening(_BV(1));
+    receiveBurst(radio, source, false);
+#if MTNB_RADIO_IRQ
+    receiveBurst(radio, source, true);
+#endif
+
+    printf("\n");
+    compareCommands(radio, fastRadio, iterations);
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    printf("\nsimulated %.3fs of radio time in %.3fs (%.0fx real time)\n",
+        now() / 1e9, wall, wall > 0 ? now() / 1e9 / wall : 0.0);
+    return 0;
+}
@@ -0,0 +1,49 @@
+// Prints the RAM taken by the bridge's objects in each build configuration
+// CMake compiles RamReportConfig.cpp for.  Everything the bridge keeps is in
+// these objects apart from the packet trace's static ring, it makes no heap
+// allocations.  Sizes are for the host:
+// pointers and vtable pointers are 8 bytes here and 2 on AVR, so they're
+// for comparing configurations and spotting growth rather than exact.
+
+#include "RamReport.h"
+#include <stdio.h>
+#include <string.h>
+#include <vector>
+#include <algorithm>
+
+static RamReportConfig* s_Configs = nullptr;
+
+RamReportConfig::RamReportConfig(int order, const char* name, const RamReportEntry* entries, int count)
+:   order(order)
+,   name(name)
+,   entries(entries)
+,   count(count)
+,   next(s_Configs)
+{
+    s_Configs = this;
+}
+
+int main()
+{
+    std::vector<const RamReportConfig*> configs;
+    for (const RamReportConfig* config = s_Configs; config; config = config->next)
+        configs.push_back(config);
+    std::sort(configs.begin(), configs.end(),
+        [](const RamReportConfig* a, const RamReportConfig* b) { return a->order < b->order; });
+    if (configs.empty())
+        return 1;
+
+    printf("RAM used by the bridge's objects (bytes, host build)\n\n");
+    printf("  %-36s", "");
+    for (const RamReportConfig* config : configs)
+        printf(" %10s", config->name);
+    printf("\n");
+    for (int entry = 0; entry < configs[0]->count; ++entry)
+    {
+        printf("  %-36s", configs[0]->entries[entry].name);
+        for (const RamReportConfig* config : configs)
+            printf(" %10zu", config->entries[entry].size);
+        printf("\n");
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+// RamReportConfig.cpp is compiled once for each build configuration and
+// registers the sizes it sees with RamReport.cpp's table
+
+#include <stddef.h>
+
+struct RamReportEntry
+{
+    const char* name;
+    size_t size;
+};
+
+struct RamReportConfig
+{
+    RamReportConfig(int order, const char* name, const RamReportEntry* entries, int count);
+
+    int order;
+    const char* name;
+    const RamReportEntry* entries;
+    int count;
+    RamReportConfig* next;
+};
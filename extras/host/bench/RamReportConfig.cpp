@@ -0,0 +1,26 @@
+// Sizes of the library's objects as built with this file's preprocessor
+// flags, see RamReport.cpp.  Only sizeof() is taken so nothing here links
+// against the library.
+
+#include <megaTinyNrfConsole.h>
+#include "RamReport.h"
+
+using namespace mtnrf;
+
+static const RamReportEntry s_Entries[] =
+{
+    { "Radio", sizeof(Radio) },
+    { "BootLoader", sizeof(BootLoader) },
+    { "Stk500", sizeof(Stk500) },
+#if !DISABLE_MTNB_STATS
+    { "LinkStats", sizeof(LinkStats) },
+#else
+    { "LinkStats", 0 },
+#endif
+    { "DebugStream", sizeof(DebugStream) },
+    { "Console (with Stk500, DebugStream)", sizeof(Console) },
+    // static, not part of any object
+    { "Trace ring (MTNB_TRACE_SIZE)", MTNB_TRACE_SIZE * 4 },
+};
+
+static RamReportConfig s_Config(RAM_REPORT_ORDER, RAM_REPORT_NAME, s_Entries, sizeof(s_Entries) / sizeof(s_Entries[0]));
@@ -0,0 +1,339 @@
+// Plays sessions recorded with writestk500 --record (or --record --proxy
+// with avrdude as the client) into the bridge stack (Console, Stk500,
+// BootLoader, Radio) talking to a simulated target, so a change to the
+// bridge can be measured against real traffic.  Each write from the PC goes
+// to the bridge as soon as it has answered the one before the way it did in
+// the recording, once it has answered with less and gone quiet, or once the
+// recorded gap plus a second has passed.  With -t the writes keep their
+// recorded timing instead.
+//
+//   replaybench [-t] [-x] [-o] [-d device] recording...
+//
+// The device comes from the signature in the recording unless -d picks
+// one, -x runs the extended bootloader, and an "addr" command in the
+// recording sets the target's radio address and channel.  -o saves what
+// the bridge said in each replay as <recording>.out to compare with what it
+// said at the time.  A summary is printed per recording and totals for all
+// of them; the exit code is non-zero if any replay got fewer STK_INSYNC
+// answers than its recording.
+
+#include <megaTinyNrfConsole.h>
+#include "VirtualSerial.h"
+#include "VirtualTarget.h"
+#include "Recorder.hpp"
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace mtnrf;
+using namespace mtnrf::host;
+
+#ifndef MTNRF_BOOTLOADER_HEX
+#define MTNRF_BOOTLOADER_HEX "NRF24BootLoader.X.production.hex"
+#endif
+
+static const uint8_t CE_PIN = 1;
+static const uint8_t CSN_PIN = 2;
+static const Nanos SLACK = millis(1000);
+// or once it's answered something and then gone quiet for this long
+static const Nanos QUIET = millis(50);
+
+static const uint8_t STK_INSYNC = 0x14;
+static const uint8_t STK_OK = 0x10;
+
+struct Replay
+{
+    const TargetDevice* device = nullptr;
+    size_t hostWrites = 0;
+    size_t bytesToBridge = 0;
+    size_t recordedFromBridge = 0;
+    size_t bytesFromBridge = 0;
+    size_t recordedInSync = 0;
+    size_t inSync = 0;
+    double recordedSeconds = 0;
+    double replaySeconds = 0;
+    double wallSeconds = 0;
+    long firstDifference = -1;
+    uint32_t pageWrites = 0;
+    uint32_t packets = 0;
+    uint32_t retransmits = 0;
+};
+
+static std::vector<uint8_t> join(const std::vector<RecordedChunk>& chunks, bool toBridge)
+{
+    std::vector<uint8_t> data;
+    for (const RecordedChunk& chunk : chunks)
+        if (chunk.toBridge == toBridge)
+            data.insert(data.end(), chunk.data.begin(), chunk.data.end());
+    return data;
+}
+
+static size_t count(const std::vector<uint8_t>& data, uint8_t value)
+{
+    return std::count(data.begin(), data.end(), value);
+}
+
+// the device that answered STK_READ_SIGN
+static const TargetDevice* findDevice(const std::vector<uint8_t>& fromBridge)
+{
+    for (size_t i = 0; i + 4 < fromBridge.size(); ++i)
+    {
+        if (fromBridge[i] == STK_INSYNC && fromBridge[i + 1] == 0x1E && fromBridge[i + 4] == STK_OK)
+        {
+            const TargetDevice* device = TargetDevice::find(&fromBridge[i + 1]);
+            if (device)
+                return device;
+        }
+    }
+    return nullptr;
+}
+
+// the last "addr xyz [channel]" sent to the bridge's console
+static bool findAddress(const std::vector<uint8_t>& toBridge, uint8_t* address, int& channel)
+{
+    std::string text(toBridge.begin(), toBridge.end());
+    size_t pos = text.rfind("addr ");
+    if (pos == std::string::npos || pos + 8 > text.size())
+        return false;
+    memcpy(address, &text[pos + 5], 3);
+    char separator = text[pos + 8];
+    if (separator == ' ' || separator == ',' || separator == ':')
+        channel = atoi(&text[pos + 9]);
+    return true;
+}
+
+static bool replay(const char* filename, const TargetDevice* device, bool extended, bool timed, bool save,
+    Replay& result)
+{
+    std::vector<RecordedChunk> chunks;
+    if (!SessionRecorder::Load(filename, chunks))
+        return false;
+    const std::vector<uint8_t> recordedToBridge = join(chunks, true);
+    const std::vector<uint8_t> recordedFromBridge = join(chunks, false);
+    if (!device)
+        device = findDevice(recordedFromBridge);
+    if (!device)
+        device = TargetDevice::find("ATtiny1614");
+    result.device = device;
+
+    Scheduler::instance().reset();
+    detachAllDevices();
+
+    VirtualEther ether;
+    VirtualNrf24 bridgeRadio(ether, "bridge");
+    bridgeRadio.attach(CE_PIN, CSN_PIN);
+    VirtualTarget target(ether, *device);
+    if (!target.loadHex(MTNRF_BOOTLOADER_HEX))
+    {
+        printf("can't read %s\n", MTNRF_BOOTLOADER_HEX);
+        return false;
+    }
+    if (extended && !target.useExtendedBootLoader())
+    {
+        printf("can't read the assembled EXTENDED_BOOTLOADER build\n");
+        return false;
+    }
+    uint8_t address[3];
+    int channel = target.userRow()[3];
+    if (findAddress(recordedToBridge, address, channel))
+    {
+        memcpy(target.userRow(), address, 3);
+        target.userRow()[3] = channel;
+    }
+    target.powerOn();
+
+    // the ProgrammingBridge sketch
+    VirtualSerial serial(500000);
+    Radio radio(CE_PIN, CSN_PIN);
+    BootLoader bootLoader(radio);
+    Console console(bootLoader);
+    Config config("001", 3, 50, RF24_2MBPS);
+    config.setRetries(0, 15, 16);
+    if (!radio.begin(config))
+    {
+        printf("radio not connected\n");
+        return false;
+    }
+    console.begin(serial);
+
+    std::vector<uint8_t> output;
+    Nanos lastOutput = 0;
+    auto loop = [&]()
+    {
+        console.handle();
+        int c;
+        while ((c = serial.hostRead()) >= 0)
+        {
+            output.push_back(c);
+            lastOutput = now();
+        }
+    };
+    // let the target time out into its application first
+    while (now() < millis(1500))
+        loop();
+    output.clear();
+
+    auto wallStart = std::chrono::steady_clock::now();
+    Nanos start = now();
+    Nanos lastWrite = start;
+    size_t answered = 0;        // output at the last write
+    size_t expected = 0;        // what the recording got back after the last write
+    auto waiting = [&](Nanos gap)
+    {
+        if (output.size() - answered >= expected || now() >= lastWrite + gap + SLACK)
+            return false;
+        return output.size() == answered || now() < lastOutput + QUIET;
+    };
+    uint32_t firstTime = 0, lastTime = 0;
+    bool first = true;
+    for (const RecordedChunk& chunk : chunks)
+    {
+        if (!chunk.toBridge)
+        {
+            if (!first)
+                expected += chunk.data.size();
+            continue;
+        }
+        if (first)
+            firstTime = lastTime = chunk.time;
+        Nanos gap = micros(chunk.time - lastTime);
+        if (timed)
+        {
+            while (now() < start + micros(chunk.time - firstTime))
+                loop();
+        }
+        else
+        {
+            while (waiting(gap))
+                loop();
+        }
+        serial.hostWrite(chunk.data.data(), chunk.data.size());
+        lastWrite = now();
+        lastTime = chunk.time;
+        answered = output.size();
+        expected = 0;
+        first = false;
+        ++result.hostWrites;
+    }
+    // and the answer to the last write
+    Nanos tail = chunks.empty() || first ? 0 : micros(chunks.back().time - lastTime);
+    while (waiting(tail))
+        loop();
+    while (!serial.hostWriteComplete())
+        loop();
+    for (Nanos end = now() + millis(5); now() < end; )
+        loop();
+
+    if (save)
+    {
+        std::string outName = std::string(filename) + ".out";
+        FILE* file = fopen(outName.c_str(), "wb");
+        if (!file)
+        {
+            printf("can't write %s\n", outName.c_str());
+            return false;
+        }
+        fwrite(output.data(), 1, output.size(), file);
+        fclose(file);
+    }
+    result.bytesToBridge = recordedToBridge.size();
+    result.recordedFromBridge = recordedFromBridge.size();
+    result.bytesFromBridge = output.size();
+    result.recordedInSync = count(recordedFromBridge, STK_INSYNC);
+    result.inSync = count(output, STK_INSYNC);
+    result.recordedSeconds = chunks.empty() ? 0 : (chunks.back().time - firstTime) / 1e6;
+    result.replaySeconds = (now() - start) / 1e9;
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    auto mismatch = std::mismatch(output.begin(), output.end(), recordedFromBridge.begin(), recordedFromBridge.end());
+    if (mismatch.first != output.end() || mismatch.second != recordedFromBridge.end())
+        result.firstDifference = (long)(mismatch.first - output.begin());
+    result.pageWrites = target.getStats().flashPageWrites;
+    result.packets = bridgeRadio.getStats().txPackets;
+    result.retransmits = bridgeRadio.getStats().retransmits;
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const TargetDevice* device = nullptr;
+    bool extended = false;
+    bool timed = false;
+    bool save = false;
+    std::vector<const char*> files;
+    for (int i = 1; i < argc; ++i)
+    {
+        if (strcmp(argv[i], "-x") == 0)
+        {
+            extended = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-t") == 0)
+        {
+            timed = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-o") == 0)
+        {
+            save = true;
+            continue;
+        }
+        if (strcmp(argv[i], "-d") == 0 && i + 1 < argc)
+        {
+            device = TargetDevice::find(argv[++i]);
+            if (!device)
+            {
+                printf("unknown device %s\n", argv[i]);
+                return 1;
+            }
+            continue;
+        }
+        files.push_back(argv[i]);
+    }
+    if (files.empty())
+    {
+        printf("usage: replaybench [-t] [-x] [-o] [-d device] recording...\n");
+        return 1;
+    }
+
+    bool ok = true;
+    Replay total;
+    for (const char* file : files)
+    {
+        Replay result;
+        if (!replay(file, device, extended, timed, save, result))
+        {
+            ok = false;
+            continue;
+        }
+        bool inSync = result.inSync >= result.recordedInSync;
+        ok &= inSync;
+        printf("%s: %s\n", file, inSync ? "OK" : "FAILED");
+        printf("  %s, %zu writes, %zu bytes sent, %zu received (%zu recorded)\n", result.device->name,
+            result.hostWrites, result.bytesToBridge, result.bytesFromBridge, result.recordedFromBridge);
+        printf("  %.3fs recorded, %.3fs replayed%s (%.2fx), %.3fs wall\n", result.recordedSeconds,
+            result.replaySeconds, timed ? " timed" : "",
+            result.replaySeconds > 0 ? result.recordedSeconds / result.replaySeconds : 0.0, result.wallSeconds);
+        printf("  STK_INSYNC %zu of %zu recorded, ", result.inSync, result.recordedInSync);
+        if (result.firstDifference < 0)
+            printf("output identical\n");
+        else
+            printf("output differs from byte %ld\n", result.firstDifference);
+        printf("  target %u page writes, bridge %u packets, %u retransmits\n\n", result.pageWrites,
+            result.packets, result.retransmits);
+        total.bytesToBridge += result.bytesToBridge;
+        total.bytesFromBridge += result.bytesFromBridge;
+        total.recordedSeconds += result.recordedSeconds;
+        total.replaySeconds += result.replaySeconds;
+        total.inSync += result.inSync;
+        total.recordedInSync += result.recordedInSync;
+        total.packets += result.packets;
+        total.retransmits += result.retransmits;
+    }
+    if (files.size() > 1)
+        printf("%zu recordings: %.3fs recorded, %.3fs replayed (%.2fx), STK_INSYNC %zu of %zu, %u packets, %u retransmits\n",
+            files.size(), total.recordedSeconds, total.replaySeconds,
+            total.replaySeconds > 0 ? total.recordedSeconds / total.replaySeconds : 0.0,
+            total.inSync, total.recordedInSync, total.packets, total.retransmits);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,593 @@
+// Programming throughput over lossy links: full STK500 sessions (Console,
+// Stk500, BootLoader, Radio) into the bootloader model for every
+// combination of bitrate, setRetries() parameters, image size and link
+// model, reporting bytes/s, packets and frames on air per page and the page
+// time percentiles.  A run fails if the bridge gives up or the flash doesn't
+// match the image, and the bench exits with 1 if any did.  Results go to a
+// JSON file, one result per line, and -c compares them with an earlier file,
+// also exiting with 1 if any got more than 5% slower, so a change to the
+// retry logic shows up as numbers.  Retry delays too short for an ack at the
+// bitrate are skipped.
+//
+//   throughputbench [-b 2M,1M,250K] [-r delay,nrf,mcu]... [-i 1024,4096,full]
+//                   [-l clean,random,bursty,slownvm] [-a] [-d device]
+//                   [-o throughput.json] [-c baseline.json]
+//
+// -r can be given several times, -a makes the PC wait for each page to be
+// answered as avrdude does, and the bootloader model is switched to the
+// bitrate as if main.S had been assembled with that SETUP_VALUE.
+
+#include <megaTinyNrfConsole.h>
+#include "VirtualSerial.h"
+#include "VirtualTarget.h"
+#include <stk500.h>
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace mtnrf;
+using namespace mtnrf::host;
+
+#ifndef MTNRF_BOOTLOADER_HEX
+#define MTNRF_BOOTLOADER_HEX "NRF24BootLoader.X.production.hex"
+#endif
+
+static const uint8_t CE_PIN = 1;
+static const uint8_t CSN_PIN = 2;
+// a run fails when the bridge hasn't answered for this long
+static const Nanos STALL = millis(3000);
+
+struct Bitrate
+{
+    const char* name;
+    BitRate bitrate;
+    uint8_t minDelay;   // shortest ARD the ack fits in, 500us at 250kbps
+};
+
+static const Bitrate bitrates[] =
+{
+    { "2M", RF24_2MBPS, 0 },
+    { "1M", RF24_1MBPS, 0 },
+    { "250K", RF24_250KBPS, 1 },
+};
+
+struct Retries
+{
+    uint8_t delay;
+    uint8_t nrfRetries;
+    uint8_t mcuRetries;
+};
+
+// the frames the target receives go through a Gilbert-Elliott channel, a
+// good and a bad state with their own loss rates switching with a fixed
+// probability at every frame.  acks back to the bridge are lost on their
+// own.  random and bursty lose about the same share of frames.
+struct LinkProfile
+{
+    const char* name;
+    double lossGood;
+    double lossBad;
+    double goodToBad;
+    double badToGood;
+    double ackLoss;
+    uint32_t flashPageWriteUs;  // NVM erase-write, CPU halted
+};
+
+static const LinkProfile profiles[] =
+{
+    { "clean", 0, 0, 0, 0, 0, 4000 },
+    { "random", 0.07, 0, 0, 0, 0.03, 4000 },
+    { "bursty", 0.01, 0.7, 0.02, 0.2, 0.03, 4000 },
+    { "slownvm", 0, 0, 0, 0, 0, 10000 },
+};
+
+class GilbertElliott : public LinkModel
+{
+public:
+    GilbertElliott(std::mt19937& random, const LinkProfile& profile) : m_Random(random), m_Profile(profile) {}
+    bool deliver(const AirPacket& packet, const VirtualNrf24&) override
+    {
+        if (packet.isAck)
+            return chance() >= m_Profile.ackLoss;
+        if (chance() < (m_Bad ? m_Profile.badToGood : m_Profile.goodToBad))
+            m_Bad = !m_Bad;
+        return chance() >= (m_Bad ? m_Profile.lossBad : m_Profile.lossGood);
+    }
+
+private:
+    double chance() { return std::uniform_real_distribution<double>(0, 1)(m_Random); }
+
+    std::mt19937& m_Random;
+    const LinkProfile& m_Profile;
+    bool m_Bad = false;
+};
+
+// PC side: connects, reads the signature, writes the image the way
+// writestk500 does (every page up front, the serial link holding it back)
+// or one page at a time, and leaves, noting when each page is answered
+class Host
+{
+public:
+    Host(VirtualSerial& serial, bool lockStep) : m_Serial(serial), m_LockStep(lockStep) {}
+
+    enum State { CONNECT, SIGNATURE, PROGRAM, LEAVE, DONE, FAILED };
+
+    void start(const std::vector<uint8_t>& image, uint16_t appStart, uint8_t pageSize)
+    {
+        m_Image = &image;
+        m_AppStart = appStart;
+        m_PageSize = pageSize;
+        m_State = CONNECT;
+        m_LastProgress = now();
+        m_Serial.hostWrite("0 0 ");
+    }
+
+    State getState() const { return m_State; }
+    Nanos getProgramStart() const { return m_ProgramStart; }
+    Nanos getProgramEnd() const { return m_ProgramEnd; }
+    size_t getPages() const { return m_PageTimes.size(); }
+    // from the page being sent or the page before being answered, whichever
+    // was later, to the page being answered
+    const std::vector<Nanos>& getPageTimes() const { return m_PageTimes; }
+
+    void poll()
+    {
+        int c;
+        while ((c = m_Serial.hostRead()) >= 0)
+        {
+            receive((uint8_t) c);
+            m_LastProgress = now();
+        }
+        if (m_State < DONE && now() - m_LastProgress > STALL)
+            m_State = FAILED;
+    }
+
+private:
+    void receive(uint8_t c)
+    {
+        m_Response.push_back(c);
+        size_t size = m_Response.size();
+        switch (m_State)
+        {
+        case CONNECT:
+            // INSYNC OK INSYNC OK once the target is in the bootloader
+            if (size >= 4 && m_Response[size - 4] == STK_INSYNC && m_Response[size - 3] == STK_OK &&
+                m_Response[size - 2] == STK_INSYNC)
+            {
+                if (c != STK_OK)
+                {
+                    m_State = FAILED;
+                    return;
+                }
+                next(SIGNATURE);
+                m_Serial.hostWrite("u ");
+            }
+            break;
+        case SIGNATURE:
+            if (size == 5)
+            {
+                next(PROGRAM);
+                m_ProgramStart = now();
+                m_PageTimes.clear();
+                m_PageSent = now();
+                for (size_t pos = 0; pos < m_Image->size() && (!m_LockStep || pos == 0); pos += m_PageSize)
+                    sendPage(pos);
+            }
+            break;
+        case PROGRAM:
+            // INSYNC OK for the address and for the page
+            if ((size & 1) == 0 && c != STK_OK)
+            {
+                m_State = FAILED;
+                return;
+            }
+            if ((size & 3) == 0)
+            {
+                m_PageTimes.push_back(now() - m_PageSent);
+                m_PageSent = now();
+                size_t pos = size / 4 * m_PageSize;
+                if (pos >= m_Image->size())
+                {
+                    m_ProgramEnd = now();
+                    next(LEAVE);
+                    m_Serial.hostWrite("Q ");
+                }
+                else if (m_LockStep)
+                {
+                    sendPage(pos);
+                }
+            }
+            break;
+        case LEAVE:
+            // pipelined pages that didn't make it are only reported here
+            if (size == 2)
+                next(c == STK_OK ? DONE : FAILED);
+            break;
+        default:
+            break;
+        }
+    }
+
+    void next(State state)
+    {
+        m_State = state;
+        m_Response.clear();
+    }
+
+    void sendPage(size_t pos)
+    {
+        uint16_t address = (uint16_t) (m_AppStart + pos);
+        uint8_t size = (uint8_t) std::min<size_t>(m_PageSize, m_Image->size() - pos);
+        uint8_t header[] =
+        {
+            STK_LOAD_ADDRESS, (uint8_t) (address & 255), (uint8_t) (address >> 8), CRC_EOP,
+            STK_PROG_PAGE, 0, size, 'F'
+        };
+        m_Serial.hostWrite(header, sizeof(header));
+        m_Serial.hostWrite(&(*m_Image)[pos], size);
+        m_Serial.hostWrite(" ");
+    }
+
+    VirtualSerial& m_Serial;
+    bool m_LockStep;
+    const std::vector<uint8_t>* m_Image = nullptr;
+    uint16_t m_AppStart = 0;
+    uint8_t m_PageSize = 64;
+    State m_State = DONE;
+    std::vector<uint8_t> m_Response;
+    Nanos m_LastProgress = 0;
+    Nanos m_ProgramStart = 0;
+    Nanos m_ProgramEnd = 0;
+    Nanos m_PageSent = 0;
+    std::vector<Nanos> m_PageTimes;
+};
+
+struct Result
+{
+    std::string id;
+    bool ok = false;
+    size_t imageBytes = 0;
+    double seconds = 0;
+    double bytesPerSecond = 0;
+    double packetsPerPage = 0;
+    double framesPerPage = 0;
+    double pageMs[4] = {};      // 50th, 95th and 99th percentile and the longest
+    uint32_t maxRt = 0;
+    uint32_t resets = 0;
+};
+
+static double percentile(std::vector<Nanos> sorted, double fraction)
+{
+    if (sorted.empty())
+        return 0;
+    std::sort(sorted.begin(), sorted.end());
+    size_t index = std::min(sorted.size() - 1, (size_t) (fraction * sorted.size()));
+    return sorted[index] / 1e6;
+}
+
+static Result run(const TargetDevice& device, const Bitrate& bitrate, const Retries& retries, size_t imageSize,
+    const LinkProfile& profile, bool lockStep)
+{
+    Scheduler::instance().reset();
+    detachAllDevices();
+
+    VirtualEther ether;
+    ether.setSeed(1614);
+    GilbertElliott link(ether.random(), profile);
+    ether.setLinkModel(&link);
+    VirtualNrf24 bridgeRadio(ether, "bridge");
+    bridgeRadio.attach(CE_PIN, CSN_PIN);
+    VirtualTarget target(ether, device);
+    Result result;
+    if (!target.loadHex(MTNRF_BOOTLOADER_HEX))
+    {
+        printf("can't read %s\n", MTNRF_BOOTLOADER_HEX);
+        return result;
+    }
+    target.setRadioSetup(_BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH) | bitrate.bitrate);
+    target.timing().flashPageWrite = micros(profile.flashPageWriteUs);
+    target.powerOn();
+    uint16_t appStart = target.getAppStart();
+    imageSize = std::min<size_t>(imageSize, device.flashSize - appStart);
+
+    // the ProgrammingBridge sketch
+    VirtualSerial serial(500000);
+    Radio radio(CE_PIN, CSN_PIN);
+    BootLoader bootLoader(radio);
+    Console console(bootLoader);
+    Config config("001", 3, 50, bitrate.bitrate);
+    config.setRetries(retries.delay, retries.nrfRetries, retries.mcuRetries);
+    if (!radio.begin(config))
+    {
+        printf("radio not connected\n");
+        return result;
+    }
+    console.begin(serial);
+    // let the target time out into its application first
+    while (now() < millis(1500))
+    {
+        console.handle();
+        serial.hostRead();
+    }
+
+    std::mt19937 random((uint32_t) imageSize);
+    std::vector<uint8_t> image(imageSize);
+    for (uint8_t& b : image)
+        b = (uint8_t) random();
+
+    Host host(serial, lockStep);
+    host.start(image, appStart, device.pageSize);
+    VirtualNrf24::Stats before;
+    bool programming = false;
+    while (host.getState() < Host::DONE)
+    {
+        console.handle();
+        host.poll();
+        if (!programming && host.getState() == Host::PROGRAM)
+        {
+            before = bridgeRadio.getStats();
+            programming = true;
+        }
+    }
+    const VirtualNrf24::Stats after = bridgeRadio.getStats();
+    // the last page can still be going into flash when "Q" is answered
+    for (Nanos end = now() + millis(50); now() < end; )
+        console.handle();
+
+    result.imageBytes = imageSize;
+    result.ok = host.getState() == Host::DONE &&
+        memcmp(&target.flash()[appStart], image.data(), image.size()) == 0;
+    if (host.getPages())
+    {
+        result.seconds = (host.getProgramEnd() - host.getProgramStart()) / 1e9;
+        result.bytesPerSecond = result.seconds > 0 ? imageSize / result.seconds : 0;
+        result.packetsPerPage = (double) (after.txPackets - before.txPackets) / host.getPages();
+        result.framesPerPage = (double) (after.txFrames - before.txFrames) / host.getPages();
+        result.pageMs[0] = percentile(host.getPageTimes(), 0.50);
+        result.pageMs[1] = percentile(host.getPageTimes(), 0.95);
+        result.pageMs[2] = percentile(host.getPageTimes(), 0.99);
+        result.pageMs[3] = percentile(host.getPageTimes(), 1);
+    }
+    result.maxRt = after.maxRetries - before.maxRetries;
+    result.resets = target.getStats().resets;
+    return result;
+}
+
+static std::vector<std::string> split(const std::string& list)
+{
+    std::vector<std::string> items;
+    for (size_t pos = 0; pos <= list.size();)
+    {
+        size_t comma = std::min(list.find(',', pos), list.size());
+        if (comma > pos)
+            items.push_back(list.substr(pos, comma - pos));
+        pos = comma + 1;
+    }
+    return items;
+}
+
+// "id" and a number from one line of a results file
+static bool parseLine(const std::string& line, const char* key, std::string& id, double& value)
+{
+    size_t pos = line.find("\"id\": \"");
+    size_t end = pos == std::string::npos ? pos : line.find('"', pos + 7);
+    std::string field = std::string("\"") + key + "\": ";
+    size_t at = line.find(field);
+    if (end == std::string::npos || at == std::string::npos)
+        return false;
+    id = line.substr(pos + 7, end - pos - 7);
+    value = atof(line.c_str() + at + field.size());
+    return true;
+}
+
+// results that got more than 5% slower, or failed, since the baseline
+static bool compare(const char* filename, const std::vector<Result>& results)
+{
+    FILE* file = fopen(filename, "r");
+    if (!file)
+    {
+        printf("can't read %s\n", filename);
+        return false;
+    }
+    std::map<std::string, double> baseline;
+    char buf[1024];
+    while (fgets(buf, sizeof(buf), file))
+    {
+        std::string id;
+        double value;
+        if (parseLine(buf, "bytes_per_s", id, value))
+            baseline[id] = value;
+    }
+    fclose(file);
+
+    printf("\nCompared with %s\n", filename);
+    int regressions = 0, compared = 0;
+    for (const Result& result : results)
+    {
+        auto it = baseline.find(result.id);
+        if (it == baseline.end())
+            continue;
+        ++compared;
+        double change = it->second > 0 ? result.bytesPerSecond / it->second - 1 : 0;
+        if (change < -0.05 || (it->second > 0 && !result.ok))
+        {
+            printf("  %-28s %8.0f -> %8.0f bytes/s (%+.1f%%)%s\n", result.id.c_str(), it->second,
+                result.bytesPerSecond, change * 100, result.ok ? "" : " FAILED");
+            ++regressions;
+        }
+        else if (change > 0.05)
+        {
+            printf("  %-28s %8.0f -> %8.0f bytes/s (%+.1f%%)\n", result.id.c_str(), it->second,
+                result.bytesPerSecond, change * 100);
+        }
+    }
+    printf("  %d of %d results slower by more than 5%%\n", regressions, compared);
+    return regressions == 0;
+}
+
+int main(int argc, char* argv[])
+{
+    std::string bitrateList = "2M,1M,250K";
+    std::vector<Retries> retries;
+    std::string sizeList = "1024,4096,full";
+    std::string profileList = "clean,random,bursty,slownvm";
+    const TargetDevice* device = TargetDevice::find("ATtiny1614");
+    bool lockStep = false;
+    const char* output = "throughput.json";
+    const char* baseline = nullptr;
+    for (int i = 1; i < argc; ++i)
+    {
+        const char* option = argv[i];
+        if (strcmp(option, "-a") == 0)
+        {
+            lockStep = true;
+            continue;
+        }
+        const char* value = i + 1 < argc ? argv[++i] : "";
+        if (strcmp(option, "-b") == 0)
+        {
+            bitrateList = value;
+        }
+        else if (strcmp(option, "-i") == 0)
+        {
+            sizeList = value;
+        }
+        else if (strcmp(option, "-l") == 0)
+        {
+            profileList = value;
+        }
+        else if (strcmp(option, "-o") == 0)
+        {
+            output = value;
+        }
+        else if (strcmp(option, "-c") == 0)
+        {
+            baseline = value;
+        }
+        else if (strcmp(option, "-d") == 0)
+        {
+            device = TargetDevice::find(value);
+            if (!device)
+            {
+                printf("unknown device %s\n", value);
+                return 1;
+            }
+        }
+        else if (strcmp(option, "-r") == 0)
+        {
+            unsigned delay, nrf, mcu;
+            if (sscanf(value, "%u,%u,%u", &delay, &nrf, &mcu) != 3 || delay > 15 || nrf > 15 || mcu > 255)
+            {
+                printf("-r needs delay,nrfRetries,mcuRetries\n");
+                return 1;
+            }
+            retries.push_back({ (uint8_t) delay, (uint8_t) nrf, (uint8_t) mcu });
+        }
+        else
+        {
+            printf("unknown option %s\n", option);
+            return 1;
+        }
+    }
+    if (retries.empty())
+    {
+        // the sketch's settings, 1ms between retransmits, and few retries
+        retries.push_back({ 0, 15, 16 });
+        retries.push_back({ 3, 15, 16 });
+        retries.push_back({ 1, 5, 4 });
+    }
+
+    std::vector<const Bitrate*> rates;
+    for (const std::string& name : split(bitrateList))
+    {
+        auto it = std::find_if(std::begin(bitrates), std::end(bitrates), [&](const Bitrate& b) { return name == b.name; });
+        if (it == std::end(bitrates))
+        {
+            printf("unknown bitrate %s\n", name.c_str());
+            return 1;
+        }
+        rates.push_back(&*it);
+    }
+    std::vector<const LinkProfile*> links;
+    for (const std::string& name : split(profileList))
+    {
+        auto it = std::find_if(std::begin(profiles), std::end(profiles), [&](const LinkProfile& p) { return name == p.name; });
+        if (it == std::end(profiles))
+        {
+            printf("unknown link %s\n", name.c_str());
+            return 1;
+        }
+        links.push_back(&*it);
+    }
+    std::vector<size_t> sizes;
+    for (const std::string& size : split(sizeList))
+        sizes.push_back(size == "full" ? device->flashSize : (size_t) atoi(size.c_str()));
+
+    printf("%s%s\n", device->name, lockStep ? " (lock step host)" : "");
+    printf("%-5s %-9s %6s %-8s %-6s %9s %7s %7s %7s %7s %7s %7s %6s\n", "rate", "retries", "bytes", "link", "",
+        "bytes/s", "pkt/pg", "frm/pg", "p50 ms", "p95 ms", "p99 ms", "max ms", "maxrt");
+    std::vector<Result> results;
+    auto wallStart = std::chrono::steady_clock::now();
+    for (const Bitrate* rate : rates)
+    {
+        for (const Retries& r : retries)
+        {
+            char retryText[16];
+            snprintf(retryText, sizeof(retryText), "%u,%u,%u", r.delay, r.nrfRetries, r.mcuRetries);
+            if (r.delay < rate->minDelay)
+            {
+                // every packet would reach MAX_RT, that measures nothing
+                printf("%-5s %-9s skipped, the ack doesn't fit in the retransmit delay\n", rate->name, retryText);
+                continue;
+            }
+            for (size_t size : sizes)
+            {
+                for (const LinkProfile* link : links)
+                {
+                    Result result = run(*device, *rate, r, size, *link, lockStep);
+                    result.id = std::string(rate->name) + "/" + retryText + "/" + std::to_string(result.imageBytes) +
+                        "/" + link->name;
+                    printf("%-5s %-9s %6zu %-8s %-6s %9.0f %7.2f %7.2f %7.2f %7.2f %7.2f %7.2f %6u\n", rate->name,
+                        retryText, result.imageBytes, link->name, result.ok ? "OK" : "FAILED", result.bytesPerSecond,
+                        result.packetsPerPage, result.framesPerPage, result.pageMs[0], result.pageMs[1],
+                        result.pageMs[2], result.pageMs[3], result.maxRt);
+                    results.push_back(result);
+                }
+            }
+        }
+    }
+    printf("%zu runs in %.1fs\n", results.size(),
+        std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count());
+
+    FILE* file = fopen(output, "w");
+    if (!file)
+    {
+        printf("can't write %s\n", output);
+        return 1;
+    }
+    fprintf(file, "{\n  \"device\": \"%s\",\n  \"lock_step\": %s,\n  \"results\": [\n", device->name,
+        lockStep ? "true" : "false");
+    for (size_t i = 0; i < results.size(); ++i)
+    {
+        const Result& r = results[i];
+        fprintf(file, "    {\"id\": \"%s\", \"ok\": %s, \"image_bytes\": %zu, \"seconds\": %.4f, \"bytes_per_s\": %.1f, "
+            "\"packets_per_page\": %.3f, \"frames_per_page\": %.3f, \"page_ms_p50\": %.3f, \"page_ms_p95\": %.3f, "
+            "\"page_ms_p99\": %.3f, \"page_ms_max\": %.3f, \"max_rt\": %u, \"resets\": %u}%s\n",
+            r.id.c_str(), r.ok ? "true" : "false", r.imageBytes, r.seconds, r.bytesPerSecond, r.packetsPerPage,
+            r.framesPerPage, r.pageMs[0], r.pageMs[1], r.pageMs[2], r.pageMs[3], r.maxRt, r.resets,
+            i + 1 < results.size() ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+    fclose(file);
+    printf("results written to %s\n", output);
+
+    bool ok = std::all_of(results.begin(), results.end(), [](const Result& r) { return r.ok; });
+    if (!ok)
+        printf("some runs FAILED\n");
+    if (baseline && !compare(baseline, results))
+        ok = false;
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,324 @@
+// Runs the bridge's UART tunnel (Console tunnel mode with UartTunnel on the
+// target) over a simulated link and reports echo turnaround and throughput
+// in each direction, checking that every byte arrives once and in order.
+// Pass a packet loss probability (e.g. tunnelbench 0.05) to try a poor link.
+//
+// The target's application runs in between the bridge's calls into the
+// core, so it can't block without stopping the bridge too.  That rules out
+// the original UART mode, where the target answers with Radio::write().
+
+#include <megaTinyNrfConsole.h>
+#include <megaTinyNrfTunnel.h>
+#include <megaTinyNrfFastRadio.h>
+#include "VirtualSerial.h"
+#include "VirtualNrf24.h"
+#include <chrono>
+#include <string>
+#include <vector>
+
+using namespace mtnrf;
+using namespace mtnrf::host;
+
+static const uint8_t CE_PIN = 1;
+static const uint8_t CSN_PIN = 2;
+
+// drops frames (data and acks) independently with a fixed probability
+class RandomLoss : public LinkModel
+{
+public:
+    RandomLoss(std::mt19937& random, double probability) : m_Random(random), m_Loss(probability) {}
+    bool deliver(const AirPacket&, const VirtualNrf24&) override
+    {
+        return std::uniform_real_distribution<double>(0, 1)(m_Random) >= m_Loss;
+    }
+
+private:
+    std::mt19937& m_Random;
+    double m_Loss;
+};
+
+// letters only, so none of it looks like a STK500 or *cfg escape
+static uint8_t pattern(size_t i)
+{
+    return 'a' + (i * 7 + i / 26) % 26;
+}
+
+// the target's radio, driven straight through VirtualNrf24::command() like
+// the bootloader model so its SPI traffic can't get mixed up with the
+// bridge's when the application runs in the middle of a bridge command.
+// the command completes before virtual time moves on.
+class TargetRadio : public Radio
+{
+public:
+    TargetRadio(VirtualNrf24& radio) : Radio(0xFF, 0xFF, s_Bus), m_Nrf(radio) {}
+
+private:
+    static void busBegin(Radio& radio)
+    {
+        static_cast<TargetRadio&>(radio).m_Nrf.setCe(true);
+    }
+    static uint8_t busTransfer(Radio& radio, uint8_t cmd, const uint8_t* out, uint8_t* in, uint8_t count)
+    {
+        uint8_t data[33] = {};
+        if (out)
+            memcpy(data, out, count);
+        else
+            memset(data, NOP, count);
+        uint8_t status = static_cast<TargetRadio&>(radio).m_Nrf.command(cmd, data, count);
+        if (in)
+            memcpy(in, data, count);
+        // roughly FastRadio's cost, and polling loops need time to pass
+        advance(micros(2 + count));
+        return count ? data[count - 1] : status;
+    }
+    static void busCe(Radio& radio, uint8_t state)
+    {
+        static_cast<TargetRadio&>(radio).m_Nrf.setCe(state);
+    }
+
+    VirtualNrf24& m_Nrf;
+    static const RadioBus s_Bus;
+};
+
+const RadioBus TargetRadio::s_Bus = { &busBegin, &busTransfer, &busCe };
+
+// application on the target running its loop() every m_Interval
+class TargetApp : public Component
+{
+public:
+    enum eJob { ECHO, SINK, SOURCE };
+
+    TargetApp(VirtualEther& ether, Nanos interval)
+    :   m_NrfRadio(ether, "target")
+    ,   m_Radio(m_NrfRadio)
+    ,   m_Tunnel(m_Radio)
+    ,   m_Interval(interval)
+    {
+        Config config("001", 3, 50, RF24_2MBPS);
+        config.setRetries(0, 15, 0);
+        m_Radio.begin(config);
+        m_Tunnel.begin();
+        m_Next = now();
+        Scheduler::instance().add(this);
+    }
+    ~TargetApp() { Scheduler::instance().remove(this); }
+
+    void start(eJob job, size_t count)
+    {
+        m_Job = job;
+        m_Count = count;
+        m_Received.clear();
+        m_Sent = 0;
+    }
+    const std::vector<uint8_t>& received() const { return m_Received; }
+    size_t sent() const { return m_Sent; }
+
+    // the radio code below moves virtual time on, so don't get called again
+    // from inside it
+    Nanos nextEvent() const override { return m_Running ? NEVER : m_Next; }
+    void process(Nanos t) override
+    {
+        m_Running = true;
+        loop();
+        m_Next = std::max(t + m_Interval, now());
+        m_Running = false;
+    }
+
+private:
+    void loop()
+    {
+        while (m_Tunnel.available())
+        {
+            uint8_t c = m_Tunnel.read();
+            m_Received.push_back(c);
+            if (m_Job == ECHO)
+                m_Tunnel.write(c);
+        }
+        while (m_Job == SOURCE && m_Sent < m_Count && m_Tunnel.availableForWrite())
+            m_Tunnel.write(pattern(m_Sent++));
+    }
+
+    VirtualNrf24 m_NrfRadio;
+    TargetRadio m_Radio;
+    UartTunnel m_Tunnel;
+    Nanos m_Interval;
+    Nanos m_Next;
+    bool m_Running = false;
+    eJob m_Job = ECHO;
+    size_t m_Count = 0;
+    size_t m_Sent = 0;
+    std::vector<uint8_t> m_Received;
+};
+
+// ProgrammingBridge sketch with a PC on its serial port, using FastRadio
+struct Bridge
+{
+    VirtualSerial serial;
+    VirtualNrf24 nrfRadio;
+    FastRadio<CE_PIN, CSN_PIN> radio;
+    BootLoader bootLoader;
+    Console console;
+    std::string received;
+
+    Bridge(VirtualEther& ether)
+    :   serial(500000)
+    ,   nrfRadio(ether, "bridge")
+    ,   radio()
+    ,   bootLoader(radio)
+    ,   console(bootLoader)
+    {
+        nrfRadio.attach(CE_PIN, CSN_PIN);
+        Config config("001", 3, 50, RF24_2MBPS);
+        config.setRetries(0, 15, 16);
+        radio.begin(config);
+        console.begin(serial);
+        serial.hostWrite("tunnel 1\nq\n");
+        run(millis(50));
+        received.clear();
+    }
+    // one pass of loop() with the PC collecting what's come back
+    void loop()
+    {
+        console.handle();
+        int c;
+        while ((c = serial.hostRead()) >= 0)
+            received += (char) c;
+    }
+    void run(Nanos duration)
+    {
+        for (Nanos end = now() + duration; now() < end; )
+            loop();
+    }
+};
+
+static const Nanos TIMEOUT = millis(2000);
+
+static bool inOrder(const std::string& data, size_t count)
+{
+    if (data.size() != count)
+        return false;
+    for (size_t i = 0; i < count; ++i)
+        if ((uint8_t) data[i] != pattern(i))
+            return false;
+    return true;
+}
+
+static bool inOrder(const std::vector<uint8_t>& data, size_t count)
+{
+    return inOrder(std::string(data.begin(), data.end()), count);
+}
+
+static void report(const char* test, Nanos time, size_t bytes, bool ok)
+{
+    printf("%-24s %10.2f ms", test, time / 1e6);
+    if (bytes)
+        printf(" %9.0f", bytes / (time / 1e9));
+    else
+        printf(" %9s", "");
+    printf("  %s\n", ok ? "ok" : "FAILED");
+}
+
+// type a character and wait for it to come back, after 'idle' without traffic
+static Nanos echo(Bridge& bridge, uint8_t c, Nanos idle, bool& ok)
+{
+    bridge.run(idle);
+    bridge.received.clear();
+    bridge.serial.hostWrite(&c, 1);
+    Nanos start = now();
+    while (bridge.received.empty() && now() - start < TIMEOUT)
+        bridge.loop();
+    ok &= bridge.received.size() == 1 && (uint8_t) bridge.received[0] == c;
+    return now() - start;
+}
+
+static bool run(double loss, int echoes, size_t bulk)
+{
+    VirtualEther ether;
+    RandomLoss model(ether.random(), loss);
+    if (loss > 0)
+        ether.setLinkModel(&model);
+
+    TargetApp app(ether, micros(100));
+    Bridge bridge(ether);
+    bridge.nrfRadio.resetStats();
+    bool allOk = true;
+
+    // keystrokes one after the other, then after a pause
+    app.start(TargetApp::ECHO, 0);
+    Nanos total = 0;
+    Nanos worst = 0;
+    bool ok = true;
+    for (int i = 0; i < echoes; ++i)
+    {
+        Nanos time = echo(bridge, pattern(i), 0, ok);
+        total += time;
+        worst = std::max(worst, time);
+    }
+    report("echo, mean", total / echoes, 0, ok);
+    report("echo, worst", worst, 0, ok);
+    allOk &= ok;
+    total = 0;
+    for (int i = 0; i < echoes / 10; ++i)
+        total += echo(bridge, pattern(i), millis(50), ok);
+    report("echo after 50ms idle", total / (echoes / 10), 0, ok);
+    allOk &= ok;
+
+    // PC to application
+    app.start(TargetApp::SINK, 0);
+    std::string data;
+    for (size_t i = 0; i < bulk; ++i)
+        data += (char) pattern(i);
+    Nanos start = now();
+    bridge.serial.hostWrite(data.c_str());
+    while (app.received().size() < bulk && now() - start < TIMEOUT)
+        bridge.loop();
+    Nanos time = now() - start;
+    // anything duplicated would still be on its way
+    bridge.run(millis(200));
+    ok = inOrder(app.received(), bulk);
+    report("PC to target", time, bulk, ok);
+    allOk &= ok;
+
+    // application to PC
+    bridge.received.clear();
+    app.start(TargetApp::SOURCE, bulk);
+    start = now();
+    while (bridge.received.size() < bulk && now() - start < TIMEOUT)
+        bridge.loop();
+    time = now() - start;
+    bridge.run(millis(200));
+    ok = inOrder(bridge.received, bulk);
+    report("target to PC", time, bulk, ok);
+    allOk &= ok;
+
+    // both at once
+    bridge.received.clear();
+    app.start(TargetApp::SOURCE, bulk);
+    start = now();
+    bridge.serial.hostWrite(data.c_str());
+    while ((bridge.received.size() < bulk || app.received().size() < bulk) && now() - start < TIMEOUT)
+        bridge.loop();
+    time = now() - start;
+    bridge.run(millis(200));
+    ok = inOrder(bridge.received, bulk) && inOrder(app.received(), bulk);
+    report("both ways at once", time, 2 * bulk, ok);
+    allOk &= ok;
+
+    const VirtualNrf24::Stats& stats = bridge.nrfRadio.getStats();
+    printf("\n%u frames, %u retransmits, %u MAX_RT, %u ack payloads received\n",
+        stats.txFrames, stats.retransmits, stats.maxRetries, stats.ackPayloadsReceived);
+    return allOk;
+}
+
+int main(int argc, char* argv[])
+{
+    double loss = argc > 1 ? atof(argv[1]) : 0;
+    auto wallStart = std::chrono::steady_clock::now();
+
+    printf("%-24s %13s %9s\n", "test", "time", "bytes/s");
+    bool ok = run(loss, 100, 4096);
+
+    double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    printf("simulated %.3fs of radio time in %.3fs\n", now() / 1e9, wall);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,326 @@
+#include "Arduino.h"
+#include "SPI.h"
+#include "HostDevices.h"
+#include <vector>
+
+using namespace mtnrf::host;
+
+namespace {
+
+struct PinBinding
+{
+    uint8_t pin;
+    PinListener* listener;
+};
+
+std::vector<PinBinding>& pinBindings()
+{
+    static std::vector<PinBinding> bindings;
+    return bindings;
+}
+
+std::vector<SpiDevice*>& spiDevices()
+{
+    static std::vector<SpiDevice*> devices;
+    return devices;
+}
+
+uint8_t pinLevels[256];
+
+struct InterruptBinding
+{
+    uint8_t pin;
+    void (*isr)();
+    int mode;
+    bool pending;
+};
+
+std::vector<InterruptBinding>& interruptBindings()
+{
+    static std::vector<InterruptBinding> bindings;
+    return bindings;
+}
+
+int interruptsDisabled = 0;
+bool inInterrupt = false;
+
+// run the handlers of any interrupts that have been raised and aren't held off
+void runInterrupts()
+{
+    if (inInterrupt || interruptsDisabled)
+        return;
+    inInterrupt = true;
+    for (size_t i = 0; i < interruptBindings().size(); ++i)
+    {
+        InterruptBinding& binding = interruptBindings()[i];
+        if (binding.pending && !SPI.blocksInterrupt(binding.pin))
+        {
+            binding.pending = false;
+            binding.isr();
+        }
+    }
+    inInterrupt = false;
+}
+
+} // namespace
+
+namespace mtnrf {
+namespace host {
+
+void attachPin(uint8_t pin, PinListener* listener)
+{
+    pinBindings().push_back({ pin, listener });
+}
+
+void setPinLevel(uint8_t pin, uint8_t level)
+{
+    uint8_t old = pinLevels[pin];
+    pinLevels[pin] = level;
+    if (old == level)
+        return;
+    for (InterruptBinding& binding : interruptBindings())
+    {
+        if (binding.pin == pin &&
+            (binding.mode == CHANGE || (binding.mode == FALLING) == (level == LOW)))
+            binding.pending = true;
+    }
+}
+
+void attachSpiDevice(SpiDevice* device)
+{
+    spiDevices().push_back(device);
+}
+
+void detachAllDevices()
+{
+    pinBindings().clear();
+    spiDevices().clear();
+    interruptBindings().clear();
+    Scheduler::instance().setInterruptHook(nullptr);
+}
+
+SpiStats& spiStats()
+{
+    static SpiStats stats;
+    return stats;
+}
+
+} // namespace host
+} // namespace mtnrf
+
+///////////////////////////////////////////////////////////////////////////////
+// time
+
+unsigned long millis()
+{
+    advance(coreCosts().millisCall);
+    return (unsigned long) (now() / 1000000);
+}
+
+unsigned long micros()
+{
+    advance(coreCosts().millisCall);
+    return (unsigned long) (now() / 1000);
+}
+
+void delay(unsigned long ms)
+{
+    advance(mtnrf::host::millis(ms));
+}
+
+void delayMicroseconds(unsigned int us)
+{
+    advance(mtnrf::host::micros(us));
+}
+
+void yield()
+{
+    advance(coreCosts().streamCall);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// pins
+
+void pinMode(uint8_t pin, uint8_t mode)
+{
+    (void) pin;
+    (void) mode;
+    advance(coreCosts().digitalWrite);
+}
+
+static void writePin(uint8_t pin, uint8_t value)
+{
+    value = value ? HIGH : LOW;
+    pinLevels[pin] = value;
+    for (const PinBinding& binding : pinBindings())
+        if (binding.pin == pin)
+            binding.listener->onPinChange(pin, value);
+    runInterrupts();
+}
+
+void digitalWrite(uint8_t pin, uint8_t value)
+{
+    advance(coreCosts().digitalWrite);
+    writePin(pin, value);
+}
+
+void digitalWriteFast(uint8_t pin, uint8_t value)
+{
+    advance(coreCosts().digitalWriteFast);
+    writePin(pin, value);
+}
+
+int digitalRead(uint8_t pin)
+{
+    advance(coreCosts().digitalWrite);
+    return pinLevels[pin];
+}
+
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode)
+{
+    detachInterrupt(interrupt);
+    interruptBindings().push_back({ interrupt, isr, mode, false });
+    Scheduler::instance().setInterruptHook(runInterrupts);
+}
+
+void detachInterrupt(uint8_t interrupt)
+{
+    auto& bindings = interruptBindings();
+    for (size_t i = 0; i < bindings.size(); ++i)
+        if (bindings[i].pin == interrupt)
+            bindings.erase(bindings.begin() + i--);
+}
+
+void noInterrupts()
+{
+    ++interruptsDisabled;
+}
+
+void interrupts()
+{
+    if (interruptsDisabled > 0)
+        --interruptsDisabled;
+    runInterrupts();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SPI
+
+SPIClass SPI;
+
+void SPIClass::beginTransaction(const SPISettings& settings)
+{
+    advance(coreCosts().spiBeginTransaction);
+    m_Clock = settings.m_Clock;
+    if (m_Clock > coreCosts().spiMaxClock)
+        m_Clock = coreCosts().spiMaxClock;
+    ++spiStats().transactions;
+    m_InTransaction = true;
+}
+
+void SPIClass::endTransaction()
+{
+    m_InTransaction = false;
+    advance(coreCosts().spiEndTransaction);
+    runInterrupts();
+}
+
+void SPIClass::usingInterrupt(uint8_t interrupt)
+{
+    if (!blocksInterrupt(interrupt) && m_NumInterrupts < sizeof(m_Interrupts))
+        m_Interrupts[m_NumInterrupts++] = interrupt;
+}
+
+void SPIClass::notUsingInterrupt(uint8_t interrupt)
+{
+    for (uint8_t i = 0; i < m_NumInterrupts; ++i)
+        if (m_Interrupts[i] == interrupt)
+            m_Interrupts[i--] = m_Interrupts[--m_NumInterrupts];
+}
+
+bool SPIClass::blocksInterrupt(uint8_t interrupt) const
+{
+    if (!m_InTransaction)
+        return false;
+    for (uint8_t i = 0; i < m_NumInterrupts; ++i)
+        if (m_Interrupts[i] == interrupt)
+            return true;
+    return false;
+}
+
+uint8_t SPIClass::transfer(uint8_t data)
+{
+    ++spiStats().bytes;
+    uint8_t result = 0xFF;
+    for (SpiDevice* device : spiDevices())
+        if (device->spiSelected())
+            result = device->spiTransfer(data);
+    advance(coreCosts().spiByteOverhead + 8000000000ull / m_Clock);
+    return result;
+}
+
+uint8_t SPIClass::transferRaw(uint8_t data, uint32_t clock)
+{
+    if (clock > coreCosts().spiMaxClock)
+        clock = coreCosts().spiMaxClock;
+    ++spiStats().bytes;
+    uint8_t result = 0xFF;
+    for (SpiDevice* device : spiDevices())
+        if (device->spiSelected())
+            result = device->spiTransfer(data);
+    advance(coreCosts().spiRegisterOverhead + 8000000000ull / clock);
+    return result;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// Print / Stream
+
+size_t Print::write(const uint8_t* buffer, size_t size)
+{
+    size_t n = 0;
+    while (size--)
+        n += write(*buffer++);
+    return n;
+}
+
+size_t Print::print(long n, int base)
+{
+    if (n < 0 && base == DEC)
+        return print('-') + print((unsigned long) -n, base);
+    return print((unsigned long) n, base);
+}
+
+size_t Print::print(unsigned long n, int base)
+{
+    char buf[8 * sizeof(long) + 1];
+    char* str = &buf[sizeof(buf) - 1];
+    *str = 0;
+    if (base < 2)
+        base = 10;
+    do {
+        unsigned long digit = n % base;
+        n /= base;
+        *--str = digit < 10 ? '0' + digit : 'A' + digit - 10;
+    } while (n);
+    return write(str);
+}
+
+size_t Print::print(double n, int digits)
+{
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%.*f", digits, n);
+    return write(buf);
+}
+
+size_t Stream::readBytes(uint8_t* buffer, size_t length)
+{
+    size_t n = 0;
+    while (n < length)
+    {
+        int c = read();
+        if (c < 0)
+            break;
+        buffer[n++] = (uint8_t) c;
+    }
+    return n;
+}
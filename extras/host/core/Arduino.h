@@ -0,0 +1,148 @@
+#pragma once
+
+// Minimal stand-in for the Arduino core so the mtnrf library can be built and
+// run on a Linux host.  Time is virtual (see VirtualTime.h) and pins/SPI are
+// routed to simulated devices instead of hardware.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+
+#define HOST_BUILD 1
+
+#define HIGH 1
+#define LOW 0
+#define INPUT 0
+#define OUTPUT 1
+#define INPUT_PULLUP 2
+
+#define CHANGE 1
+#define FALLING 2
+#define RISING 3
+
+#define DEC 10
+#define HEX 16
+#define OCT 8
+#define BIN 2
+
+#ifndef _BV
+#define _BV(bit) (1 << (bit))
+#endif
+
+typedef uint8_t byte;
+typedef bool boolean;
+
+///////////////////////////////////////////////////////////////////////////////
+// program memory (flat address space on the host)
+
+#define PROGMEM
+#define PGM_P const char*
+#define PSTR(s) (s)
+#define pgm_read_byte(addr) (*(const uint8_t*)(addr))
+#define pgm_read_word(addr) (*(const uint16_t*)(addr))
+#define memcpy_P memcpy
+#define strcpy_P strcpy
+#define strlen_P strlen
+#define strncmp_P strncmp
+#define sprintf_P sprintf
+#define snprintf_P snprintf
+
+class __FlashStringHelper;
+#define F(string_literal) (reinterpret_cast<const __FlashStringHelper*>(PSTR(string_literal)))
+
+///////////////////////////////////////////////////////////////////////////////
+// time and pins
+
+unsigned long millis();
+unsigned long micros();
+void delay(unsigned long ms);
+void delayMicroseconds(unsigned int us);
+void yield();
+
+void pinMode(uint8_t pin, uint8_t mode);
+void digitalWrite(uint8_t pin, uint8_t value);
+// megaTinyCore's single instruction write for pins known at compile time
+void digitalWriteFast(uint8_t pin, uint8_t value);
+int digitalRead(uint8_t pin);
+
+// interrupts run between simulated events, never in the middle of an SPI
+// transaction that has declared them with SPI.usingInterrupt()
+#define digitalPinToInterrupt(pin) (pin)
+void attachInterrupt(uint8_t interrupt, void (*isr)(), int mode);
+void detachInterrupt(uint8_t interrupt);
+void noInterrupts();
+void interrupts();
+
+///////////////////////////////////////////////////////////////////////////////
+// String
+
+class String
+{
+public:
+    String() {}
+    String(const char* str) : m_Str(str ? str : "") {}
+    String(const __FlashStringHelper* str) : m_Str(reinterpret_cast<const char*>(str)) {}
+    String(char c) : m_Str(1, c) {}
+
+    String& operator=(const char* str) { m_Str = str ? str : ""; return *this; }
+    String& operator+=(char c) { m_Str += c; return *this; }
+    String& operator+=(const char* str) { m_Str += str; return *this; }
+    String& operator+=(const String& str) { m_Str += str.m_Str; return *this; }
+    bool operator==(const char* str) const { return m_Str == str; }
+    char operator[](unsigned int index) const { return index < m_Str.size() ? m_Str[index] : 0; }
+
+    unsigned int length() const { return (unsigned int) m_Str.size(); }
+    const char* c_str() const { return m_Str.c_str(); }
+    bool startsWith(const String& prefix) const { return m_Str.compare(0, prefix.m_Str.size(), prefix.m_Str) == 0; }
+    int indexOf(char c) const { size_t i = m_Str.find(c); return i == std::string::npos ? -1 : (int) i; }
+    long toInt() const { return atol(m_Str.c_str()); }
+
+private:
+    std::string m_Str;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// Print / Stream
+
+class Print
+{
+public:
+    virtual ~Print() {}
+    virtual size_t write(uint8_t c) = 0;
+    virtual size_t write(const uint8_t* buffer, size_t size);
+    size_t write(const char* str) { return str ? write((const uint8_t*) str, strlen(str)) : 0; }
+    size_t write(const char* buffer, size_t size) { return write((const uint8_t*) buffer, size); }
+    virtual int availableForWrite() { return 0; }
+    virtual void flush() {}
+
+    size_t print(const __FlashStringHelper* str) { return write(reinterpret_cast<const char*>(str)); }
+    size_t print(const String& str) { return write(str.c_str()); }
+    size_t print(const char* str) { return write(str); }
+    size_t print(char c) { return write((uint8_t) c); }
+    size_t print(unsigned char n, int base = DEC) { return print((unsigned long) n, base); }
+    size_t print(int n, int base = DEC) { return print((long) n, base); }
+    size_t print(unsigned int n, int base = DEC) { return print((unsigned long) n, base); }
+    size_t print(long n, int base = DEC);
+    size_t print(unsigned long n, int base = DEC);
+    size_t print(double n, int digits = 2);
+
+    size_t println() { return write("\r\n"); }
+    template<class T>
+    size_t println(const T& value) { size_t n = print(value); return n + println(); }
+    template<class T>
+    size_t println(const T& value, int format) { size_t n = print(value, format); return n + println(); }
+};
+
+class Stream : public Print
+{
+public:
+    virtual int available() = 0;
+    virtual int read() = 0;
+    virtual int peek() = 0;
+    size_t readBytes(uint8_t* buffer, size_t length);
+};
+
+#include "VirtualTime.h"
@@ -0,0 +1,42 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace mtnrf {
+namespace host {
+
+// receives digitalWrite() calls for the pins it is attached to
+class PinListener
+{
+public:
+    virtual ~PinListener() {}
+    virtual void onPinChange(uint8_t pin, uint8_t level) = 0;
+};
+
+// device on the simulated SPI bus, addressed while its chip select is low
+class SpiDevice
+{
+public:
+    virtual ~SpiDevice() {}
+    virtual bool spiSelected() const = 0;
+    virtual uint8_t spiTransfer(uint8_t data) = 0;
+};
+
+void attachPin(uint8_t pin, PinListener* listener);
+// drive an input pin from a simulated device (an nRF24L01+ IRQ line), which
+// triggers any interrupt attached to the pin
+void setPinLevel(uint8_t pin, uint8_t level);
+void attachSpiDevice(SpiDevice* device);
+// remove all pin listeners and SPI devices
+void detachAllDevices();
+
+struct SpiStats
+{
+    uint32_t transactions = 0;
+    uint32_t bytes = 0;
+};
+
+SpiStats& spiStats();
+
+} // namespace host
+} // namespace mtnrf
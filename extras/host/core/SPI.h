@@ -0,0 +1,48 @@
+#pragma once
+
+#include "Arduino.h"
+
+#define MSBFIRST 1
+#define LSBFIRST 0
+#define SPI_MODE0 0x00
+#define SPI_MODE1 0x04
+#define SPI_MODE2 0x08
+#define SPI_MODE3 0x0C
+
+class SPISettings
+{
+public:
+    SPISettings(uint32_t clock = 4000000, uint8_t bitOrder = MSBFIRST, uint8_t dataMode = SPI_MODE0)
+    :   m_Clock(clock)
+    {
+        (void) bitOrder;
+        (void) dataMode;
+    }
+    uint32_t m_Clock;
+};
+
+// SPI bus routed to whichever simulated device currently has chip select low
+class SPIClass
+{
+public:
+    void begin() {}
+    void end() {}
+    void beginTransaction(const SPISettings& settings);
+    void endTransaction();
+    uint8_t transfer(uint8_t data);
+    // stands in for writing and reading SPI0.DATA directly, as FastRadio does
+    uint8_t transferRaw(uint8_t data, uint32_t clock);
+    // hold off this interrupt while a transaction is in progress
+    void usingInterrupt(uint8_t interrupt);
+    void notUsingInterrupt(uint8_t interrupt);
+
+    bool blocksInterrupt(uint8_t interrupt) const;
+
+private:
+    uint32_t m_Clock = 4000000;
+    bool m_InTransaction = false;
+    uint8_t m_Interrupts[8] = {};
+    uint8_t m_NumInterrupts = 0;
+};
+
+extern SPIClass SPI;
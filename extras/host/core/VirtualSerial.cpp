@@ -0,0 +1,148 @@
+#include "VirtualSerial.h"
+#include <string.h>
+
+namespace mtnrf {
+namespace host {
+
+VirtualSerial::VirtualSerial(uint32_t baud, uint16_t rxBufferSize, uint16_t txBufferSize, bool flowControl)
+:   m_RxBufferSize(rxBufferSize)
+,   m_TxBufferSize(txBufferSize)
+,   m_FlowControl(flowControl)
+{
+    begin(baud);
+}
+
+void VirtualSerial::begin(uint32_t baud)
+{
+    // 8N1: 10 bits per byte
+    m_ByteTime = 10 * 1000000000ull / baud;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// PC side
+
+void VirtualSerial::hostWrite(const void* data, size_t size)
+{
+    if (m_Pending.empty() && m_NextArrival < now() + m_ByteTime)
+        m_NextArrival = now() + m_ByteTime;
+    const uint8_t* u8data = (const uint8_t*) data;
+    m_Pending.insert(m_Pending.end(), u8data, u8data + size);
+}
+
+void VirtualSerial::hostWrite(const char* str)
+{
+    hostWrite(str, strlen(str));
+}
+
+size_t VirtualSerial::hostAvailable()
+{
+    size_t count = 0;
+    Nanos t = now();
+    for (const TimedByte& b : m_TxLine)
+    {
+        if (b.arrival > t)
+            break;
+        ++count;
+    }
+    return count;
+}
+
+int VirtualSerial::hostRead()
+{
+    if (m_TxLine.empty() || m_TxLine.front().arrival > now())
+        return -1;
+    uint8_t value = m_TxLine.front().value;
+    m_TxLine.pop_front();
+    return value;
+}
+
+bool VirtualSerial::hostWriteComplete()
+{
+    receive();
+    return m_Pending.empty() && m_RxBuffer.empty();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// device side
+
+void VirtualSerial::receive()
+{
+    Nanos t = now();
+    while (!m_Pending.empty() && m_NextArrival <= t)
+    {
+        if (m_RxBuffer.size() < m_RxBufferSize)
+        {
+            m_RxBuffer.push_back(m_Pending.front());
+            ++m_BytesToDevice;
+        }
+        else if (m_FlowControl)
+        {
+            // held off until there is room again
+            m_NextArrival = t + m_ByteTime;
+            break;
+        }
+        else
+        {
+            ++m_Overruns;
+        }
+        m_Pending.pop_front();
+        m_NextArrival += m_ByteTime;
+    }
+}
+
+int VirtualSerial::available()
+{
+    advance(coreCosts().streamCall);
+    receive();
+    return (int) m_RxBuffer.size();
+}
+
+int VirtualSerial::read()
+{
+    advance(coreCosts().streamCall);
+    receive();
+    if (m_RxBuffer.empty())
+        return -1;
+    uint8_t value = m_RxBuffer.front();
+    m_RxBuffer.pop_front();
+    return value;
+}
+
+int VirtualSerial::peek()
+{
+    advance(coreCosts().streamCall);
+    receive();
+    return m_RxBuffer.empty() ? -1 : m_RxBuffer.front();
+}
+
+int VirtualSerial::availableForWrite()
+{
+    advance(coreCosts().streamCall);
+    Nanos t = now();
+    int inFlight = 0;
+    for (auto it = m_TxLine.rbegin(); it != m_TxLine.rend() && it->arrival > t; ++it)
+        ++inFlight;
+    return inFlight < m_TxBufferSize ? m_TxBufferSize - inFlight : 0;
+}
+
+size_t VirtualSerial::write(uint8_t c)
+{
+    // block while the transmit buffer is full
+    while (availableForWrite() == 0)
+        advanceTo(m_TxLine[m_TxLine.size() - m_TxBufferSize].arrival);
+    Nanos start = m_TxLineFree > now() ? m_TxLineFree : now();
+    m_TxLineFree = start + m_ByteTime;
+    m_TxLine.push_back({ m_TxLineFree, c });
+    ++m_BytesToHost;
+    return 1;
+}
+
+void VirtualSerial::flush()
+{
+    advance(coreCosts().streamCall);
+    if (m_TxLineFree > now())
+        advanceTo(m_TxLineFree);
+}
+
+} // namespace host
+} // namespace mtnrf
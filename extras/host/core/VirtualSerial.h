@@ -0,0 +1,72 @@
+#pragma once
+
+#include "Arduino.h"
+#include <deque>
+
+namespace mtnrf {
+namespace host {
+
+// Stand-in for a serial port connected to a PC.  Bytes travel at the baud
+// rate in both directions.  With flow control (USB CDC bridges, TCP) the PC
+// is held off while the receive buffer is full, otherwise bytes arriving at
+// a full buffer are dropped like a UART overrun.  Writes block once the
+// transmit buffer is full, as HardwareSerial does.
+class VirtualSerial : public Stream
+{
+public:
+    explicit VirtualSerial(uint32_t baud = 500000, uint16_t rxBufferSize = 64,
+        uint16_t txBufferSize = 64, bool flowControl = true);
+
+    void begin(uint32_t baud);
+
+    ///////////////////////////////////////////////////////////////////////////
+    // PC side
+
+    void hostWrite(const void* data, size_t size);
+    void hostWrite(const char* str);
+    // bytes that have reached the PC
+    size_t hostAvailable();
+    int hostRead();
+    // true once everything the PC wrote has been read by the device
+    bool hostWriteComplete();
+    uint32_t getOverruns() const { return m_Overruns; }
+    uint64_t getBytesToDevice() const { return m_BytesToDevice; }
+    uint64_t getBytesToHost() const { return m_BytesToHost; }
+
+    ///////////////////////////////////////////////////////////////////////////
+    // Stream
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    size_t write(uint8_t c) override;
+    using Print::write;
+    int availableForWrite() override;
+    void flush() override;
+
+private:
+    struct TimedByte
+    {
+        Nanos arrival;
+        uint8_t value;
+    };
+    void receive();
+
+    Nanos m_ByteTime;
+    uint16_t m_RxBufferSize;
+    uint16_t m_TxBufferSize;
+    bool m_FlowControl;
+
+    std::deque<uint8_t> m_Pending;      // written by the PC, not yet received
+    Nanos m_NextArrival = 0;
+    std::deque<uint8_t> m_RxBuffer;
+    std::deque<TimedByte> m_TxLine;     // written by the device, on the way to the PC
+    Nanos m_TxLineFree = 0;
+
+    uint32_t m_Overruns = 0;
+    uint64_t m_BytesToDevice = 0;
+    uint64_t m_BytesToHost = 0;
+};
+
+} // namespace host
+} // namespace mtnrf
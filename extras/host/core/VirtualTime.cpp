@@ -0,0 +1,95 @@
+#include "VirtualTime.h"
+#include <algorithm>
+
+namespace mtnrf {
+namespace host {
+
+Scheduler& Scheduler::instance()
+{
+    static Scheduler scheduler;
+    return scheduler;
+}
+
+CoreCosts& coreCosts()
+{
+    static CoreCosts costs;
+    return costs;
+}
+
+void Scheduler::add(Component* component)
+{
+    if (std::find(m_Components.begin(), m_Components.end(), component) == m_Components.end())
+        m_Components.push_back(component);
+}
+
+void Scheduler::remove(Component* component)
+{
+    m_Components.erase(std::remove(m_Components.begin(), m_Components.end(), component), m_Components.end());
+}
+
+Component* Scheduler::nextComponent(Nanos limit, Nanos& when) const
+{
+    Component* next = nullptr;
+    when = limit;
+    for (Component* component : m_Components)
+    {
+        Nanos t = component->nextEvent();
+        if (t <= when && (next == nullptr || t < when))
+        {
+            when = t;
+            next = component;
+        }
+    }
+    return next;
+}
+
+void Scheduler::advanceTo(Nanos time)
+{
+    if (time < m_Now)
+        return;
+    for (;;)
+    {
+        Nanos when;
+        Component* next = nextComponent(time, when);
+        if (!next)
+            break;
+        if (when > m_Now)
+            m_Now = when;
+        next->process(m_Now);
+        // an interrupt handler may take us past 'time'
+        if (m_InterruptHook)
+            m_InterruptHook();
+    }
+    if (time > m_Now)
+        m_Now = time;
+}
+
+void Scheduler::advance(Nanos duration)
+{
+    advanceTo(m_Now + duration);
+}
+
+void Scheduler::runUntilIdle(Nanos limit)
+{
+    for (;;)
+    {
+        Nanos when;
+        Component* next = nextComponent(limit, when);
+        if (!next)
+            break;
+        if (when > m_Now)
+            m_Now = when;
+        next->process(m_Now);
+        if (m_InterruptHook)
+            m_InterruptHook();
+    }
+}
+
+void Scheduler::reset()
+{
+    m_Components.clear();
+    m_Now = 0;
+}
+
+} // namespace host
+} // namespace mtnrf
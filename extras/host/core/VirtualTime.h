@@ -0,0 +1,82 @@
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+namespace mtnrf {
+namespace host {
+
+// virtual time in nanoseconds since the simulation started
+typedef uint64_t Nanos;
+
+static const Nanos NEVER = ~(Nanos)0;
+
+inline constexpr Nanos micros(uint64_t us) { return us * 1000; }
+inline constexpr Nanos millis(uint64_t ms) { return ms * 1000000; }
+
+// something that changes state on its own as virtual time passes (radios,
+// target device models...).  the scheduler calls process() whenever the
+// time returned by nextEvent() is reached.
+class Component
+{
+public:
+    virtual ~Component() {}
+    // time of the next internal state change (or NEVER)
+    virtual Nanos nextEvent() const = 0;
+    // handle all state changes due at or before 'now'
+    virtual void process(Nanos now) = 0;
+};
+
+// single threaded discrete event clock.  time only moves forward when the
+// code under test calls into the stand-in Arduino core (delay(), SPI
+// transfers, digitalWrite, serial polling...) so a simulation runs as fast
+// as the host can execute it.
+class Scheduler
+{
+public:
+    static Scheduler& instance();
+
+    Nanos now() const { return m_Now; }
+    void add(Component* component);
+    void remove(Component* component);
+    // run all events up to now + duration
+    void advance(Nanos duration);
+    void advanceTo(Nanos time);
+    // run events until nothing more is scheduled before 'limit'
+    void runUntilIdle(Nanos limit);
+    // forget all components and restart the clock at zero
+    void reset();
+    // called after each event so pin interrupts it raised run on time
+    void setInterruptHook(void (*hook)()) { m_InterruptHook = hook; }
+
+private:
+    Component* nextComponent(Nanos limit, Nanos& when) const;
+
+    Nanos m_Now = 0;
+    void (*m_InterruptHook)() = nullptr;
+    std::vector<Component*> m_Components;
+};
+
+// approximate CPU cost of the core functions used by the library, charged to
+// virtual time on every call.  defaults are for a 20MHz tinyAVR bridge.
+struct CoreCosts
+{
+    Nanos digitalWrite = micros(2);
+    Nanos digitalWriteFast = 50;
+    Nanos spiBeginTransaction = 750;
+    Nanos spiEndTransaction = 500;
+    Nanos spiByteOverhead = 400;
+    Nanos spiRegisterOverhead = 150;
+    uint32_t spiMaxClock = 10000000;
+    Nanos streamCall = 300;
+    Nanos millisCall = 250;
+};
+
+CoreCosts& coreCosts();
+
+inline Nanos now() { return Scheduler::instance().now(); }
+inline void advance(Nanos duration) { Scheduler::instance().advance(duration); }
+inline void advanceTo(Nanos time) { Scheduler::instance().advanceTo(time); }
+
+} // namespace host
+} // namespace mtnrf
@@ -0,0 +1,629 @@
+#include "AvrCpu.h"
+
+namespace mtnrf {
+namespace host {
+
+enum { FLAG_C, FLAG_Z, FLAG_N, FLAG_V, FLAG_S, FLAG_H, FLAG_T, FLAG_I };
+
+// CPU registers in the I/O space
+enum
+{
+    CPU_CCP = 0x34,
+    CPU_SPL = 0x3D,
+    CPU_SPH = 0x3E,
+    CPU_SREG = 0x3F,
+};
+
+static const uint8_t CCP_SPM = 0x9D;
+static const uint8_t CCP_IOREG = 0xD8;
+
+// pointer registers
+enum { REG_X = 26, REG_Y = 28, REG_Z = 30 };
+
+AvrCpu::AvrCpu(AvrBus& bus, uint16_t flashSize)
+:   m_Bus(bus)
+,   m_PcMask(flashSize / 2 - 1)
+{
+}
+
+void AvrCpu::reset(uint16_t ramEnd)
+{
+    m_Pc = 0;
+    m_Sp = ramEnd;
+    m_Sreg = 0;
+    m_CcpCount = 0;
+}
+
+uint16_t AvrCpu::fetch(uint16_t pc) const
+{
+    pc &= m_PcMask;
+    return m_Bus.readFlash(pc * 2) | (m_Bus.readFlash(pc * 2 + 1) << 8);
+}
+
+uint8_t AvrCpu::load(uint16_t address)
+{
+    switch (address)
+    {
+    case CPU_CCP:
+        return 0;
+    case CPU_SPL:
+        return m_Sp & 255;
+    case CPU_SPH:
+        return m_Sp >> 8;
+    case CPU_SREG:
+        return m_Sreg;
+    }
+    return m_Bus.read(address);
+}
+
+void AvrCpu::store(uint16_t address, uint8_t value)
+{
+    switch (address)
+    {
+    case CPU_CCP:
+        if (value == CCP_SPM || value == CCP_IOREG)
+        {
+            m_Ccp = value;
+            // counted down at the end of this instruction as well
+            m_CcpCount = 5;
+        }
+        return;
+    case CPU_SPL:
+        m_Sp = (m_Sp & 0xFF00) | value;
+        return;
+    case CPU_SPH:
+        m_Sp = (m_Sp & 0x00FF) | (value << 8);
+        return;
+    case CPU_SREG:
+        m_Sreg = value;
+        return;
+    }
+    m_Bus.write(address, value);
+}
+
+void AvrCpu::push(uint8_t value)
+{
+    store(m_Sp--, value);
+}
+
+uint8_t AvrCpu::pop()
+{
+    return load(++m_Sp);
+}
+
+void AvrCpu::setPair(uint8_t r, uint16_t value)
+{
+    m_R[r] = value & 255;
+    m_R[r + 1] = value >> 8;
+}
+
+bool AvrCpu::isTwoWord(uint16_t op) const
+{
+    // lds/sts, jmp/call
+    return (op & 0xFC0F) == 0x9000 || (op & 0xFE0C) == 0x940C;
+}
+
+uint8_t AvrCpu::skip()
+{
+    uint8_t words = isTwoWord(fetch(m_Pc)) ? 2 : 1;
+    m_Pc += words;
+    return words;
+}
+
+void AvrCpu::setFlag(uint8_t bit, bool value)
+{
+    m_Sreg = value ? m_Sreg | (1 << bit) : m_Sreg & ~(1 << bit);
+}
+
+// N, Z and S from the result with V already set
+void AvrCpu::setNZS(uint8_t result)
+{
+    setFlag(FLAG_N, result & 0x80);
+    setFlag(FLAG_Z, result == 0);
+    setFlag(FLAG_S, flag(FLAG_N) != flag(FLAG_V));
+}
+
+uint8_t AvrCpu::add(uint8_t a, uint8_t b, bool carry)
+{
+    uint8_t result = a + b + carry;
+    uint8_t carries = (a & b) | (b & ~result) | (~result & a);
+    setFlag(FLAG_H, carries & 0x08);
+    setFlag(FLAG_C, carries & 0x80);
+    setFlag(FLAG_V, ((a & b & ~result) | (~a & ~b & result)) & 0x80);
+    setNZS(result);
+    return result;
+}
+
+// sbc, sbci and cpc only ever clear Z so multi-byte compares work
+uint8_t AvrCpu::sub(uint8_t a, uint8_t b, bool carry, bool keepZero)
+{
+    uint8_t result = a - b - carry;
+    uint8_t borrows = (~a & b) | (b & result) | (result & ~a);
+    bool zero = flag(FLAG_Z);
+    setFlag(FLAG_H, borrows & 0x08);
+    setFlag(FLAG_C, borrows & 0x80);
+    setFlag(FLAG_V, ((a & ~b & ~result) | (~a & b & result)) & 0x80);
+    setNZS(result);
+    if (keepZero)
+        setFlag(FLAG_Z, result == 0 && zero);
+    return result;
+}
+
+uint8_t AvrCpu::logic(uint8_t result)
+{
+    setFlag(FLAG_V, false);
+    setNZS(result);
+    return result;
+}
+
+uint8_t AvrCpu::shiftRight(uint8_t value, uint8_t result)
+{
+    setFlag(FLAG_C, value & 1);
+    setFlag(FLAG_V, ((result >> 7) ^ value) & 1);
+    setNZS(result);
+    return result;
+}
+
+int32_t AvrCpu::nextDataAddress() const
+{
+    uint16_t op = fetch(m_Pc);
+    if ((op & 0xD000) == 0x8000)
+    {
+        // ldd/std Y+q or Z+q
+        uint8_t q = (op & 7) | ((op >> 7) & 0x18) | ((op >> 8) & 0x20);
+        return (uint16_t) (pair(op & 8 ? REG_Y : REG_Z) + q);
+    }
+    if ((op & 0xFC00) == 0x9000)
+    {
+        switch (op & 15)
+        {
+        case 0x0:
+            return fetch(m_Pc + 1);
+        case 0x1:
+            return pair(REG_Z);
+        case 0x2:
+            return (uint16_t) (pair(REG_Z) - 1);
+        case 0x9:
+            return pair(REG_Y);
+        case 0xA:
+            return (uint16_t) (pair(REG_Y) - 1);
+        case 0xC:
+        case 0xD:
+            return pair(REG_X);
+        case 0xE:
+            return (uint16_t) (pair(REG_X) - 1);
+        case 0xF:
+            return (uint16_t) (op & 0x0200 ? m_Sp : m_Sp + 1);
+        }
+        return -1;
+    }
+    // in/out
+    if ((op & 0xF000) == 0xB000)
+        return (op & 15) | ((op >> 5) & 0x30);
+    // cbi/sbic/sbi/sbis
+    if ((op & 0xFC00) == 0x9800)
+        return (op >> 3) & 31;
+    return -1;
+}
+
+// ld/st in all their forms, ldd/std, lds/sts, lpm and push/pop
+uint8_t AvrCpu::loadStore(uint16_t op)
+{
+    uint8_t d = (op >> 4) & 31;
+    bool isStore = op & 0x0200;
+    uint16_t address;
+    uint8_t cycles = isStore ? 1 : 2;
+    if ((op & 0xD000) == 0x8000)
+    {
+        uint8_t q = (op & 7) | ((op >> 7) & 0x18) | ((op >> 8) & 0x20);
+        address = pair(op & 8 ? REG_Y : REG_Z) + q;
+    }
+    else
+    {
+        switch (op & 15)
+        {
+        case 0x0:
+            address = fetch(m_Pc++);
+            ++cycles;
+            break;
+        case 0x1:
+        case 0x2:
+        case 0x9:
+        case 0xA:
+        case 0xC:
+        case 0xD:
+        case 0xE:
+        {
+            uint8_t p = (op & 15) >= 0xC ? REG_X : (op & 8) ? REG_Y : REG_Z;
+            address = pair(p);
+            if ((op & 3) == 2)
+                setPair(p, --address);
+            else if ((op & 3) == 1)
+                setPair(p, address + 1);
+            break;
+        }
+        case 0x4:
+        case 0x5:
+            if (isStore)
+            {
+                ++m_IllegalOpcodes;
+                return 1;
+            }
+            // lpm Rd, Z / Z+
+            address = pair(REG_Z);
+            if (op & 1)
+                setPair(REG_Z, address + 1);
+            m_R[d] = m_Bus.readFlash(address);
+            return 3;
+        case 0xF:
+            if (isStore)
+                push(m_R[d]);
+            else
+                m_R[d] = pop();
+            return cycles;
+        default:
+            // elpm and the AVRxm read-modify-write instructions
+            ++m_IllegalOpcodes;
+            return 1;
+        }
+    }
+    if (isStore)
+        store(address, m_R[d]);
+    else
+        m_R[d] = load(address);
+    return cycles;
+}
+
+// mul, muls, mulsu and the fractional versions, product in r1:r0
+uint8_t AvrCpu::multiply(uint16_t op)
+{
+    int32_t a, b;
+    bool fractional = false;
+    if ((op & 0xFC00) == 0x9C00)
+    {
+        a = m_R[(op >> 4) & 31];
+        b = m_R[(op & 15) | ((op >> 5) & 16)];
+    }
+    else if ((op & 0xFF00) == 0x0200)
+    {
+        a = (int8_t) m_R[16 + ((op >> 4) & 15)];
+        b = (int8_t) m_R[16 + (op & 15)];
+    }
+    else
+    {
+        uint8_t d = 16 + ((op >> 4) & 7);
+        uint8_t r = 16 + (op & 7);
+        fractional = (op & 0x88) != 0;
+        a = (op & 0x88) == 0x08 ? m_R[d] : (int8_t) m_R[d];
+        b = (op & 0x88) == 0x80 ? (int8_t) m_R[r] : m_R[r];
+    }
+    uint16_t product = (uint16_t) (a * b);
+    setFlag(FLAG_C, product & 0x8000);
+    if (fractional)
+        product <<= 1;
+    setFlag(FLAG_Z, product == 0);
+    setPair(0, product);
+    return 2;
+}
+
+uint8_t AvrCpu::step()
+{
+    m_Pc &= m_PcMask;
+    uint16_t op = fetch(m_Pc++);
+    uint8_t cycles = 1;
+    uint8_t d = (op >> 4) & 31;
+    uint8_t r = (op & 15) | ((op >> 5) & 16);
+    uint8_t dHigh = 16 + ((op >> 4) & 15);
+    uint8_t k = (op & 15) | ((op >> 4) & 0xF0);
+    switch (op >> 12)
+    {
+    case 0x0:
+        switch ((op >> 10) & 3)
+        {
+        case 0:
+            if ((op & 0xFF00) == 0x0100)
+                setPair((op >> 3) & 0x1E, pair((op & 15) * 2));   // movw
+            else if (op & 0x0200)
+                cycles = multiply(op);
+            else if (op != 0)
+                ++m_IllegalOpcodes;
+            break;
+        case 1:
+            sub(m_R[d], m_R[r], flag(FLAG_C), true);            // cpc
+            break;
+        case 2:
+            m_R[d] = sub(m_R[d], m_R[r], flag(FLAG_C), true);   // sbc
+            break;
+        case 3:
+            m_R[d] = add(m_R[d], m_R[r], false);                // add
+            break;
+        }
+        break;
+    case 0x1:
+        switch ((op >> 10) & 3)
+        {
+        case 0:
+            if (m_R[d] == m_R[r])                               // cpse
+                cycles += skip();
+            break;
+        case 1:
+            sub(m_R[d], m_R[r], false, false);                  // cp
+            break;
+        case 2:
+            m_R[d] = sub(m_R[d], m_R[r], false, false);         // sub
+            break;
+        case 3:
+            m_R[d] = add(m_R[d], m_R[r], flag(FLAG_C));         // adc
+            break;
+        }
+        break;
+    case 0x2:
+        switch ((op >> 10) & 3)
+        {
+        case 0:
+            m_R[d] = logic(m_R[d] & m_R[r]);                    // and
+            break;
+        case 1:
+            m_R[d] = logic(m_R[d] ^ m_R[r]);                    // eor
+            break;
+        case 2:
+            m_R[d] = logic(m_R[d] | m_R[r]);                    // or
+            break;
+        case 3:
+            m_R[d] = m_R[r];                                    // mov
+            break;
+        }
+        break;
+    case 0x3:
+        sub(m_R[dHigh], k, false, false);                       // cpi
+        break;
+    case 0x4:
+        m_R[dHigh] = sub(m_R[dHigh], k, flag(FLAG_C), true);    // sbci
+        break;
+    case 0x5:
+        m_R[dHigh] = sub(m_R[dHigh], k, false, false);          // subi
+        break;
+    case 0x6:
+        m_R[dHigh] = logic(m_R[dHigh] | k);                     // ori
+        break;
+    case 0x7:
+        m_R[dHigh] = logic(m_R[dHigh] & k);                     // andi
+        break;
+    case 0x8:
+    case 0xA:
+        cycles = loadStore(op);                                 // ldd/std
+        break;
+    case 0x9:
+        switch ((op >> 8) & 15)
+        {
+        case 0x0:
+        case 0x1:
+        case 0x2:
+        case 0x3:
+            cycles = loadStore(op);
+            break;
+        case 0x4:
+        case 0x5:
+        {
+            uint8_t value = m_R[d];
+            switch (op & 15)
+            {
+            case 0x0:
+                m_R[d] = logic(~value);                         // com
+                setFlag(FLAG_C, true);
+                break;
+            case 0x1:
+                m_R[d] = sub(0, value, false, false);           // neg
+                break;
+            case 0x2:
+                m_R[d] = (value << 4) | (value >> 4);           // swap
+                break;
+            case 0x3:
+                m_R[d] = ++value;                               // inc
+                setFlag(FLAG_V, value == 0x80);
+                setNZS(value);
+                break;
+            case 0x5:
+                m_R[d] = shiftRight(value, (value >> 1) | (value & 0x80));  // asr
+                break;
+            case 0x6:
+                m_R[d] = shiftRight(value, value >> 1);         // lsr
+                break;
+            case 0x7:
+                m_R[d] = shiftRight(value, (value >> 1) | (flag(FLAG_C) << 7));  // ror
+                break;
+            case 0x8:
+                if (!(op & 0x0100))
+                {
+                    setFlag((op >> 4) & 7, !(op & 0x0080));     // bset/bclr
+                    break;
+                }
+                switch ((op >> 4) & 15)
+                {
+                case 0x0:                                       // ret
+                case 0x1:                                       // reti
+                {
+                    uint8_t high = pop();
+                    m_Pc = (high << 8) | pop();
+                    if (op & 0x0010)
+                        setFlag(FLAG_I, true);
+                    cycles = 4;
+                    break;
+                }
+                case 0x8:                                       // sleep
+                case 0x9:                                       // break
+                case 0xE:                                       // spm
+                    break;
+                case 0xA:                                       // wdr
+                    m_Bus.watchdogReset();
+                    break;
+                case 0xC:                                       // lpm
+                    m_R[0] = m_Bus.readFlash(pair(REG_Z));
+                    cycles = 3;
+                    break;
+                default:
+                    ++m_IllegalOpcodes;
+                    break;
+                }
+                break;
+            case 0x9:
+                if (op == 0x9509)                               // icall
+                {
+                    push(m_Pc & 255);
+                    push(m_Pc >> 8);
+                }
+                else if (op != 0x9409)                          // ijmp
+                {
+                    ++m_IllegalOpcodes;
+                    break;
+                }
+                m_Pc = pair(REG_Z);
+                cycles = 2;
+                break;
+            case 0xA:
+                m_R[d] = --value;                               // dec
+                setFlag(FLAG_V, value == 0x7F);
+                setNZS(value);
+                break;
+            case 0xC:
+            case 0xD:
+                m_Pc = fetch(m_Pc);                             // jmp
+                cycles = 3;
+                break;
+            case 0xE:
+            case 0xF:
+            {
+                uint16_t target = fetch(m_Pc++);               // call
+                push(m_Pc & 255);
+                push(m_Pc >> 8);
+                m_Pc = target;
+                cycles = 3;
+                break;
+            }
+            default:
+                ++m_IllegalOpcodes;
+                break;
+            }
+            break;
+        }
+        case 0x6:
+        case 0x7:
+        {
+            // adiw/sbiw
+            uint8_t p = 24 + ((op >> 3) & 6);
+            uint8_t constant = (op & 15) | ((op >> 2) & 0x30);
+            uint16_t value = pair(p);
+            bool subtract = op & 0x0100;
+            uint16_t result = subtract ? value - constant : value + constant;
+            bool before = value & 0x8000;
+            bool after = result & 0x8000;
+            setFlag(FLAG_V, subtract ? before && !after : !before && after);
+            setFlag(FLAG_C, subtract ? after && !before : before && !after);
+            setFlag(FLAG_N, after);
+            setFlag(FLAG_Z, result == 0);
+            setFlag(FLAG_S, after != flag(FLAG_V));
+            setPair(p, result);
+            cycles = 2;
+            break;
+        }
+        case 0x8:
+        case 0x9:
+        case 0xA:
+        case 0xB:
+        {
+            uint8_t address = (op >> 3) & 31;
+            uint8_t mask = 1 << (op & 7);
+            switch ((op >> 8) & 3)
+            {
+            case 0:
+                store(address, load(address) & ~mask);          // cbi
+                break;
+            case 1:
+                if (!(load(address) & mask))                    // sbic
+                    cycles += skip();
+                break;
+            case 2:
+                store(address, load(address) | mask);           // sbi
+                break;
+            case 3:
+                if (load(address) & mask)                       // sbis
+                    cycles += skip();
+                break;
+            }
+            break;
+        }
+        default:
+            cycles = multiply(op);                              // mul
+            break;
+        }
+        break;
+    case 0xB:
+    {
+        uint8_t address = (op & 15) | ((op >> 5) & 0x30);
+        if (op & 0x0800)
+            store(address, m_R[d]);                             // out
+        else
+            m_R[d] = load(address);                             // in
+        break;
+    }
+    case 0xC:
+        m_Pc += (int16_t) (op << 4) >> 4;                       // rjmp
+        cycles = 2;
+        break;
+    case 0xD:
+        push(m_Pc & 255);                                       // rcall
+        push(m_Pc >> 8);
+        m_Pc += (int16_t) (op << 4) >> 4;
+        cycles = 2;
+        break;
+    case 0xE:
+        m_R[dHigh] = k;                                         // ldi
+        break;
+    case 0xF:
+        if (!(op & 0x0800))
+        {
+            // brbs/brbc
+            if (flag(op & 7) == !(op & 0x0400))
+            {
+                m_Pc += (int8_t) ((op >> 2) & 0xFE) >> 1;
+                cycles = 2;
+            }
+            break;
+        }
+        if (op & 0x0008)
+        {
+            // erased flash (0xFFFF) falls through
+            if (op != 0xFFFF)
+                ++m_IllegalOpcodes;
+            break;
+        }
+        switch ((op >> 9) & 3)
+        {
+        case 0:
+            if (flag(FLAG_T))                                   // bld
+                m_R[d] |= 1 << (op & 7);
+            else
+                m_R[d] &= ~(1 << (op & 7));
+            break;
+        case 1:
+            setFlag(FLAG_T, (m_R[d] >> (op & 7)) & 1);          // bst
+            break;
+        case 2:
+            if (!((m_R[d] >> (op & 7)) & 1))                    // sbrc
+                cycles += skip();
+            break;
+        case 3:
+            if ((m_R[d] >> (op & 7)) & 1)                       // sbrs
+                cycles += skip();
+            break;
+        }
+        break;
+    }
+    if (m_CcpCount)
+        --m_CcpCount;
+    m_Cycles += cycles;
+    return cycles;
+}
+
+} // namespace host
+} // namespace mtnrf
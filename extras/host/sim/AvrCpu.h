@@ -0,0 +1,85 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace mtnrf {
+namespace host {
+
+// what an AvrCpu is connected to: program memory and the data space
+class AvrBus
+{
+public:
+    virtual ~AvrBus() {}
+    // a byte of flash at a byte address
+    virtual uint8_t readFlash(uint16_t address) = 0;
+    // everything in the data space apart from the CPU's own SREG, SP and CCP
+    virtual uint8_t read(uint16_t address) = 0;
+    virtual void write(uint16_t address, uint8_t value) = 0;
+    // the wdr instruction
+    virtual void watchdogReset() = 0;
+};
+
+// AVRxt (tinyAVR 0/1-series) instruction set with the cycle counts from the
+// AVR instruction set manual.  The register file isn't mapped into the data
+// space on these parts; SREG, SP and CCP are kept here and every other data
+// access goes to the bus.  Interrupts aren't implemented as the bootloader
+// runs with them disabled, SPM and SLEEP execute as NOPs and anything that
+// isn't an AVRxt instruction is counted and skipped.
+class AvrCpu
+{
+public:
+    AvrCpu(AvrBus& bus, uint16_t flashSize);
+
+    // start from the reset vector with SP at the top of RAM.  like the real
+    // part the register file keeps whatever it held.
+    void reset(uint16_t ramEnd);
+    // execute one instruction and return the cycles it took
+    uint8_t step();
+    // the data space address the next instruction reads or writes, -1 if
+    // none (LPM reads flash)
+    int32_t nextDataAddress() const;
+
+    // byte address of the next instruction
+    uint16_t getPc() const { return (m_Pc & m_PcMask) * 2; }
+    uint8_t getRegister(uint8_t r) const { return m_R[r & 31]; }
+    uint8_t getSreg() const { return m_Sreg; }
+    uint16_t getSp() const { return m_Sp; }
+    uint64_t getCycles() const { return m_Cycles; }
+    // the signature written to CCP if it's still within its 4 instructions
+    uint8_t getCcp() const { return m_CcpCount ? m_Ccp : 0; }
+    uint32_t getIllegalOpcodes() const { return m_IllegalOpcodes; }
+
+private:
+    uint16_t fetch(uint16_t pc) const;
+    uint8_t load(uint16_t address);
+    void store(uint16_t address, uint8_t value);
+    void push(uint8_t value);
+    uint8_t pop();
+    uint16_t pair(uint8_t r) const { return m_R[r] | (m_R[r + 1] << 8); }
+    void setPair(uint8_t r, uint16_t value);
+    bool isTwoWord(uint16_t op) const;
+    uint8_t skip();
+    void setFlag(uint8_t bit, bool value);
+    bool flag(uint8_t bit) const { return (m_Sreg >> bit) & 1; }
+    void setNZS(uint8_t result);
+    uint8_t add(uint8_t a, uint8_t b, bool carry);
+    uint8_t sub(uint8_t a, uint8_t b, bool carry, bool keepZero);
+    uint8_t logic(uint8_t result);
+    uint8_t shiftRight(uint8_t value, uint8_t result);
+    uint8_t loadStore(uint16_t op);
+    uint8_t multiply(uint16_t op);
+
+    AvrBus& m_Bus;
+    uint16_t m_PcMask;          // the PC wraps at the end of flash
+    uint8_t m_R[32] = {};
+    uint16_t m_Pc = 0;          // word address
+    uint16_t m_Sp = 0;
+    uint8_t m_Sreg = 0;
+    uint8_t m_Ccp = 0;
+    uint8_t m_CcpCount = 0;
+    uint64_t m_Cycles = 0;
+    uint32_t m_IllegalOpcodes = 0;
+};
+
+} // namespace host
+} // namespace mtnrf
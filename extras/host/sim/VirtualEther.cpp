@@ -0,0 +1,116 @@
+#include "VirtualEther.h"
+#include "VirtualNrf24.h"
+#include <Arduino.h>
+#include "nRF24L01.h"
+#include <algorithm>
+
+namespace mtnrf {
+namespace host {
+
+VirtualEther::VirtualEther()
+:   m_Random(1614)
+{
+}
+
+void VirtualEther::addRadio(VirtualNrf24* radio)
+{
+    m_Radios.push_back(radio);
+}
+
+void VirtualEther::removeRadio(VirtualNrf24* radio)
+{
+    m_Radios.erase(std::remove(m_Radios.begin(), m_Radios.end(), radio), m_Radios.end());
+}
+
+void VirtualEther::setChannelNoise(uint8_t channel, float probability)
+{
+    if (channel < 128)
+        m_Noise[channel] = probability;
+}
+
+Nanos VirtualEther::airTime(uint8_t dataRate, uint8_t addressWidth, uint8_t payloadSize, uint8_t crcBytes)
+{
+    // preamble + address + 9 bit packet control field + payload + CRC
+    uint32_t bits = 8 * (1 + addressWidth + payloadSize + crcBytes) + 9;
+    uint32_t bitsPerSecond = 1000000;
+    if (dataRate & _BV(RF_DR_LOW))
+        bitsPerSecond = 250000;
+    else if (dataRate & _BV(RF_DR_HIGH))
+        bitsPerSecond = 2000000;
+    return (Nanos) bits * 1000000000ull / bitsPerSecond;
+}
+
+void VirtualEther::prune(Nanos now)
+{
+    const Nanos keep = millis(20);
+    m_Transmissions.erase(std::remove_if(m_Transmissions.begin(), m_Transmissions.end(),
+        [&](const Transmission& t) { return t.end + keep < now; }), m_Transmissions.end());
+}
+
+void VirtualEther::beginTransmission(const AirPacket& packet)
+{
+    prune(packet.start);
+    m_Transmissions.push_back({ packet.channel, packet.start, packet.end, &packet });
+    ++m_Stats.frames;
+}
+
+void VirtualEther::endTransmission(AirPacket& packet)
+{
+    for (Transmission& t : m_Transmissions)
+    {
+        if (t.packet != &packet && t.channel == packet.channel &&
+            t.start < packet.end && t.end > packet.start)
+        {
+            packet.corrupted = true;
+        }
+    }
+    for (Transmission& t : m_Transmissions)
+    {
+        // the frame buffer is reused by the sender so forget the pointer
+        if (t.packet == &packet)
+            t.packet = nullptr;
+    }
+    if (packet.corrupted)
+    {
+        ++m_Stats.collisions;
+        return;
+    }
+    if (packet.isAck)
+    {
+        VirtualNrf24* target = packet.ackTarget;
+        if (!target)
+            return;
+        if (m_LinkModel && !m_LinkModel->deliver(packet, *target))
+        {
+            ++m_Stats.lost;
+            return;
+        }
+        target->onAck(packet);
+        return;
+    }
+    // deliver a copy since receivers may start their own frames (acks)
+    AirPacket copy = packet;
+    for (VirtualNrf24* radio : m_Radios)
+    {
+        if (radio == packet.sender)
+            continue;
+        if (m_LinkModel && !m_LinkModel->deliver(copy, *radio))
+        {
+            ++m_Stats.lost;
+            continue;
+        }
+        radio->onFrame(copy);
+    }
+}
+
+bool VirtualEther::receivedPowerDetected(uint8_t channel, Nanos from, Nanos to)
+{
+    for (const Transmission& t : m_Transmissions)
+        if (t.channel == channel && t.start < to && t.end > from)
+            return true;
+    float noise = channel < 128 ? m_Noise[channel] : 0;
+    return noise > 0 && std::uniform_real_distribution<float>(0, 1)(m_Random) < noise;
+}
+
+} // namespace host
+} // namespace mtnrf
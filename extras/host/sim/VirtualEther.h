@@ -0,0 +1,94 @@
+#pragma once
+
+#include "VirtualTime.h"
+#include <random>
+#include <vector>
+
+namespace mtnrf {
+namespace host {
+
+class VirtualNrf24;
+
+// a single Enhanced ShockBurst frame on the air
+struct AirPacket
+{
+    VirtualNrf24* sender = nullptr;
+    VirtualNrf24* ackTarget = nullptr; // set for ACK frames
+    uint8_t channel = 0;
+    uint8_t dataRate = 0;       // RF_SETUP data rate bits
+    uint8_t crcBytes = 0;
+    uint8_t addressWidth = 0;
+    uint8_t address[5] = {};
+    uint8_t pid = 0;
+    bool noAck = false;
+    bool isAck = false;
+    bool corrupted = false;
+    uint8_t size = 0;
+    uint8_t payload[32] = {};
+    Nanos start = 0;
+    Nanos end = 0;
+};
+
+// decides whether a frame that reached a receiver is decoded correctly.
+// the default ether is lossless apart from collisions.
+class LinkModel
+{
+public:
+    virtual ~LinkModel() {}
+    virtual bool deliver(const AirPacket& packet, const VirtualNrf24& receiver) = 0;
+};
+
+// shared 2.4GHz medium connecting all simulated radios
+class VirtualEther
+{
+public:
+    VirtualEther();
+
+    void addRadio(VirtualNrf24* radio);
+    void removeRadio(VirtualNrf24* radio);
+    void setLinkModel(LinkModel* model) { m_LinkModel = model; }
+    // probability that RPD reads 1 on a quiet channel (background interference)
+    void setChannelNoise(uint8_t channel, float probability);
+    void setSeed(uint32_t seed) { m_Random.seed(seed); }
+    std::mt19937& random() { return m_Random; }
+
+    // time on air of a frame with the given settings
+    static Nanos airTime(uint8_t dataRate, uint8_t addressWidth, uint8_t payloadSize, uint8_t crcBytes);
+
+    // called by the transmitting radio when the frame starts and ends
+    void beginTransmission(const AirPacket& packet);
+    void endTransmission(AirPacket& packet);
+
+    // was anything transmitted on 'channel' between 'from' and 'to', or did
+    // the background noise trigger the received power detector
+    bool receivedPowerDetected(uint8_t channel, Nanos from, Nanos to);
+
+    struct Stats
+    {
+        uint32_t frames = 0;
+        uint32_t collisions = 0;
+        uint32_t lost = 0;
+    };
+    const Stats& getStats() const { return m_Stats; }
+    void resetStats() { m_Stats = Stats(); }
+
+private:
+    struct Transmission
+    {
+        uint8_t channel;
+        Nanos start;
+        Nanos end;
+        const AirPacket* packet;
+    };
+    void prune(Nanos now);
+
+    std::vector<VirtualNrf24*> m_Radios;
+    std::vector<Transmission> m_Transmissions;
+    LinkModel* m_LinkModel = nullptr;
+    float m_Noise[128] = {};
+    std::mt19937 m_Random;
+    Stats m_Stats;
+};
+
+} // namespace host
+} // namespace mtnrf
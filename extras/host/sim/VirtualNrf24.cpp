@@ -0,0 +1,594 @@
+#include "VirtualNrf24.h"
+#include <Arduino.h>
+#include "nRF24L01.h"
+#include <string.h>
+
+namespace mtnrf {
+namespace host {
+
+static const Nanos StartUpTime = micros(1500);
+static const Nanos SettleTime = micros(130);
+
+static uint16_t payloadCrc(const uint8_t* data, uint8_t size)
+{
+    uint16_t crc = 0xFFFF;
+    while (size--)
+    {
+        crc ^= *data++ << 8;
+        for (int i = 0; i < 8; i++)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+VirtualNrf24::VirtualNrf24(VirtualEther& ether, const char* name)
+:   m_Ether(ether)
+,   m_Name(name)
+{
+    // power on reset values
+    m_Regs[CONFIG] = _BV(EN_CRC);
+    m_Regs[EN_AA] = 0x3F;
+    m_Regs[EN_RXADDR] = 0x03;
+    m_Regs[SETUP_AW] = 0x03;
+    m_Regs[SETUP_RETR] = 0x03;
+    m_Regs[RF_CH] = 0x02;
+    m_Regs[RF_SETUP] = 0x0E;
+    m_Regs[RX_ADDR_P2] = 0xC3;
+    m_Regs[RX_ADDR_P3] = 0xC4;
+    m_Regs[RX_ADDR_P4] = 0xC5;
+    m_Regs[RX_ADDR_P5] = 0xC6;
+    memset(m_RxAddrP0, 0xE7, 5);
+    memset(m_TxAddr, 0xE7, 5);
+    memset(m_RxAddrP1, 0xC2, 5);
+    memset(m_LastPid, 0xFF, sizeof(m_LastPid));
+    memset(m_LastCrc, 0, sizeof(m_LastCrc));
+    m_Ether.addRadio(this);
+    Scheduler::instance().add(this);
+}
+
+VirtualNrf24::~VirtualNrf24()
+{
+    m_Ether.removeRadio(this);
+    Scheduler::instance().remove(this);
+}
+
+void VirtualNrf24::attach(uint8_t cePin, uint8_t csnPin, uint8_t irqPin)
+{
+    m_CePin = cePin;
+    m_CsnPin = csnPin;
+    m_IrqPin = irqPin;
+    attachPin(cePin, this);
+    attachPin(csnPin, this);
+    attachSpiDevice(this);
+    updateIrq();
+}
+
+void VirtualNrf24::updateIrq()
+{
+    // IRQ is low while any interrupt flag not masked in CONFIG is set
+    if (m_IrqPin != 0xFF)
+        setPinLevel(m_IrqPin, (m_Status & ~m_Regs[CONFIG] & 0x70) ? LOW : HIGH);
+}
+
+void VirtualNrf24::onPinChange(uint8_t pin, uint8_t level)
+{
+    if (pin == m_CsnPin)
+        select(level == 0);
+    else if (pin == m_CePin)
+        setCe(level != 0);
+}
+
+uint8_t VirtualNrf24::spiTransfer(uint8_t data)
+{
+    return transferByte(data);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// SPI command decoding
+
+void VirtualNrf24::select(bool selected)
+{
+    if (selected == m_Selected)
+        return;
+    m_Selected = selected;
+    if (selected)
+    {
+        m_Index = 0;
+        m_PayloadRead = false;
+    }
+    else if (m_Index > 0)
+    {
+        completeCommand();
+        updateIrq();
+    }
+}
+
+uint8_t VirtualNrf24::transferByte(uint8_t data)
+{
+    if (m_Index == 0)
+    {
+        m_Command = data;
+        m_Index = 1;
+        return status();
+    }
+    uint8_t index = m_Index - 1;
+    if (m_Index < sizeof(m_Buffer))
+        ++m_Index;
+    uint8_t cmd = m_Command;
+    if (cmd < W_REGISTER)
+        return readRegisterByte(cmd & REGISTER_MASK, index);
+    if (cmd == R_RX_PL_WID)
+        return m_RxFifo.empty() ? 0 : m_RxFifo.front().size;
+    if (cmd == R_RX_PAYLOAD)
+    {
+        if (m_RxFifo.empty())
+            return 0;
+        m_PayloadRead = true;
+        const FifoEntry& entry = m_RxFifo.front();
+        return index < entry.size ? entry.data[index] : 0;
+    }
+    if (index < 32)
+        m_Buffer[index] = data;
+    return 0;
+}
+
+uint8_t VirtualNrf24::command(uint8_t cmd, uint8_t* data, uint8_t length)
+{
+    select(true);
+    uint8_t result = transferByte(cmd);
+    for (uint8_t i = 0; i < length; ++i)
+        data[i] = transferByte(data[i]);
+    select(false);
+    return result;
+}
+
+uint8_t VirtualNrf24::readRegister(uint8_t reg)
+{
+    uint8_t value = NOP;
+    command(R_REGISTER | reg, &value, 1);
+    return value;
+}
+
+void VirtualNrf24::writeRegister(uint8_t reg, uint8_t value)
+{
+    command(W_REGISTER | reg, &value, 1);
+}
+
+void VirtualNrf24::writeRegister(uint8_t reg, const void* data, uint8_t length)
+{
+    uint8_t buf[5];
+    memcpy(buf, data, length);
+    command(W_REGISTER | reg, buf, length);
+}
+
+void VirtualNrf24::completeCommand()
+{
+    uint8_t cmd = m_Command;
+    uint8_t length = m_Index - 1;
+    if (cmd >= W_REGISTER && cmd < W_REGISTER + 0x20)
+    {
+        if (length > 0)
+            applyRegisterWrite(cmd & REGISTER_MASK);
+    }
+    else if (cmd == R_RX_PAYLOAD)
+    {
+        if (m_PayloadRead && !m_RxFifo.empty())
+            m_RxFifo.pop_front();
+    }
+    else if (cmd == W_TX_PAYLOAD || cmd == W_TX_PAYLOAD_NO_ACK || (cmd & 0xF8) == W_ACK_PAYLOAD)
+    {
+        if (length == 0 || m_TxFifo.size() >= 3)
+            return;
+        if ((cmd & 0xF8) == W_ACK_PAYLOAD && !(m_Regs[FEATURE] & _BV(EN_ACK_PAY)))
+            return;
+        FifoEntry entry;
+        entry.size = length > 32 ? 32 : length;
+        memcpy(entry.data, m_Buffer, entry.size);
+        entry.noAck = cmd == W_TX_PAYLOAD_NO_ACK && (m_Regs[FEATURE] & _BV(EN_DYN_ACK));
+        entry.pipe = (cmd & 0xF8) == W_ACK_PAYLOAD ? (cmd & 7) : 0;
+        m_TxFifo.push_back(entry);
+        evaluate();
+    }
+    else if (cmd == FLUSH_TX)
+    {
+        m_TxFifo.clear();
+        m_FrameAfterMaxRt = false;
+    }
+    else if (cmd == FLUSH_RX)
+    {
+        m_RxFifo.clear();
+    }
+}
+
+uint8_t VirtualNrf24::status() const
+{
+    uint8_t s = m_Status & (_BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT));
+    s |= (m_RxFifo.empty() ? 7 : m_RxFifo.front().pipe) << RX_P_NO;
+    if (m_TxFifo.size() >= 3)
+        s |= _BV(TX_FULL);
+    return s;
+}
+
+uint8_t VirtualNrf24::fifoStatus() const
+{
+    uint8_t s = 0;
+    if (m_TxFifo.size() >= 3)
+        s |= _BV(FIFO_FULL);
+    if (m_TxFifo.empty())
+        s |= _BV(TX_EMPTY);
+    if (m_RxFifo.size() >= 3)
+        s |= _BV(RX_FULL);
+    if (m_RxFifo.empty())
+        s |= _BV(RX_EMPTY);
+    return s;
+}
+
+uint8_t VirtualNrf24::readRegisterByte(uint8_t reg, uint8_t index)
+{
+    switch (reg)
+    {
+    case STATUS_NRF: return status();
+    case FIFO_STATUS: return fifoStatus();
+    case OBSERVE_TX: return (m_LostCount << PLOS_CNT) | m_ArcCount;
+    case RPD:
+        if (m_State == RX)
+            m_Rpd = m_Ether.receivedPowerDetected(m_Regs[RF_CH], m_RxSince, now()) ? 1 : 0;
+        return m_Rpd;
+    case RX_ADDR_P0: return index < 5 ? m_RxAddrP0[index] : 0;
+    case RX_ADDR_P1: return index < 5 ? m_RxAddrP1[index] : 0;
+    case TX_ADDR: return index < 5 ? m_TxAddr[index] : 0;
+    default: return m_Regs[reg];
+    }
+}
+
+void VirtualNrf24::applyRegisterWrite(uint8_t reg)
+{
+    uint8_t length = m_Index - 1;
+    uint8_t value = m_Buffer[0];
+    switch (reg)
+    {
+    case STATUS_NRF:
+        m_Status &= ~(value & (_BV(RX_DR) | _BV(TX_DS) | _BV(MAX_RT)));
+        break;
+    case RX_ADDR_P0: memcpy(m_RxAddrP0, m_Buffer, length < 5 ? length : 5); break;
+    case RX_ADDR_P1: memcpy(m_RxAddrP1, m_Buffer, length < 5 ? length : 5); break;
+    case TX_ADDR: memcpy(m_TxAddr, m_Buffer, length < 5 ? length : 5); break;
+    case OBSERVE_TX:
+    case RPD:
+    case FIFO_STATUS:
+        break; // read only
+    case RF_CH:
+        m_Regs[reg] = value & 0x7F;
+        m_LostCount = 0;
+        break;
+    default:
+        if (reg < 32)
+            m_Regs[reg] = value;
+        break;
+    }
+    evaluate();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// state machine
+
+uint8_t VirtualNrf24::getDataRate() const
+{
+    return m_Regs[RF_SETUP] & (_BV(RF_DR_LOW) | _BV(RF_DR_HIGH));
+}
+
+uint8_t VirtualNrf24::crcBytes() const
+{
+    if (!(m_Regs[CONFIG] & _BV(EN_CRC)))
+        return 0;
+    return m_Regs[CONFIG] & _BV(CRCO) ? 2 : 1;
+}
+
+uint8_t VirtualNrf24::addressWidth() const
+{
+    uint8_t aw = m_Regs[SETUP_AW] & 3;
+    return aw ? aw + 2 : 3;
+}
+
+void VirtualNrf24::setCe(bool high)
+{
+    if (high == m_Ce)
+        return;
+    m_Ce = high;
+    if (!high && m_State == RX)
+        m_Rpd = m_Ether.receivedPowerDetected(m_Regs[RF_CH], m_RxSince, now()) ? 1 : 0;
+    evaluate();
+}
+
+void VirtualNrf24::setState(State state, Nanos duration)
+{
+    m_State = state;
+    m_EventTime = duration == NEVER ? NEVER : now() + duration;
+    if (state == RX)
+        m_RxSince = now();
+}
+
+void VirtualNrf24::evaluate()
+{
+    bool powerUp = (m_Regs[CONFIG] & _BV(PWR_UP)) != 0;
+    bool primRx = (m_Regs[CONFIG] & _BV(PRIM_RX)) != 0;
+    if (!powerUp)
+    {
+        if (m_State != POWER_DOWN)
+            setState(POWER_DOWN);
+        return;
+    }
+    switch (m_State)
+    {
+    case POWER_DOWN:
+        setState(START_UP, StartUpTime);
+        return;
+    case RX_SETTLE:
+    case RX:
+        if (!m_Ce || !primRx)
+            setState(STANDBY);
+        break;
+    case STANDBY:
+        break;
+    default:
+        // start up, transmission or ack in progress
+        return;
+    }
+    if (m_State != STANDBY || !m_Ce)
+        return;
+    if (primRx)
+        setState(RX_SETTLE, SettleTime);
+    else if (!m_TxFifo.empty() && !(m_Status & _BV(MAX_RT)))
+        setState(TX_SETTLE, SettleTime);
+}
+
+void VirtualNrf24::fillAirPacket(AirPacket& packet) const
+{
+    packet.sender = const_cast<VirtualNrf24*>(this);
+    packet.ackTarget = nullptr;
+    packet.channel = m_Regs[RF_CH];
+    packet.dataRate = getDataRate();
+    packet.crcBytes = crcBytes();
+    packet.addressWidth = addressWidth();
+    packet.corrupted = false;
+    packet.start = now();
+}
+
+void VirtualNrf24::startFrame()
+{
+    const FifoEntry& entry = m_TxFifo.front();
+    if (!m_FrameIsRetry)
+    {
+        // a payload that reached MAX_RT goes again with the same PID when
+        // CE is pulsed, so a receiver that only lost the acks drops it
+        if (!m_FrameAfterMaxRt)
+        {
+            m_Pid = (m_Pid + 1) & 3;
+            ++m_Stats.txPackets;
+        }
+        m_FrameAfterMaxRt = false;
+        m_ArcCount = 0;
+    }
+    fillAirPacket(m_Frame);
+    memcpy(m_Frame.address, m_TxAddr, 5);
+    m_Frame.pid = m_Pid;
+    m_Frame.noAck = entry.noAck;
+    m_Frame.isAck = false;
+    m_Frame.size = entry.size;
+    memcpy(m_Frame.payload, entry.data, entry.size);
+    Nanos air = VirtualEther::airTime(m_Frame.dataRate, m_Frame.addressWidth, m_Frame.size, m_Frame.crcBytes);
+    m_Frame.end = m_Frame.start + air;
+    m_Stats.airTime += air;
+    ++m_Stats.txFrames;
+    m_Ether.beginTransmission(m_Frame);
+    setState(TX, air);
+}
+
+void VirtualNrf24::finishTx()
+{
+    m_TxFifo.pop_front();
+    m_Status |= _BV(TX_DS);
+    m_FrameIsRetry = false;
+    setState(STANDBY);
+    if (m_Ce && !m_TxFifo.empty())
+        setState(TX_SETTLE, SettleTime);
+    updateIrq();
+}
+
+void VirtualNrf24::process(Nanos t)
+{
+    (void) t;
+    switch (m_State)
+    {
+    case START_UP:
+        setState(STANDBY);
+        evaluate();
+        break;
+    case RX_SETTLE:
+        setState(RX);
+        break;
+    case TX_SETTLE:
+        if (m_TxFifo.empty())
+        {
+            setState(STANDBY);
+            break;
+        }
+        startFrame();
+        break;
+    case TX:
+    {
+        bool expectAck = !m_Frame.noAck && (m_Regs[EN_AA] & _BV(ENAA_P0));
+        if (expectAck)
+        {
+            // wait for the ACK until the auto retransmit delay expires
+            Nanos ard = micros(250) * ((m_Regs[SETUP_RETR] >> ARD) + 1);
+            setState(TX_WAIT_ACK, ard);
+        }
+        m_Ether.endTransmission(m_Frame);
+        if (!expectAck)
+            finishTx();
+        break;
+    }
+    case TX_WAIT_ACK:
+        if (m_ArcCount < (m_Regs[SETUP_RETR] & 15))
+        {
+            ++m_ArcCount;
+            ++m_Stats.retransmits;
+            m_FrameIsRetry = true;
+            startFrame();
+        }
+        else
+        {
+            // give up: packet stays in the FIFO until flushed or MAX_RT is cleared
+            m_Status |= _BV(MAX_RT);
+            if (m_LostCount < 15)
+                ++m_LostCount;
+            ++m_Stats.maxRetries;
+            m_FrameIsRetry = false;
+            m_FrameAfterMaxRt = true;
+            setState(STANDBY);
+        }
+        break;
+    case ACK_SETTLE:
+    {
+        Nanos air = VirtualEther::airTime(m_Ack.dataRate, m_Ack.addressWidth, m_Ack.size, m_Ack.crcBytes);
+        m_Ack.start = now();
+        m_Ack.end = m_Ack.start + air;
+        m_Stats.airTime += air;
+        ++m_Stats.acksSent;
+        m_Ether.beginTransmission(m_Ack);
+        setState(ACK_TX, air);
+        break;
+    }
+    case ACK_TX:
+        setState(RX);
+        m_Ether.endTransmission(m_Ack);
+        evaluate();
+        break;
+    default:
+        m_EventTime = NEVER;
+        break;
+    }
+    updateIrq();
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// reception
+
+int VirtualNrf24::matchPipe(const AirPacket& packet) const
+{
+    uint8_t aw = addressWidth();
+    if (packet.addressWidth != aw)
+        return -1;
+    for (int pipe = 0; pipe < 6; ++pipe)
+    {
+        if (!(m_Regs[EN_RXADDR] & _BV(pipe)))
+            continue;
+        const uint8_t* addr = pipe == 0 ? m_RxAddrP0 : m_RxAddrP1;
+        if (pipe >= 2 && packet.address[0] != m_Regs[RX_ADDR_P0 + pipe])
+            continue;
+        if (memcmp(packet.address + (pipe >= 2), addr + (pipe >= 2), aw - (pipe >= 2)) == 0)
+            return pipe;
+    }
+    return -1;
+}
+
+void VirtualNrf24::onFrame(AirPacket& packet)
+{
+    if (m_State != RX || m_RxSince > packet.start)
+        return;
+    if (packet.channel != m_Regs[RF_CH] || packet.dataRate != getDataRate() ||
+        packet.crcBytes != crcBytes())
+        return;
+    int pipe = matchPipe(packet);
+    if (pipe < 0)
+        return;
+    bool dynamic = (m_Regs[FEATURE] & _BV(EN_DPL)) && (m_Regs[DYNPD] & _BV(pipe));
+    if (!dynamic && packet.size != (m_Regs[RX_PW_P0 + pipe] & 0x3F))
+        return;
+
+    uint16_t crc = payloadCrc(packet.payload, packet.size);
+    bool duplicate = !packet.noAck && m_LastPid[pipe] == packet.pid && m_LastCrc[pipe] == crc;
+    if (duplicate)
+    {
+        ++m_Stats.duplicates;
+    }
+    else
+    {
+        if (m_RxFifo.size() >= 3)
+        {
+            // no room: the packet is discarded and not acknowledged
+            ++m_Stats.rxOverflows;
+            return;
+        }
+        FifoEntry entry;
+        entry.pipe = pipe;
+        entry.size = packet.size;
+        memcpy(entry.data, packet.payload, packet.size);
+        m_RxFifo.push_back(entry);
+        m_Status |= _BV(RX_DR);
+        ++m_Stats.rxPackets;
+        m_LastPid[pipe] = packet.pid;
+        m_LastCrc[pipe] = crc;
+        // a new packet means the previous ack payload got through
+        for (auto it = m_TxFifo.begin(); it != m_TxFifo.end(); ++it)
+        {
+            if (it->pipe == pipe && it->sent)
+            {
+                m_TxFifo.erase(it);
+                m_Status |= _BV(TX_DS);
+                break;
+            }
+        }
+        updateIrq();
+    }
+
+    if (packet.noAck || !(m_Regs[EN_AA] & _BV(pipe)))
+        return;
+
+    fillAirPacket(m_Ack);
+    memcpy(m_Ack.address, packet.address, 5);
+    m_Ack.ackTarget = packet.sender;
+    m_Ack.isAck = true;
+    m_Ack.noAck = true;
+    m_Ack.pid = packet.pid;
+    m_Ack.size = 0;
+    if (m_Regs[FEATURE] & _BV(EN_ACK_PAY))
+    {
+        for (FifoEntry& entry : m_TxFifo)
+        {
+            if (entry.pipe == pipe)
+            {
+                entry.sent = true;
+                m_Ack.size = entry.size;
+                memcpy(m_Ack.payload, entry.data, entry.size);
+                break;
+            }
+        }
+    }
+    setState(ACK_SETTLE, SettleTime);
+}
+
+void VirtualNrf24::onAck(const AirPacket& ack)
+{
+    if (m_State != TX_WAIT_ACK || ack.pid != m_Frame.pid)
+        return;
+    ++m_Stats.acksReceived;
+    if (ack.size > 0)
+    {
+        ++m_Stats.ackPayloadsReceived;
+        if (m_RxFifo.size() < 3)
+        {
+            FifoEntry entry;
+            entry.pipe = 0;
+            entry.size = ack.size;
+            memcpy(entry.data, ack.payload, ack.size);
+            m_RxFifo.push_back(entry);
+            m_Status |= _BV(RX_DR);
+        }
+    }
+    finishTx();
+}
+
+} // namespace host
+} // namespace mtnrf
@@ -0,0 +1,160 @@
+#pragma once
+
+#include "VirtualEther.h"
+#include "HostDevices.h"
+#include <deque>
+#include <string>
+
+namespace mtnrf {
+namespace host {
+
+// Register level model of an nRF24L01+ with Enhanced ShockBurst timing:
+// power up and PLL settling delays, time on air for the configured data
+// rate, auto acknowledge with ack payloads, auto retransmit (ARD/ARC),
+// MAX_RT, OBSERVE_TX, RPD, 3 deep TX/RX FIFOs and dynamic payloads.
+//
+// The radio can either be attached to host core pins (so mtnrf::Radio drives
+// it through SPI/digitalWrite) or driven directly via command() by a
+// simulated target.
+class VirtualNrf24 : public Component, public PinListener, public SpiDevice
+{
+public:
+    VirtualNrf24(VirtualEther& ether, const char* name);
+    ~VirtualNrf24();
+
+    const char* getName() const { return m_Name.c_str(); }
+
+    // connect to host core pins so SPI.transfer/digitalWrite reach this radio,
+    // optionally driving an IRQ pin (active low, like the real part)
+    void attach(uint8_t cePin, uint8_t csnPin, uint8_t irqPin = 0xFF);
+
+    // perform a complete SPI command.  'data' is sent after the command byte
+    // and replaced with the bytes clocked out.  returns the STATUS register.
+    uint8_t command(uint8_t cmd, uint8_t* data = nullptr, uint8_t length = 0);
+    uint8_t readRegister(uint8_t reg);
+    void writeRegister(uint8_t reg, uint8_t value);
+    void writeRegister(uint8_t reg, const void* data, uint8_t length);
+    void setCe(bool high);
+    bool getCe() const { return m_Ce; }
+    // CSN driven by an emulated target's port, with spiTransfer() for its SPI
+    void setCsn(bool high) { select(!high); }
+
+    uint8_t getChannel() const { return m_Regs[RF_CH_REG]; }
+    uint8_t getDataRate() const;
+    bool isListening() const { return m_State == RX; }
+
+    struct Stats
+    {
+        uint32_t txPackets = 0;         // new packets started
+        uint32_t txFrames = 0;          // frames put on air including retransmits
+        uint32_t retransmits = 0;
+        uint32_t maxRetries = 0;        // MAX_RT events
+        uint32_t acksReceived = 0;
+        uint32_t ackPayloadsReceived = 0;
+        uint32_t rxPackets = 0;
+        uint32_t duplicates = 0;
+        uint32_t rxOverflows = 0;
+        uint32_t acksSent = 0;
+        Nanos airTime = 0;              // total time spent transmitting
+    };
+    const Stats& getStats() const { return m_Stats; }
+    void resetStats() { m_Stats = Stats(); }
+
+    // Component
+    Nanos nextEvent() const override { return m_EventTime; }
+    void process(Nanos now) override;
+    // PinListener
+    void onPinChange(uint8_t pin, uint8_t level) override;
+    // SpiDevice
+    bool spiSelected() const override { return m_Selected; }
+    uint8_t spiTransfer(uint8_t data) override;
+
+private:
+    friend class VirtualEther;
+
+    enum { RF_CH_REG = 0x05 };
+    enum State
+    {
+        POWER_DOWN,
+        START_UP,       // crystal oscillator start up after PWR_UP
+        STANDBY,
+        RX_SETTLE,
+        RX,
+        TX_SETTLE,
+        TX,
+        TX_WAIT_ACK,
+        ACK_SETTLE,     // PRX turning around to send an ACK
+        ACK_TX,
+    };
+
+    struct FifoEntry
+    {
+        uint8_t pipe = 0;
+        bool noAck = false;
+        bool sent = false;      // ack payload that has gone out at least once
+        uint8_t size = 0;
+        uint8_t data[32] = {};
+    };
+
+    void select(bool selected);
+    uint8_t transferByte(uint8_t data);
+    void completeCommand();
+    uint8_t status() const;
+    uint8_t fifoStatus() const;
+    uint8_t readRegisterByte(uint8_t reg, uint8_t index);
+    void applyRegisterWrite(uint8_t reg);
+    void setState(State state, Nanos duration = NEVER);
+    void evaluate();
+    void startFrame();
+    void finishTx();
+    uint8_t crcBytes() const;
+    uint8_t addressWidth() const;
+    int matchPipe(const AirPacket& packet) const;
+    void fillAirPacket(AirPacket& packet) const;
+    void updateIrq();
+
+    // called by VirtualEther at the end of a frame
+    void onFrame(AirPacket& packet);
+    void onAck(const AirPacket& ack);
+
+    VirtualEther& m_Ether;
+    std::string m_Name;
+    uint8_t m_CePin = 0xFF;
+    uint8_t m_CsnPin = 0xFF;
+    uint8_t m_IrqPin = 0xFF;
+
+    uint8_t m_Regs[32] = {};
+    uint8_t m_RxAddrP0[5] = {};
+    uint8_t m_RxAddrP1[5] = {};
+    uint8_t m_TxAddr[5] = {};
+    uint8_t m_Status = 0;
+    uint8_t m_Rpd = 0;
+    uint8_t m_ArcCount = 0;
+    uint8_t m_LostCount = 0;
+    uint8_t m_Pid = 0;
+    uint8_t m_LastPid[6];
+    uint16_t m_LastCrc[6];
+
+    bool m_Ce = false;
+    bool m_Selected = false;
+    uint8_t m_Command = 0;
+    uint8_t m_Index = 0;
+    uint8_t m_Buffer[33] = {};
+    bool m_PayloadRead = false;
+
+    State m_State = POWER_DOWN;
+    Nanos m_EventTime = NEVER;
+    Nanos m_RxSince = 0;
+    bool m_FrameIsRetry = false;
+    bool m_FrameAfterMaxRt = false;  // left in the FIFO by MAX_RT, same PID again
+    AirPacket m_Frame;
+    AirPacket m_Ack;
+
+    std::deque<FifoEntry> m_TxFifo;
+    std::deque<FifoEntry> m_RxFifo;
+
+    Stats m_Stats;
+};
+
+} // namespace host
+} // namespace mtnrf
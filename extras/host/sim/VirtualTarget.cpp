@@ -0,0 +1,1156 @@
+#include "VirtualTarget.h"
+#include <Arduino.h>
+#include "nRF24L01.h"
+#include "megaTinyNrfUpdater.h"
+#include "bootloader_256.h"
+#include "bootloader_packed.h"
+#include <algorithm>
+#include <functional>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+namespace mtnrf {
+namespace host {
+
+static const TargetDevice devices[] =
+{
+    { "ATtiny202",  { 0x1E, 0x91, 0x23 }, 0x800,  0x40, 64,  128 },
+    { "ATtiny212",  { 0x1E, 0x91, 0x21 }, 0x800,  0x40, 64,  128 },
+    { "ATtiny204",  { 0x1E, 0x91, 0x22 }, 0x800,  0x40, 64,  128 },
+    { "ATtiny214",  { 0x1E, 0x91, 0x20 }, 0x800,  0x40, 64,  128 },
+
+    { "ATtiny402",  { 0x1E, 0x92, 0x27 }, 0x1000, 0x40, 128, 256 },
+    { "ATtiny412",  { 0x1E, 0x92, 0x23 }, 0x1000, 0x40, 128, 256 },
+    { "ATtiny404",  { 0x1E, 0x92, 0x26 }, 0x1000, 0x40, 128, 256 },
+    { "ATtiny414",  { 0x1E, 0x92, 0x22 }, 0x1000, 0x40, 128, 256 },
+    { "ATtiny406",  { 0x1E, 0x92, 0x25 }, 0x1000, 0x40, 128, 256 },
+    { "ATtiny416",  { 0x1E, 0x92, 0x21 }, 0x1000, 0x40, 128, 256 },
+    { "ATtiny417",  { 0x1E, 0x92, 0x20 }, 0x1000, 0x40, 128, 256 },
+
+    { "ATtiny804",  { 0x1E, 0x93, 0x25 }, 0x2000, 0x40, 128, 512 },
+    { "ATtiny814",  { 0x1E, 0x93, 0x22 }, 0x2000, 0x40, 128, 512 },
+    { "ATtiny806",  { 0x1E, 0x93, 0x24 }, 0x2000, 0x40, 128, 512 },
+    { "ATtiny816",  { 0x1E, 0x93, 0x21 }, 0x2000, 0x40, 128, 512 },
+    { "ATtiny807",  { 0x1E, 0x93, 0x23 }, 0x2000, 0x40, 128, 512 },
+    { "ATtiny817",  { 0x1E, 0x93, 0x20 }, 0x2000, 0x40, 128, 512 },
+
+    { "ATtiny1604", { 0x1E, 0x94, 0x25 }, 0x4000, 0x40, 256, 1024 },
+    { "ATtiny1614", { 0x1E, 0x94, 0x22 }, 0x4000, 0x40, 256, 2048 },
+    { "ATtiny1606", { 0x1E, 0x94, 0x24 }, 0x4000, 0x40, 256, 1024 },
+    { "ATtiny1616", { 0x1E, 0x94, 0x21 }, 0x4000, 0x40, 256, 2048 },
+    { "ATtiny1607", { 0x1E, 0x94, 0x23 }, 0x4000, 0x40, 256, 1024 },
+    { "ATtiny1617", { 0x1E, 0x94, 0x20 }, 0x4000, 0x40, 256, 2048 },
+
+    { "ATtiny3214", { 0x1E, 0x95, 0x20 }, 0x8000, 0x80, 256, 2048 },
+    { "ATtiny3216", { 0x1E, 0x95, 0x21 }, 0x8000, 0x80, 256, 2048 },
+    { "ATtiny3217", { 0x1E, 0x95, 0x22 }, 0x8000, 0x80, 256, 2048 },
+};
+
+const TargetDevice* TargetDevice::find(const char* name)
+{
+    for (const TargetDevice& device : devices)
+        if (strcasecmp(device.name, name) == 0)
+            return &device;
+    return nullptr;
+}
+
+const TargetDevice* TargetDevice::find(const uint8_t* signature)
+{
+    for (const TargetDevice& device : devices)
+        if (memcmp(device.signature, signature, 3) == 0)
+            return &device;
+    return nullptr;
+}
+
+// data space addresses used by the bootloader
+enum
+{
+    VPORTB_DIR = 0x0004,
+    VPORTB_OUT = 0x0005,
+    RSTCTRL_RSTFR = 0x0040,
+    RSTCTRL_SWRR = 0x0041,
+    CLKCTRL_MCLKCTRLB = 0x0061,
+    WDT_CTRLA = 0x0100,
+    WDT_STATUS = 0x0101,
+    CRCSCAN_CTRLA = 0x0120,
+    CRCSCAN_CTRLB = 0x0121,
+    CRCSCAN_STATUS = 0x0122,
+    SPI0_CTRLA = 0x0820,
+    SPI0_CTRLB = 0x0821,
+    SPI0_INTFLAGS = 0x0823,
+    SPI0_DATA = 0x0824,
+    NVMCTRL_CTRLA = 0x1000,
+    NVMCTRL_STATUS = 0x1002,
+    SIGROW_START = 0x1100,
+    FUSES_START = 0x1280,
+    USERROW_START = 0x1300,
+    EEPROM_START = 0x1400,
+    MAPPED_PROGMEM_START = 0x8000,
+    COMMAND_BUFFER = 0x3F80,
+};
+
+enum
+{
+    RSTFR_PORF = 0x01,
+    RSTFR_WDRF = 0x08,
+    RSTFR_SWRF = 0x10,
+};
+
+enum { FUSE_WDTCFG, FUSE_BODCFG, FUSE_OSCCFG, FUSE_TCD0CFG = 4, FUSE_SYSCFG0, FUSE_SYSCFG1, FUSE_APPEND, FUSE_BOOTEND };
+
+static const uint8_t CPU_CCP_SPM = 0x9D;
+static const uint8_t CPU_CCP_IOREG = 0xD8;
+// wait_for_command (word address), the PACKED_WRITES build clears r19
+// before the watchdog check, which moves it up a word
+static const uint16_t BOOT_WAIT_FOR_COMMAND = BOOT256_wait_for_command;
+static const uint16_t BOOT_PACKED_WAIT_FOR_COMMAND = PACKED_wait_for_command;
+static const uint8_t CONFIG_RX = _BV(MASK_RX_DR) | _BV(MASK_TX_DS) | _BV(MASK_MAX_RT) | _BV(CRCO) | _BV(EN_CRC) | _BV(PWR_UP) | _BV(PRIM_RX);
+static const uint8_t SETUP_VALUE = _BV(RF_PWR_LOW) | _BV(RF_PWR_HIGH) | _BV(RF_DR_HIGH);
+
+// the first flash page BootLoader::changeRadioSettings writes, with the
+// jumps back into the bootloader relative to the start of the app.  0 stands
+// for the ldi r24, W_REGISTER | RF_SETUP between them.
+static bool isChannelSwitcher(const uint8_t* code, uint16_t appStart, uint16_t waitForCommand)
+{
+    const uint16_t targets[] = { waitForCommand, BOOT256_nrf24_set_config_r21, 0, BOOT256_nrf24_command_data_x,
+        BOOT256_start_bootloader_custom_channel };
+    static const uint16_t opcodes[] = { 0xC000, 0xD000, 0xE286, 0xD000, 0xC000 };
+    if (code[0] != 0x03 || code[1] != 0xFC)
+        return false;
+    for (int i = 0; i < 5; ++i)
+    {
+        uint16_t pc = appStart / 2 + 1 + i;
+        uint16_t expected = targets[i] ? opcodes[i] | ((targets[i] - pc - 1) & 0xFFF) : opcodes[i];
+        if ((code[2 + i * 2] | (code[3 + i * 2] << 8)) != expected)
+            return false;
+    }
+    return true;
+}
+
+// the first flash page BootLoader::joinGroup writes: ldi r29, 0x3F /
+// sbrc r0, WDRF / rjmp wait_for_command / cpi r26, lo8(data) /
+// ldi r18, hi8(data) ...  returns the address of the group's radio
+// address and channel or 0.
+static uint16_t groupSwitcherData(const uint8_t* code)
+{
+    uint16_t ldi29 = code[0] | (code[1] << 8);
+    uint16_t sbrc = code[2] | (code[3] << 8);
+    uint16_t cpi26 = code[6] | (code[7] << 8);
+    uint16_t ldi18 = code[8] | (code[9] << 8);
+    if (ldi29 != 0xE3DF || sbrc != 0xFC03 || (cpi26 & 0xF0F0) != 0x30A0 || (ldi18 & 0xF0F0) != 0xE020)
+        return 0;
+    return (cpi26 & 15) | ((cpi26 >> 4) & 0xF0) | ((ldi18 & 15) << 8) | ((ldi18 << 4) & 0xF000);
+}
+
+// the jump to the stage-2 updater that BootLoader::beginCompressed writes:
+// ldi r30, lo8(entry) / ldi r31, hi8(entry) / ijmp.  returns the updater's
+// byte address or 0.
+static uint16_t updaterEntry(const uint8_t* code)
+{
+    uint16_t ldi30 = code[0] | (code[1] << 8);
+    uint16_t ldi31 = code[2] | (code[3] << 8);
+    uint16_t ijmp = code[4] | (code[5] << 8);
+    if ((ldi30 & 0xF0F0) != 0xE0E0 || (ldi31 & 0xF0F0) != 0xE0F0 || ijmp != 0x9409)
+        return 0;
+    uint16_t entry = (ldi30 & 15) | ((ldi30 >> 4) & 0xF0) | ((ldi31 & 15) << 8) | ((ldi31 << 4) & 0xF000);
+    return entry * 2;
+}
+
+VirtualTarget::VirtualTarget(VirtualEther& ether, const TargetDevice& device, const char* name)
+:   m_Device(device)
+,   m_Radio(ether, name)
+,   m_Flash(device.flashSize, 0xFF)
+,   m_Eeprom(device.eepromSize, 0xFF)
+,   m_Sram(device.sramSize, 0)
+,   m_SetupValue(SETUP_VALUE)
+,   m_Cpu(*this, device.flashSize)
+{
+    // defaults from fuses.c
+    static const uint8_t defaultFuses[] = { 0x08, 0x00, 0x01, 0xFF, 0x00, 0xC4, 0x04, 0x00, 0x01, 0xFF, 0xC5 };
+    memcpy(m_Fuses, defaultFuses, sizeof(m_Fuses));
+    memset(m_UserRow, 0xFF, sizeof(m_UserRow));
+    memcpy(m_UserRow, "001\x32", 4);
+    memset(m_PageBuffer, 0xFF, sizeof(m_PageBuffer));
+    memcpy(&m_Io[SIGROW_START], device.signature, 3);
+    Scheduler::instance().add(this);
+}
+
+VirtualTarget::~VirtualTarget()
+{
+    Scheduler::instance().remove(this);
+}
+
+static int hexByte(const char* s)
+{
+    unsigned value;
+    return sscanf(s, "%2x", &value) == 1 ? (int) value : -1;
+}
+
+// calls store() with each data byte of an Intel HEX file and its address
+static bool readHex(const char* filename, const std::function<void(uint32_t, uint8_t)>& store)
+{
+    FILE* file = fopen(filename, "r");
+    if (!file)
+        return false;
+    char line[600];
+    uint32_t base = 0;
+    bool ok = true;
+    while (ok && fgets(line, sizeof(line), file))
+    {
+        if (line[0] != ':')
+            continue;
+        int count = hexByte(line + 1);
+        int addrhi = hexByte(line + 3);
+        int addrlo = hexByte(line + 5);
+        int type = hexByte(line + 7);
+        if (count < 0 || addrhi < 0 || addrlo < 0 || type < 0 || strlen(line) < 11u + count * 2)
+        {
+            ok = false;
+            break;
+        }
+        uint8_t data[256];
+        for (int i = 0; i < count; ++i)
+            data[i] = hexByte(line + 9 + i * 2);
+        if (type == 1)
+            break;
+        if (type == 4 && count == 2)
+        {
+            base = (data[0] << 24) | (data[1] << 16);
+            continue;
+        }
+        if (type != 0)
+            continue;
+        uint32_t address = base + (addrhi << 8) + addrlo;
+        for (int i = 0; i < count; ++i)
+            store(address + i, data[i]);
+    }
+    fclose(file);
+    return ok;
+}
+
+bool VirtualTarget::loadHex(const char* filename)
+{
+    return readHex(filename, [this](uint32_t address, uint8_t data) {
+        // avr-objcopy section addresses
+        if (address < 0x800000)
+        {
+            if (address < m_Flash.size())
+                m_Flash[address] = data;
+        }
+        else if (address >= 0x810000 && address < 0x810000 + m_Eeprom.size())
+            m_Eeprom[address - 0x810000] = data;
+        else if (address >= 0x820000 && address < 0x820000 + sizeof(m_Fuses))
+            m_Fuses[address - 0x820000] = data;
+        else if (address >= 0x850000 && address < 0x850000 + sizeof(m_UserRow))
+            m_UserRow[address - 0x850000] = data;
+    });
+}
+
+bool VirtualTarget::loadBootSection(const char* filename)
+{
+    std::vector<uint8_t> flash(m_Flash.size(), 0xFF);
+    uint8_t bootEnd = 0;
+    bool ok = readHex(filename, [&](uint32_t address, uint8_t data) {
+        if (address < flash.size())
+            flash[address] = data;
+        else if (address == 0x820000 + FUSE_BOOTEND)
+            bootEnd = data;
+    });
+    if (!ok || bootEnd == 0)
+        return false;
+    m_Fuses[FUSE_BOOTEND] = bootEnd;
+    std::copy(flash.begin(), flash.begin() + getAppStart(), m_Flash.begin());
+    return true;
+}
+
+uint32_t VirtualTarget::getCpuClock() const
+{
+    // the bootloader leaves the main clock prescaler at its reset value of 6,
+    // the stage-2 updater changes it to 2
+    uint32_t oscillator = (m_Fuses[FUSE_OSCCFG] & 3) == 2 ? 20000000 : 16000000;
+    return oscillator / m_ClockDivider;
+}
+
+Nanos VirtualTarget::getWatchdogTimeout() const
+{
+    // WDT.CTRLA, loaded from the WDTCFG fuse at reset
+    uint8_t period = m_Io[WDT_CTRLA] & 0x0F;
+    if (period == 0 || period > 0x0B)
+        return NEVER;
+    // 8 << (period - 1) cycles of the 1.024kHz ULP oscillator
+    return (Nanos) (8u << (period - 1)) * 1000000000ull / 1024;
+}
+
+uint16_t VirtualTarget::getAppStart() const
+{
+    return m_Fuses[FUSE_BOOTEND] * 256;
+}
+
+bool VirtualTarget::inBootLoader() const
+{
+    if (m_Emulated)
+    {
+        // the radio functions the application calls return to it
+        uint16_t pc = m_Cpu.getPc();
+        size_t top = m_Sram.size();
+        if (m_Cpu.getSp() < 0x3FFE)
+            pc = ((m_Sram[top - 2] << 8) | m_Sram[top - 1]) * 2;
+        return m_State == RUN && pc < getAppStart();
+    }
+    return m_State >= BOOT && m_State <= READ_PAYLOAD;
+}
+
+uint16_t VirtualTarget::flashCrc(uint16_t start, uint16_t end, uint16_t crc) const
+{
+    for (uint32_t i = start; i < end; ++i)
+    {
+        crc ^= m_Flash[i] << 8;
+        for (int b = 0; b < 8; ++b)
+            crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+    }
+    return crc;
+}
+
+Nanos VirtualTarget::cycles(uint32_t count) const
+{
+    return (Nanos) count * 1000000000ull / getCpuClock();
+}
+
+void VirtualTarget::schedule(State state, Nanos when)
+{
+    m_State = state;
+    m_Next = when > m_HaltedUntil ? when : m_HaltedUntil;
+}
+
+Nanos VirtualTarget::nextEvent() const
+{
+    return m_Next < m_WatchdogDeadline ? m_Next : m_WatchdogDeadline;
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// reset and radio set up
+
+bool VirtualTarget::useExtendedBootLoader()
+{
+    if (!loadBootSection(MTNRF_EXTENDED_BOOTLOADER_HEX))
+        return false;
+    m_Extended = true;
+    return true;
+}
+
+bool VirtualTarget::usePackedWrites()
+{
+    if (!loadBootSection(MTNRF_PACKED_BOOTLOADER_HEX))
+        return false;
+    m_Extended = true;
+    m_PackedWrites = true;
+    return true;
+}
+
+void VirtualTarget::powerOn()
+{
+    m_Rstfr = 0;
+    reset(RSTFR_PORF);
+}
+
+void VirtualTarget::reset(uint8_t flags)
+{
+    static const uint8_t startUpMs[] = { 0, 1, 2, 4, 8, 16, 32, 64 };
+    ++m_Stats.resets;
+    m_Rstfr |= flags;
+    m_ClockDivider = 6;
+    m_PageRegion = REGION_NONE;
+    memset(m_PageLoaded, 0, sizeof(m_PageLoaded));
+    memset(m_PageBuffer, 0xFF, sizeof(m_PageBuffer));
+    m_HaltedUntil = 0;
+    m_CrcBusyUntil = 0;
+    m_Io[CRCSCAN_CTRLA] = 0;
+    m_Io[WDT_CTRLA] = m_Fuses[FUSE_WDTCFG];
+    // a watchdog configured by fuse is locked
+    m_Io[WDT_STATUS] = m_Fuses[FUSE_WDTCFG] ? 0x80 : 0;
+    if (m_Emulated)
+    {
+        // ports back to inputs, SPI off
+        memset(m_Io, 0, 0x10);
+        memset(&m_Io[SPI0_CTRLA], 0, 5);
+        m_SpiPending = false;
+        updateCsn();
+        // CE is tied high
+        m_Radio.setCe(true);
+    }
+    Nanos startUp = millis(startUpMs[m_Fuses[FUSE_SYSCFG1] & 7]);
+    schedule(RESET, now() + startUp);
+    // the watchdog is enabled by fuse and runs from reset
+    Nanos timeout = getWatchdogTimeout();
+    m_WatchdogDeadline = timeout == NEVER ? NEVER : m_Next + timeout;
+}
+
+void VirtualTarget::configureRadio()
+{
+    // radio_registers table
+    m_Radio.writeRegister(CONFIG, 0);
+    m_Radio.writeRegister(EN_AA, 0x3F);
+    m_Radio.writeRegister(SETUP_AW, 1);
+    m_Radio.writeRegister(SETUP_RETR, 0x7F);
+    m_Radio.writeRegister(RF_SETUP, m_SetupValue);
+    m_Radio.writeRegister(DYNPD, 0x3F);
+    m_Radio.writeRegister(RX_ADDR_P5, 'P');
+    m_Radio.writeRegister(FEATURE, _BV(EN_DPL) | _BV(EN_ACK_PAY) | _BV(EN_DYN_ACK));
+    // address and channel from USERROW
+    uint8_t address[3];
+    for (uint8_t i = 0; i < 3; ++i)
+        address[i] = readData(USERROW_START + i);
+    m_Radio.writeRegister(TX_ADDR, address, 3);
+    m_Radio.writeRegister(RX_ADDR_P0, address, 3);
+    m_Radio.writeRegister(RX_ADDR_P1, address, 3);
+    m_X = USERROW_START + 3;
+    m_Radio.writeRegister(RF_CH, readData(m_X++));
+    beginRx();
+}
+
+void VirtualTarget::beginRx()
+{
+    m_Radio.writeRegister(EN_RXADDR, _BV(5));
+    m_Radio.writeRegister(CONFIG, CONFIG_RX);
+    m_R21 = CONFIG_RX;
+    m_Radio.setCe(true);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// main loop
+
+void VirtualTarget::process(Nanos t)
+{
+    if (t >= m_WatchdogDeadline)
+    {
+        ++m_Stats.watchdogResets;
+        reset(RSTFR_WDRF);
+        return;
+    }
+    if (t < m_Next)
+        return;
+
+    switch (m_State)
+    {
+    case RESET:
+        if (m_Emulated)
+        {
+            m_Cpu.reset(0x3FFF);
+            schedule(RUN, t);
+            runCpu(t);
+            break;
+        }
+        schedule(BOOT, t);
+        // fall through
+    case BOOT:
+    {
+        configureRadio();
+        // read and clear the reset flags
+        m_R0 = m_Rstfr;
+        m_Rstfr = 0;
+        m_R20 = -2;
+        if (m_PackedWrites)
+            m_R19 = 0;
+        Nanos done = t + cycles(m_Timing.bootCycles);
+        if (m_R0 & RSTFR_WDRF)
+            schedule(APP, done);
+        else
+            schedule(WRITE_NVM, done);
+        break;
+    }
+    case WRITE_NVM:
+    {
+        // out CPU_CCP, r21 / sts NVMCTRL_CTRLA, PAGEERASEWRITE
+        Nanos halt = m_R21 == CPU_CCP_SPM ? pageEraseWrite() : 0;
+        if (halt)
+        {
+            m_Stats.nvmBusyTime += halt;
+            m_HaltedUntil = t + halt;
+            schedule(ACK_PAYLOAD, t);
+            break;
+        }
+    }
+        // fall through
+    case ACK_PAYLOAD:
+    {
+        // send back r20 + 1 bytes from X: the byte following the written
+        // data, or the memory asked for by a read command
+        uint8_t count = m_R20 > 0 ? m_R20 + 1 : 1;
+        uint8_t payload[32];
+        for (uint8_t i = 0; i < count && i < 32; ++i)
+            payload[i] = readData(m_X + i);
+        m_Radio.command(W_ACK_PAYLOAD | 5, payload, count < 32 ? count : 32);
+        m_R20 = m_R20 > 0 ? -1 : m_R20 - 1;
+        // wait_for_command
+        m_R2 = m_X + count;
+        m_X = COMMAND_BUFFER;
+        schedule(POLL, t + cycles(m_Timing.writeNvmCycles + (count - 1) * m_Timing.ackByteCycles));
+        break;
+    }
+    case POLL:
+    {
+        uint8_t status = m_Radio.command(NOP);
+        if ((status & 0x0E) == 0x0E)
+        {
+            schedule(POLL, t + cycles(m_Timing.pollCycles));
+            break;
+        }
+        // wdr
+        Nanos timeout = getWatchdogTimeout();
+        m_WatchdogDeadline = timeout == NEVER ? NEVER : t + timeout;
+        m_Radio.command(R_RX_PL_WID, &m_ReadWidth, 1);
+        uint16_t bytes = m_ReadWidth ? m_ReadWidth : 256;
+        schedule(READ_PAYLOAD, t + cycles(m_Timing.pollCycles + m_Timing.readCycles + bytes * m_Timing.readByteCycles));
+        break;
+    }
+    case READ_PAYLOAD:
+        readPayload(t);
+        break;
+    case APP:
+        enterApp(t);
+        break;
+    case RUN:
+        runCpu(t);
+        break;
+    case UPDATER_POLL:
+    {
+        uint8_t status = m_Radio.command(NOP);
+        if ((status & 0x0E) == 0x0E)
+        {
+            schedule(UPDATER_POLL, t + cycles(m_Timing.pollCycles));
+            break;
+        }
+        // wdr
+        Nanos timeout = getWatchdogTimeout();
+        m_WatchdogDeadline = timeout == NEVER ? NEVER : t + timeout;
+        uint8_t width;
+        m_Radio.command(R_RX_PL_WID, &width, 1);
+        memset(m_Updater.packet, 0, sizeof(m_Updater.packet));
+        m_Radio.command(R_RX_PAYLOAD, m_Updater.packet, width < 32 ? width : 32);
+        ++m_Stats.packets;
+        handleUpdaterPacket(t + cycles(m_Timing.pollCycles + m_Timing.readCycles + width * m_Timing.readByteCycles));
+        break;
+    }
+    case APP_POLL:
+    {
+        // nrf24_poll_reset: software reset when a packet arrives in pipe 5
+        Nanos timeout = getWatchdogTimeout();
+        m_WatchdogDeadline = timeout == NEVER ? NEVER : t + timeout;
+        uint8_t status = m_Radio.command(NOP);
+        if ((status & 0x0E) == 0x0A)
+            reset(RSTFR_SWRF);
+        else
+            schedule(APP_POLL, t + cycles(m_Timing.appPollCycles));
+        break;
+    }
+    default:
+        m_Next = NEVER;
+        break;
+    }
+}
+
+void VirtualTarget::readPayload(Nanos t)
+{
+    uint8_t payload[32] = {};
+    uint16_t bytes = m_ReadWidth ? m_ReadWidth : 256;
+    m_Radio.command(R_RX_PAYLOAD, payload, bytes < 32 ? bytes : 32);
+    ++m_Stats.packets;
+    for (uint16_t i = 0; i < bytes; ++i)
+        writeData(m_X++, i < 32 ? payload[i] : 0);
+
+    if (--m_R20 == 0)
+    {
+        schedule(WRITE_NVM, t);
+    }
+    else if (m_R20 > 0)
+    {
+        schedule(POLL, t);
+    }
+    else if (m_PackedWrites && m_ReadWidth == 32 && m_R19)
+    {
+        // next_page: a full packet in place of a command starts the page
+        // after the last write, r21 is still CPU_CCP_SPM
+        ++m_Stats.pagesWithoutCommand;
+        m_X = m_R2 - 1;
+        for (uint8_t i = 0; i < 32; ++i)
+            writeData(m_X++, readData(COMMAND_BUFFER + i));
+        m_R20 = m_R19 - 1;
+        Nanos done = t + cycles(m_Timing.commandCycles + 32 * m_Timing.copyByteCycles);
+        schedule(m_R20 == 0 ? WRITE_NVM : POLL, done);
+    }
+    else
+    {
+        // read_command
+        ++m_Stats.commands;
+        m_R21 = readData(COMMAND_BUFFER);
+        m_R20 = (int8_t) readData(COMMAND_BUFFER + 1);
+        m_X = readData(COMMAND_BUFFER + 2) | (readData(COMMAND_BUFFER + 3) << 8);
+        Nanos done = t + cycles(m_Timing.commandCycles);
+        if (m_R21 != CPU_CCP_SPM)
+        {
+            schedule(APP, done);
+        }
+        else if (m_Extended && m_ReadWidth > 4)
+        {
+            // read memory command
+            ++m_Stats.readCommands;
+            m_R20 = (int8_t) readData(COMMAND_BUFFER + 4);
+            m_X = readData(COMMAND_BUFFER + 5) | (readData(COMMAND_BUFFER + 6) << 8);
+            schedule(ACK_PAYLOAD, done + cycles(7));
+        }
+        else
+        {
+            // packets per page that can follow a write with bit 7 of its
+            // count set, not changed by a sync's 0
+            if (m_PackedWrites && m_R20 < 0)
+            {
+                m_R20 &= 0x7F;
+                m_R19 = m_R20;
+            }
+            else if (m_PackedWrites && m_R20 > 0)
+            {
+                m_R19 = 0;
+            }
+            schedule(POLL, done);
+        }
+    }
+}
+
+void VirtualTarget::enterApp(Nanos t)
+{
+    const uint8_t* app = &m_Flash[getAppStart()];
+    uint16_t waitForCommand = m_PackedWrites ? BOOT_PACKED_WAIT_FOR_COMMAND : BOOT_WAIT_FOR_COMMAND;
+    if (isChannelSwitcher(app, getAppStart(), waitForCommand))
+    {
+        if (m_R0 & RSTFR_WDRF)
+        {
+            // watchdog reset: back to the bootloader on the USERROW channel
+            m_X = COMMAND_BUFFER;
+            schedule(POLL, t + cycles(4));
+            return;
+        }
+        // nrf24_set_config_r21, RF_SETUP from X by nrf24_command_data_x,
+        // then start_bootloader_custom_channel
+        m_Radio.writeRegister(CONFIG, m_R21);
+        m_Radio.writeRegister(RF_SETUP, readData(m_X++));
+        m_Radio.writeRegister(RF_CH, readData(m_X++));
+        m_R20 -= 2;
+        beginRx();
+        if (m_PackedWrites)
+            m_R19 = 0;
+        m_R0 = m_Rstfr;
+        m_Rstfr = 0;
+        schedule(m_R0 & RSTFR_WDRF ? APP : WRITE_NVM, t + cycles(300));
+    }
+    else if (uint16_t data = groupSwitcherData(app))
+    {
+        if ((m_R0 & RSTFR_WDRF) || (m_X != data && m_X != USERROW_START))
+        {
+            // watchdog reset: stay in the bootloader on the USERROW address.
+            // otherwise a packet taken for a command after a missed one, and
+            // the next packet is read as a command
+            if (!(m_R0 & RSTFR_WDRF))
+                m_R20 = 0;
+            m_X = COMMAND_BUFFER;
+            schedule(POLL, t + cycles(8));
+            return;
+        }
+        // join the group at X or go back to the address and channel in
+        // USERROW: nrf24_set_config_r21, RX_ADDR_P1 from X, then
+        // start_bootloader_custom_channel
+        m_Radio.writeRegister(CONFIG, m_R21);
+        uint8_t address[3];
+        for (uint8_t i = 0; i < 3; ++i)
+            address[i] = readData(m_X++);
+        m_Radio.writeRegister(RX_ADDR_P1, address, 3);
+        m_Radio.writeRegister(RF_CH, readData(m_X++));
+        m_R20 = -2;
+        beginRx();
+        if (m_PackedWrites)
+            m_R19 = 0;
+        m_R0 = m_Rstfr;
+        m_Rstfr = 0;
+        schedule(m_R0 & RSTFR_WDRF ? APP : WRITE_NVM, t + cycles(400));
+    }
+    else if (uint16_t entry = updaterEntry(app))
+    {
+        if (m_Flash[entry] == 0xFF && m_Flash[entry + 1] == 0xFF)
+            schedule(BOOT, t + cycles((m_Device.flashSize - entry) / 2));
+        else
+            enterUpdater(t);
+    }
+    else if (app[0] == 0xFF && app[1] == 0xFF)
+    {
+        // erased flash executes through to the end and wraps round to the
+        // reset vector without setting any reset flags
+        schedule(BOOT, t + cycles((m_Device.flashSize - (app - &m_Flash[0])) / 2));
+    }
+    else
+    {
+        schedule(APP_POLL, t + cycles(m_Timing.appPollCycles));
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// stage-2 updater
+
+void VirtualTarget::enterUpdater(Nanos t)
+{
+    ++m_Stats.updaterEntries;
+    m_ClockDivider = 2;
+    t += cycles(m_Timing.updaterEntryCycles);
+    // finish the packet that was being decompressed before the last page
+    // write, then carry on with the one that started the application
+    if (m_Updater.valid && decompress(t))
+        return;
+    for (uint8_t i = 0; i < 32; ++i)
+        m_Updater.packet[i] = readData(COMMAND_BUFFER + i);
+    writeData(COMMAND_BUFFER, 0);
+    handleUpdaterPacket(t);
+}
+
+void VirtualTarget::handleUpdaterPacket(Nanos t)
+{
+    Updater& u = m_Updater;
+    u.packetPos = UPDATER_PACKET_SIZE;
+    if (u.packet[0] != UPDATER_PACKET)
+    {
+        // sync packets are ignored, anything else waits to be reset
+        if (u.packet[0] == CPU_CCP_SPM && u.packet[1] == 0)
+            schedule(UPDATER_POLL, t);
+        else
+            schedule(APP_POLL, t);
+        return;
+    }
+    switch (u.packet[1])
+    {
+    case UPDATER_START:
+        u.start = u.packet[2] | (u.packet[3] << 8);
+        u.end = u.packet[4] | (u.packet[5] << 8);
+        u.pos = u.start;
+        u.decoder.begin();
+        u.status = UPDATER_BUSY;
+        u.valid = true;
+        // fall through
+    case UPDATER_QUERY:
+    {
+        uint8_t id[] = { 'M', 'T', 'Z', '2' };
+        m_Radio.command(FLUSH_TX);
+        m_Radio.command(W_ACK_PAYLOAD | 5, id, sizeof(id));
+        break;
+    }
+    case UPDATER_DATA:
+        if (!u.valid)
+        {
+            if (u.status == UPDATER_OK || u.status == UPDATER_BUSY)
+                u.status = UPDATER_NOT_STARTED;
+            returnToBootLoader(t, false);
+            return;
+        }
+        u.packetPos = 2;
+        if (decompress(t))
+            return;
+        break;
+    case UPDATER_END:
+        if (!u.valid)
+        {
+            if (u.status == UPDATER_BUSY)
+                u.status = UPDATER_NOT_STARTED;
+            returnToBootLoader(t, false);
+            return;
+        }
+        u.valid = false;
+        if (u.pos != u.end)
+        {
+            u.status = UPDATER_INCOMPLETE;
+            returnToBootLoader(t, false);
+            return;
+        }
+        u.status = UPDATER_OK;
+        for (uint8_t i = 0; i < m_Device.pageSize; ++i)
+            writeData(MAPPED_PROGMEM_START + u.start + i, u.firstPage[i]);
+        returnToBootLoader(t + cycles(m_Device.pageSize * m_Timing.updaterCopyCycles), true);
+        return;
+    }
+    schedule(UPDATER_POLL, t);
+}
+
+bool VirtualTarget::decompress(Nanos& t)
+{
+    Updater& u = m_Updater;
+    uint8_t pageSize = m_Device.pageSize;
+    for (;;)
+    {
+        int16_t c;
+        if (u.decoder.copying())
+        {
+            uint16_t distance = u.decoder.getDistance();
+            if (distance > u.pos - u.start)
+            {
+                u.status = UPDATER_BAD_REFERENCE;
+                u.valid = false;
+                returnToBootLoader(t, false);
+                return true;
+            }
+            uint16_t address = u.pos - distance;
+            if (address - u.start < pageSize)
+                c = u.firstPage[address - u.start];
+            else if (address >= (u.pos & ~(pageSize - 1)))
+                c = u.page[address & (pageSize - 1)];
+            else
+                c = m_Flash[address];
+            u.decoder.copied();
+        }
+        else if (u.packetPos < UPDATER_PACKET_SIZE)
+        {
+            c = u.decoder.decode(u.packet[u.packetPos++]);
+            if (c < 0)
+                continue;
+        }
+        else
+        {
+            return false;
+        }
+        t += cycles(m_Timing.updaterByteCycles);
+        // anything after the end is padding
+        if (u.pos == u.end)
+            continue;
+        uint8_t* buffer = u.pos - u.start < pageSize ? u.firstPage : u.page;
+        buffer[u.pos & (pageSize - 1)] = c;
+        if ((++u.pos & (pageSize - 1)) == 0 && buffer == u.page)
+        {
+            uint16_t address = u.pos - pageSize;
+            for (uint8_t i = 0; i < pageSize; ++i)
+                writeData(MAPPED_PROGMEM_START + address + i, u.page[i]);
+            returnToBootLoader(t + cycles(pageSize * m_Timing.updaterCopyCycles), true);
+            return true;
+        }
+    }
+}
+
+void VirtualTarget::returnToBootLoader(Nanos t, bool writePage)
+{
+    // the status byte lives in the updater's .noinit RAM
+    uint16_t status = 0x4000 - m_Device.sramSize;
+    writeData(status, m_Updater.status);
+    m_R19 = 0;
+    m_R20 = 0;
+    m_R21 = CPU_CCP_SPM;
+    m_X = status;
+    schedule(writePage ? WRITE_NVM : ACK_PAYLOAD, t);
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// instruction emulator
+
+void VirtualTarget::runCpu(Nanos t)
+{
+    // run ahead of the rest of the simulation until an instruction touches
+    // something outside the CPU and its memories, then wait for time to
+    // catch up.  the limit keeps a loop that never does any I/O from
+    // holding everything else up.
+    m_CpuTime = t;
+    while (m_CpuTime < m_WatchdogDeadline && m_CpuTime < t + micros(100))
+    {
+        if (m_CpuTime > t && cpuSyncs(m_Cpu.nextDataAddress()))
+            break;
+        if (m_InstructionHook)
+            m_InstructionHook(*this);
+        uint8_t count = m_Cpu.step();
+        // a software reset has already scheduled the start up
+        if (m_State != RUN)
+            return;
+        m_CpuTime += cycles(count);
+        if (m_HaltedUntil > m_CpuTime)
+            m_CpuTime = m_HaltedUntil;
+    }
+    schedule(RUN, m_CpuTime);
+}
+
+bool VirtualTarget::cpuSyncs(int32_t address) const
+{
+    // SRAM, EEPROM, flash and the CPU's own registers are only seen by the
+    // CPU and neither is polling for the end of an SPI transfer
+    if (address < 0 || address >= EEPROM_START || address == SPI0_INTFLAGS)
+        return false;
+    return address < 0x34 || address > 0x3F;
+}
+
+uint8_t VirtualTarget::readFlash(uint16_t address)
+{
+    return address < m_Flash.size() ? m_Flash[address] : 0xFF;
+}
+
+uint8_t VirtualTarget::read(uint16_t address)
+{
+    switch (address)
+    {
+    case SPI0_INTFLAGS:
+        // RXCIF once the byte has been clocked through
+        return m_SpiPending && m_Cpu.getCycles() >= m_SpiDoneCycle ? 0x80 : 0;
+    case SPI0_DATA:
+        m_SpiPending = false;
+        return m_SpiData;
+    }
+    return readData(address);
+}
+
+void VirtualTarget::write(uint16_t address, uint8_t value)
+{
+    bool ioreg = m_Cpu.getCcp() == CPU_CCP_IOREG;
+    switch (address)
+    {
+    case VPORTB_DIR:
+    case VPORTB_OUT:
+        m_Io[address] = value;
+        updateCsn();
+        return;
+    case RSTCTRL_SWRR:
+        if (ioreg && (value & 1))
+            reset(RSTFR_SWRF);
+        return;
+    case CLKCTRL_MCLKCTRLB:
+    {
+        static const uint8_t dividers[16] = { 2, 4, 8, 16, 32, 64, 1, 1, 6, 10, 12, 24, 48, 1, 1, 1 };
+        if (ioreg)
+        {
+            m_Io[address] = value;
+            m_ClockDivider = value & 1 ? dividers[(value >> 1) & 15] : 1;
+        }
+        return;
+    }
+    case WDT_CTRLA:
+        if (ioreg && !(m_Io[WDT_STATUS] & 0x80))
+        {
+            m_Io[address] = value;
+            Nanos timeout = getWatchdogTimeout();
+            m_WatchdogDeadline = timeout == NEVER ? NEVER : now() + timeout;
+        }
+        return;
+    case WDT_STATUS:
+        if (ioreg)
+            m_Io[address] |= value & 0x80;
+        return;
+    case SPI0_DATA:
+    {
+        if (!(m_Io[SPI0_CTRLA] & 1))
+            return;
+        // SCK is CLK_PER / prescaler, doubled by CLK2X
+        static const uint8_t prescalers[] = { 4, 16, 64, 128 };
+        uint16_t clocks = 8 * prescalers[(m_Io[SPI0_CTRLA] >> 1) & 3];
+        if (m_Io[SPI0_CTRLA] & 0x10)
+            clocks /= 2;
+        // MISO floats high when the radio isn't selected
+        m_SpiData = m_Radio.spiSelected() ? m_Radio.spiTransfer(value) : 0xFF;
+        m_SpiPending = true;
+        m_SpiDoneCycle = m_Cpu.getCycles() + clocks;
+        return;
+    }
+    case SPI0_INTFLAGS:
+        return;
+    case NVMCTRL_CTRLA:
+        if (m_Cpu.getCcp() == CPU_CCP_SPM)
+            nvmCommand(value & 7);
+        return;
+    }
+    if (address < 0x10)
+    {
+        m_Io[address] = value;
+        return;
+    }
+    writeData(address, value);
+}
+
+void VirtualTarget::watchdogReset()
+{
+    Nanos timeout = getWatchdogTimeout();
+    m_WatchdogDeadline = timeout == NEVER ? NEVER : m_CpuTime + timeout;
+}
+
+void VirtualTarget::updateCsn()
+{
+    // PB0, pulled up while it's an input
+    m_Radio.setCsn(!(m_Io[VPORTB_DIR] & 1) || (m_Io[VPORTB_OUT] & 1));
+}
+
+void VirtualTarget::nvmCommand(uint8_t command)
+{
+    enum { WRITE = 1, ERASE, ERASE_WRITE, PAGE_BUFFER_CLEAR };
+    if (command == PAGE_BUFFER_CLEAR)
+    {
+        memset(m_PageLoaded, 0, sizeof(m_PageLoaded));
+        memset(m_PageBuffer, 0xFF, sizeof(m_PageBuffer));
+        m_PageRegion = REGION_NONE;
+        return;
+    }
+    // a separate write or erase is taken as an erase-write
+    if (command < WRITE || command > ERASE_WRITE)
+        return;
+    Nanos halt = pageEraseWrite();
+    if (halt)
+    {
+        m_Stats.nvmBusyTime += halt;
+        m_HaltedUntil = now() + halt;
+    }
+}
+
+///////////////////////////////////////////////////////////////////////////////
+// data space
+
+uint8_t VirtualTarget::readData(uint16_t address)
+{
+    if (address >= MAPPED_PROGMEM_START)
+    {
+        uint16_t offset = address - MAPPED_PROGMEM_START;
+        return offset < m_Flash.size() ? m_Flash[offset] : 0xFF;
+    }
+    uint16_t sramStart = 0x4000 - m_Device.sramSize;
+    if (address >= sramStart && address < 0x4000)
+        return m_Sram[address - sramStart];
+    if (address >= EEPROM_START && address < EEPROM_START + m_Eeprom.size())
+        return m_Eeprom[address - EEPROM_START];
+    if (address >= USERROW_START && address < USERROW_START + sizeof(m_UserRow))
+        return m_UserRow[address - USERROW_START];
+    if (address >= FUSES_START && address < FUSES_START + sizeof(m_Fuses))
+        return m_Fuses[address - FUSES_START];
+    switch (address)
+    {
+    case RSTCTRL_RSTFR:
+        return m_Rstfr;
+    case NVMCTRL_STATUS:
+        return (now() < m_EepromBusyUntil ? 2 : 0) | (m_WriteError ? 4 : 0);
+    case CRCSCAN_STATUS:
+        if (!(m_Io[CRCSCAN_CTRLA] & 1))
+            return 0;
+        if (now() < m_CrcBusyUntil)
+            return 1;
+        return m_CrcOk ? 2 : 0;
+    }
+    return address < sizeof(m_Io) ? m_Io[address] : 0;
+}
+
+void VirtualTarget::writeData(uint16_t address, uint8_t value)
+{
+    Region region = REGION_NONE;
+    uint8_t pageSize = 32;
+    uint16_t sramStart = 0x4000 - m_Device.sramSize;
+    if (address >= MAPPED_PROGMEM_START)
+    {
+        uint16_t offset = address - MAPPED_PROGMEM_START;
+        if (offset < m_Flash.size())
+        {
+            region = REGION_FLASH;
+            pageSize = m_Device.pageSize;
+        }
+    }
+    else if (address >= sramStart && address < 0x4000)
+    {
+        m_Sram[address - sramStart] = value;
+        return;
+    }
+    else if (address >= EEPROM_START && address < EEPROM_START + m_Eeprom.size())
+    {
+        region = REGION_EEPROM;
+    }
+    else if (address >= USERROW_START && address < USERROW_START + sizeof(m_UserRow))
+    {
+        region = REGION_USERROW;
+    }
+    else if (address == RSTCTRL_RSTFR)
+    {
+        m_Rstfr &= ~value;
+        return;
+    }
+    else if (address == NVMCTRL_CTRLA || address == NVMCTRL_STATUS || address < 0x40)
+    {
+        // CCP protected, read only or a port (pins are not modelled)
+        return;
+    }
+    else if (address < sizeof(m_Io) && (address < SIGROW_START || address >= USERROW_START))
+    {
+        m_Io[address] = value;
+        if (address == CRCSCAN_CTRLA && (value & 1))
+            startCrcScan();
+        return;
+    }
+
+    if (region != REGION_NONE)
+    {
+        // load the NVM page buffer, the page address follows the last write
+        m_PageRegion = region;
+        m_PageAddress = address & ~(pageSize - 1);
+        m_PageBuffer[address & (pageSize - 1)] = value;
+        m_PageLoaded[address & (pageSize - 1)] = true;
+    }
+}
+
+Nanos VirtualTarget::pageEraseWrite()
+{
+    m_WriteError = false;
+    bool loaded = false;
+    for (bool l : m_PageLoaded)
+        loaded |= l;
+    // nothing in the page buffer: treated as a no-op (the bootloader issues
+    // the command after every write, including I/O register writes)
+    if (!loaded || m_PageRegion == REGION_NONE)
+        return 0;
+
+    Nanos halt = 0;
+    if (m_PageRegion == REGION_FLASH)
+    {
+        uint16_t offset = m_PageAddress - MAPPED_PROGMEM_START;
+        if (offset < m_Fuses[FUSE_BOOTEND] * 256)
+        {
+            // the boot section can't write itself
+            m_WriteError = true;
+            ++m_Stats.writeErrors;
+        }
+        else
+        {
+            for (uint8_t i = 0; i < m_Device.pageSize; ++i)
+                m_Flash[offset + i] = m_PageLoaded[i] ? m_PageBuffer[i] : 0xFF;
+            ++m_Stats.flashPageWrites;
+            halt = m_Timing.flashPageWrite;
+        }
+    }
+    else
+    {
+        // EEPROM style erase-write of just the loaded bytes
+        uint8_t* target = m_PageRegion == REGION_EEPROM
+            ? &m_Eeprom[m_PageAddress - EEPROM_START]
+            : &m_UserRow[m_PageAddress - USERROW_START];
+        for (uint8_t i = 0; i < 32; ++i)
+            if (m_PageLoaded[i])
+                target[i] = m_PageBuffer[i];
+        ++m_Stats.eepromPageWrites;
+        Nanos start = m_EepromBusyUntil > now() ? m_EepromBusyUntil : now();
+        m_EepromBusyUntil = start + m_Timing.eepromPageWrite;
+    }
+    memset(m_PageLoaded, 0, sizeof(m_PageLoaded));
+    memset(m_PageBuffer, 0xFF, sizeof(m_PageBuffer));
+    m_PageRegion = REGION_NONE;
+    return halt;
+}
+
+void VirtualTarget::startCrcScan()
+{
+    uint16_t bootEnd = m_Fuses[FUSE_BOOTEND] * 256;
+    uint16_t appEnd = m_Fuses[FUSE_APPEND] ? m_Fuses[FUSE_APPEND] * 256 : m_Device.flashSize;
+    uint16_t start = 0;
+    uint16_t end = m_Device.flashSize;
+    switch (m_Io[CRCSCAN_CTRLB] & 3)
+    {
+    case 1: start = bootEnd; end = appEnd; break;   // application
+    case 2: end = bootEnd; break;                   // boot
+    }
+    // the section is OK when the checksum stored at its end zeroes the CRC
+    m_CrcOk = flashCrc(start, end) == 0;
+    m_CrcBusyUntil = now() + cycles((uint32_t) (end - start) * m_Timing.crcCyclesPerByte);
+    // priority mode halts the CPU until the scan completes
+    if ((m_Io[CRCSCAN_CTRLB] & 0x30) == 0)
+        m_HaltedUntil = m_CrcBusyUntil;
+}
+
+} // namespace host
+} // namespace mtnrf
@@ -0,0 +1,258 @@
+#pragma once
+
+#include "VirtualNrf24.h"
+#include "AvrCpu.h"
+#include "megaTinyNrfLz.h"
+#include <vector>
+
+namespace mtnrf {
+namespace host {
+
+// tinyAVR 0/1-series memory layout
+struct TargetDevice
+{
+    const char* name;
+    uint8_t signature[3];
+    uint16_t flashSize;
+    uint8_t pageSize;
+    uint16_t eepromSize;
+    uint16_t sramSize;
+
+    static const TargetDevice* find(const char* name);
+    static const TargetDevice* find(const uint8_t* signature);
+};
+
+// CPU cycles spent in each path through main.S, counted from the AVRxt
+// instruction timings with the SPI clock at CLK_PER/2 (about 29 cycles per
+// spi_transfer call).  NVM times are the datasheet typicals.
+struct BootLoaderTiming
+{
+    uint16_t bootCycles = 1500;         // start_bootloader up to the RSTFR check
+    uint16_t pollCycles = 79;           // one wait_for_packet iteration
+    uint16_t readCycles = 124;          // nrf24_read_rx_payload_to_x excluding the payload
+    uint8_t readByteCycles = 33;        // read_packet loop
+    uint8_t commandCycles = 14;         // read_command
+    uint8_t writeNvmCycles = 86;        // write_nvm and ack payload up to wait_for_packet
+    uint8_t ackByteCycles = 45;         // write_loop per extra ack payload byte (extended build)
+    uint8_t copyByteCycles = 6;         // next_page copy loop per byte (PACKED_WRITES build)
+    uint16_t appPollCycles = 85;        // dummy app: nrf24_poll_reset loop
+    uint8_t crcCyclesPerByte = 1;       // CRCSCAN in priority mode (CPU halted)
+    uint16_t updaterEntryCycles = 200;  // stage-2 updater: jump, C start up and state checks
+    uint8_t updaterByteCycles = 30;     // stage-2 updater: LZ decode per output byte
+    uint8_t updaterCopyCycles = 6;      // stage-2 updater: page buffer copy per byte
+    Nanos flashPageWrite = millis(4);   // page erase-write, CPU halted
+    Nanos eepromPageWrite = millis(4);  // EEPROM/USERROW erase-write, EEBUSY set
+};
+
+// Behavioural model of a tinyAVR running the 256 byte bootloader in
+// extras/NRF24BootLoader.X/main.S, driving its own simulated radio.  It
+// follows the bootloader's register usage (r20 packet count, r21 CCP value,
+// X write pointer, command buffer at 0x3F80) so protocol corner cases behave
+// as they do on a real device: 4 byte command packets, writes into the NVM
+// page buffer committed by NVMCTRL_CTRLA, the W_ACK_PAYLOAD readback of the
+// byte at X, watchdog expiry and the radio address/channel in USERROW.
+//
+// The application section is modelled by behaviour rather than executed:
+// erased flash falls through to the bootloader, the channel and group
+// switchers that BootLoader::changeRadioSettings and BootLoader::joinGroup
+// install are recognised, a jump to
+// non-erased flash written by BootLoader::beginCompressed runs a model of
+// the stage-2 updater (megaTinyNrfUpdater.cpp) and anything else is
+// treated as an app calling nrf24_poll_reset.  The radio's CE pin is
+// assumed to be tied high.
+//
+// With useInstructionEmulator() nothing is modelled: whatever is in flash
+// runs on an AvrCpu with SPI0, the VPORTB pins (CSN on PB0 as in main.S),
+// NVMCTRL, CRCSCAN, RSTCTRL, WDT and the main clock prescaler wired to the
+// same data space, memories and radio.
+class VirtualTarget : public Component, private AvrBus
+{
+public:
+    VirtualTarget(VirtualEther& ether, const TargetDevice& device, const char* name = "target");
+    ~VirtualTarget();
+
+    // load flash, fuses and USERROW from an Intel HEX file such as the
+    // bootloader's production hex.  returns false if it can't be read.
+    bool loadHex(const char* filename);
+    // model the 512 byte EXTENDED_BOOTLOADER build (read memory command,
+    // BOOTEND = 2) instead of the one in the hex.  its boot section is
+    // main.S assembled by avrasm with PACKED_WRITES off, false if that
+    // can't be read.
+    bool useExtendedBootLoader();
+    // model the extended build with PACKED_WRITES, where flash pages that
+    // follow on from a write flagged in its packet count come without a
+    // command packet.  its boot section is main.S assembled by avrasm,
+    // false if that can't be read.
+    bool usePackedWrites();
+    // model a bootloader assembled with another SETUP_VALUE (RF_SETUP data
+    // rate and power), call before powerOn()
+    void setRadioSetup(uint8_t value) { m_SetupValue = value; }
+    // execute the code in flash instead of modelling the bootloader, call
+    // before powerOn().  the application section runs as it would on the
+    // device, so it needs to hold real code or be erased.
+    void useInstructionEmulator() { m_Emulated = true; }
+    bool isEmulated() const { return m_Emulated; }
+    const AvrCpu& getCpu() const { return m_Cpu; }
+    // called before each emulated instruction
+    void setInstructionHook(void (*hook)(const VirtualTarget& target)) { m_InstructionHook = hook; }
+    // apply power and start running from the reset vector
+    void powerOn();
+
+    const TargetDevice& getDevice() const { return m_Device; }
+    VirtualNrf24& getRadio() { return m_Radio; }
+    BootLoaderTiming& timing() { return m_Timing; }
+    uint32_t getCpuClock() const;
+    Nanos getWatchdogTimeout() const;
+    bool inBootLoader() const;
+    uint16_t getAppStart() const;
+
+    // non-volatile memory contents (bypassing the bootloader)
+    std::vector<uint8_t>& flash() { return m_Flash; }
+    std::vector<uint8_t>& eeprom() { return m_Eeprom; }
+    uint8_t* userRow() { return m_UserRow; }
+    uint8_t* fuses() { return m_Fuses; }
+    // CRC16-CCITT of a flash range as computed by CRCSCAN
+    uint16_t flashCrc(uint16_t start, uint16_t end, uint16_t crc = 0xFFFF) const;
+
+    struct Stats
+    {
+        uint32_t resets = 0;
+        uint32_t watchdogResets = 0;
+        uint32_t packets = 0;
+        uint32_t commands = 0;
+        uint32_t readCommands = 0;
+        uint32_t pagesWithoutCommand = 0; // PACKED_WRITES pages after the last
+        uint32_t flashPageWrites = 0;
+        uint32_t eepromPageWrites = 0;
+        uint32_t writeErrors = 0;       // page writes refused (boot section)
+        uint32_t updaterEntries = 0;    // times the stage-2 updater was started
+        Nanos nvmBusyTime = 0;          // time the CPU was halted by flash writes
+    };
+    const Stats& getStats() const { return m_Stats; }
+    void resetStats() { m_Stats = Stats(); }
+
+    // Component
+    Nanos nextEvent() const override;
+    void process(Nanos now) override;
+
+private:
+    enum State
+    {
+        OFF,
+        RESET,          // start up time before the reset vector
+        BOOT,           // start_bootloader
+        WRITE_NVM,
+        ACK_PAYLOAD,    // after the CPU resumes from a flash write
+        POLL,           // wait_for_packet
+        READ_PAYLOAD,
+        APP,
+        APP_POLL,       // application calling nrf24_poll_reset
+        UPDATER_POLL,   // stage-2 updater waiting for a packet
+        RUN,            // executing instructions
+    };
+    enum Region
+    {
+        REGION_NONE,
+        REGION_FLASH,
+        REGION_EEPROM,
+        REGION_USERROW,
+    };
+
+    Nanos cycles(uint32_t count) const;
+    void schedule(State state, Nanos when);
+    void reset(uint8_t flags);
+    void configureRadio();
+    void beginRx();
+    void enterApp(Nanos t);
+    void readPayload(Nanos t);
+    void enterUpdater(Nanos t);
+    void handleUpdaterPacket(Nanos t);
+    bool decompress(Nanos& t);
+    void returnToBootLoader(Nanos t, bool writePage);
+
+    uint8_t readData(uint16_t address);
+    void writeData(uint16_t address, uint8_t value);
+    // AvrBus: peripherals only the emulated CPU uses, then readData/writeData
+    uint8_t readFlash(uint16_t address) override;
+    uint8_t read(uint16_t address) override;
+    void write(uint16_t address, uint8_t value) override;
+    void watchdogReset() override;
+    void runCpu(Nanos t);
+    bool cpuSyncs(int32_t address) const;
+    void updateCsn();
+    void nvmCommand(uint8_t command);
+    Nanos pageEraseWrite();
+    void startCrcScan();
+    // the boot section and BOOTEND fuse from a hex, leaving the rest alone
+    bool loadBootSection(const char* filename);
+
+    const TargetDevice& m_Device;
+    VirtualNrf24 m_Radio;
+    BootLoaderTiming m_Timing;
+
+    std::vector<uint8_t> m_Flash;
+    std::vector<uint8_t> m_Eeprom;
+    std::vector<uint8_t> m_Sram;
+    uint8_t m_UserRow[32];
+    uint8_t m_Fuses[11];
+    uint8_t m_Io[0x1400] = {};
+
+    // NVM page buffer
+    Region m_PageRegion = REGION_NONE;
+    uint16_t m_PageAddress = 0;
+    uint8_t m_PageBuffer[128];
+    bool m_PageLoaded[128] = {};
+    bool m_WriteError = false;
+    Nanos m_EepromBusyUntil = 0;
+    Nanos m_CrcBusyUntil = 0;
+    bool m_CrcOk = false;
+    Nanos m_HaltedUntil = 0;
+
+    // CPU registers the bootloader keeps state in
+    uint8_t m_R0 = 0;       // RSTFR at boot
+    int8_t m_R20 = 0;       // packets remaining
+    uint8_t m_R21 = 0;      // CCP value for write_nvm
+    uint16_t m_X = 0;       // write pointer
+    uint16_t m_R2 = 0;      // X at wait_for_command (PACKED_WRITES)
+    uint8_t m_R19 = 0;      // packets per page (PACKED_WRITES)
+    uint8_t m_Rstfr = 0;
+    uint8_t m_ClockDivider = 6; // CLKCTRL_MCLKCTRLB prescaler
+
+    State m_State = OFF;
+    Nanos m_Next = NEVER;
+    Nanos m_WatchdogDeadline = NEVER;
+    uint8_t m_ReadWidth = 0;
+    bool m_Extended = false;
+    bool m_PackedWrites = false;
+    uint8_t m_SetupValue;
+
+    // instruction emulator
+    AvrCpu m_Cpu;
+    bool m_Emulated = false;
+    Nanos m_CpuTime = 0;            // when the current instruction started
+    void (*m_InstructionHook)(const VirtualTarget& target) = nullptr;
+    bool m_SpiPending = false;
+    uint64_t m_SpiDoneCycle = 0;
+    uint8_t m_SpiData = 0;
+
+    // stage-2 updater state, in .noinit RAM on the device
+    struct Updater
+    {
+        bool valid = false;
+        uint8_t status = 0xFF;
+        uint16_t start = 0;
+        uint16_t end = 0;
+        uint16_t pos = 0;
+        LzDecoder decoder;
+        uint8_t packetPos = 32;
+        uint8_t packet[32] = {};
+        uint8_t firstPage[128] = {};
+        uint8_t page[128] = {};
+    };
+    Updater m_Updater;
+
+    Stats m_Stats;
+};
+
+} // namespace host
+} // namespace mtnrf
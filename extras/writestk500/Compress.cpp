@@ -0,0 +1,130 @@
+#include "Compress.hpp"
+
+static const int MinLength = 3;
+static const int MaxLength = 18;
+static const int MaxDistance = 4096;
+static const int HashBits = 12;
+static const int MaxChain = 1024;
+
+static int Hash(const uint8_t* p)
+{
+	return (int)(((p[0] << 16 | p[1] << 8 | p[2]) * 2654435761u) >> (32 - HashBits));
+}
+
+std::vector<uint8_t> LzCompress(const std::vector<uint8_t>& data)
+{
+	int size = (int)data.size();
+	std::vector<int> head(1 << HashBits, -1);
+	std::vector<int> prev(size, -1);
+	auto insert = [&](int i)
+	{
+		if (i + MinLength <= size)
+		{
+			int h = Hash(&data[i]);
+			prev[i] = head[h];
+			head[h] = i;
+		}
+	};
+	auto findMatch = [&](int i, int& distance)
+	{
+		int best = 0;
+		if (i + MinLength > size)
+			return best;
+		int maxLength = size - i < MaxLength ? size - i : MaxLength;
+		int chain = 0;
+		for (int p = head[Hash(&data[i])]; p >= 0 && i - p <= MaxDistance && chain < MaxChain; p = prev[p], ++chain)
+		{
+			int length = 0;
+			while (length < maxLength && data[p + length] == data[i + length])
+				++length;
+			if (length > best)
+			{
+				best = length;
+				distance = i - p;
+				if (length == maxLength)
+					break;
+			}
+		}
+		return best;
+	};
+
+	// a flag byte in front of every 8 items, lowest bit first
+	std::vector<uint8_t> out;
+	size_t flags = 0;
+	int flagBit = 8;
+	auto addItem = [&](bool match)
+	{
+		if (flagBit == 8)
+		{
+			flags = out.size();
+			out.push_back(0);
+			flagBit = 0;
+		}
+		if (match)
+			out[flags] |= 1 << flagBit;
+		++flagBit;
+	};
+
+	for (int i = 0; i < size;)
+	{
+		int distance = 0;
+		int length = findMatch(i, distance);
+		insert(i);
+		// lazy matching: a literal first is better if the next match is longer
+		int nextDistance;
+		if (length >= MinLength && findMatch(i + 1, nextDistance) > length)
+			length = 0;
+		if (length < MinLength)
+		{
+			addItem(false);
+			out.push_back(data[i++]);
+			continue;
+		}
+		addItem(true);
+		out.push_back((uint8_t)(distance - 1));
+		out.push_back((uint8_t)((((distance - 1) >> 8) << 4) | (length - MinLength)));
+		for (int j = 1; j < length; ++j)
+			insert(i + j);
+		i += length;
+	}
+	return out;
+}
+
+static uint16_t Crc16(uint16_t crc, const uint8_t* data, size_t size)
+{
+	while (size--)
+	{
+		crc ^= *data++ << 8;
+		for (int i = 0; i < 8; i++)
+			crc = crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1;
+	}
+	return crc;
+}
+
+uint16_t CrcFixup(uint16_t crc, const std::vector<uint8_t>& tail)
+{
+	// the CRC after the tail is linear in the CRC before it, so find the
+	// state that leads to zero from the response to each bit...
+	uint16_t offset = Crc16(0, tail.data(), tail.size());
+	uint16_t bits[16];
+	for (int i = 0; i < 16; ++i)
+		bits[i] = Crc16(1 << i, tail.data(), tail.size()) ^ offset;
+	uint32_t target = 0;
+	for (; target < 0x10000; ++target)
+	{
+		uint16_t result = offset;
+		for (int i = 0; i < 16; ++i)
+			if (target & (1 << i))
+				result ^= bits[i];
+		if (result == 0)
+			break;
+	}
+	// ...then the two bytes that take crc there
+	for (uint32_t fix = 0; fix < 0x10000; ++fix)
+	{
+		uint8_t bytes[2] = { (uint8_t)(fix >> 8), (uint8_t)fix };
+		if (Crc16(crc, bytes, 2) == target)
+			return (uint16_t)fix;
+	}
+	return 0;
+}
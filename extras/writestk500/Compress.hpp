@@ -0,0 +1,14 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+
+// Compress an image for the stage-2 updater in the LZSS format decoded by
+// mtnrf::LzDecoder (src/megaTinyNrfLz.h).
+std::vector<uint8_t> LzCompress(const std::vector<uint8_t>& data);
+
+// Find the two bytes to store after data that has left the flash CRC in
+// state crc so that the CRC over those bytes and then tail comes out as
+// zero, i.e. CRCSCAN passes with tail (the updater) after the image.
+uint16_t CrcFixup(uint16_t crc, const std::vector<uint8_t>& tail);
@@ -0,0 +1,111 @@
+#include "Fleet.hpp"
+#include "Platform.h"
+#include <algorithm>
+#include <sstream>
+
+FleetScheduler::FleetScheduler(const std::vector<FleetJob>& jobs, int bridges)
+:	m_Jobs(jobs)
+,	m_States(jobs.size(), Pending)
+,	m_Attempts(jobs.size(), 0)
+,	m_Runners(jobs.size(), -1)
+,	m_Tried(jobs.size(), std::vector<bool>(bridges, false))
+,	m_Live(bridges, true)
+{
+}
+
+bool FleetScheduler::LoadJobs(const char* filename, std::vector<FleetJob>& jobs)
+{
+	FILE* f = NULL;
+	if (fopen_s(&f, filename, "r"))
+	{
+		fprintf(stderr, "Error opening %s\n", filename);
+		return false;
+	}
+	char line[512];
+	bool ok = true;
+	for (int number = 1; fgets(line, sizeof(line), f); ++number)
+	{
+		if (char* comment = strchr(line, '#'))
+			*comment = 0;
+		std::istringstream fields(line);
+		FleetJob job;
+		if (!(fields >> job.address))
+			continue;
+		if (!(fields >> job.channel >> job.image) || job.address.size() != 3 || job.channel < 0 || job.channel > 125)
+		{
+			fprintf(stderr, "%s:%i: expected \"address channel image\"\n", filename, number);
+			ok = false;
+			continue;
+		}
+		jobs.push_back(job);
+	}
+	fclose(f);
+	if (ok && jobs.empty())
+	{
+		fprintf(stderr, "No jobs in %s\n", filename);
+		ok = false;
+	}
+	return ok;
+}
+
+bool FleetScheduler::CanRun(int bridge, int job) const
+{
+	if (m_States[job] != Pending ||
+		std::find(m_BusyChannels.begin(), m_BusyChannels.end(), m_Jobs[job].channel) != m_BusyChannels.end())
+		return false;
+	if (!m_Tried[job][bridge])
+		return true;
+	// leave a retry for a bridge that hasn't had a go at it
+	for (size_t other = 0; other < m_Live.size(); ++other)
+		if (m_Live[other] && !m_Tried[job][other])
+			return false;
+	return true;
+}
+
+int FleetScheduler::Next(int bridge)
+{
+	std::unique_lock<std::mutex> lock(m_Mutex);
+	for (;;)
+	{
+		bool unfinished = false;
+		for (size_t job = 0; job < m_Jobs.size(); ++job)
+		{
+			if (CanRun(bridge, (int)job))
+			{
+				m_States[job] = Running;
+				m_Runners[job] = bridge;
+				++m_Attempts[job];
+				m_Tried[job][bridge] = true;
+				m_BusyChannels.push_back(m_Jobs[job].channel);
+				return (int)job;
+			}
+			// a running job might fail and come back to us
+			unfinished |= m_States[job] == Pending || m_States[job] == Running;
+		}
+		if (!unfinished)
+			return -1;
+		m_Changed.wait(lock);
+	}
+}
+
+bool FleetScheduler::Finish(int bridge, int job, bool ok)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	if (m_States[job] != Running || m_Runners[job] != bridge)
+		return false;
+	m_Runners[job] = -1;
+	m_BusyChannels.erase(std::find(m_BusyChannels.begin(), m_BusyChannels.end(), m_Jobs[job].channel));
+	if (ok)
+		m_States[job] = Done;
+	else
+		m_States[job] = m_Attempts[job] < MaxAttempts ? Pending : Failed;
+	m_Changed.notify_all();
+	return m_States[job] == Pending;
+}
+
+void FleetScheduler::Retire(int bridge)
+{
+	std::lock_guard<std::mutex> lock(m_Mutex);
+	m_Live[bridge] = false;
+	m_Changed.notify_all();
+}
@@ -0,0 +1,58 @@
+#pragma once
+
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// one device to program: its radio address and channel and the HEX file
+struct FleetJob
+{
+	std::string address;
+	int channel = 0;
+	std::string image;
+};
+
+// Hands out programming jobs to bridges that each run in their own thread.
+// A job is only given to a bridge while no other bridge is working on the
+// same RF channel, so bridges never talk over each other.  A job that fails
+// goes back in the queue for a bridge that hasn't tried it yet, if there is
+// one still working, until it has been tried MaxAttempts times.
+class FleetScheduler
+{
+public:
+	static const int MaxAttempts = 3;
+
+	FleetScheduler(const std::vector<FleetJob>& jobs, int bridges);
+
+	// read "address channel image" lines, '#' starts a comment
+	static bool LoadJobs(const char* filename, std::vector<FleetJob>& jobs);
+
+	// wait for a job the bridge can run, -1 once there are none left
+	int Next(int bridge);
+	// the job has finished with the bridge parked off the air, returns true
+	// if it failed and will be tried again.  a job the bridge isn't running
+	// is left alone.
+	bool Finish(int bridge, int job, bool ok);
+	// the bridge can't be used any more
+	void Retire(int bridge);
+
+	// results, once every bridge has stopped asking for jobs
+	bool Succeeded(int job) const { return m_States[job] == Done; }
+	int GetAttempts(int job) const { return m_Attempts[job]; }
+
+private:
+	enum State { Pending, Running, Done, Failed };
+
+	bool CanRun(int bridge, int job) const;
+
+	const std::vector<FleetJob>& m_Jobs;
+	std::vector<State> m_States;
+	std::vector<int> m_Attempts;
+	std::vector<int> m_Runners; // bridge running each job, -1 for none
+	std::vector<std::vector<bool>> m_Tried; // per job, per bridge
+	std::vector<bool> m_Live;
+	std::vector<int> m_BusyChannels;
+	std::mutex m_Mutex;
+	std::condition_variable m_Changed;
+};
@@ -0,0 +1,109 @@
+#include "ImageCache.hpp"
+#include "Platform.h"
+#include <stdlib.h>
+#include <filesystem>
+#include <system_error>
+
+// file layout: magic, signature, pad, start and size (little endian), data
+static const char CacheMagic[8] = { 'M', 'T', 'N', 'B', 'I', 'M', 'G', '1' };
+static const int CacheHeaderSize = 8 + 4 + 4 + 4;
+
+static void PutU32(uint8_t* p, uint32_t value)
+{
+	for (int i = 0; i < 4; ++i)
+		p[i] = (uint8_t)(value >> (i * 8));
+}
+
+static uint32_t GetU32(const uint8_t* p)
+{
+	return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+ImageCache::ImageCache(const std::string& dir)
+:	m_Dir(dir)
+{
+	if (!m_Dir.empty())
+		return;
+#ifdef _WIN32
+	const char* base = getenv("LOCALAPPDATA");
+	m_Dir = std::string(base ? base : ".") + "\\writestk500";
+#else
+	const char* base = getenv("HOME");
+	m_Dir = std::string(base ? base : ".") + "/.writestk500";
+#endif
+}
+
+std::string ImageCache::MakeKey(const uint8_t addr[3], int channel)
+{
+	char key[32];
+	sprintf_s(key, "%02x%02x%02x-ch%i", addr[0], addr[1], addr[2], channel);
+	return key;
+}
+
+std::string ImageCache::GetPath(const std::string& key) const
+{
+	return (std::filesystem::path(m_Dir) / (key + ".img")).string();
+}
+
+bool ImageCache::Load(const std::string& key, const uint8_t signature[3], int& start, std::vector<uint8_t>& data) const
+{
+	FILE* f = NULL;
+	if (fopen_s(&f, GetPath(key).c_str(), "rb"))
+		return false;
+	uint8_t header[CacheHeaderSize];
+	bool ok = fread(header, 1, CacheHeaderSize, f) == CacheHeaderSize &&
+		memcmp(header, CacheMagic, 8) == 0 &&
+		memcmp(header + 8, signature, 3) == 0;
+	if (ok)
+	{
+		start = (int)GetU32(header + 12);
+		uint32_t size = GetU32(header + 16);
+		ok = size <= 0x10000;
+		if (ok)
+		{
+			data.resize(size);
+			ok = fread(data.data(), 1, size, f) == size;
+		}
+	}
+	fclose(f);
+	return ok;
+}
+
+bool ImageCache::Store(const std::string& key, const uint8_t signature[3], int start, const std::vector<uint8_t>& data) const
+{
+	std::error_code error;
+	std::filesystem::create_directories(m_Dir, error);
+	// write a temporary file and rename it so an interrupted upload never
+	// leaves a truncated baseline behind
+	std::string path = GetPath(key);
+	std::string temp = path + ".tmp";
+	FILE* f = NULL;
+	if (fopen_s(&f, temp.c_str(), "wb"))
+	{
+		fprintf(stderr, "Can't write image cache %s\n", temp.c_str());
+		return false;
+	}
+	uint8_t header[CacheHeaderSize] = {};
+	memcpy(header, CacheMagic, 8);
+	memcpy(header + 8, signature, 3);
+	PutU32(header + 12, (uint32_t)start);
+	PutU32(header + 16, (uint32_t)data.size());
+	bool ok = fwrite(header, 1, CacheHeaderSize, f) == CacheHeaderSize &&
+		fwrite(data.data(), 1, data.size(), f) == data.size();
+	ok = fclose(f) == 0 && ok;
+	if (ok)
+		std::filesystem::rename(temp, path, error);
+	if (!ok || error)
+	{
+		std::filesystem::remove(temp, error);
+		fprintf(stderr, "Can't write image cache %s\n", path.c_str());
+		return false;
+	}
+	return true;
+}
+
+void ImageCache::Remove(const std::string& key) const
+{
+	std::error_code error;
+	std::filesystem::remove(GetPath(key), error);
+}
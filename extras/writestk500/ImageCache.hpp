@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+// Remembers the last flash image that passed a CRC check on each remote
+// device so that the next upload only has to send the pages that changed.
+// Images are kept one file per device, named after the radio address and
+// channel, in ~/.writestk500 (%LOCALAPPDATA%\writestk500 on Windows) unless
+// another directory is given.
+class ImageCache
+{
+public:
+	explicit ImageCache(const std::string& dir = std::string());
+
+	// key for a programming address such as "P01" on the given channel
+	static std::string MakeKey(const uint8_t addr[3], int channel);
+
+	// fetch the cached image for a device, fails if there is none or it was
+	// taken from a different part
+	bool Load(const std::string& key, const uint8_t signature[3], int& start, std::vector<uint8_t>& data) const;
+	bool Store(const std::string& key, const uint8_t signature[3], int start, const std::vector<uint8_t>& data) const;
+	void Remove(const std::string& key) const;
+
+	const std::string& GetDirectory() const { return m_Dir; }
+
+private:
+	std::string GetPath(const std::string& key) const;
+
+	std::string m_Dir;
+};
@@ -1,5 +1,7 @@
 #pragma once
 
+#ifdef _WIN32
+
 #define WIN32_LEAN_AND_MEAN
 #define WINVER			  0x501 // XP or above 
 #define NOGDICAPMASKS			// - CC_*, LC_*, PC_*, CP_*, TC_*, RC_
@@ -42,3 +44,31 @@
 #define NOCTLMGR				// - Control and Dialog routines used in IFileOpen/SaveDialog
 
 #include <windows.h>
+
+#else
+
+#include <errno.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+
+#define ARRAYSIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define sscanf_s sscanf
+
+inline int fopen_s(FILE** f, const char* filename, const char* mode)
+{
+	*f = fopen(filename, mode);
+	return *f ? 0 : errno;
+}
+
+template<size_t N>
+inline int sprintf_s(char (&buf)[N], const char* format, ...)
+{
+	va_list args;
+	va_start(args, format);
+	int result = vsnprintf(buf, N, format, args);
+	va_end(args);
+	return result;
+}
+
+#endif
@@ -0,0 +1,89 @@
+#include "Recorder.hpp"
+#include "Platform.h"
+#include <string.h>
+
+const char SessionRecorder::Magic[8] = { 'M', 'T', 'N', 'B', 'R', 'E', 'C', '1' };
+
+SessionRecorder::~SessionRecorder()
+{
+	Close();
+}
+
+bool SessionRecorder::Open(const char* filename)
+{
+	Close();
+	if (fopen_s(&m_File, filename, "wb") != 0 || !m_File)
+	{
+		m_File = nullptr;
+		fprintf(stderr, "Can't create %s\n", filename);
+		return false;
+	}
+	fwrite(Magic, 1, sizeof(Magic), m_File);
+	m_Start = std::chrono::steady_clock::now();
+	return true;
+}
+
+void SessionRecorder::Close()
+{
+	if (m_File)
+	{
+		fclose(m_File);
+		m_File = nullptr;
+	}
+}
+
+void SessionRecorder::Record(char direction, const void* data, size_t len)
+{
+	if (!m_File)
+		return;
+	uint32_t time = (uint32_t) std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now() - m_Start).count();
+	const uint8_t* bytes = (const uint8_t*) data;
+	while (len > 0)
+	{
+		uint16_t n = (uint16_t) (len > 0xFFFF ? 0xFFFF : len);
+		uint8_t header[7] =
+		{
+			(uint8_t) direction,
+			(uint8_t) time, (uint8_t) (time >> 8), (uint8_t) (time >> 16), (uint8_t) (time >> 24),
+			(uint8_t) n, (uint8_t) (n >> 8),
+		};
+		fwrite(header, 1, sizeof(header), m_File);
+		fwrite(bytes, 1, n, m_File);
+		bytes += n;
+		len -= n;
+	}
+	// a session that hangs is the one worth having, so don't leave it buffered
+	fflush(m_File);
+}
+
+bool SessionRecorder::Load(const char* filename, std::vector<RecordedChunk>& chunks)
+{
+	FILE* file = nullptr;
+	if (fopen_s(&file, filename, "rb") != 0 || !file)
+	{
+		fprintf(stderr, "Can't open %s\n", filename);
+		return false;
+	}
+	char magic[sizeof(Magic)];
+	if (fread(magic, 1, sizeof(magic), file) != sizeof(magic) || memcmp(magic, Magic, sizeof(Magic)) != 0)
+	{
+		fprintf(stderr, "%s isn't a session recording\n", filename);
+		fclose(file);
+		return false;
+	}
+	chunks.clear();
+	uint8_t header[7];
+	while (fread(header, 1, sizeof(header), file) == sizeof(header) && (header[0] == '>' || header[0] == '<'))
+	{
+		RecordedChunk chunk;
+		chunk.toBridge = header[0] == '>';
+		chunk.time = header[1] | (header[2] << 8) | (header[3] << 16) | ((uint32_t) header[4] << 24);
+		chunk.data.resize(header[5] | (header[6] << 8));
+		if (fread(chunk.data.data(), 1, chunk.data.size(), file) != chunk.data.size())
+			break;
+		chunks.push_back(std::move(chunk));
+	}
+	fclose(file);
+	return true;
+}
@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+#include <chrono>
+#include <vector>
+
+// Both directions of a conversation with the programming bridge, as
+// writestk500 --record saves it and replaybench plays it back.  The file is
+// the 8 byte header "MTNBREC1" followed by one chunk for every read and
+// write: the direction ('>' to the bridge, '<' from it), the time in
+// microseconds since the recording started (4 bytes, low byte first), the
+// length (2 bytes, low byte first) and the data.
+struct RecordedChunk
+{
+	bool toBridge;
+	uint32_t time;	// microseconds from the start of the recording
+	std::vector<uint8_t> data;
+};
+
+class SessionRecorder
+{
+public:
+	static const char Magic[8];
+
+	~SessionRecorder();
+
+	bool Open(const char* filename);
+	void Close();
+	bool IsOpen() const { return m_File != nullptr; }
+
+	// called by Transport as the bytes go out and come in
+	void Sent(const void* data, size_t len) { Record('>', data, len); }
+	void Received(const void* data, size_t len) { Record('<', data, len); }
+
+	// read a recording back, false if it's missing or not a recording.  a
+	// chunk cut short at the end (the tool was killed) is dropped.
+	static bool Load(const char* filename, std::vector<RecordedChunk>& chunks);
+
+private:
+	void Record(char direction, const void* data, size_t len);
+
+	FILE* m_File = nullptr;
+	std::chrono::steady_clock::time_point m_Start;
+};
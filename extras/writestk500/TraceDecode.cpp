@@ -0,0 +1,345 @@
+// Rebuilds a programming session from the bridge's packet trace (the frame
+// "trace" prints in configuration mode, or writestk500 --trace saves) and
+// reports where the time went: entering the bootloader, each flash page,
+// memory reads, retry bursts and the gaps where nothing happened.
+
+#include "CommandLine.hpp"
+#include "Platform.h"
+#include <stdio.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+// eTraceEvent in megaTinyNrfTrace.h
+enum TraceEvent
+{
+	TRACE_TIME,
+	TRACE_TX,
+	TRACE_TX_NO_ACK,
+	TRACE_TX_DONE,
+	TRACE_MAX_RT,
+	TRACE_FLUSH_TX,
+	TRACE_RX,
+	TRACE_MODE,
+	TRACE_ENTER,
+	TRACE_ENTERED,
+	TRACE_SYNC,
+	TRACE_PAGE,
+	TRACE_DATA,
+	TRACE_READ,
+	TRACE_EXIT,
+	TRACE_LINK,
+};
+
+static const char* const EventNames[] =
+{
+	"time", "tx", "tx-noack", "tx-done", "max-rt", "flush-tx", "rx", "mode",
+	"enter", "entered", "sync", "page", "data", "read", "exit", "link",
+};
+static const char* const ModeNames[] = { "power-down", "rx", "tx" };
+
+struct Event
+{
+	double time;	// ms from the first record
+	uint8_t event;
+	uint8_t data;
+	int address;	// PAGE and READ with the TRACE_DATA that follows them, else -1
+};
+
+// what happened while one page or read was in progress
+struct Span
+{
+	int address;
+	double start;
+	double end;
+	int packets = 0;
+	int maxRt = 0;
+	int arc = 0;
+};
+
+// find the last complete frame in what was captured from the bridge
+static bool FindFrame(const std::vector<uint8_t>& input, std::vector<Event>& events, int& tickShift)
+{
+	for (size_t pos = input.size(); pos-- > 1; )
+	{
+		if (input[pos - 1] != 0xA5 || input[pos] != 0x7E || pos + 4 > input.size())
+			continue;
+		const uint8_t* header = &input[pos + 1];
+		size_t count = header[1] | (header[2] << 8);
+		if (pos + 4 + count * 4 + 1 > input.size())
+			continue;
+		const uint8_t* records = header + 3;
+		uint8_t sum = header[0] + header[1] + header[2];
+		for (size_t i = 0; i < count * 4; ++i)
+			sum += records[i];
+		if (sum != records[count * 4])
+			continue;
+
+		tickShift = header[0];
+		double tick = (1 << tickShift) / 1000.0;
+		uint64_t ticks = 0;
+		uint16_t last = records[0] | (records[1] << 8);
+		events.clear();
+		for (size_t i = 0; i < count; ++i)
+		{
+			const uint8_t* record = records + i * 4;
+			uint16_t time = record[0] | (record[1] << 8);
+			uint8_t event = record[2];
+			uint8_t data = record[3];
+			ticks += (uint16_t)(time - last);
+			last = time;
+			// a TIME record holds how many more times the 16 bit time wrapped
+			if (event == TRACE_TIME)
+			{
+				ticks += (uint64_t)data << 16;
+				continue;
+			}
+			if (event == TRACE_DATA && !events.empty() && events.back().address >= 0)
+			{
+				events.back().address |= data;
+				continue;
+			}
+			Event e;
+			e.time = ticks * tick;
+			e.event = event;
+			e.data = data;
+			e.address = event == TRACE_PAGE || event == TRACE_READ ? data << 8 : -1;
+			events.push_back(e);
+		}
+		return true;
+	}
+	return false;
+}
+
+static void PrintEvent(const Event& e)
+{
+	printf("%10.3f  %-9s", e.time, e.event < sizeof(EventNames) / sizeof(EventNames[0]) ? EventNames[e.event] : "?");
+	if (e.address >= 0)
+		printf(" 0x%04X", e.address);
+	else if (e.event == TRACE_MODE)
+		printf(" %s", e.data < 3 ? ModeNames[e.data] : "?");
+	else if (e.event != TRACE_SYNC && e.event != TRACE_ENTER && e.event != TRACE_EXIT && e.event != TRACE_FLUSH_TX)
+		printf(" %u", e.data);
+	printf("\n");
+}
+
+int main(int argc, char* argv[])
+{
+	std::string input;
+	bool timeline = false;
+	double gapMs = 2;
+	int32_t burstLength = 2;
+	int32_t top = 10;
+	bool printHelp = false;
+
+	CommandLine args("Decodes a packet trace from the programming bridge (\"trace\" in configuration mode or writestk500 --trace)");
+	args.addArgument({ "-i", "--input" }, &input, "Captured trace, - for stdin (default)");
+	args.addArgument({ "-t", "--timeline" }, &timeline, "Print every event");
+	args.addArgument({ "-g", "--gap" }, &gapMs, "Count quiet stretches between pages longer than this many ms as idle (default 2)");
+	args.addArgument({ "-b", "--burst" }, &burstLength, "Report this many MAX_RTs in a row as a retry burst (default 2)");
+	args.addArgument({ "-n", "--top" }, &top, "How many of the slowest pages and longest gaps to list (default 10)");
+	args.addArgument({ "-h", "--help" }, &printHelp, "Help!");
+	try {
+		args.parse(argc, argv);
+	}
+	catch (std::runtime_error const& e) {
+		std::cout << e.what() << std::endl;
+		return -1;
+	}
+	if (printHelp)
+	{
+		args.printHelp();
+		return 0;
+	}
+
+	FILE* file = stdin;
+	if (!input.empty() && input != "-" && (fopen_s(&file, input.c_str(), "rb") != 0 || !file))
+	{
+		fprintf(stderr, "Can't open %s\n", input.c_str());
+		return 1;
+	}
+	std::vector<uint8_t> data;
+	uint8_t buf[4096];
+	for (size_t n; (n = fread(buf, 1, sizeof(buf), file)) > 0; )
+		data.insert(data.end(), buf, buf + n);
+	if (file != stdin)
+		fclose(file);
+
+	std::vector<Event> events;
+	int tickShift = 0;
+	if (!FindFrame(data, events, tickShift))
+	{
+		fprintf(stderr, "No complete trace frame found\n");
+		return 1;
+	}
+	if (events.empty())
+	{
+		printf("The trace is empty\n");
+		return 0;
+	}
+	if (timeline)
+	{
+		for (const Event& e : events)
+			PrintEvent(e);
+		printf("\n");
+	}
+
+	// each stretch between two events goes to what the bridge was doing: a
+	// page or read runs until the next one starts, the TX FIFO empties or the
+	// session ends.  outside of those anything longer than gapMs is idle.
+	enum Activity { OTHER, ENTERING, PAGE, READ, IDLE, ACTIVITIES };
+	double spent[ACTIVITIES] = {};
+	Activity activity = OTHER;
+	double total = events.back().time - events.front().time;
+	std::vector<Span> pages;
+	size_t reads = 0;
+	int entries = 0, failedEntries = 0;
+	Span* current = nullptr;
+	int txPackets = 0, maxRts = 0, arc = 0;
+	struct Gap { double start, length; uint8_t before, after; };
+	std::vector<Gap> gaps;
+	for (size_t i = 0; i < events.size(); ++i)
+	{
+		const Event& e = events[i];
+		if (i > 0)
+		{
+			double length = e.time - events[i - 1].time;
+			if (activity == OTHER && length > gapMs)
+			{
+				spent[IDLE] += length;
+				gaps.push_back({ events[i - 1].time, length, events[i - 1].event, e.event });
+			}
+			else
+			{
+				spent[activity] += length;
+			}
+		}
+		bool ends = e.event == TRACE_PAGE || e.event == TRACE_READ || e.event == TRACE_ENTER ||
+			e.event == TRACE_EXIT || e.event == TRACE_TX_DONE;
+		if (ends)
+		{
+			if (current)
+				current->end = e.time;
+			current = nullptr;
+			activity = OTHER;
+		}
+		switch (e.event)
+		{
+		case TRACE_PAGE:
+			pages.push_back(Span());
+			current = &pages.back();
+			current->address = e.address;
+			current->start = current->end = e.time;
+			activity = PAGE;
+			break;
+		case TRACE_READ:
+			++reads;
+			activity = READ;
+			break;
+		case TRACE_ENTER:
+			activity = ENTERING;
+			break;
+		case TRACE_ENTERED:
+			activity = OTHER;
+			++entries;
+			failedEntries += e.data == 0;
+			break;
+		case TRACE_TX:
+		case TRACE_TX_NO_ACK:
+			++txPackets;
+			if (current)
+				++current->packets;
+			break;
+		case TRACE_MAX_RT:
+			++maxRts;
+			if (current)
+				++current->maxRt;
+			break;
+		case TRACE_TX_DONE:
+			arc += e.data;
+			if (!pages.empty() && pages.back().end == e.time)
+				pages.back().arc += e.data;
+			break;
+		default:
+			break;
+		}
+	}
+
+	// retry bursts: burstLength or more MAX_RTs with no packet getting through
+	// in between.  a new packet going into the FIFO means one left it.
+	struct Burst { double start, end; int count; int address; };
+	std::vector<Burst> bursts;
+	int run = 0;
+	double runStart = 0;
+	int runAddress = -1, lastAddress = -1;
+	for (const Event& e : events)
+	{
+		if (e.event == TRACE_PAGE || e.event == TRACE_READ)
+			lastAddress = e.address;
+		if (e.event == TRACE_MAX_RT)
+		{
+			if (run++ == 0)
+			{
+				runStart = e.time;
+				runAddress = lastAddress;
+			}
+			if (run >= burstLength && (bursts.empty() || bursts.back().start != runStart))
+				bursts.push_back({ runStart, e.time, run, runAddress });
+			else if (run > burstLength)
+			{
+				bursts.back().end = e.time;
+				bursts.back().count = run;
+			}
+		}
+		else if (e.event == TRACE_TX || e.event == TRACE_TX_DONE || e.event == TRACE_RX || e.event == TRACE_FLUSH_TX)
+		{
+			run = 0;
+		}
+	}
+
+	printf("%zu events over %.1f ms (%u us ticks)\n", events.size(), total, 1u << tickShift);
+	printf("  %d packets sent, %d MAX_RT, %d auto retransmits seen\n\n", txPackets, maxRts, arc);
+	printf("Where the time went\n");
+	printf("  entering bootloader  %9.1f ms  (%d entries, %d failed)\n", spent[ENTERING], entries, failedEntries);
+	printf("  flash pages          %9.1f ms  (%zu pages", spent[PAGE], pages.size());
+	if (!pages.empty())
+		printf(", %.2f ms each", spent[PAGE] / pages.size());
+	printf(")\n");
+	printf("  memory reads         %9.1f ms  (%zu reads)\n", spent[READ], reads);
+	printf("  idle gaps > %-4g ms  %9.1f ms  (%zu gaps)\n", gapMs, spent[IDLE], gaps.size());
+	printf("  other                %9.1f ms\n\n", spent[OTHER]);
+
+	if (!pages.empty())
+	{
+		std::vector<const Span*> slowest;
+		for (const Span& s : pages)
+			slowest.push_back(&s);
+		std::sort(slowest.begin(), slowest.end(), [](const Span* a, const Span* b) { return a->end - a->start > b->end - b->start; });
+		printf("Slowest pages (address, ms, packets, MAX_RT, auto retransmits)\n");
+		for (int i = 0; i < top && i < (int)slowest.size(); ++i)
+			printf("  0x%04X  %7.2f  %3d  %3d  %3d\n", slowest[i]->address, slowest[i]->end - slowest[i]->start,
+				slowest[i]->packets, slowest[i]->maxRt, slowest[i]->arc);
+		printf("\n");
+	}
+	if (!bursts.empty())
+	{
+		printf("Retry bursts (%d or more MAX_RT in a row)\n", burstLength);
+		for (const Burst& b : bursts)
+		{
+			printf("  %10.3f ms  %3d MAX_RT over %.2f ms", b.start, b.count, b.end - b.start);
+			if (b.address >= 0)
+				printf(" at 0x%04X", b.address);
+			printf("\n");
+		}
+		printf("\n");
+	}
+	if (!gaps.empty())
+	{
+		std::sort(gaps.begin(), gaps.end(), [](const Gap& a, const Gap& b) { return a.length > b.length; });
+		printf("Longest idle gaps (start, ms, between)\n");
+		for (int i = 0; i < top && i < (int)gaps.size(); ++i)
+			printf("  %10.3f ms  %8.2f  %s .. %s\n", gaps[i].start, gaps[i].length,
+				EventNames[gaps[i].before & 15], EventNames[gaps[i].after & 15]);
+	}
+	return 0;
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+class SessionRecorder;
+
+// Byte stream connection to the programming bridge, either a serial port or
+// a TCP socket (ESP8266 bridge).  The Win32 backend lives in TransportWin32.cpp
+// and the Linux one in TransportPosix.cpp.
+class Transport
+{
+public:
+	Transport();
+	~Transport();
+
+	// open serial port (COMx on Windows, /dev/ttyX on Linux)
+	bool OpenSerial(const char* comport, int baudrate);
+	// connect to a TCP socket
+	bool OpenSocket(const char* addr, const char* port);
+	// wait for one client to connect to this TCP port (writestk500 --proxy)
+	bool AcceptSocket(const char* port);
+	void Close();
+
+	bool IsSocket() const { return m_IsSocket; }
+	// false once the connection is closed, including by the other end of a socket
+	bool IsOpen() const;
+	// record everything sent and received from now on, nullptr to stop
+	void SetRecorder(SessionRecorder* recorder) { m_Recorder = recorder; }
+	// number of bytes that can be read without blocking
+	int Available();
+	// read up to 'bytes' bytes, blocking until they arrive or the link times out
+	int Read(void* buf, int bytes);
+	// write all of the data, servicing incoming data while the link is busy
+	int Write(const void* data, int len);
+	// discard any unsent and unread data
+	void Purge();
+
+	uint64_t GetBytesSent() const { return m_BytesSent; }
+	uint64_t GetBytesReceived() const { return m_BytesReceived; }
+
+private:
+	bool m_IsSocket = false;
+	bool m_PeerClosed = false;
+	uint64_t m_BytesSent = 0;
+	uint64_t m_BytesReceived = 0;
+	SessionRecorder* m_Recorder = nullptr;
+
+#ifdef _WIN32
+	void* m_Handle = nullptr;
+#else
+	// wait for the descriptor to become readable (or writable) and drain
+	// whatever has arrived into the receive buffer
+	bool Poll(int timeoutMs, bool waitForWrite = false);
+	int FillBuffer();
+	int Buffered() const { return (int)(m_RxBuf.size() - m_RxPos); }
+
+	int m_Fd = -1;
+	int m_Epoll = -1;
+	bool m_WantWrite = false;
+	std::vector<uint8_t> m_RxBuf;
+	size_t m_RxPos = 0;
+#endif
+};
@@ -0,0 +1,383 @@
+#ifndef _WIN32
+#include "Transport.hpp"
+#include "Recorder.hpp"
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <termios.h>
+#include <unistd.h>
+#include <algorithm>
+#include <chrono>
+
+// same limits as the COMMTIMEOUTS/select() values used by the Win32 backend
+static const int SerialReadTimeoutMs = 1000;
+static const int SerialReadTimeoutPerByteMs = 10;
+static const int SocketReadTimeoutMs = 10000;
+static const int WriteTimeoutMs = 1000;
+
+static speed_t BaudRateToSpeed(int baudrate)
+{
+	switch (baudrate)
+	{
+	case 9600: return B9600;
+	case 19200: return B19200;
+	case 38400: return B38400;
+	case 57600: return B57600;
+	case 115200: return B115200;
+	case 230400: return B230400;
+#ifdef B460800
+	case 460800: return B460800;
+#endif
+#ifdef B500000
+	case 500000: return B500000;
+#endif
+#ifdef B921600
+	case 921600: return B921600;
+#endif
+#ifdef B1000000
+	case 1000000: return B1000000;
+#endif
+#ifdef B2000000
+	case 2000000: return B2000000;
+#endif
+	default: return 0;
+	}
+}
+
+static int ElapsedMs(std::chrono::steady_clock::time_point start)
+{
+	return (int) std::chrono::duration_cast<std::chrono::milliseconds>(
+		std::chrono::steady_clock::now() - start).count();
+}
+
+Transport::Transport()
+{
+}
+
+Transport::~Transport()
+{
+	Close();
+}
+
+void Transport::Close()
+{
+	if (m_Epoll >= 0)
+	{
+		close(m_Epoll);
+		m_Epoll = -1;
+	}
+	if (m_Fd >= 0)
+	{
+		close(m_Fd);
+		m_Fd = -1;
+	}
+	m_RxBuf.clear();
+	m_RxPos = 0;
+	m_WantWrite = false;
+	m_PeerClosed = false;
+}
+
+bool Transport::IsOpen() const
+{
+	return m_Fd >= 0 && !m_PeerClosed;
+}
+
+static int CreateEventLoop(int fd)
+{
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0)
+		return -1;
+	epoll_event ev = {};
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+	{
+		close(epfd);
+		return -1;
+	}
+	return epfd;
+}
+
+bool Transport::OpenSocket(const char* addr, const char* port)
+{
+	struct addrinfo hints = {};
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	struct addrinfo* addresses = nullptr;
+	int result = getaddrinfo(addr, port, &hints, &addresses);
+	if (result != 0)
+	{
+		printf("getaddrinfo failed with error: %s\n", gai_strerror(result));
+		return false;
+	}
+
+	int fd = -1;
+	for (struct addrinfo* ptr = addresses; ptr; ptr = ptr->ai_next)
+	{
+		fd = socket(ptr->ai_family, ptr->ai_socktype | SOCK_CLOEXEC, ptr->ai_protocol);
+		if (fd < 0)
+		{
+			printf("socket failed with error: %s\n", strerror(errno));
+			break;
+		}
+		if (connect(fd, ptr->ai_addr, ptr->ai_addrlen) == 0)
+			break;
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addresses);
+
+	if (fd < 0)
+		return false;
+
+	// pages are written in one go so don't hold back the tail of each one
+	int nodelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	m_Epoll = CreateEventLoop(fd);
+	if (m_Epoll < 0)
+	{
+		close(fd);
+		return false;
+	}
+	m_Fd = fd;
+	m_IsSocket = true;
+	return true;
+}
+
+bool Transport::AcceptSocket(const char* port)
+{
+	struct addrinfo hints = {};
+	hints.ai_family = AF_INET6;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_PASSIVE;
+	struct addrinfo* addresses = nullptr;
+	int result = getaddrinfo(nullptr, port, &hints, &addresses);
+	if (result != 0)
+	{
+		printf("getaddrinfo failed with error: %s\n", gai_strerror(result));
+		return false;
+	}
+	int listener = socket(addresses->ai_family, addresses->ai_socktype | SOCK_CLOEXEC, addresses->ai_protocol);
+	int on = 1, off = 0;
+	if (listener >= 0)
+	{
+		setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+		// IPv4 clients too, avrdude -P net:localhost:port may use either
+		setsockopt(listener, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+	}
+	if (listener < 0 || bind(listener, addresses->ai_addr, addresses->ai_addrlen) != 0 || listen(listener, 1) != 0)
+	{
+		printf("Can't listen on port %s: %s\n", port, strerror(errno));
+		freeaddrinfo(addresses);
+		if (listener >= 0)
+			close(listener);
+		return false;
+	}
+	freeaddrinfo(addresses);
+
+	int fd;
+	do {
+		fd = accept4(listener, nullptr, nullptr, SOCK_CLOEXEC);
+	} while (fd < 0 && errno == EINTR);
+	close(listener);
+	if (fd < 0)
+	{
+		printf("accept failed with error: %s\n", strerror(errno));
+		return false;
+	}
+
+	int nodelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+	m_Epoll = CreateEventLoop(fd);
+	if (m_Epoll < 0)
+	{
+		close(fd);
+		return false;
+	}
+	m_Fd = fd;
+	m_IsSocket = true;
+	m_PeerClosed = false;
+	return true;
+}
+
+bool Transport::OpenSerial(const char* comport, int baudrate)
+{
+	speed_t speed = BaudRateToSpeed(baudrate);
+	if (!speed)
+	{
+		fprintf(stderr, "Error: Unsupported baud rate %i\n", baudrate);
+		return false;
+	}
+	int fd = open(comport, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (fd < 0)
+	{
+		fprintf(stderr, "Error: Could not open serial port.\n");
+		return false;
+	}
+
+	struct termios tty;
+	if (tcgetattr(fd, &tty) != 0)
+	{
+		fprintf(stderr, "Error getting device state\n");
+		close(fd);
+		return false;
+	}
+	cfmakeraw(&tty);
+	tty.c_cflag |= CLOCAL | CREAD;
+	tty.c_cflag &= ~(CSTOPB | PARENB | CRTSCTS);
+	tty.c_cc[VMIN] = 0;
+	tty.c_cc[VTIME] = 0;
+	cfsetispeed(&tty, speed);
+	cfsetospeed(&tty, speed);
+	if (tcsetattr(fd, TCSANOW, &tty) != 0)
+	{
+		fprintf(stderr, "Error setting device parameters\n");
+		close(fd);
+		return false;
+	}
+
+	m_Epoll = CreateEventLoop(fd);
+	if (m_Epoll < 0)
+	{
+		close(fd);
+		return false;
+	}
+	m_Fd = fd;
+	m_IsSocket = false;
+	return true;
+}
+
+int Transport::FillBuffer()
+{
+	if (m_RxPos > 0 && m_RxPos == m_RxBuf.size())
+	{
+		m_RxBuf.clear();
+		m_RxPos = 0;
+	}
+	int total = 0;
+	for (;;)
+	{
+		uint8_t buf[4096];
+		ssize_t n = read(m_Fd, buf, sizeof(buf));
+		// a serial port also reads 0 bytes when there's nothing there
+		if (n == 0 && m_IsSocket)
+			m_PeerClosed = true;
+		if (n <= 0)
+			break;
+		m_RxBuf.insert(m_RxBuf.end(), buf, buf + n);
+		if (m_Recorder)
+			m_Recorder->Received(buf, n);
+		total += (int) n;
+	}
+	m_BytesReceived += total;
+	return total;
+}
+
+bool Transport::Poll(int timeoutMs, bool waitForWrite)
+{
+	if (waitForWrite != m_WantWrite)
+	{
+		epoll_event ev = {};
+		ev.events = waitForWrite ? EPOLLIN | EPOLLOUT : EPOLLIN;
+		ev.data.fd = m_Fd;
+		epoll_ctl(m_Epoll, EPOLL_CTL_MOD, m_Fd, &ev);
+		m_WantWrite = waitForWrite;
+	}
+	epoll_event ev;
+	int n;
+	do {
+		n = epoll_wait(m_Epoll, &ev, 1, timeoutMs);
+	} while (n < 0 && errno == EINTR);
+	if (n <= 0)
+		return false;
+	if (ev.events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+		FillBuffer();
+	return (ev.events & EPOLLOUT) != 0 || !waitForWrite;
+}
+
+int Transport::Available()
+{
+	if (m_Fd < 0)
+		return 0;
+	Poll(0);
+	return Buffered();
+}
+
+int Transport::Read(void* buf, int bytes)
+{
+	if (m_Fd < 0)
+		return 0;
+	int timeoutMs = m_IsSocket ? SocketReadTimeoutMs :
+		SerialReadTimeoutMs + SerialReadTimeoutPerByteMs * bytes;
+	auto start = std::chrono::steady_clock::now();
+	while (Buffered() < bytes && !m_PeerClosed)
+	{
+		int remaining = timeoutMs - ElapsedMs(start);
+		if (remaining <= 0)
+			break;
+		Poll(remaining);
+	}
+	int n = std::min(bytes, Buffered());
+	if (n <= 0)
+		return 0;
+	memcpy(buf, m_RxBuf.data() + m_RxPos, n);
+	m_RxPos += n;
+	return n;
+}
+
+int Transport::Write(const void* data, int len)
+{
+	if (m_Fd < 0)
+		return 0;
+	const uint8_t* u8data = (const uint8_t*) data;
+	int written = 0;
+	auto start = std::chrono::steady_clock::now();
+	while (written < len)
+	{
+		ssize_t n = write(m_Fd, u8data + written, len - written);
+		if (n > 0)
+		{
+			if (m_Recorder)
+				m_Recorder->Sent(u8data + written, n);
+			written += (int) n;
+			start = std::chrono::steady_clock::now();
+			continue;
+		}
+		if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			break;
+		// output is backed up: keep draining responses while we wait so the
+		// bridge never stalls on a full receive buffer at our end
+		int remaining = WriteTimeoutMs - ElapsedMs(start);
+		if (remaining <= 0)
+			break;
+		Poll(remaining, true);
+	}
+	if (m_WantWrite)
+		Poll(0);
+	m_BytesSent += written;
+	return written;
+}
+
+void Transport::Purge()
+{
+	if (m_Fd < 0)
+		return;
+	if (!m_IsSocket)
+		tcflush(m_Fd, TCIOFLUSH);
+	m_RxBuf.clear();
+	m_RxPos = 0;
+}
+
+#endif
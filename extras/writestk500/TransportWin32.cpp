@@ -0,0 +1,277 @@
+#ifdef _WIN32
+#include "Transport.hpp"
+#include "Platform.h"
+#include "Recorder.hpp"
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <stdio.h>
+
+#pragma comment(lib, "wsock32")
+#pragma comment(lib, "ws2_32")
+
+Transport::Transport()
+{
+}
+
+Transport::~Transport()
+{
+	Close();
+}
+
+void Transport::Close()
+{
+	if (m_Handle != nullptr)
+	{
+		if (m_IsSocket)
+		{
+			closesocket((SOCKET) m_Handle);
+			WSACleanup();
+		}
+		else
+		{
+			CloseHandle((HANDLE) m_Handle);
+		}
+		m_Handle = nullptr;
+	}
+	m_PeerClosed = false;
+}
+
+bool Transport::IsOpen() const
+{
+	return m_Handle != nullptr && !m_PeerClosed;
+}
+
+bool Transport::OpenSocket(const char* addr, const char* port)
+{
+	WSADATA wsadata = { 0 };
+	int result = WSAStartup(MAKEWORD(2, 2), &wsadata);
+	if (result != 0)
+	{
+		printf("Error opening winsock: %d\n", result);
+		return false;
+	}
+	DWORD flags = 0;
+	GROUP group = 0;
+	WSAPROTOCOL_INFO* protoInfo = nullptr;
+
+	struct addrinfo hints = { 0 };
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	struct addrinfo* addresses = nullptr;
+	result = getaddrinfo(addr, port, &hints, &addresses);
+	if (result != 0)
+	{
+		printf("getaddrinfo failed with error: %d\n", result);
+		WSACleanup();
+		return false;
+	}
+
+	SOCKET hSocket = INVALID_SOCKET;
+	for (struct addrinfo* ptr = addresses; ptr; ptr = ptr->ai_next)
+	{
+		hSocket = WSASocket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol, protoInfo, group, flags);
+		if (hSocket == INVALID_SOCKET)
+		{
+			printf("socket failed with error: %ld\n", WSAGetLastError());
+			break;
+		}
+		result = connect(hSocket, ptr->ai_addr, (int)ptr->ai_addrlen);
+		if (result != SOCKET_ERROR)
+		{
+			break;
+		}
+		closesocket(hSocket);
+		hSocket = INVALID_SOCKET;
+	}
+	freeaddrinfo(addresses);
+
+	if (hSocket == INVALID_SOCKET)
+	{
+		WSACleanup();
+		return false;
+	}
+
+	m_Handle = (HANDLE)hSocket;
+	m_IsSocket = true;
+	return true;
+}
+
+bool Transport::AcceptSocket(const char* port)
+{
+	WSADATA wsadata = { 0 };
+	int result = WSAStartup(MAKEWORD(2, 2), &wsadata);
+	if (result != 0)
+	{
+		printf("Error opening winsock: %d\n", result);
+		return false;
+	}
+	struct addrinfo hints = { 0 };
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_protocol = IPPROTO_TCP;
+	hints.ai_flags = AI_PASSIVE;
+	struct addrinfo* addresses = nullptr;
+	result = getaddrinfo(nullptr, port, &hints, &addresses);
+	if (result != 0)
+	{
+		printf("getaddrinfo failed with error: %d\n", result);
+		WSACleanup();
+		return false;
+	}
+	SOCKET listener = WSASocket(addresses->ai_family, addresses->ai_socktype, addresses->ai_protocol, nullptr, 0, 0);
+	if (listener == INVALID_SOCKET ||
+		bind(listener, addresses->ai_addr, (int)addresses->ai_addrlen) == SOCKET_ERROR ||
+		listen(listener, 1) == SOCKET_ERROR)
+	{
+		printf("Can't listen on port %s: %ld\n", port, WSAGetLastError());
+		freeaddrinfo(addresses);
+		if (listener != INVALID_SOCKET)
+			closesocket(listener);
+		WSACleanup();
+		return false;
+	}
+	freeaddrinfo(addresses);
+
+	SOCKET hSocket = accept(listener, nullptr, nullptr);
+	closesocket(listener);
+	if (hSocket == INVALID_SOCKET)
+	{
+		printf("accept failed with error: %ld\n", WSAGetLastError());
+		WSACleanup();
+		return false;
+	}
+	m_Handle = (HANDLE)hSocket;
+	m_IsSocket = true;
+	m_PeerClosed = false;
+	return true;
+}
+
+bool Transport::OpenSerial(const char* comport, int baudrate)
+{
+	HANDLE hSerial = CreateFileA((R"(\\.\)" + std::string(comport)).c_str(), GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
+
+	if (hSerial == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "Error: Could not open serial port.\n");
+		return false;
+	}
+
+	DCB dcbSerialParams = { sizeof(dcbSerialParams) };
+	if (GetCommState(hSerial, &dcbSerialParams) == 0)
+	{
+		fprintf(stderr, "Error getting device state\n");
+		CloseHandle(hSerial);
+		return false;
+	}
+
+	dcbSerialParams.BaudRate = baudrate; //CBR_115200;
+	dcbSerialParams.ByteSize = 8;
+	dcbSerialParams.StopBits = ONESTOPBIT;
+	dcbSerialParams.Parity = NOPARITY;
+	dcbSerialParams.fBinary = 1;
+
+	if(SetCommState(hSerial, &dcbSerialParams) == 0)
+	{
+		fprintf(stderr, "Error setting device parameters\n");
+		CloseHandle(hSerial);
+		return false;
+	}
+
+	COMMTIMEOUTS timeouts;
+	timeouts.ReadIntervalTimeout = 250;
+	timeouts.ReadTotalTimeoutConstant = 1000;
+	timeouts.ReadTotalTimeoutMultiplier = 10;
+	timeouts.WriteTotalTimeoutConstant = 100;
+	timeouts.WriteTotalTimeoutMultiplier = 10;
+	if (SetCommTimeouts(hSerial, &timeouts) == 0)
+	{
+		fprintf(stderr, "Error setting timeouts\n");
+		CloseHandle(hSerial);
+		return false;
+	}
+	m_Handle = hSerial;
+	m_IsSocket = false;
+	return true;
+}
+
+int Transport::Available()
+{
+	if (m_IsSocket)
+	{
+		FD_SET sockets;
+		FD_ZERO(&sockets);
+		FD_SET((SOCKET)m_Handle, &sockets);
+		TIMEVAL timeout = { 0 };
+		if (select(1, &sockets, nullptr, nullptr, &timeout) != 1)
+			return 0;
+		// readable with nothing to read means the other end has gone
+		char c;
+		if (recv((SOCKET)m_Handle, &c, 1, MSG_PEEK) <= 0)
+		{
+			m_PeerClosed = true;
+			return 0;
+		}
+		return 1;
+	}
+	else
+	{
+		DWORD flags = 0;
+		COMSTAT comstat;
+		if (!ClearCommError((HANDLE) m_Handle, &flags, &comstat))
+			return 0;
+		return comstat.cbInQue;
+	}
+}
+
+int Transport::Read(void* buf, int bytes)
+{
+	DWORD totalRead = 0;
+	while (totalRead < (DWORD) bytes)
+	{
+		if (m_IsSocket)
+		{
+			FD_SET sockets;
+			FD_ZERO(&sockets);
+			FD_SET((SOCKET) m_Handle, &sockets);
+			TIMEVAL timeout = { 0 };
+			timeout.tv_sec = 10;
+			if (select(1, &sockets, nullptr, nullptr, &timeout) != 1)
+			{
+				break;
+			}
+		}
+		DWORD n = 0;
+		if (!ReadFile((HANDLE) m_Handle, (uint8_t*)buf + totalRead, bytes - totalRead, &n, NULL) || n == 0)
+		{
+			m_PeerClosed = m_IsSocket;
+			break;
+		}
+		if (m_Recorder)
+			m_Recorder->Received((uint8_t*)buf + totalRead, n);
+		totalRead += n;
+	}
+	m_BytesReceived += totalRead;
+	return totalRead;
+}
+
+int Transport::Write(const void* data, int len)
+{
+	DWORD n = 0;
+	if (WriteFile((HANDLE) m_Handle, data, len, &n, NULL))
+	{
+		if (m_Recorder)
+			m_Recorder->Sent(data, n);
+		m_BytesSent += n;
+		return n;
+	}
+	return 0;
+}
+
+void Transport::Purge()
+{
+	if (!m_IsSocket)
+		PurgeComm((HANDLE) m_Handle, PURGE_TXCLEAR | PURGE_TXABORT | PURGE_RXCLEAR | PURGE_RXABORT);
+}
+
+#endif
@@ -1,11 +1,15 @@
 #include "CommandLine.hpp"
 #include <algorithm>
+#include <chrono>
+#include <map>
+#include <stdarg.h>
+#include <thread>
 #include "Platform.h"
-#include <winsock2.h>
-#include <ws2tcpip.h>
-
-#pragma comment(lib, "wsock32")
-#pragma comment(lib, "ws2_32")
+#include "ImageCache.hpp"
+#include "Compress.hpp"
+#include "Fleet.hpp"
+#include "Recorder.hpp"
+#include "Transport.hpp"
 
 struct PartInfo
 {
@@ -64,34 +68,51 @@ int crc16(const uint8_t* addr, int num, int crc = 0xFFFF)
 	return crc;
 }
 
+// contents of one contiguous block of device memory
+struct MemoryImage
+{
+	int segment = 0;
+	int start = 0;
+	std::vector<uint8_t> data;
+};
+
 class Stk500
 {
-	HANDLE m_Serial = INVALID_HANDLE_VALUE;
-	bool m_IsSocket = false;
+	Transport m_Transport;
 	bool m_Verbose = false;
 	bool m_Connected = false;
 	std::string m_Port;
 	uint16_t m_FlashSize = 0;
 	uint8_t m_PageSize = 0;
+	uint8_t m_Signature[3] = {};
+	bool m_PadFlash = false;
+	bool m_Quiet = false;
+	MemoryImage m_Flash;
 	int m_PendingResponseData = 0;
+	bool m_Version2 = false;
+	int m_BlockSize = 1024;
+	uint8_t m_Sequence = 0;
+	uint8_t m_ReplySequence = 0;
+	int m_PendingMessages = 0;
+	int m_BytesProgrammed = 0;
+	double m_ProgrammingTime = 0;
+
+	// progress output, left out when quiet
+	void Print(const char* format, ...)
+	{
+		if (m_Quiet)
+			return;
+		va_list args;
+		va_start(args, format);
+		vprintf(format, args);
+		va_end(args);
+	}
 
 public:	
 	~Stk500()
 	{
 		Close();
-		if (m_Serial != NULL)
-		{
-			if (m_IsSocket)
-			{
-				closesocket((SOCKET) m_Serial);
-				WSACleanup();
-			}
-			else
-			{
-				CloseHandle(m_Serial);
-			}
-			m_Serial = NULL;
-		}
+		m_Transport.Close();
 	}
 
 	bool Open(const char* addr, const char* port)
@@ -99,179 +120,49 @@ public:
 		m_Port = addr;
 		m_Port += ":";
 		m_Port += port;
-		WSADATA wsadata = { 0 };
-		int result = WSAStartup(MAKEWORD(2, 2), &wsadata);
-		if (result != 0)
-		{
-			printf("Error opening winsock: %d\n", result);
-			return false;
-		}
-		DWORD flags = 0;
-		GROUP group = 0;
-		WSAPROTOCOL_INFO* protoInfo = nullptr;
-
-		struct addrinfo hints = { 0 };
-		hints.ai_family = AF_UNSPEC;
-		hints.ai_socktype = SOCK_STREAM;
-		hints.ai_protocol = IPPROTO_TCP;
-		struct addrinfo* addresses = nullptr;
-		result = getaddrinfo(addr, port, &hints, &addresses);
-		if (result != 0) 
-		{
-			printf("getaddrinfo failed with error: %d\n", result);
-			WSACleanup();
-			return false;
-		}
-
-		SOCKET hSocket = INVALID_SOCKET;
-		for (struct addrinfo* ptr = addresses; ptr; ptr = ptr->ai_next) 
-		{
-			hSocket = WSASocket(ptr->ai_family, ptr->ai_socktype, ptr->ai_protocol, protoInfo, group, flags);
-			if (hSocket == INVALID_SOCKET)
-			{
-				printf("socket failed with error: %ld\n", WSAGetLastError());
-				break;
-			}
-			result = connect(hSocket, ptr->ai_addr, (int)ptr->ai_addrlen);
-			if (result != SOCKET_ERROR)
-			{
-				break;
-			}
-			closesocket(hSocket);
-			hSocket = INVALID_SOCKET;
-		}
-		freeaddrinfo(addresses);
-
-		if (hSocket == INVALID_SOCKET)
-		{
-			WSACleanup();
-			return false;
-		}
-
-		
-		//DWORD sndbuf = 32;
-		//result = setsockopt(hSocket, SOL_SOCKET, SO_SNDBUF, (char*) &sndbuf, sizeof(DWORD));
-		//if (result == SOCKET_ERROR)
-		//	return false;
-		//DWORD rcvbuf = 32;
-		//result = setsockopt(hSocket, SOL_SOCKET, SO_RCVBUF, (char*) &rcvbuf, sizeof(DWORD));
-		//if (result == SOCKET_ERROR)
-		//	return false;
-		//DWORD rcvtimeo = 100;
-		//result = setsockopt(hSocket, SOL_SOCKET, SO_RCVTIMEO, (char*) &rcvtimeo, sizeof(DWORD));
-		//if (result == SOCKET_ERROR)
-		//	return false;
-		//result = setsockopt(hSocket, SOL_SOCKET, SO_SNDTIMEO, (char*) &rcvtimeo, sizeof(DWORD));
-		//if (result == SOCKET_ERROR)
-		//	return false;		
-		//BOOL disable = TRUE;
-		//setsockopt(hSocket, IPPROTO_TCP, TCP_NODELAY, (char*) &disable, sizeof(BOOL));
-
-		m_Serial = (HANDLE)hSocket;
-		m_IsSocket = true;
-		return true;
+		return m_Transport.OpenSocket(addr, port);
 	}
 
 	void SetVerbose(bool verbose) { m_Verbose = verbose; }
+	// save everything said to and by the bridge for replaybench
+	void SetRecorder(SessionRecorder* recorder) { m_Transport.SetRecorder(recorder); }
+	// pad program memory with zeroes up to the end of flash rather than the
+	// end of the page, so a CRC check of the whole flash passes
+	void SetPadFlash(bool pad) { m_PadFlash = pad; }
+	// only print errors, for when several bridges are programming at once
+	void SetQuiet(bool quiet) { m_Quiet = quiet; }
+	// talk STK500v2 to the bridge, writing up to blockSize bytes of flash
+	// per message which the bridge splits into pages
+	void SetVersion2(bool version2, int blockSize) { m_Version2 = version2; m_BlockSize = blockSize; }
+
+	const uint8_t* GetSignature() const { return m_Signature; }
+	int GetPageSize() const { return m_PageSize; }
+	int GetBytesProgrammed() const { return m_BytesProgrammed; }
+	const std::string& GetPort() const { return m_Port; }
+	// program memory as it was sent by the last Program() call, CRC included
+	const MemoryImage& GetFlash() const { return m_Flash; }
 
 	bool Open(const char* comport, int baudrate = 500000)
 	{
 		m_Port = comport;
-		HANDLE hSerial = CreateFileA((R"(\\.\)" + m_Port).c_str(), GENERIC_READ|GENERIC_WRITE, 0, NULL, OPEN_EXISTING, 0, NULL);
-				
-		if (hSerial == INVALID_HANDLE_VALUE) 
-		{
-            fprintf(stderr, "Error: Could not open serial port.\n");
-            return false;
-		} 
-		
-		DCB dcbSerialParams = { sizeof(dcbSerialParams) };
-		if (GetCommState(hSerial, &dcbSerialParams) == 0) 
-		{
-			fprintf(stderr, "Error getting device state\n");
-			CloseHandle(hSerial);
-			return false;
-		}
-		
-		dcbSerialParams.BaudRate = baudrate; //CBR_115200;
-		dcbSerialParams.ByteSize = 8;
-		dcbSerialParams.StopBits = ONESTOPBIT;
-		dcbSerialParams.Parity = NOPARITY;
-		dcbSerialParams.fBinary = 1;
-
-		if(SetCommState(hSerial, &dcbSerialParams) == 0) 
-		{
-			fprintf(stderr, "Error setting device parameters\n");
-			CloseHandle(hSerial);
+		if (!m_Transport.OpenSerial(comport, baudrate))
 			return false;
-		}
- 
-		COMMTIMEOUTS timeouts;
-		timeouts.ReadIntervalTimeout = 250;
-		timeouts.ReadTotalTimeoutConstant = 1000;
-		timeouts.ReadTotalTimeoutMultiplier = 10;
-		timeouts.WriteTotalTimeoutConstant = 100;
-		timeouts.WriteTotalTimeoutMultiplier = 10;
-		if (SetCommTimeouts(hSerial, &timeouts) == 0) 
-		{
-			fprintf(stderr, "Error setting timeouts\n");
-			CloseHandle(hSerial);
-			return false;
-		}		        
-		m_Serial = hSerial;
-		m_IsSocket = false;
 		Purge();
-
 		return true;
 	}
 	
 	int Available()
 	{
-		if (m_IsSocket)
-		{
-			FD_SET sockets;
-			FD_ZERO(&sockets);
-			FD_SET((SOCKET)m_Serial, &sockets);
-			TIMEVAL timeout = { 0 };
-			return select(1, &sockets, nullptr, nullptr, &timeout) == 1 ? 1 : 0;
-		}
-		else
-		{
-			DWORD flags = 0;
-			COMSTAT comstat;
-			if (!ClearCommError(m_Serial, &flags, &comstat))
-				return 0;
-			return comstat.cbInQue;
-		}
+		return m_Transport.Available();
 	}
 	
 	int Read(void* buf, int bytes)
 	{
-		DWORD totalRead = 0;
-		while (totalRead < bytes)
-		{
-			if (m_IsSocket)
-			{
-				FD_SET sockets;
-				FD_ZERO(&sockets);
-				FD_SET((SOCKET) m_Serial, &sockets);
-				TIMEVAL timeout = { 0 };
-				timeout.tv_sec = 10;
-				if (select(1, &sockets, nullptr, nullptr, &timeout) != 1)
-				{
-					return totalRead;
-				}
-			}
-			DWORD n = 0;
-			if (!ReadFile(m_Serial, (uint8_t*)buf + totalRead, bytes - totalRead, &n, NULL))
-				return totalRead;
-			totalRead += n;
-		}
-		return totalRead;
+		return m_Transport.Read(buf, bytes);
 	}
 	int Read()
 	{
-		char c;
+		uint8_t c;
 		if (Read(&c, 1))
 		{
 			//printf("<%02x ", c);
@@ -281,10 +172,7 @@ public:
 	}	
 	int Write(const void* data, int len)
 	{
-		DWORD n = 0;
-		if (WriteFile(m_Serial, data, len, &n, NULL))
-			return n;
-		return 0;
+		return m_Transport.Write(data, len);
 	}	
 	int Write(const char* str)
 	{
@@ -304,12 +192,24 @@ public:
 			if (m_Verbose && (c == '\n' || c == '\r' || c >= 32 && c < 128))
 				fputc(c, stdout);
 		}
-		if (!m_IsSocket)
-			PurgeComm(m_Serial, PURGE_TXCLEAR | PURGE_TXABORT | PURGE_RXCLEAR | PURGE_RXABORT);
+		m_Transport.Purge();
+	}
+
+	void PrintThroughput()
+	{
+		if (m_BytesProgrammed == 0)
+			return;
+		printf("Programmed %i bytes in %.2fs (%.0f bytes/s), link sent %llu bytes and received %llu bytes\n",
+			m_BytesProgrammed, m_ProgrammingTime,
+			m_ProgrammingTime > 0 ? m_BytesProgrammed / m_ProgrammingTime : 0.0,
+			(unsigned long long) m_Transport.GetBytesSent(),
+			(unsigned long long) m_Transport.GetBytesReceived());
 	}
         
     bool Connect()
 	{
+		if (m_Version2)
+			return ConnectVersion2();
 		Purge();
 		Write("0 ");
 		for(int i = 0; i < 5; ++i)
@@ -336,19 +236,7 @@ public:
 				Write("u ");
 				if (Read(sigbuf, 5) == 5 && sigbuf[0] == 0x14 && sigbuf[4] == 0x10)
 				{
-					for (int i = 0; i < ARRAYSIZE(parts); ++i)
-					{
-						if (memcmp(sigbuf + 1, parts[i].signature, 3) == 0)
-						{
-							m_Connected = true;
-							m_FlashSize = parts[i].flashSize;
-							m_PageSize = parts[i].pageSize;
-							printf("Connected to %s on %s\n", parts[i].name, m_Port.c_str());
-							return true;
-						}
-					}
-					printf("Unknown device %02X%02X%02X on %s\n", sigbuf[1], sigbuf[2], sigbuf[3], m_Port.c_str());
-					return false;
+					return SetPart(sigbuf + 1);
 				}
 				else
 				{
@@ -366,8 +254,135 @@ public:
 		return false;
 	}
 
+	// look up the connected device from its signature
+	bool SetPart(const uint8_t* signature)
+	{
+		for (size_t i = 0; i < ARRAYSIZE(parts); ++i)
+		{
+			if (memcmp(signature, parts[i].signature, 3) == 0)
+			{
+				m_Connected = true;
+				memcpy(m_Signature, parts[i].signature, 3);
+				m_FlashSize = parts[i].flashSize;
+				m_PageSize = parts[i].pageSize;
+				Print("Connected to %s on %s\n", parts[i].name, m_Port.c_str());
+				return true;
+			}
+		}
+		printf("Unknown device %02X%02X%02X on %s\n", signature[0], signature[1], signature[2], m_Port.c_str());
+		return false;
+	}
+
+	// STK500v2 messages are framed by 0x1B, sequence number, size, 0x0E
+	// and end with an XOR checksum
+	void SendMessage(const std::vector<uint8_t>& body)
+	{
+		int size = (int)body.size();
+		std::vector<uint8_t> message = { 0x1B, ++m_Sequence, (uint8_t)(size >> 8), (uint8_t)size, 0x0E };
+		message.insert(message.end(), body.begin(), body.end());
+		uint8_t checksum = 0;
+		for (uint8_t c : message)
+			checksum ^= c;
+		message.push_back(checksum);
+		Write(message.data(), (int)message.size());
+		++m_PendingMessages;
+	}
+
+	// read the reply to the oldest message that doesn't have one yet
+	bool ReadMessage(std::vector<uint8_t>& body)
+	{
+		--m_PendingMessages;
+		++m_ReplySequence;
+		int c;
+		do
+			c = Read();
+		while (c >= 0 && c != 0x1B);
+		uint8_t header[4];
+		if (c < 0 || Read(header, 4) != 4 || header[3] != 0x0E)
+		{
+			fprintf(stderr, "\nTimed out waiting for response\n");
+			return false;
+		}
+		int size = (header[1] << 8) | header[2];
+		body.resize(size + 1);
+		if (Read(body.data(), size + 1) != size + 1)
+		{
+			fprintf(stderr, "\nTimed out waiting for response\n");
+			return false;
+		}
+		uint8_t checksum = 0x1B ^ header[0] ^ header[1] ^ header[2] ^ header[3];
+		for (uint8_t b : body)
+			checksum ^= b;
+		body.pop_back();
+		if (checksum != 0 || header[0] != m_ReplySequence || size < 2)
+		{
+			fprintf(stderr, "\nBad response\n");
+			return false;
+		}
+		return true;
+	}
+
+	// send a message and wait for its reply, which has to succeed
+	bool Transact(const std::vector<uint8_t>& message, std::vector<uint8_t>& reply)
+	{
+		if (!CheckResponse())
+			return false;
+		SendMessage(message);
+		return ReadMessage(reply) && reply[0] == message[0] && reply[1] == 0x00;
+	}
+
+	bool ConnectVersion2()
+	{
+		Purge();
+		m_PendingMessages = 0;
+		m_ReplySequence = m_Sequence;
+		std::vector<uint8_t> reply;
+		bool signedOn = false;
+		for (int i = 0; i < 5 && !signedOn; ++i)
+		{
+			// CMD_SIGN_ON
+			SendMessage({ 0x01 });
+			signedOn = ReadMessage(reply);
+			if (!signedOn)
+			{
+				Purge();
+				m_PendingMessages = 0;
+				m_ReplySequence = m_Sequence;
+			}
+		}
+		if (!signedOn)
+		{
+			printf("No response on %s\n", m_Port.c_str());
+			return false;
+		}
+		if (reply[0] != 0x01 || reply[1] != 0x00)
+		{
+			printf("Error connecting to remote device\n");
+			return false;
+		}
+		// the bridge has to close the session from here on
+		m_Connected = true;
+		// CMD_ENTER_PROGMODE_ISP, which reads the signature, then
+		// CMD_READ_SIGNATURE_ISP for each byte of it
+		uint8_t sig[3];
+		bool ok = Transact({ 0x10, 200, 100, 25, 32, 0, 0x53, 3, 0xAC, 0x53, 0, 0 }, reply);
+		for (uint8_t i = 0; i < 3 && ok; ++i)
+		{
+			ok = Transact({ 0x1B, 4, 0x30, 0, i, 0 }, reply) && reply.size() == 4;
+			sig[i] = ok ? reply[2] : 0;
+		}
+		if (!ok)
+		{
+			printf("Error reading remote device's signature\n");
+			return false;
+		}
+		return SetPart(sig);
+	}
+
 	bool CheckResponse(bool blocking = true)
-	{		
+	{
+		if (m_Version2)
+			return CheckMessages(blocking);
 		for (; m_PendingResponseData > 0 && (blocking || Available()); --m_PendingResponseData)
 		{
 			int resp = Read();
@@ -385,14 +400,66 @@ public:
 			}
 			if (resp == 0x10)
 			{
-				fputc('.', stdout);
+				Print(".");
 				//fflush(stdout);
 			}
 		}
 		return true;
 	}
 
-	bool Program(int segment, int start, std::vector<uint8_t> data)
+	// check the replies to STK500v2 messages as they arrive
+	bool CheckMessages(bool blocking)
+	{
+		std::vector<uint8_t> reply;
+		while (m_PendingMessages > 0 && (blocking || Available()))
+		{
+			if (!ReadMessage(reply))
+			{
+				Purge();
+				m_PendingMessages = 0;
+				m_ReplySequence = m_Sequence;
+				return false;
+			}
+			if (reply[1] != 0x00)
+			{
+				if (reply[1] == 0xC0)
+					fprintf(stderr, "\nFailed flashing\n");
+				else
+					fprintf(stderr, "\nUnexpected response 0x%02x to 0x%02x\n", reply[1], reply[0]);
+				return false;
+			}
+			if (reply[0] == 0x13 || reply[0] == 0x15)
+				Print(".");
+		}
+		return true;
+	}
+
+	// program memory as Program() writes it, remembered by GetFlash()
+	const MemoryImage& PrepareFlash(int start, std::vector<uint8_t> data)
+	{
+		int size = (int)data.size();
+		if (start + size < m_FlashSize)
+		{
+			// provided the rest of flash is cleared to zeroes we
+			// can just stick the CRC on the end of the program					
+			uint16_t crc = crc16(&data[0], size);
+			data.push_back(crc >> 8);
+			data.push_back(crc & 255);
+			// pad out to a full page with zeroes
+			if (m_PadFlash)
+				data.resize(m_FlashSize - start, 0);
+			else
+				data.resize((data.size() + m_PageSize - 1) & ~(m_PageSize - 1), 0);
+		}
+		m_Flash.segment = 0;
+		m_Flash.start = start;
+		m_Flash.data = data;
+		return m_Flash;
+	}
+
+	// write a block of memory, skipping any pages that already match
+	// 'baseline' (the flash contents the device is believed to hold)
+	bool Program(int segment, int start, std::vector<uint8_t> data, const MemoryImage* baseline = nullptr)
 	{
 		uint8_t type;
 		const char* name;
@@ -404,25 +471,14 @@ public:
 				type = 'F';
 				name = "program memory";
 				pagesize = m_PageSize;				
-				if (start + size < m_FlashSize)
-				{
-					// provided the rest of flash is cleared to zeroes we
-					// can just stick the CRC on the end of the program					
-					uint16_t crc = crc16(&data[0], size);
-					data.push_back(crc >> 8);
-					data.push_back(crc & 255);
-					// pad out to a full page with zeroes
-					data.resize((size + pagesize - 1) & ~(pagesize - 1), 0);
-					//data.resize(m_FlashSize - start, 0);
-					size = (int)data.size();
-				}
+				data = PrepareFlash(start, data).data;
 				break;
 			case 0x81:
 				type = 'E';
 				name = "EEPROM";
 				break;
 			case 0x82:
-				printf("Skipping fuses segment\n");
+				Print("Skipping fuses segment\n");
 				return true;
 			case 0x85:
 				type = 'U';
@@ -433,31 +489,273 @@ public:
 				return false;
 		}
 
-        printf("Writing %i bytes to %s", size, name);
-	    for(int pos = 0; pos < size; pos += pagesize)
+		if (baseline && baseline->segment != segment)
+			baseline = nullptr;
+		std::vector<bool> skip;
+		size = (int)data.size();
+		for (int pos = 0; pos < size; pos += pagesize)
+		{
+			int len = std::min(pagesize, size - pos);
+			int offset = start + pos - (baseline ? baseline->start : 0);
+			skip.push_back(baseline && offset >= 0 && offset + len <= (int)baseline->data.size() &&
+				memcmp(&baseline->data[offset], &data[pos], len) == 0);
+		}
+		if (baseline)
+			Print("Writing %i of %i pages (%i bytes) to %s", CountPages(skip), (int)skip.size(), CountBytes(skip, pagesize, size), name);
+		else
+			Print("Writing %i bytes to %s", size, name);
+		return WritePages(type, pagesize, start, data, skip);
+	}
+
+	static int CountPages(const std::vector<bool>& skip)
+	{
+		return (int)std::count(skip.begin(), skip.end(), false);
+	}
+	static int CountBytes(const std::vector<bool>& skip, int pagesize, int size)
+	{
+		int bytes = 0;
+		for (int page = 0; page < (int)skip.size(); ++page)
+			if (!skip[page])
+				bytes += std::min(pagesize, size - page * pagesize);
+		return bytes;
+	}
+
+	// write the pages of 'data' that aren't marked in 'skip'
+	bool WritePages(uint8_t type, int pagesize, int start, const std::vector<uint8_t>& data, const std::vector<bool>& skip)
+	{
+		int size = (int)data.size();
+		int bytes = CountBytes(skip, pagesize, size);
+		auto startTime = std::chrono::steady_clock::now();
+		if (m_Version2)
+		{
+			if (!WriteBlocks(type, pagesize, start, data, skip))
+				return false;
+		}
+		else for (int pos = 0, page = 0; pos < size; pos += pagesize, ++page)
 		{
+			if (skip[page])
+				continue;
             int addr = start + pos;
 			uint8_t packetsize = std::min(pagesize, size - pos);
-			uint8_t packet [] = 
+			// send the whole command in one write so each page costs a
+			// single syscall, responses are picked up as they arrive
+			uint8_t packet [8 + 256 + 1] =
 			{
 				0x55, (uint8_t)(addr & 255), (uint8_t)(addr >> 8), ' ',
 				0x64, 0, packetsize, type
 			};
-			Write(packet, sizeof(packet));
-			Write(&data[pos], packetsize);
-			Write(' ');
+			memcpy(packet + 8, &data[pos], packetsize);
+			packet[8 + packetsize] = ' ';
+			Write(packet, 8 + packetsize + 1);
 			m_PendingResponseData += 4;
 			if (!CheckResponse(false))
 				return false;
 		}
 		if (!CheckResponse())
 			return false;
-		puts("OK\n");
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		m_BytesProgrammed += bytes;
+		m_ProgrammingTime += seconds;
+		Print("OK (%.2fs, %.0f bytes/s)\n\n", seconds, seconds > 0 ? bytes / seconds : 0.0);
 		return true;
 	}
-        
+
+	// write runs of pages that aren't skipped as blocks of up to m_BlockSize
+	// bytes with STK500v2 messages
+	bool WriteBlocks(uint8_t type, int pagesize, int start, const std::vector<uint8_t>& data, const std::vector<bool>& skip)
+	{
+		if (type == 'U')
+		{
+			fprintf(stderr, "\nUser signatures can't be written with STK500v2\n");
+			return false;
+		}
+		int size = (int)data.size();
+		int blockPages = std::max(1, m_BlockSize / pagesize);
+		int next = -1; // where the bridge's address is after the last block
+		for (int page = 0; page * pagesize < size; )
+		{
+			if (skip[page])
+			{
+				++page;
+				continue;
+			}
+			int pos = page * pagesize;
+			int end = pos;
+			for (int pages = 0; pages < blockPages && end < size && !skip[page]; ++pages, ++page)
+				end = std::min(end + pagesize, size);
+			// flash addresses are in words, the bridge moves on after each block
+			int addr = start + pos;
+			if (addr != next)
+			{
+				int loadaddr = type == 'F' ? addr >> 1 : addr;
+				SendMessage({ 0x06, 0, 0, (uint8_t)(loadaddr >> 8), (uint8_t)loadaddr });
+			}
+			next = start + end;
+			int length = end - pos;
+			// CMD_PROGRAM_FLASH_ISP or CMD_PROGRAM_EEPROM_ISP, the ISP
+			// parameters after the length are ignored
+			std::vector<uint8_t> message = { (uint8_t)(type == 'F' ? 0x13 : 0x15),
+				(uint8_t)(length >> 8), (uint8_t)length, 0xC1, 10, 0x40, 0x4C, 0x20, 0, 0 };
+			message.insert(message.end(), data.begin() + pos, data.begin() + end);
+			SendMessage(message);
+			if (!CheckResponse(false))
+				return false;
+		}
+		return true;
+	}
+
+	// write program memory LZ compressed through the stage-2 updater,
+	// uploading the updater first if it isn't on the device.  the program is
+	// zero filled up to the updater and ends with two bytes that make a CRC
+	// check of the whole flash (updater included) pass.
+	bool ProgramCompressed(int start, std::vector<uint8_t> data, const MemoryImage& updater)
+	{
+		int end = updater.start;
+		if (end % m_PageSize || start % m_PageSize || start + (int)data.size() + 2 > end)
+		{
+			fprintf(stderr, "Program doesn't fit below the stage-2 updater at 0x%04X\n", end);
+			return false;
+		}
+		std::vector<uint8_t> resident = updater.data;
+		resident.resize(m_FlashSize - end, 0);
+		data.resize(end - start - 2, 0);
+		uint16_t fix = CrcFixup(crc16(&data[0], (int)data.size()), resident);
+		data.push_back(fix >> 8);
+		data.push_back(fix & 255);
+		std::vector<uint8_t> compressed = LzCompress(data);
+
+		if (!StartUpdater(start, end))
+		{
+			Print("No stage-2 updater on the device, uploading it\n");
+			if (!Program(0, end, resident) || !StartUpdater(start, end))
+			{
+				fprintf(stderr, "Failed starting the stage-2 updater\n");
+				return false;
+			}
+		}
+		Print("Writing %i bytes to program memory as %i compressed bytes (%.0f%%)",
+			(int)data.size(), (int)compressed.size(), 100.0 * compressed.size() / data.size());
+		auto startTime = std::chrono::steady_clock::now();
+		for (size_t pos = 0;;)
+		{
+			// an empty page ends the stream
+			uint8_t packetsize = (uint8_t)std::min<size_t>(128, compressed.size() - pos);
+			uint8_t packet [4 + 128 + 1] = { 0x64, 0, packetsize, 'Z' };
+			memcpy(packet + 4, compressed.data() + pos, packetsize);
+			packet[4 + packetsize] = ' ';
+			Write(packet, 4 + packetsize + 1);
+			m_PendingResponseData += 2;
+			if (!CheckResponse(false))
+				return false;
+			if (packetsize == 0)
+				break;
+			pos += packetsize;
+		}
+		if (!CheckResponse())
+			return false;
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		m_BytesProgrammed += (int)data.size();
+		m_ProgrammingTime += seconds;
+		Print("OK (%.2fs, %.0f bytes/s)\n\n", seconds, seconds > 0 ? data.size() / seconds : 0.0);
+		m_Flash.segment = 0;
+		m_Flash.start = start;
+		m_Flash.data = data;
+		return true;
+	}
+
+	// point the updater at the flash between start and end, fails if there's
+	// no updater at the address it was linked at
+	bool StartUpdater(int start, int end)
+	{
+		if (!CheckResponse())
+			return false;
+		// the updater is linked to start where the program has to end
+		uint8_t packet[] =
+		{
+			0x55, (uint8_t)(end & 255), (uint8_t)(end >> 8), ' ',
+			0x64, 0, 4, 'S', (uint8_t)(start & 255), (uint8_t)(start >> 8), (uint8_t)(end & 255), (uint8_t)(end >> 8), ' '
+		};
+		Write(packet, sizeof(packet));
+		uint8_t resp[4];
+		int n = Read(resp, 4);
+		return n == 4 && resp[0] == 0x14 && resp[1] == 0x10 && resp[2] == 0x14 && resp[3] == 0x10;
+	}
+
+	// read program memory back a page at a time.  the 256 byte bootloader
+	// can't read flash so the bridge returns 0xFF for everything.
+	bool ReadFlash(int start, int size, std::vector<uint8_t>& data)
+	{
+		if (!CheckResponse())
+			return false;
+		data.clear();
+		if (m_Version2)
+			return ReadFlashBlocks(start, size, data);
+		for (int pos = 0; pos < size; pos += m_PageSize)
+		{
+			int addr = start + pos;
+			uint8_t len = (uint8_t)std::min<int>(m_PageSize, size - pos);
+			uint8_t packet[] =
+			{
+				0x55, (uint8_t)(addr & 255), (uint8_t)(addr >> 8), ' ',
+				0x74, 0, len, 'F', ' '
+			};
+			uint8_t resp[2 + 1 + 256 + 1];
+			// a read that didn't get through ends with 0x11, try it again
+			bool ok = false;
+			for (int attempt = 0; attempt < 3 && !ok; ++attempt)
+			{
+				Write(packet, sizeof(packet));
+				if (Read(resp, len + 4) != len + 4 || resp[0] != 0x14 || resp[1] != 0x10 || resp[2] != 0x14)
+					break;
+				ok = resp[len + 3] == 0x10;
+			}
+			if (!ok)
+			{
+				fprintf(stderr, "Error reading program memory at 0x%04X\n", addr);
+				Purge();
+				return false;
+			}
+			data.insert(data.end(), resp + 3, resp + 3 + len);
+		}
+		return true;
+	}
+
+	bool ReadFlashBlocks(int start, int size, std::vector<uint8_t>& data)
+	{
+		std::vector<uint8_t> reply;
+		for (int pos = 0; pos < size; pos += m_BlockSize)
+		{
+			int addr = start + pos;
+			int len = std::min(m_BlockSize, size - pos);
+			// a read that didn't get through fails, try it again
+			bool ok = false;
+			for (int attempt = 0; attempt < 3 && !ok; ++attempt)
+			{
+				// CMD_LOAD_ADDRESS in words then CMD_READ_FLASH_ISP
+				ok = Transact({ 0x06, 0, 0, (uint8_t)(addr >> 9), (uint8_t)(addr >> 1) }, reply) &&
+					Transact({ 0x14, (uint8_t)(len >> 8), (uint8_t)len, 0x20 }, reply) &&
+					(int)reply.size() == len + 3 && reply[len + 2] == 0x00;
+			}
+			if (!ok)
+			{
+				fprintf(stderr, "Error reading program memory at 0x%04X\n", addr);
+				Purge();
+				return false;
+			}
+			data.insert(data.end(), reply.begin() + 2, reply.begin() + 2 + len);
+		}
+		return true;
+	}
+
     void Close()
 	{
+		if (m_Connected && m_Version2)
+		{
+			// CMD_LEAVE_PROGMODE_ISP
+			std::vector<uint8_t> reply;
+			Transact({ 0x11, 1, 1 }, reply);
+			m_Connected = false;
+		}
 		if (m_Connected)
 		{
 			Write("Q ");
@@ -467,7 +765,9 @@ public:
 		}
 	}
         
-    bool SendCommand(const char* cmd)
+	// send a console command and wait for the prompt, optionally keeping
+	// what the bridge printed
+    bool SendCommand(const char* cmd, std::string* output = nullptr)
 	{
 		Purge();
 		Write(cmd);
@@ -482,13 +782,461 @@ public:
 			}
 			if (m_Verbose)
 				fputc(c, stdout);
+			if (output)
+				*output += (char)c;
 			c0 = c;
             c = Read();
 		}
 		return true;
 	}
+
+	// have the bridge run CRCSCAN over the remote device's whole flash
+	bool CheckCrc()
+	{
+		std::string output;
+		if (!SendCommand("*cfg\n") || !SendCommand("crc\n", &output))
+			return false;
+		Write("q\n");
+		return output.find("CRC check passed OK") != std::string::npos;
+	}
+
+	// fetch the bridge's packet trace frame (see megaTinyNrfTrace.h) for tracedecode
+	bool ReadTrace(std::vector<uint8_t>& frame)
+	{
+		if (!SendCommand("*cfg\n"))
+			return false;
+		Purge();
+		Write("trace\n");
+		// the frame is binary, so find it by its sync bytes rather than the prompt
+		int c0 = -1;
+		int c = Read();
+		while (c >= 0 && (c0 != 0xA5 || c != 0x7E))
+		{
+			c0 = c;
+			c = Read();
+		}
+		uint8_t header[3];
+		if (c < 0 || Read(header, 3) != 3)
+		{
+			fprintf(stderr, "No trace from the bridge, it needs building with MTNB_TRACE_SIZE\n");
+			return false;
+		}
+		frame = { 0xA5, 0x7E, header[0], header[1], header[2] };
+		size_t size = (header[1] | (header[2] << 8)) * 4 + 1;
+		frame.resize(frame.size() + size);
+		if (Read(&frame[5], (int)size) != (int)size)
+		{
+			fprintf(stderr, "Communication error\n");
+			return false;
+		}
+		Write("q\n");
+		return true;
+	}
 };
     
+static bool IsSerialPort(const std::string& comport)
+{
+#ifdef _WIN32
+	return comport.size() >= 3 &&
+		tolower(comport[0]) == 'c' &&
+		tolower(comport[1]) == 'o' &&
+		tolower(comport[2]) == 'm';
+#else
+	return !comport.empty() && comport[0] == '/';
+#endif
+}
+
+// read an Intel HEX file into contiguous blocks, segment is the high
+// address from type 4 records (0x81 EEPROM, 0x82 fuses, 0x85 user signatures)
+static bool LoadHex(const char* filename, std::vector<MemoryImage>& images)
+{
+	FILE* f = NULL;
+	if (fopen_s(&f, filename, "r"))
+	{
+		fprintf(stderr, "Error opening %s\n", filename);
+		return false;
+	}
+	MemoryImage image;
+	char line[128];
+	bool ok = false;
+	while (fgets(line, 128, f))
+	{
+		int bytes, address, type;
+		if (sscanf_s(line, ":%02x%04x%02x", &bytes, &address, &type) == 3)
+		{
+			if (!image.data.empty() && (type != 0 || address != image.start + (int)image.data.size()))
+			{
+				images.push_back(image);
+				image.data.clear();
+			}
+			if (type == 0)
+			{
+				if (image.data.empty())
+					image.start = address;
+				int i;
+				const char* hex = line + 9;
+				for( i = 0; i < bytes; ++i, hex += 2)
+				{
+					int value = 0;
+					if (sscanf_s(hex, "%02x", &value) == 1)
+						image.data.push_back(value);
+					else
+						break;
+				}
+				if (i == bytes)
+					continue;
+			}
+			int checksum;
+			if (type == 4 && sscanf_s(line + 9, "%04x%02x", &image.segment, &checksum) == 2)
+				continue;
+			if (type == 1)
+			{
+				ok = true;
+				break;
+			}
+			if (type == 3)
+				continue;
+			fprintf(stderr, "Unknown record type %i in hex file\n", type);
+			break;
+		}
+		else
+		{
+			fprintf(stderr, "Error parsing HEX file\n");
+			break;
+		}			
+	}
+	fclose(f);
+	if (!image.data.empty())
+		images.push_back(image);
+	return ok;
+}
+
+static bool ProgramImages(Stk500& prog, const std::vector<MemoryImage>& images, const MemoryImage* baseline, const MemoryImage* updater = nullptr)
+{
+	for (const MemoryImage& image : images)
+	{
+		bool ok = updater && image.segment == 0
+			? prog.ProgramCompressed(image.start, image.data, *updater)
+			: prog.Program(image.segment, image.start, image.data, baseline);
+		if (!ok)
+			return false;
+	}
+	return true;
+}
+
+// Program every device in 'devices' with one broadcast of the program memory
+// image to a group of bootloaders, then visit each device in turn to write
+// the pages that can't be broadcast and check its CRC.  Pages a device missed
+// are repaired from a read back of its flash where the bootloader supports
+// that, otherwise the whole image is written to it again.
+static bool ProgramGroup(Stk500& prog, const std::vector<MemoryImage>& images,
+	const std::vector<std::string>& devices, const std::string& group)
+{
+	const MemoryImage* flash = nullptr;
+	std::vector<MemoryImage> others;
+	for (const MemoryImage& image : images)
+	{
+		if (image.segment == 0)
+			flash = &image;
+		else
+			others.push_back(image);
+	}
+
+	char buf[64];
+	std::vector<bool> joined;
+	for (const std::string& device : devices)
+	{
+		std::string output;
+		printf("Joining %s to group %s... ", device.c_str(), group.c_str());
+		sprintf_s(buf, "addr %s\n", device.c_str());
+		bool ok = prog.SendCommand("*cfg\n") && prog.SendCommand(buf);
+		sprintf_s(buf, "join %s\n", group.c_str());
+		ok = ok && prog.SendCommand(buf, &output) && output.find("Joined group") != std::string::npos;
+		printf(ok ? "OK\n" : "failed, programming it on its own\n");
+		joined.push_back(ok);
+	}
+
+	// every page but the first, which holds the code that moved the devices
+	// into the group, and any that look like bootloader commands
+	prog.SetPadFlash(true);
+	std::vector<bool> held;
+	auto startTime = std::chrono::steady_clock::now();
+	double broadcastTime = 0;
+	int members = (int)std::count(joined.begin(), joined.end(), true);
+	if (members > 0)
+	{
+		if (!prog.SendCommand("group\n") || !prog.Write("q\n") || !prog.Connect())
+			return false;
+		const MemoryImage& image = prog.PrepareFlash(flash->start, flash->data);
+		int pagesize = prog.GetPageSize();
+		for (size_t pos = 0; pos < image.data.size(); pos += pagesize)
+			held.push_back(pos == 0 || image.data[pos] == 0x9D);
+		printf("Broadcasting %i of %i pages to %i devices", Stk500::CountPages(held), (int)held.size(), members);
+		bool ok = prog.WritePages('F', pagesize, image.start, image.data, held);
+		prog.Close();
+		if (!ok)
+			return false;
+		broadcastTime = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		held.flip();
+	}
+
+	int verified = 0;
+	for (size_t i = 0; i < devices.size(); ++i)
+	{
+		sprintf_s(buf, "addr %s\n", devices[i].c_str());
+		if (!prog.SendCommand("*cfg\n") || !prog.SendCommand(buf) || !prog.Write("q\n"))
+			return false;
+		if (!prog.Connect())
+		{
+			printf("%s: no response\n\n", devices[i].c_str());
+			continue;
+		}
+		const MemoryImage& image = prog.PrepareFlash(flash->start, flash->data);
+		bool ok;
+		if (joined[i])
+		{
+			printf("Writing %i held back pages to %s", Stk500::CountPages(held), devices[i].c_str());
+			ok = prog.WritePages('F', prog.GetPageSize(), image.start, image.data, held);
+		}
+		else
+		{
+			ok = prog.Program(0, flash->start, flash->data);
+		}
+		ok = ok && ProgramImages(prog, others, nullptr);
+		prog.Close();
+		bool crc = ok && prog.CheckCrc();
+		if (ok && !crc && joined[i])
+		{
+			// only rewrite pages that read back differently.  if the page
+			// we've just written doesn't match either the bootloader can't
+			// read flash and the image goes again in full.
+			std::vector<uint8_t> readback;
+			int pagesize = prog.GetPageSize();
+			ok = prog.Connect() && prog.ReadFlash(image.start, (int)image.data.size(), readback);
+			if (ok)
+			{
+				std::vector<bool> same;
+				for (size_t pos = 0; pos < image.data.size(); pos += pagesize)
+				{
+					size_t len = std::min<size_t>(pagesize, image.data.size() - pos);
+					same.push_back(memcmp(&readback[pos], &image.data[pos], len) == 0);
+				}
+				if (!same[0])
+					same.assign(same.size(), false);
+				printf("CRC check failed, rewriting %i pages of %s", Stk500::CountPages(same), devices[i].c_str());
+				ok = prog.WritePages('F', pagesize, image.start, image.data, same);
+			}
+			prog.Close();
+			crc = ok && prog.CheckCrc();
+		}
+		printf("%s: %s\n\n", devices[i].c_str(), crc ? "CRC check passed OK" : "FAILED");
+		if (crc)
+			++verified;
+	}
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	printf("Programmed %i of %i devices in %.2fs (broadcast %.2fs)\n", verified, (int)devices.size(), seconds, broadcastTime);
+	return verified == (int)devices.size();
+}
+
+// a --fleet bridge: a serial port or host[:port] of an ESP8266 bridge
+static bool OpenBridge(Stk500& prog, std::string bridge, int baudrate)
+{
+	if (IsSerialPort(bridge))
+		return prog.Open(bridge.c_str(), baudrate);
+	std::string port = "1614";
+	size_t colon = bridge.find(':');
+	if (colon != std::string::npos)
+	{
+		port = bridge.substr(colon + 1);
+		bridge.resize(colon);
+	}
+	return prog.Open(bridge.c_str(), port.c_str());
+}
+
+// program and CRC check one device, starting with the bridge in
+// configuration mode
+static bool ProgramFleetJob(Stk500& prog, const FleetJob& job, const std::vector<MemoryImage>& images)
+{
+	char buf[64];
+	sprintf_s(buf, "addr %s %i\n", job.address.c_str(), job.channel);
+	if (!prog.SendCommand(buf) || !prog.Write("q\n"))
+		return false;
+	prog.SetPadFlash(true);
+	bool ok = prog.Connect() && ProgramImages(prog, images, nullptr);
+	prog.Close();
+	return ok && prog.CheckCrc();
+}
+
+// Work through a list of jobs with every bridge at once, one thread per
+// bridge.  Bridges wait in configuration mode between jobs so that only the
+// ones holding a channel in the scheduler are on the air.
+static bool ProgramFleet(const std::vector<FleetJob>& jobs, const std::vector<std::string>& bridges, int baudrate)
+{
+	std::map<std::string, std::vector<MemoryImage>> images;
+	for (const FleetJob& job : jobs)
+		if (!images.count(job.image) && !LoadHex(job.image.c_str(), images[job.image]))
+			return false;
+
+	struct Result
+	{
+		double seconds = 0;
+		int bytes = 0;
+		std::string bridge;
+	};
+	std::vector<Result> results(jobs.size());
+	FleetScheduler scheduler(jobs, (int)bridges.size());
+	std::mutex printMutex;
+	auto startTime = std::chrono::steady_clock::now();
+	std::vector<std::thread> threads;
+	for (int bridge = 0; bridge < (int)bridges.size(); ++bridge)
+	{
+		threads.emplace_back([&, bridge]()
+		{
+			Stk500 prog;
+			prog.SetQuiet(true);
+			if (!OpenBridge(prog, bridges[bridge], baudrate) || !prog.SendCommand("*cfg\n"))
+			{
+				std::lock_guard<std::mutex> lock(printMutex);
+				fprintf(stderr, "Can't use bridge %s\n", bridges[bridge].c_str());
+				scheduler.Retire(bridge);
+				return;
+			}
+			for (int index; (index = scheduler.Next(bridge)) >= 0;)
+			{
+				const FleetJob& job = jobs[index];
+				auto jobStart = std::chrono::steady_clock::now();
+				int bytes = prog.GetBytesProgrammed();
+				bool ok = ProgramFleetJob(prog, job, images.at(job.image));
+				// park the bridge before giving up the channel
+				bool parked = prog.SendCommand("*cfg\n");
+				Result& result = results[index];
+				result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - jobStart).count();
+				result.bytes = prog.GetBytesProgrammed() - bytes;
+				result.bridge = bridges[bridge];
+				bool retry = scheduler.Finish(bridge, index, ok);
+				{
+					std::lock_guard<std::mutex> lock(printMutex);
+					if (ok)
+						printf("%s ch %i: OK on %s, %i bytes in %.2fs (%.0f bytes/s)\n", job.address.c_str(), job.channel,
+							bridges[bridge].c_str(), result.bytes, result.seconds, result.seconds > 0 ? result.bytes / result.seconds : 0.0);
+					else
+						printf("%s ch %i: failed on %s%s\n", job.address.c_str(), job.channel,
+							bridges[bridge].c_str(), retry ? ", will retry" : "");
+					fflush(stdout);
+				}
+				if (!parked)
+				{
+					std::lock_guard<std::mutex> lock(printMutex);
+					fprintf(stderr, "Lost bridge %s\n", bridges[bridge].c_str());
+					scheduler.Retire(bridge);
+					return;
+				}
+			}
+		});
+	}
+	for (std::thread& thread : threads)
+		thread.join();
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+	int succeeded = 0, bytes = 0;
+	for (size_t index = 0; index < jobs.size(); ++index)
+	{
+		if (scheduler.Succeeded((int)index))
+		{
+			++succeeded;
+			bytes += results[index].bytes;
+		}
+		else
+		{
+			printf("FAILED %s ch %i %s after %i attempts\n", jobs[index].address.c_str(), jobs[index].channel,
+				jobs[index].image.c_str(), scheduler.GetAttempts((int)index));
+		}
+	}
+	printf("Programmed %i of %i devices with %i bridges in %.2fs (%i bytes, %.0f bytes/s)\n", succeeded, (int)jobs.size(),
+		(int)bridges.size(), seconds, bytes, seconds > 0 ? bytes / seconds : 0.0);
+	return succeeded == (int)jobs.size();
+}
+
+// one device address per line, optionally followed by its channel
+static bool LoadDeviceList(const char* filename, std::vector<std::string>& devices)
+{
+	FILE* f = NULL;
+	if (fopen_s(&f, filename, "r"))
+	{
+		fprintf(stderr, "Error opening %s\n", filename);
+		return false;
+	}
+	char line[128];
+	while (fgets(line, 128, f))
+	{
+		std::string device = line;
+		device.erase(0, device.find_first_not_of(" \t"));
+		device.erase(device.find_last_not_of(" \t\r\n") + 1);
+		if (!device.empty() && device[0] != '#')
+			devices.push_back(device);
+	}
+	fclose(f);
+	if (devices.empty())
+		fprintf(stderr, "No devices in %s\n", filename);
+	return !devices.empty();
+}
+
+// pass everything between a client such as avrdude -P net:host:port and the
+// bridge until the client disconnects
+static void RunProxy(Stk500& prog, const char* port)
+{
+	printf("Waiting for a connection on port %s\n", port);
+	Transport client;
+	if (!client.AcceptSocket(port))
+		return;
+	printf("Connected\n");
+	uint8_t buf[4096];
+	while (client.IsOpen())
+	{
+		bool idle = true;
+		int n = std::min(client.Available(), (int)sizeof(buf));
+		if (n > 0 && (n = client.Read(buf, n)) > 0)
+		{
+			prog.Write(buf, n);
+			idle = false;
+		}
+		n = std::min(prog.Available(), (int)sizeof(buf));
+		if (n > 0 && (n = prog.Read(buf, n)) > 0)
+		{
+			client.Write(buf, n);
+			idle = false;
+		}
+		if (idle)
+			std::this_thread::sleep_for(std::chrono::microseconds(200));
+	}
+	printf("Disconnected\n");
+}
+
+// find the remote device's address in the addresses printed by the bridge
+static std::string GetCacheKey(const std::string& console, const std::string& setaddr)
+{
+	size_t pos = console.rfind("Channel = ");
+	int channel = 0;
+	uint8_t addr[3];
+	int a0, a1, a2;
+	if (pos == std::string::npos ||
+		sscanf_s(console.c_str() + pos, "Channel = %i  UART addr = %*x  Programming addr = %02x%02x%02x",
+			&channel, &a0, &a1, &a2) != 4)
+		return std::string();
+	addr[0] = a0;
+	addr[1] = a1;
+	addr[2] = a2;
+	if (setaddr.size() >= 3)
+	{
+		// the device has just been given a new address (and channel)
+		addr[1] = setaddr[1];
+		addr[2] = setaddr[2];
+		if (setaddr.size() > 4)
+			channel = atoi(&setaddr[4]);
+	}
+	return ImageCache::MakeKey(addr, channel);
+}
+
 int main(int argc, char* argv[])
 {
 	printf("STK500 flash tool\n");
@@ -497,20 +1245,41 @@ int main(int argc, char* argv[])
 	std::string flash;
 	std::string addr, setaddr;
 	std::string ip, port;
+	std::string cachedir;
+	std::string updaterFile;
+	std::string groupFile, group = "grp";
+	std::string fleetFile;
+	std::string traceFile;
+	std::string recordFile;
+	std::string proxyPort;
 	int baudrate = 500000;
 	bool verbose = false;
 	bool printHelp = false;
 	bool crc = false;
+	bool diff = false;
+	bool version2 = false;
+	int blockSize = 1024;
 
 	// First configure all possible command line options.
 	CommandLine args("STK500 flash tool");
-	args.addArgument({ "-c", "--comport" }, &comport, "Com port to use");
+	args.addArgument({ "-c", "--comport" }, &comport, "Com port to use (COMx or /dev/ttyX)");
 	args.addArgument({ "-i", "--ip" }, &ip, "IP address to use");
 	args.addArgument({ "-p", "--port" }, &port, "TCP port to use");
 	args.addArgument({ "-b", "--baudrate" }, &baudrate, "Baud rate (default 500000)");
 	args.addArgument({ "-f", "--flash" }, &flash, "Intel HEX file to flash");
 	args.addArgument({ "-a", "--addr" }, &addr, "Remote radio address");
 	args.addArgument({ "-s", "--setaddr" }, &setaddr, "Reprogram remote radio address");
+	args.addArgument({ "-d", "--diff" }, &diff, "Only write pages that changed since the last verified upload to this device");
+	args.addArgument({ "--cache" }, &cachedir, "Directory for the images used by --diff");
+	args.addArgument({ "-z", "--updater" }, &updaterFile, "Send the program LZ compressed through this stage-2 updater HEX file (uploaded if the device doesn't have it)");
+	args.addArgument({ "-g", "--group" }, &groupFile, "Program every device listed in this file (one address per line) with a single broadcast");
+	args.addArgument({ "--group-addr" }, &group, "Radio address and optional channel of the group used by --group (default grp)");
+	args.addArgument({ "--fleet" }, &fleetFile, "Program the jobs in this file (address channel image per line) using every bridge given to -c, separated by commas");
+	args.addArgument({ "-2", "--v2" }, &version2, "Use STK500v2 messages, writing several pages per message");
+	args.addArgument({ "--block" }, &blockSize, "Bytes of flash per message with --v2 (default 1024)");
+	args.addArgument({ "--trace" }, &traceFile, "Save the bridge's packet trace of the session to this file for tracedecode");
+	args.addArgument({ "--record" }, &recordFile, "Save both directions of the conversation with the bridge to this file for replaybench");
+	args.addArgument({ "--proxy" }, &proxyPort, "Pass a client connecting to this TCP port (avrdude -P net:localhost:port) through to the bridge, use with --record");
 	args.addArgument({ "-v", "--verbose" }, &verbose, "Verbose output");
 	args.addArgument({ "-h", "--help" }, &printHelp, "Help!");
 
@@ -528,18 +1297,93 @@ int main(int argc, char* argv[])
 		return 0;
 	}
 
-    if (ip.empty())
+	if (!fleetFile.empty())
+	{
+		if (!recordFile.empty() || !proxyPort.empty())
+		{
+			fprintf(stderr, "--record and --proxy work with a single bridge, not --fleet\n");
+			return 1;
+		}
+		std::vector<FleetJob> jobs;
+		if (!FleetScheduler::LoadJobs(fleetFile.c_str(), jobs))
+			return 1;
+		std::vector<std::string> bridges;
+		for (size_t pos = 0; pos <= comport.size();)
+		{
+			size_t comma = std::min(comport.find(',', pos), comport.size());
+			if (comma > pos)
+				bridges.push_back(comport.substr(pos, comma - pos));
+			pos = comma + 1;
+		}
+		if (bridges.empty())
+		{
+			fprintf(stderr, "--fleet needs the bridges to use in -c\n");
+			return 1;
+		}
+		return ProgramFleet(jobs, bridges, baudrate) ? 0 : 1;
+	}
+
+	std::vector<MemoryImage> images;
+	if (!flash.empty() && !LoadHex(flash.c_str(), images))
+		return 1;
+	if (diff && std::count_if(images.begin(), images.end(), [](const MemoryImage& image) { return image.segment == 0; }) > 1)
+	{
+		fprintf(stderr, "--diff needs the program to be one contiguous block\n");
+		return 1;
+	}
+
+	std::vector<MemoryImage> updaterImages;
+	if (!updaterFile.empty())
+	{
+		if (!LoadHex(updaterFile.c_str(), updaterImages))
+			return 1;
+		if (updaterImages.size() != 1 || updaterImages[0].segment != 0)
+		{
+			fprintf(stderr, "%s should only contain the updater's program memory\n", updaterFile.c_str());
+			return 1;
+		}
+		if (diff)
+		{
+			fprintf(stderr, "--diff and --updater can't be used together\n");
+			return 1;
+		}
+	}
+	const MemoryImage* updater = updaterImages.empty() ? nullptr : &updaterImages[0];
+	if (version2 && (updater || blockSize < 1 || blockSize > 0x8000))
+	{
+		fprintf(stderr, "--v2 needs a --block size up to 32768 and can't be used with --updater\n");
+		return 1;
+	}
+
+	std::vector<std::string> devices;
+	if (!groupFile.empty())
+	{
+		if (!LoadDeviceList(groupFile.c_str(), devices))
+			return 1;
+		if (diff || updater || !addr.empty() || !setaddr.empty())
+		{
+			fprintf(stderr, "--group can't be used with --diff, --updater, --addr or --setaddr\n");
+			return 1;
+		}
+		if (std::count_if(images.begin(), images.end(), [](const MemoryImage& image) { return image.segment == 0; }) != 1)
+		{
+			fprintf(stderr, "--group needs the program to be one contiguous block\n");
+			return 1;
+		}
+	}
+
+    if (ip.empty() && !IsSerialPort(comport))
     {
-        if (comport.size() < 3 ||
-            tolower(comport[0]) != 'c' ||
-            tolower(comport[1]) != 'o' ||
-            tolower(comport[2]) != 'm')
-        {
-            ip = comport;
-        }
+        ip = comport;
     }
 
+	SessionRecorder recorder;
+	if (!recordFile.empty() && !recorder.Open(recordFile.c_str()))
+		return 1;
+
     Stk500 prog;
+	prog.SetVersion2(version2, blockSize);
+	prog.SetRecorder(recorder.IsOpen() ? &recorder : nullptr);
 	if (!ip.empty())
 	{
         if (port.empty())
@@ -559,7 +1403,15 @@ int main(int argc, char* argv[])
 		return 1;
 	}
 
-	if (!prog.SendCommand("*cfg\n"))
+	if (!proxyPort.empty())
+	{
+		RunProxy(prog, proxyPort.c_str());
+		return 0;
+	}
+
+	// keep the addresses the bridge prints to identify the device for --diff
+	std::string console;
+	if (!prog.SendCommand("*cfg\n", &console))
 		return 2;
 
 	if (verbose)
@@ -573,7 +1425,7 @@ int main(int argc, char* argv[])
 	if (!addr.empty())
 	{
 		sprintf_s(buf, "addr %s\n", addr.c_str());
-		if (!prog.SendCommand(buf))
+		if (!prog.SendCommand(buf, &console))
 			return 2;
 	}
 	if (!setaddr.empty())
@@ -582,69 +1434,89 @@ int main(int argc, char* argv[])
 		if (!prog.SendCommand(buf))
 			return 2;
 	}
+	if (!devices.empty())
+	{
+		// the group goes on the bridge's channel unless told otherwise
+		size_t pos = console.rfind("Channel = ");
+		int channel;
+		if (group.size() == 3 && pos != std::string::npos && sscanf_s(console.c_str() + pos, "Channel = %i", &channel) == 1)
+			group += " " + std::to_string(channel);
+		bool ok = ProgramGroup(prog, images, devices, group);
+		prog.PrintThroughput();
+		return ok ? 0 : 1;
+	}
+	if (!traceFile.empty() && !prog.SendCommand("trace clear\n"))
+		return 2;
 	if (!prog.Write("q\n"))
 		return 2;
 
-	if (!flash.empty())
+	if (!images.empty())
 	{
-		FILE* f = NULL;
-		if (fopen_s(&f, flash.c_str(), "r"))
+		ImageCache cache(cachedir);
+		std::string key;
+		if (diff)
 		{
-			fprintf(stderr, "Error opening %s\n", flash.c_str());
-			return 2;
+			key = GetCacheKey(console, setaddr);
+			if (key.empty())
+			{
+				printf("Can't read the radio address from the bridge, writing everything\n");
+				diff = false;
+			}
 		}
+		// the cached image covers all of flash so that the CRC check proves
+		// the pages we didn't send match it too
+		prog.SetPadFlash(diff);
 		if (!prog.Connect())
 			return 1;
-		std::vector<uint8_t> databuf;	
-		char line[128];
-		int segment = 0;
-		int progaddr = 0;
-		while (fgets(line, 128, f))
-		{
-			int bytes, address, type;
-			if (sscanf_s(line, ":%02x%04x%02x", &bytes, &address, &type) == 3)
+		MemoryImage baseline;
+		bool haveBaseline = diff && cache.Load(key, prog.GetSignature(), baseline.start, baseline.data);
+		if (diff)
+		{
+			if (!haveBaseline)
+				printf("No verified image of %s in %s, writing everything\n", key.c_str(), cache.GetDirectory().c_str());
+			// forget the old image until the new one has been checked in case
+			// we're interrupted part way through
+			cache.Remove(key);
+		}
+		if (!ProgramImages(prog, images, haveBaseline ? &baseline : nullptr, updater))
+			return 1;
+		if (diff)
+		{
+			prog.Close();
+			bool verified = prog.CheckCrc();
+			if (!verified && haveBaseline)
 			{
-				if (!databuf.empty() && (type != 0 || address != progaddr + databuf.size()))
-				{
-					if (!prog.Program(segment, progaddr, databuf))
-						return 1;
-					databuf.clear();
-				}
-				if (type == 0)
-				{
-					if (databuf.empty())
-						progaddr = address;
-					int i;
-					const char* hex = line + 9;
-					for( i = 0; i < bytes; ++i, hex += 2)
-					{
-						int value = 0;
-						if (sscanf_s(hex, "%02x", &value) == 1)
-							databuf.push_back(value);
-						else
-							break;
-					}
-					if (i == bytes)
-						continue;
-				}
-				int checksum;
-				if (type == 4 && sscanf_s(line + 9, "%04x%02x", &segment, &checksum) == 2)
-					continue;
-				if (type == 1)
-					break;
-				if (type == 3)
-					continue;
-				fprintf(stderr, "Unknown record type %i in hex file\n", type);
-				return 1;
+				printf("CRC check failed, %s doesn't match its cached image. Writing everything\n", key.c_str());
+				if (!prog.Connect() || !ProgramImages(prog, images, nullptr))
+					return 1;
+				prog.Close();
+				verified = prog.CheckCrc();
 			}
-			else
+			if (!verified)
 			{
-				fprintf(stderr, "Error parsing HEX file\n");
+				fprintf(stderr, "CRC check failed\n");
 				return 1;
-			}			
+			}
+			printf("CRC check passed OK\n");
+			const MemoryImage& image = prog.GetFlash();
+			cache.Store(key, prog.GetSignature(), image.start, image.data);
 		}
 	}
 	prog.Close();
+	prog.PrintThroughput();
+	if (!traceFile.empty())
+	{
+		std::vector<uint8_t> frame;
+		FILE* file = nullptr;
+		if (!prog.ReadTrace(frame) || fopen_s(&file, traceFile.c_str(), "wb") != 0 || !file)
+		{
+			fprintf(stderr, "Can't save the trace to %s\n", traceFile.c_str());
+			return 1;
+		}
+		fwrite(frame.data(), 1, frame.size(), file);
+		fclose(file);
+		printf("Trace of %u events saved to %s\n", (unsigned)((frame.size() - 6) / 4), traceFile.c_str());
+	}
 	//if (!prog.SendCommand("*cfg\n"))
 	//	return 2;
 	//if (!prog.SendCommand("crc\n"))
@@ -6,13 +6,11 @@
 namespace mtnrf {
 
 #if !MEGA_TINY_NRF24_BOOT
+const RadioBus Radio::s_ArduinoBus = { &Radio::arduinoBegin, &Radio::arduinoTransfer, &Radio::arduinoCe };
+
 bool Radio::begin(const Config& config)
 {
-	SPI.begin();
-	pinMode(m_CePin, OUTPUT);
-	pinMode(m_CsnPin, OUTPUT);
-	digitalWrite(m_CePin, HIGH);
-	digitalWrite(m_CsnPin, HIGH);
+	m_Bus->begin(*this);
 	delay(5);
 	powerDown();
 	writeRegister(EN_AA, 0x3F);
@@ -29,6 +27,30 @@ bool Radio::begin(const Config& config)
 	startListening();
 	return readRegister(RF_SETUP) == config.m_Setup;
 }
+void Radio::arduinoBegin(Radio& radio)
+{
+	SPI.begin();
+	pinMode(radio.m_CePin, OUTPUT);
+	pinMode(radio.m_CsnPin, OUTPUT);
+	digitalWrite(radio.m_CePin, HIGH);
+	digitalWrite(radio.m_CsnPin, HIGH);
+}
+uint8_t Radio::arduinoTransfer(Radio& radio, uint8_t cmd, const uint8_t* out, uint8_t* in, uint8_t count)
+{
+	uint8_t result = radio.beginCommand(cmd);
+	while (count--)
+	{
+		result = SPI.transfer(out ? *out++ : NOP);
+		if (in)
+			*in++ = result;
+	}
+	radio.endCommand();
+	return result;
+}
+void Radio::arduinoCe(Radio& radio, uint8_t state)
+{
+	digitalWrite(radio.m_CePin, state ? HIGH : LOW);
+}
 uint8_t Radio::beginCommand(uint8_t cmd)
 {
 	SPI.beginTransaction(SPISettings(4000000, MSBFIRST, SPI_MODE0));
@@ -38,58 +60,163 @@ uint8_t Radio::beginCommand(uint8_t cmd)
 }
 void Radio::endCommand()
 {
-	SPI.endTransaction();
+	// deselect before the IRQ handler is allowed back on the bus
 	digitalWrite(m_CsnPin, HIGH);
+	SPI.endTransaction();
 	delayMicroseconds(5);
 }
 uint8_t Radio::command(uint8_t cmd, uint8_t data) 
 { 
-	beginCommand(cmd);
-	data = SPI.transfer(data);
-	endCommand();
-	return data;
+	return m_Bus->transfer(*this, cmd, &data, nullptr, 1);
 }
 uint8_t Radio::commandLong(uint8_t cmd, const void* data, uint8_t count) 
 { 
-	const uint8_t* u8data = (const uint8_t*) data;
-	uint8_t result = beginCommand(cmd);
-	do {
-		result = SPI.transfer(*u8data++);
-	} while (--count);
-	endCommand();
-	return result;
+	return m_Bus->transfer(*this, cmd, (const uint8_t*) data, nullptr, count);
 }
-rx_return Radio::read(void* dstbuf) 
+rx_return Radio::readFifo(void* dstbuf) 
 {
 	uint8_t packetSize = command(R_RX_PL_WID);
 	rx_return ret;
 	ret.packetsize = packetSize;
-	ret.packetend = (uint8_t*) dstbuf;
-	beginCommand(R_RX_PAYLOAD);
-	do {
-		*ret.packetend++ = SPI.transfer(0xFF);
-	} while (--packetSize);
-	endCommand();
+	ret.packetend = (uint8_t*) dstbuf + packetSize;
+	m_Bus->transfer(*this, R_RX_PAYLOAD, nullptr, (uint8_t*) dstbuf, packetSize);
 	return ret;
 }
 void Radio::readRegister(uint8_t reg, void* result, uint8_t size)
 {
-	uint8_t* u8result = static_cast<uint8_t*>(result);
-	beginCommand(R_REGISTER | reg);
-	do {
-		*u8result++ = SPI.transfer(0xFF);
-	} while (--size);
-	endCommand();
+	m_Bus->transfer(*this, R_REGISTER | reg, nullptr, (uint8_t*) result, size);
 }
 void Radio::startListening(uint8_t pipes) 
 { 
+	MTNB_TRACE(TRACE_MODE, TRACE_MODE_RX);
 	writeRegister(EN_RXADDR, pipes);
 	writeRegister(CONFIG, (1 << MASK_RX_DR) | (1 << MASK_TX_DS) | (1 << MASK_MAX_RT) | (1 << CRCO) | (1 << EN_CRC) | (1 << PWR_UP) | (1 << PRIM_RX));
+	unmaskInterrupts();
 }
 void Radio::stopListening() 
 {
+	MTNB_TRACE(TRACE_MODE, TRACE_MODE_TX);
 	writeRegister(EN_RXADDR, _BV(0));
 	writeRegister(CONFIG, (1 << MASK_RX_DR) | (1 << MASK_TX_DS) | (1 << MASK_MAX_RT) | (1 << CRCO) | (1 << EN_CRC) | (1 << PWR_UP));
+	unmaskInterrupts();
+}
+#endif
+
+#if MTNB_RADIO_IRQ
+static const uint8_t INTERRUPT_MASKS = _BV(MASK_RX_DR) | _BV(MASK_TX_DS) | _BV(MASK_MAX_RT);
+static Radio* s_InterruptRadio;
+
+static void radioInterrupt()
+{
+	s_InterruptRadio->handleInterrupt();
+}
+
+void Radio::beginInterrupts(uint8_t irqPin, RxPacket* queue, uint8_t size)
+{
+	m_RxQueueMask = size - 1;
+	m_RxHead = m_RxTail = 0;
+	m_Events = 0;
+	m_RxStalled = false;
+	m_IrqPin = irqPin;
+	m_RxQueue = queue;
+	s_InterruptRadio = this;
+	pinMode(irqPin, INPUT);
+#if !MEGA_TINY_NRF24_BOOT
+	SPI.usingInterrupt(digitalPinToInterrupt(irqPin));
+#endif
+	attachInterrupt(digitalPinToInterrupt(irqPin), radioInterrupt, FALLING);
+	unmaskInterrupts();
+	// IRQ may already be low, in which case there's no edge to wait for
+	noInterrupts();
+	handleInterrupt();
+	interrupts();
+}
+
+void Radio::endInterrupts()
+{
+	if (!m_RxQueue)
+		return;
+	detachInterrupt(digitalPinToInterrupt(m_IrqPin));
+#if !MEGA_TINY_NRF24_BOOT
+	SPI.notUsingInterrupt(digitalPinToInterrupt(m_IrqPin));
+#endif
+	m_RxQueue = nullptr;
+	writeRegister(CONFIG, readRegister(CONFIG) | INTERRUPT_MASKS);
+}
+
+void Radio::unmaskInterrupts()
+{
+	if (!m_RxQueue)
+		return;
+	noInterrupts();
+	writeRegister(CONFIG, readRegister(CONFIG) & ~INTERRUPT_MASKS);
+	interrupts();
+}
+
+void Radio::handleInterrupt()
+{
+	uint8_t s = status();
+	// clear the flags before emptying the FIFO so that anything arriving
+	// meanwhile pulls IRQ low again
+	writeRegister(STATUS_NRF, s & (_BV(RX_DR) | _BV(TX_DS)));
+	m_Events |= s & _BV(TX_DS);
+	if (s & _BV(MAX_RT))
+	{
+		// MAX_RT holds IRQ low until it's cleared, mask it so received
+		// packets still get through.  clearWriteFailed() unmasks it.
+		uint8_t config = readRegister(CONFIG);
+		if (!(config & _BV(MASK_MAX_RT)))
+		{
+			writeRegister(CONFIG, config | _BV(MASK_MAX_RT));
+			m_Events |= RADIO_TX_FAILED;
+		}
+	}
+	unsigned long time = micros();
+	for (uint8_t pipe; (pipe = (s >> 1) & 7) != 7; s = status())
+	{
+#if MEGA_TINY_NRF24_BOOT
+		// resets into the bootloader
+		if (pipe == 5)
+			bootPoll();
+#endif
+		uint8_t head = m_RxHead;
+		uint8_t next = (head + 1) & m_RxQueueMask;
+		if (next == m_RxTail)
+		{
+			// leave the rest in the radio until pop() makes room
+			m_Events |= RADIO_RX_FULL;
+			m_RxStalled = true;
+			break;
+		}
+		RxPacket& packet = m_RxQueue[head];
+		packet.time = time;
+		packet.pipe = pipe;
+		packet.size = readFifo(packet.data).packetsize;
+		m_RxHead = next;
+	}
+}
+
+void Radio::pop()
+{
+	if (m_RxHead == m_RxTail)
+		return;
+	m_RxTail = (m_RxTail + 1) & m_RxQueueMask;
+	if (m_RxStalled)
+	{
+		noInterrupts();
+		m_RxStalled = false;
+		handleInterrupt();
+		interrupts();
+	}
+}
+
+uint8_t Radio::takeEvents()
+{
+	noInterrupts();
+	uint8_t events = m_Events;
+	m_Events = 0;
+	interrupts();
+	return events;
 }
 #endif
 
@@ -97,6 +224,8 @@ void Radio::stopListening()
 void Radio::resetStats()
 {
 	m_SendCount = m_ResendCount = 0;
+	m_ByteCount = 0;
+	m_MaxRtCount = m_AutoRetransmits = 0;
 }
 #endif
 
@@ -146,6 +275,19 @@ bool Radio::write(const void* data, uint8_t len)
     return true;
 }
 
+bool Radio::writeMulticast(const void* data, uint8_t len)
+{
+	if (!flush(false))
+		return false;
+#if !DISABLE_MTNB_STATS
+	++m_SendCount;
+	m_ByteCount += len;
+#endif
+	MTNB_TRACE(TRACE_TX_NO_ACK, len);
+	commandLong(W_TX_PAYLOAD_NO_ACK, data, len);
+	return true;
+}
+
 bool Radio::writeLong(const void* data, uint16_t len)
 {
 	const uint8_t* u8data = (const uint8_t*) data;
@@ -177,20 +319,32 @@ bool Radio::flush(bool entireTxFifo)
 	{
 		if (writeCompleted())
 		{
-#if !DISABLE_MTNB_STATS
-#if COUNT_ALL_RESENDS
+#if !DISABLE_MTNB_STATS && (COUNT_ALL_RESENDS || MTNB_TRACE_SIZE)
+			// an SPI transaction for every completed write, only taken by
+			// the builds that count every retransmit or trace them
 			if (m_DataPending)
-				m_ResendCount += readRegister(OBSERVE_TX) & 15;
-			m_DataPending = !entireTxFifo;
+			{
+				m_DataPending = false;
+				uint8_t arc = readRegister(OBSERVE_TX) & 15;
+				MTNB_TRACE(TRACE_TX_DONE, arc);
+				m_AutoRetransmits += arc;
+#if COUNT_ALL_RESENDS
+				m_ResendCount += arc;
 #endif
+			}
 #endif
 			return true;
 		}
 		uint8_t s = status();
 		if (s & _BV(MAX_RT))
 		{
-			writeRegister(STATUS_NRF, _BV(MAX_RT));
+#if !DISABLE_MTNB_STATS
+			++m_MaxRtCount;
+			m_AutoRetransmits += readRegister(OBSERVE_TX) & 15;
+#endif
+			clearWriteFailed();
 #if !DISABLEMILLIS
+			MTNB_TRACE(TRACE_MAX_RT, retries);
 			if (retries > 0)
 			{
 				--retries;
@@ -202,6 +356,8 @@ bool Radio::flush(bool entireTxFifo)
 				ce(HIGH);
 			}
 			else
+#else
+			MTNB_TRACE(TRACE_MAX_RT, 0);
 #endif
 			{
 				clearWriteFifo();
@@ -2,11 +2,65 @@
 
 #include <Arduino.h>
 #include "nRF24L01.h"
+#include "megaTinyNrfTrace.h"
 
 namespace mtnrf {
 
 typedef struct { uint8_t packetsize; uint8_t* packetend; } rx_return;
 class Config;
+class Radio;
+
+#if !MEGA_TINY_NRF24_BOOT
+// How Radio reaches the nRF24L01+.  The default goes through the Arduino SPI
+// library and digitalWrite(), FastRadio has one specialised for its pins.
+struct RadioBus
+{
+    // set up the pins and SPI
+    void (*begin)(Radio& radio);
+    // select the radio, send 'cmd' followed by 'count' bytes from 'out' (NOP
+    // if null) keeping what comes back in 'in' (if not null), and deselect.
+    // returns the last byte received.
+    uint8_t (*transfer)(Radio& radio, uint8_t cmd, const uint8_t* out, uint8_t* in, uint8_t count);
+    void (*ce)(Radio& radio, uint8_t state);
+};
+#endif
+
+#if MTNB_RADIO_IRQ
+// keeps the IRQ handler off the SPI bus while radio code that can't use
+// SPI.usingInterrupt() (the bootloader's, FastRadio's) is running
+#if HOST_BUILD
+struct RadioLock
+{
+    RadioLock() { noInterrupts(); }
+    ~RadioLock() { interrupts(); }
+};
+#else
+struct RadioLock
+{
+    uint8_t sreg;
+    RadioLock() : sreg(SREG) { cli(); }
+    ~RadioLock() { SREG = sreg; }
+};
+#endif
+
+// packet taken from the radio by the IRQ handler
+struct RxPacket
+{
+    unsigned long time; // micros() when it was taken from the radio
+    uint8_t pipe;
+    uint8_t size;
+    uint8_t data[32];
+};
+// events returned by Radio::takeEvents()
+enum RadioEvent
+{
+    RADIO_TX_DONE = _BV(TX_DS),     // a packet was sent (and acknowledged)
+    RADIO_TX_FAILED = _BV(MAX_RT),  // max retries reached, see clearWriteFailed()
+    RADIO_RX_FULL = _BV(RX_DR),     // the queue filled up, packets may have been lost
+};
+#else
+struct RadioLock {};
+#endif
 enum BitRate
 {
     RF24_250KBPS = _BV(RF_DR_LOW),
@@ -45,6 +99,8 @@ public:
     BitRate getBitRate();
     // set retry parameters
     void setRetries(uint8_t delay, uint8_t nrfRetries, uint8_t mcuRetries);
+    // times flush() restarts a packet after MAX_RT before giving up
+    uint8_t getMcuRetries() const;
 
     ///////////////////////////////////////////////////////////////////////////
     // receive mode
@@ -80,6 +136,9 @@ public:
     bool write(const T& data) { return write(&data, sizeof(data)); }
     // write multiple packets
     bool writeLong(const void* data, uint16_t len);
+    // write single packet without asking for an acknowledgement, so any
+    // number of receivers listening on the address can take it
+    bool writeMulticast(const void* data, uint8_t size);
     // flush pending writes and return send success status
     bool flush(bool entireTxFifo = true);
     // returns true when transmit buffer has emptied
@@ -95,6 +154,24 @@ public:
     // switch to TX mode, write string to specified pipe then switch back to RX mode
     void write(uint8_t address, const char* str);
 
+#if MTNB_RADIO_IRQ
+    ///////////////////////////////////////////////////////////////////////////
+    // interrupt mode
+
+    // empty the RX FIFO into 'queue' (size a power of 2) from the radio's IRQ
+    // pin rather than polling STATUS.  available(), readPipe() and read()
+    // then work from the queue.  only one radio can use interrupt mode.
+    void beginInterrupts(uint8_t irqPin, RxPacket* queue, uint8_t size);
+    void endInterrupts();
+    // oldest queued packet (or nullptr), pop() it when finished with it
+    const RxPacket* peek();
+    void pop();
+    // RadioEvent bits raised since the last call
+    uint8_t takeEvents();
+    // called from the IRQ pin interrupt
+    void handleInterrupt();
+#endif
+
 #if !DISABLE_MTNB_STATS
     ///////////////////////////////////////////////////////////////////////////
     // stats
@@ -105,6 +182,14 @@ public:
     int getSendCount();
     // get resend count
     int getResendCount();
+    // payload bytes sent
+    uint32_t getByteCount();
+    // MAX_RT events, including the ones flush() retried
+    uint16_t getMaxRtCount();
+    // ARC_CNT from OBSERVE_TX for packets that gave up, and with
+    // COUNT_ALL_RESENDS or MTNB_TRACE_SIZE also for the last packet before
+    // flush() finds the TX FIFO empty
+    uint16_t getAutoRetransmits();
 #endif
 
     ///////////////////////////////////////////////////////////////////////////
@@ -129,18 +214,46 @@ public:
     void    clearWriteFifo();
     void    clearWriteFailed();
 
+protected:
+#if !MEGA_TINY_NRF24_BOOT
+    Radio(uint8_t cePin, uint8_t csnPin, const RadioBus& bus);
+#endif
+
 private:
+    rx_return readFifo(void* dstbuf);
+    void    unmaskInterrupts();
+#if !MEGA_TINY_NRF24_BOOT
+    static void arduinoBegin(Radio& radio);
+    static uint8_t arduinoTransfer(Radio& radio, uint8_t cmd, const uint8_t* out, uint8_t* in, uint8_t count);
+    static void arduinoCe(Radio& radio, uint8_t state);
+    static const RadioBus s_ArduinoBus;
+
+    const RadioBus* m_Bus;
+#endif
 
     uint8_t m_NumRetries;
     uint8_t m_CsnPin;
     uint8_t m_CePin;
 
+#if MTNB_RADIO_IRQ
+    RxPacket* m_RxQueue;
+    uint8_t m_RxQueueMask;
+    volatile uint8_t m_RxHead;
+    volatile uint8_t m_RxTail;
+    volatile uint8_t m_Events;
+    // the handler stopped with packets left in the radio
+    volatile bool m_RxStalled;
+    uint8_t m_IrqPin;
+#endif
+
 #if !DISABLE_MTNB_STATS
-#if COUNT_ALL_RESENDS
+    // a packet went out since OBSERVE_TX was last read
     bool m_DataPending = false;
-#endif
     int m_SendCount = 0;
     int m_ResendCount = 0;
+    uint32_t m_ByteCount = 0;
+    uint16_t m_MaxRtCount = 0;
+    uint16_t m_AutoRetransmits = 0;
 #endif
 };
 
@@ -186,7 +299,20 @@ inline Radio::Radio(uint8_t cePin, uint8_t csnPin)
     m_NumRetries = 0;
     m_CePin = cePin;
     m_CsnPin = csnPin;
+#if !MEGA_TINY_NRF24_BOOT
+    m_Bus = &s_ArduinoBus;
+#endif
+#if MTNB_RADIO_IRQ
+    m_RxQueue = nullptr;
+#endif
 }
+#if !MEGA_TINY_NRF24_BOOT
+inline Radio::Radio(uint8_t cePin, uint8_t csnPin, const RadioBus& bus)
+:   Radio(cePin, csnPin)
+{
+    m_Bus = &bus;
+}
+#endif
 inline void Radio::writeRegister(uint8_t reg, uint8_t data)
 {
     command(reg | W_REGISTER, data); 
@@ -203,7 +329,10 @@ inline void Radio::writeImmediate(const void* data, uint8_t len)
 {
 #if !DISABLE_MTNB_STATS
     ++m_SendCount;
+    m_ByteCount += len;
+    m_DataPending = true;
 #endif
+    MTNB_TRACE(TRACE_TX, len);
     commandLong(W_TX_PAYLOAD, data, len);
 }
 inline void Radio::writeAckPayload(const void* data, uint8_t len, uint8_t pipe)
@@ -212,6 +341,7 @@ inline void Radio::writeAckPayload(const void* data, uint8_t len, uint8_t pipe)
 }
 inline void Radio::powerDown()
 {
+    MTNB_TRACE(TRACE_MODE, TRACE_MODE_POWER_DOWN);
     writeRegister(CONFIG, 0);
 }
 inline bool Radio::writeCompleted()
@@ -229,17 +359,66 @@ inline bool Radio::writeFailed()
 inline void Radio::clearWriteFailed()
 {
     writeRegister(STATUS_NRF, _BV(MAX_RT));
+    unmaskInterrupts();
+}
+inline uint8_t Radio::getMcuRetries() const
+{
+    return m_NumRetries;
 }
 inline uint8_t Radio::readPipe()
 {
+#if MTNB_RADIO_IRQ
+    if (m_RxQueue)
+    {
+        const RxPacket* packet = peek();
+        return packet ? packet->pipe : 7;
+    }
+#endif
     return (status() & 0x0E) >> 1;
 }
 inline bool Radio::available()
 {
+#if MTNB_RADIO_IRQ
+    if (m_RxQueue)
+        return m_RxHead != m_RxTail;
+#endif
     return (status() & 0x0E) != 0x0E;
 }
+inline rx_return Radio::read(void* dstbuf)
+{
+#if MTNB_RADIO_IRQ
+    if (m_RxQueue)
+    {
+        const RxPacket* packet = peek();
+        rx_return ret;
+        ret.packetsize = packet ? packet->size : 0;
+        ret.packetend = (uint8_t*) dstbuf + ret.packetsize;
+        if (packet)
+        {
+            MTNB_TRACE(TRACE_RX, packet->size);
+            memcpy(dstbuf, packet->data, packet->size);
+            pop();
+        }
+        return ret;
+    }
+#endif
+    rx_return ret = readFifo(dstbuf);
+    MTNB_TRACE(TRACE_RX, ret.packetsize);
+    return ret;
+}
+#if MTNB_RADIO_IRQ
+inline const RxPacket* Radio::peek()
+{
+    return m_RxHead != m_RxTail ? &m_RxQueue[m_RxTail] : nullptr;
+}
+#else
+inline void Radio::unmaskInterrupts()
+{
+}
+#endif
 inline void Radio::clearWriteFifo() 
 { 
+    MTNB_TRACE(TRACE_FLUSH_TX, 0);
     command(FLUSH_TX); 
 }
 inline void Radio::clearReadFifo()
@@ -259,12 +438,24 @@ inline int Radio::getResendCount()
 {
     return m_ResendCount;
 }
+inline uint32_t Radio::getByteCount()
+{
+    return m_ByteCount;
+}
+inline uint16_t Radio::getMaxRtCount()
+{
+    return m_MaxRtCount;
+}
+inline uint16_t Radio::getAutoRetransmits()
+{
+    return m_AutoRetransmits;
+}
 #endif
+#if !MEGA_TINY_NRF24_BOOT
 inline void Radio::ce(uint8_t state)
 {
-    digitalWrite(m_CePin, state ? HIGH : LOW);
+    m_Bus->ce(*this, state);
 }
-#if !MEGA_TINY_NRF24_BOOT
 inline uint8_t Radio::status()
 {
     return readRegister(STATUS_NRF);
@@ -278,6 +469,10 @@ inline uint8_t Radio::command(uint8_t cmd)
     return command(cmd, NOP);
 }
 #else
+inline void Radio::ce(uint8_t state)
+{
+    digitalWrite(m_CePin, state ? HIGH : LOW);
+}
 // these functions are provided by the bootloader:
 extern "C" {
 void nrf24_boot_poll();
@@ -289,14 +484,14 @@ rx_return nrf24_read_payload(void* dstbuf);
 void nrf24_begin_tx();
 void nrf24_begin_rx(uint8_t pipeBits);
 } // extern "C"
-inline void Radio::bootPoll() { nrf24_boot_poll(); }
-inline uint8_t Radio::status() { return nrf24_status(); }
-inline uint8_t Radio::command(uint8_t cmd) { return nrf24_command(cmd); }
-inline uint8_t Radio::command(uint8_t cmd, uint8_t data) { return nrf24_command_data(cmd, data); }
-inline uint8_t Radio::commandLong(uint8_t cmd, const void* data, uint8_t count) { return nrf24_command_long(cmd, data, count); }
-inline rx_return Radio::read(void* dstbuf) { return nrf24_read_payload(dstbuf); }
-inline void Radio::startListening(uint8_t pipes) { nrf24_begin_rx(pipes); }
-inline void Radio::stopListening() { nrf24_begin_tx(); }
+inline void Radio::bootPoll() { RadioLock lock; nrf24_boot_poll(); }
+inline uint8_t Radio::status() { RadioLock lock; return nrf24_status(); }
+inline uint8_t Radio::command(uint8_t cmd) { RadioLock lock; return nrf24_command(cmd); }
+inline uint8_t Radio::command(uint8_t cmd, uint8_t data) { RadioLock lock; return nrf24_command_data(cmd, data); }
+inline uint8_t Radio::commandLong(uint8_t cmd, const void* data, uint8_t count) { RadioLock lock; return nrf24_command_long(cmd, data, count); }
+inline rx_return Radio::readFifo(void* dstbuf) { RadioLock lock; return nrf24_read_payload(dstbuf); }
+inline void Radio::startListening(uint8_t pipes) { { RadioLock lock; nrf24_begin_rx(pipes); } unmaskInterrupts(); }
+inline void Radio::stopListening() { { RadioLock lock; nrf24_begin_tx(); } unmaskInterrupts(); }
 #endif
 
 } // namespace mtnrf
@@ -1,5 +1,7 @@
 #if !MEGA_TINY_NRF24_BOOT
-#include "megaTinyNRFBoot.h"
+#include "megaTinyNrfBoot.h"
+#include "megaTinyNrfEntryPoints.h"
+#include "megaTinyNrfUpdater.h"
 
 namespace mtnrf {
 
@@ -9,6 +11,12 @@ namespace mtnrf {
 #define MTNB_DEBUG(X) do {if (m_DebugLog) m_DebugLog->X;} while (0)
 #endif
 
+#if DISABLE_MTNB_STATS
+#define MTNB_STATS(X) do {} while (0)
+#else
+#define MTNB_STATS(X) do {if (m_Stats) m_Stats->X;} while (0)
+#endif
+
 struct Packet
 {
 	uint8_t command = 0x9D; // CPU_CCP_SPM_gc
@@ -17,6 +25,49 @@ struct Packet
 	uint8_t addresshi = 0x3F;
 };
 
+// read memory command for the extended bootloader.  the 256 byte bootloader
+// only looks at the first 4 bytes and treats it as a sync packet.
+struct ReadPacket
+{
+	Packet sync;
+	uint8_t lengthminus1;
+	uint8_t addresslo;
+	uint8_t addresshi;
+};
+
+// written before reading back the signature row and NVMCTRL.STATUS
+static const uint8_t s_Zero = 0;
+
+static uint16_t relativeJump(uint16_t opcode, uint16_t from, uint16_t to)
+{
+	return opcode | ((to - from - 1) & 0xFFF);
+}
+static const uint16_t RJMP = 0xC000;
+static const uint16_t RCALL = 0xD000;
+static const uint16_t IJMP = 0x9409;
+
+static uint16_t loadImmediate(uint8_t reg, uint8_t value)
+{
+	return 0xE000 | ((value & 0xF0) << 4) | ((reg - 16) << 4) | (value & 15);
+}
+static uint16_t compareImmediate(uint8_t reg, uint8_t value)
+{
+	return 0x3000 | ((value & 0xF0) << 4) | ((reg - 16) << 4) | (value & 15);
+}
+static uint16_t branch(uint16_t opcode, uint16_t from, uint16_t to)
+{
+	return opcode | (((to - from - 1) & 0x7F) << 3);
+}
+static const uint16_t BREQ = 0xF001;
+static const uint16_t BRNE = 0xF401;
+static const uint16_t CPC_R27_R18 = 0x07B2;
+
+// nothing holds the bridge back when it sends to a group, so each page
+// allows the devices time to read every packet at 3.3MHz and then erase and
+// write the page (microseconds)
+static const uint16_t GROUP_PACKET_TIME = 400;
+static const uint16_t GROUP_PAGE_WRITE_TIME = 5000;
+
 BootLoader::BootLoader(Radio& m_Radio, Stream* debuglog)
 :	m_Radio(m_Radio)
 {
@@ -25,30 +76,84 @@ BootLoader::BootLoader(Radio& m_Radio, Stream* debuglog)
 
 bool BootLoader::readDeviceSignature(uint8_t* sig)
 {
-	uint8_t buf[3];
-	if (!sig)
-		sig = buf;
-	uint8_t retry = 3;
-	for (uint8_t i = 0; i < 3; ++i)
+	startReadDeviceSignature();
+	bool success = runAsync();
+	if (sig)
+		memcpy(sig, m_Signature, 3);
+	return success;
+}
+
+void BootLoader::startReadDeviceSignature()
+{
+	startAsync(OP_SIGNATURE);
+}
+
+BootLoader::eAsyncStatus BootLoader::pollSignature()
+{
+	uint8_t* sig = m_Signature;
+	if (m_AsyncCount == 0)
 	{
-		int16_t sigbyte = writeAndReadMemory(0x10FF + i, 0);
-		if (sigbyte < 0)
-			return false;
-		sig[i] = sigbyte & 255;
-		if (i == 0 && sig[i] != 0x1E)
+		if (m_InGroup)
 		{
-			if (!retry--)
-				return false;
-			--i;
+			// every device in the group was checked to be the same part
+			memcpy(sig, m_GroupSignature, 3);
+			m_FlashSize = sig[1] - 0x90;
+			m_BootEnd = m_GroupBootEnd;
+			m_ReadCommand = false;
+			m_PackedWrites = false;
+			return finishAsync(true);
 		}
+		// try the extended bootloader's read command first
+		m_ReadCommand = true;
+		if (readMemory(0x1100, sig, 3, 2) && sig[0] == 0x1E)
+		{
+			// the bootloader answered so a failure from here on is the link's,
+			// the 256 byte fallback would leave the read command unused
+			if (!readMemory(0x1288, &m_BootEnd, 1, 2)) // BOOTEND fuse
+				return finishAsync(false);
+			m_FlashSize = sig[1] - 0x90;
+			uint8_t opcode[2];
+			m_PackedWrites = readMemory(0x8000 + (BOOT_PACKED_WAIT_FOR_COMMAND + 2) * 2, opcode, 2, 2) &&
+				(opcode[0] | (opcode[1] << 8)) == MOVW_R2_X;
+			return finishAsync(true);
+		}
+		m_ReadCommand = false;
+		m_PackedWrites = false;
+		m_BootEnd = 1;
+		// then a byte at a time, m_AsyncCount is the next one plus 1 and
+		// m_AsyncStart counts the tries left for the first
+		m_AsyncCount = 1;
+		m_AsyncStart = 3;
+		beginRead(0x10FF, &s_Zero, 1, 16);
+		return ASYNC_PENDING;
 	}
-	m_FlashSize = sig[1] - 0x90;
-	return true;
+	int8_t result = pollRead();
+	if (result < 0)
+		return finishAsync(false);
+	if (result == 0)
+		return ASYNC_PENDING;
+	uint8_t i = m_AsyncCount - 1;
+	sig[i] = m_AsyncValue & 255;
+	if (i == 0 && sig[i] != 0x1E)
+	{
+		if (!m_AsyncStart--)
+			return finishAsync(false);
+	}
+	else if (++m_AsyncCount == 4)
+	{
+		m_FlashSize = sig[1] - 0x90;
+		return finishAsync(true);
+	}
+	beginRead(0x10FF + m_AsyncCount - 1, &s_Zero, 1, 16);
+	return ASYNC_PENDING;
 }
 
 bool BootLoader::sendSyncPacket()
 {
 	Packet syncPacket;
+	MTNB_TRACE(TRACE_SYNC, 0);
+	if (m_InGroup)
+		return sendGroupPacket(&syncPacket, sizeof(syncPacket));
 	m_Radio.clearReadFifo();
 	return m_Radio.write(syncPacket) && m_Radio.flush();
 }
@@ -64,52 +169,310 @@ void BootLoader::keepAlive(uint16_t t)
 
 bool BootLoader::enterBootLoader()
 {
+	startEnterBootLoader();
+	return runAsync();
+}
+
+void BootLoader::startEnterBootLoader()
+{
+	// the device starts with the bootloader's own settings after a reset,
+	// but an application left by exitBootLoader() still has the adapted
+	// link until then, so that is tried first
+	restoreLink();
+	uint8_t appLink = m_ExitLinkLevel;
+	m_ExitLinkLevel = 0;
+	beginEnter();
+	if (appLink && m_AsyncOp == OP_ENTER)
+	{
+		useLinkLevel(appLink);
+		m_AsyncOp = OP_ENTER_APP_LINK;
+	}
+#if !DISABLE_MTNB_STATS
+	if (m_Stats && !m_InGroup)
+	{
+		uint8_t address[3];
+		m_Radio.readRegister(TX_ADDR, address, 3);
+		m_Stats->beginSession(address);
+	}
+#endif
+}
+
+void BootLoader::beginEnter()
+{
+	MTNB_TRACE(TRACE_ENTER, 0);
 	m_Radio.powerDown();
 	m_Radio.openWritingPipe('P');
 	m_Radio.clearReadFifo();
 	m_Radio.clearWriteFifo();
 	m_Radio.stopListening();
-	delay(5);
+	// it may be a different device to last time
+	m_FlashSize = 0;
+	m_ReadCommand = false;
+	m_PackedWrites = false;
+	m_NextPage = 0;
+	m_BootEnd = 1;
+	// nobody acknowledges in a group, just make sure it is awake
+	m_AsyncOp = m_InGroup ? OP_ENTER_GROUP : OP_ENTER;
+	m_AsyncStatus = ASYNC_PENDING;
+	m_AsyncCount = 0;
+	m_AsyncRetries = 0;
+	m_AsyncTime = millis();
+	m_AsyncWait = 5;
+}
 
-	// wait for 4 sync packets to be received.  Up to 3 can fit in
-	// the receivers FIFO so only with 4 can we be sure the bootloader
-	// has actually started pulling them out of the FIFO.
-	uint8_t retries = 0;
-	uint8_t successes = 0;
-	for (;;)
+void BootLoader::startWaitForEepromWrites()
+{
+	startAsync(OP_EEPROM);
+	m_AsyncStart = millis();
+	beginRead(0x1001, &s_Zero, 1, 16);
+}
+
+void BootLoader::startWriteAndReadMemory(uint16_t address, const void* data, uint8_t len, uint8_t retries)
+{
+	startAsync(OP_READ);
+#if !DISABLE_MTNB_STATS && !DISABLEMILLIS
+	m_ReadStart = micros();
+#endif
+	MTNB_TRACE(TRACE_READ, address >> 8);
+	MTNB_TRACE(TRACE_DATA, address & 255);
+	beginRead(address, data, len, retries);
+}
+
+void BootLoader::startCrcCheck()
+{
+	MTNB_DEBUG(println(F("Requesting CRC check")));
+	// set CRCSCAN.ENABLE=1
+	static const uint8_t vals [] = { 1, 0 };
+	startWriteAndReadMemory(0x120, vals, 2);
+	m_AsyncOp = OP_CRC;
+}
+
+void BootLoader::startAsync(eAsyncOperation op)
+{
+	m_AsyncOp = op;
+	m_AsyncStatus = ASYNC_PENDING;
+	m_AsyncCount = 0;
+	m_AsyncWait = 0;
+}
+
+void BootLoader::beginRead(uint16_t address, const void* data, uint8_t len, uint8_t retries)
+{
+	m_AsyncAddress = address;
+	m_AsyncData = data;
+	m_AsyncLength = len;
+	m_AsyncRetries = retries;
+}
+
+int8_t BootLoader::pollRead()
+{
+	int8_t result = requestRead(m_AsyncAddress, m_AsyncData, m_AsyncLength, m_AsyncValue);
+	if (result == 0)
 	{
-		if (sendSyncPacket())
+		// no answer yet, try again shortly
+#ifdef ESP8266
+		wdt_reset();
+#endif
+		if (m_AsyncRetries--)
+		{
+			m_AsyncTime = millis();
+			m_AsyncWait = 1;
+			return 0;
+		}
+		MTNB_DEBUG(println(F("No response to read memory request")));
+		result = -1;
+	}
+	if (result < 0)
+		m_AsyncValue = -1;
+	return result;
+}
+
+BootLoader::eAsyncStatus BootLoader::poll()
+{
+	if (m_AsyncOp == OP_NONE)
+		return m_AsyncStatus;
+	if (m_AsyncWait)
+	{
+		if ((uint16_t)(millis() - m_AsyncTime) < m_AsyncWait)
+			return ASYNC_PENDING;
+		m_AsyncWait = 0;
+	}
+	switch (m_AsyncOp)
+	{
+	case OP_ENTER_APP_LINK:
+	case OP_ENTER:
+	{
+		// wait for 4 sync packets to be received.  Up to 3 can fit in
+		// the receivers FIFO so only with 4 can we be sure the bootloader
+		// has actually started pulling them out of the FIFO.
+		bool sent = sendSyncPacket();
+		// after the application answers on the adapted link, or doesn't
+		// because the device has reset since, it's the bootloader's own
+		if (m_AsyncOp == OP_ENTER_APP_LINK)
+		{
+			restoreLink();
+			m_AsyncOp = OP_ENTER;
+		}
+		if (sent)
 		{
-			if (++successes == 4)
+			if (++m_AsyncCount == 4)
 			{
 				// make sure to clear read fifo in case application had queued any ack payloads
 				MTNB_DEBUG(println(F("Reset device succesfully")));
-				return true;
+				MTNB_STATS(enterFinished(true));
+				MTNB_TRACE(TRACE_ENTERED, 1);
+				return finishAsync(true);
 			}
 		}
 		else
 		{
-			if (++retries == 10) // todo: timeout setting
+			if (++m_AsyncRetries == 10) // todo: timeout setting
 			{
 				MTNB_DEBUG(print(F("Failed resetting device (")));
-				MTNB_DEBUG(print(successes));
+				MTNB_DEBUG(print(m_AsyncCount));
 				MTNB_DEBUG(println(F(" packets were acknowledged)")));
-				return false;
+				MTNB_STATS(enterFinished(false));
+				MTNB_TRACE(TRACE_ENTERED, 0);
+				return finishAsync(false);
 			}
-			delay(50);
+			m_AsyncTime = millis();
+			m_AsyncWait = 50;
+		}
+		break;
+	}
+	case OP_ENTER_GROUP:
+	{
+		if (!sendSyncPacket())
+			return finishAsync(false);
+		if (++m_AsyncCount == 4)
+			startAsync(OP_SIGNATURE);
+		break;
+	}
+	case OP_SIGNATURE:
+		return pollSignature();
+	case OP_READ:
+	case OP_CRC:
+	{
+		int8_t result = pollRead();
+		if (result == 0)
+			break;
+#if !DISABLE_MTNB_STATS && !DISABLEMILLIS
+		if (result > 0)
+			MTNB_STATS(addReadTime(micros() - m_ReadStart));
+#endif
+		if (m_AsyncOp == OP_READ)
+			return finishAsync(result > 0);
+		if (result < 0)
+		{
+			MTNB_DEBUG(println(F("Failed to read CRC check status!")));
+			return finishAsync(false);
+		}
+		if ((m_AsyncValue & 3) == 2)
+		{
+			MTNB_DEBUG(println(F("CRC check passed OK!")));
+			return finishAsync(true);
+		}
+		MTNB_DEBUG(print(F("CRC status = ")));
+		MTNB_DEBUG(print(m_AsyncValue, HEX));
+		MTNB_DEBUG(println(F("\nCRC check failed!")));
+		return finishAsync(false);
+	}
+	case OP_EEPROM:
+	{
+		int8_t result = pollRead();
+		if (result == 0)
+			break;
+		if (result < 0)
+		{
+			MTNB_DEBUG(println(F("Failed to read non-volatile memory controller status register")));
+			return finishAsync(false);
+		}
+		if ((m_AsyncValue & 3) == 0)
+			return finishAsync(true);
+		uint16_t t = millis() - m_AsyncStart;
+		if (t > 200)
+		{
+			MTNB_DEBUG(println(F("Timed out waiting for EEPROM writes!")));
+			return finishAsync(false);
+		}
+		m_AsyncRetries = 16;
+		break;
+	}
+	default:
+		break;
+	}
+	return ASYNC_PENDING;
+}
+
+BootLoader::eAsyncStatus BootLoader::finishAsync(bool success)
+{
+	m_AsyncOp = OP_NONE;
+	m_AsyncWait = 0;
+	m_AsyncStatus = success ? ASYNC_DONE : ASYNC_FAILED;
+	return m_AsyncStatus;
+}
+
+bool BootLoader::runAsync()
+{
+	eAsyncStatus status;
+	while ((status = poll()) == ASYNC_PENDING)
+	{
+		if (m_AsyncWait)
+		{
+			delay(m_AsyncWait);
+			m_AsyncWait = 0;
 		}
 	}
+	return status == ASYNC_DONE;
 }
 
 bool BootLoader::writeMemory(uint16_t address, const void* data, uint8_t length)
 {
 	// writes cannot cross page boundaries
+	if (m_InGroup)
+		return writeGroupMemory(address, (const uint8_t*) data, length);
+	if (beginWriteMemory(address, length) && m_Radio.writeLong(data, length))
+		return true;
+	m_NextPage = 0;
+	return false;
+}
+bool BootLoader::beginWriteMemory(uint16_t address, uint8_t length)
+{
+	// group packets depend on the page contents, see writeGroupMemory
+	if (m_InGroup)
+		return false;
 	m_Radio.clearReadFifo();
 	Packet packet;
 	packet.addresshi = address >> 8;
 	packet.addresslo = address & 255;
 	packet.numpackets = (length + 31) / 32;
-	return m_Radio.write(packet) && m_Radio.writeLong(data, length);
+	if (address >= 0x8000)
+	{
+		MTNB_STATS(beginPage());
+		MTNB_TRACE(TRACE_PAGE, address >> 8);
+		MTNB_TRACE(TRACE_DATA, address & 255);
+	}
+	// the PACKED_WRITES build takes whole flash pages following on from one
+	// written with bit 7 of the packet count set without a command, their
+	// first data packet in its place
+	bool wholePage = m_PackedWrites && address >= 0x8000 && length == getFlashPageSize() &&
+		(address & (length - 1)) == 0;
+	bool follows = wholePage && address == m_NextPage;
+	m_NextPage = wholePage ? address + length : 0;
+	if (follows)
+		return true;
+	if (wholePage)
+		packet.numpackets |= 0x80;
+	if (m_Radio.write(packet))
+		return true;
+	m_NextPage = 0;
+	return false;
+}
+bool BootLoader::writeMemoryData(const void* data, uint8_t length)
+{
+	if (m_Radio.write(data, length))
+		return true;
+	m_NextPage = 0;
+	return false;
 }
 bool BootLoader::writeMemoryLong(uint16_t address, const void* data, uint16_t length)
 {
@@ -141,105 +504,551 @@ bool BootLoader::writeMemory(uint16_t address, uint8_t value)
 }
 int16_t BootLoader::writeAndReadMemory(uint16_t address, const void* data, uint8_t len, uint8_t retries)
 {
-	for(;;)
+	startWriteAndReadMemory(address, data, len, retries);
+	runAsync();
+	return m_AsyncValue;
+}
+int8_t BootLoader::requestRead(uint16_t address, const void* data, uint8_t len, int16_t& value)
+{
+	if (!flushWrites() ||
+		!writeMemory(address, data, len))
 	{
-		if (!flushWrites() ||
-			!writeMemory(address, data, len))
-		{
-			MTNB_DEBUG(println(F("failed sending write")));
-			return -1;
-		}
-		bool gotPacket = false;		
-		for (uint8_t sync = 0; sync < 3; ++sync)
+		MTNB_DEBUG(println(F("failed sending write")));
+		return -1;
+	}
+	bool gotPacket = false;		
+	for (uint8_t sync = 0; sync < 3; ++sync)
+	{
+		if (m_Radio.available())
 		{
-			if (m_Radio.available())
-			{
-				gotPacket = true;
-			}
-			else if (!sendSyncPacket())
-			{
-				MTNB_DEBUG(println(F("failed sending write")));
-				return -1;
-			}
+			gotPacket = true;
 		}
-		if (gotPacket)
-			break;
-#ifdef ESP8266
-		wdt_reset();
-#endif
-		if (!retries--)
+		else if (!sendSyncPacket())
 		{
-			MTNB_DEBUG(println(F("No response to read memory request")));
+			MTNB_DEBUG(println(F("failed sending write")));
 			return -1;
 		}
-		delay(1);
 	}
-	int16_t value;
+	// the answer can come with the last sync when the device was busy for
+	// a while (a CRC scan halts it for milliseconds)
+	if (!gotPacket && !m_Radio.available())
+		return 0;
 	do 
 	{
+		MTNB_TRACE(TRACE_RX, 1);
 		value = m_Radio.command(R_RX_PAYLOAD);
 	} 
 	while (m_Radio.available());
-
-	return value;
+	return 1;
 }
 int16_t BootLoader::writeAndReadMemory(uint16_t address, uint8_t value, uint8_t retries)
 {
-	return writeAndReadMemory(address, &value, 1, retries);
+	m_AsyncByte = value;
+	return writeAndReadMemory(address, &m_AsyncByte, 1, retries);
+}
+void BootLoader::startWriteAndReadMemory(uint16_t address, uint8_t value, uint8_t retries)
+{
+	m_AsyncByte = value;
+	startWriteAndReadMemory(address, &m_AsyncByte, 1, retries);
+}
+bool BootLoader::readMemory(uint16_t address, void* data, uint16_t length, uint8_t retries)
+{
+	if (!m_ReadCommand)
+		return false;
+	// a 32 byte ack payload needs an auto retransmit delay of at least
+	// 500us (1500us at 250kbps) or the ack is missed
+	uint8_t setupRetr = m_Radio.readRegister(SETUP_RETR);
+	uint8_t minDelay = (m_Radio.readRegister(RF_SETUP) & _BV(RF_DR_LOW)) ? 5 : 1;
+	if ((setupRetr >> ARD) < minDelay)
+		m_Radio.writeRegister(SETUP_RETR, (minDelay << ARD) | (setupRetr & 15));
+	// asking again gets fresh replies for whatever a marginal link lost
+	bool success = readMemoryChunks((uint8_t*) data, address, length, retries) ||
+		readMemoryChunks((uint8_t*) data, address, length, retries);
+	m_Radio.writeRegister(SETUP_RETR, setupRetr);
+	return success;
+}
+bool BootLoader::readMemoryChunks(uint8_t* data, uint16_t address, uint16_t length, uint8_t retries)
+{
+	uint16_t requested = 0;
+	uint16_t received = 0;
+	m_Radio.clearReadFifo();
+	// replies to a read that was given up on may still be queued in the
+	// device, each packet takes one off until an ack comes back empty
+	for (uint8_t i = 0; m_ReadFailed && i < 4; i++)
+	{
+		Packet syncPacket;
+		if (!m_Radio.write(syncPacket) || !m_Radio.flush())
+			return false;
+		m_ReadFailed = m_Radio.available();
+		m_Radio.clearReadFifo();
+	}
+	// the bootloader's next page pointer ends up after the data
+	m_NextPage = 0;
+	// each reply comes back in the ack payload of the packet after the
+	// request, so keep sending requests while collecting the replies
+	bool first = true;
+	uint8_t repeats = 0;
+	uint8_t firstChunk = length > 32 ? 32 : length;
+	const uint8_t chunkSize = firstChunk;
+	while (received < length)
+	{
+		bool sent;
+		if (requested < length)
+		{
+			uint8_t chunk = length - requested > 32 ? 32 : length - requested;
+			if (!requested)
+				chunk = firstChunk;
+			ReadPacket packet;
+			packet.lengthminus1 = chunk - 1;
+			packet.addresslo = (address + requested) & 255;
+			packet.addresshi = (address + requested) >> 8;
+			sent = m_Radio.write(packet);
+			requested += chunk;
+		}
+		else
+		{
+			if (!retries--)
+			{
+				MTNB_DEBUG(println(F("No response to read memory request")));
+				m_ReadFailed = true;
+				return false;
+			}
+			Packet syncPacket;
+			sent = m_Radio.write(syncPacket);
+		}
+		if (!sent || !m_Radio.flush())
+		{
+			MTNB_DEBUG(println(F("failed sending read")));
+			m_ReadFailed = true;
+			return false;
+		}
+		if (first)
+		{
+			// the first ack is left over from an earlier command, unless the
+			// request was retransmitted and the device had answered it by
+			// then.  the reply may also still be on its way, so the request
+			// is repeated for a length none of the earlier ones had (fewer
+			// bytes, then more than asked for) and only that length is taken
+			m_Radio.clearReadFifo();
+			if (m_Radio.readRegister(OBSERVE_TX) & 15)
+			{
+				if (++repeats == 32)
+				{
+					m_ReadFailed = true;
+					return false;
+				}
+				firstChunk = repeats < chunkSize ? chunkSize - repeats : repeats + 1;
+				requested = 0;
+			}
+			else
+				first = false;
+			continue;
+		}
+		while (m_Radio.available())
+		{
+			uint8_t buf[32];
+			uint8_t expected = length - received > 32 ? 32 : length - received;
+			uint8_t size = m_Radio.read(buf).packetsize;
+			if (!received && size == firstChunk)
+			{
+				memcpy(data, buf, firstChunk < expected ? firstChunk : expected);
+				received += firstChunk < expected ? firstChunk : expected;
+			}
+			else if (received && size == expected && received < requested)
+			{
+				memcpy(data + received, buf, expected);
+				received += expected;
+			}
+		}
+	}
+	m_ReadFailed = false;
+	return true;
 }
 bool BootLoader::flushWrites()
 {
-	return m_Radio.flush();
+	if (!m_Radio.flush())
+		return false;
+	MTNB_STATS(endPage());
+	return true;
 }
 bool BootLoader::exitBootLoader()
 {
+	if (m_InGroup)
+	{
+		// each device still needs its first page, see joinGroup
+		endGroup();
+		return true;
+	}
 	Packet resetPacket;
 	resetPacket.command = 0;
-	return m_Radio.write(resetPacket) && m_Radio.flush();
+	m_NextPage = 0;
+	MTNB_TRACE(TRACE_EXIT, 0);
+	bool success = m_Radio.write(resetPacket) && m_Radio.flush();
+	MTNB_STATS(endSession());
+	// the application carries on with the bootloader's radio settings
+	m_ExitLinkLevel = m_LinkLevel;
+	restoreLink();
+	return success;
 }
 
 bool BootLoader::waitForEepromWrites()
 {
-	uint16_t startTime = millis();
+	startWaitForEepromWrites();
+	return runAsync();
+}
+
+bool BootLoader::performCrcCheck()
+{
+	startCrcCheck();
+	return runAsync();
+}
+
+bool BootLoader::sendUpdaterPacket(uint8_t command)
+{
+	// always 32 bytes so the updater doesn't need the payload width
+	memset(m_UpdaterPacket + 2 + m_UpdaterLength, 0, UPDATER_DATA_SIZE - m_UpdaterLength);
+	m_UpdaterPacket[0] = UPDATER_PACKET;
+	m_UpdaterPacket[1] = command;
+	m_UpdaterLength = 0;
+	if (!m_Radio.write(m_UpdaterPacket, UPDATER_PACKET_SIZE))
+		return false;
+	if (command != UPDATER_DATA)
+		return true;
+	// give the bootloader something to take after each page it writes
+	static const uint8_t wake[] = { UPDATER_PACKET, UPDATER_WAKE };
+	for (uint8_t pages = countUpdaterPages(m_UpdaterPacket + 2); pages; --pages)
+		if (!m_Radio.write(wake, sizeof(wake)))
+			return false;
+	return true;
+}
+uint8_t BootLoader::countUpdaterPages(const uint8_t* data)
+{
+	// decode the packet as the updater will, without the data itself
+	uint16_t pageSize = getFlashPageSize();
+	uint16_t pageMask = pageSize - 1;
+	uint8_t pages = 0;
+	uint8_t i = 0;
 	for (;;)
 	{
-		int16_t nvmstatus = writeAndReadMemory(0x1001, 0);
-		if (nvmstatus < 0)
+		if (m_UpdaterDecoder.copying())
+			m_UpdaterDecoder.copied();
+		else if (i < UPDATER_DATA_SIZE)
 		{
-			MTNB_DEBUG(println(F("Failed to read non-volatile memory controller status register")));
+			if (m_UpdaterDecoder.decode(data[i++]) < 0)
+				continue;
+		}
+		else
+			return pages;
+		if (m_UpdaterPos == m_UpdaterEnd)
+			continue;
+		// the first page is only written at the end
+		if ((++m_UpdaterPos & pageMask) == 0 && uint16_t(m_UpdaterPos - m_UpdaterStart) > pageSize)
+			++pages;
+	}
+}
+
+bool BootLoader::beginCompressed(uint16_t updater, uint16_t start, uint16_t end)
+{
+	if (m_FlashSize == 0 && !readDeviceSignature())
+		return false;
+	// point the application at the updater.  the updater writes the real
+	// first page last of all so an interrupted upload can be restarted.
+	uint16_t entry = updater / 2;
+	const uint16_t jumpToUpdater [] =
+	{
+		loadImmediate(30, entry & 255),
+		loadImmediate(31, entry >> 8),
+		IJMP,
+	};
+	m_UpdaterDecoder.begin();
+	m_UpdaterStart = start;
+	m_UpdaterEnd = end;
+	m_UpdaterPos = start;
+	m_UpdaterPacket[2] = start & 255;
+	m_UpdaterPacket[3] = start >> 8;
+	m_UpdaterPacket[4] = end & 255;
+	m_UpdaterPacket[5] = end >> 8;
+	m_UpdaterLength = 4;
+	if (!writeMemory(0x8000 + start, jumpToUpdater, sizeof(jumpToUpdater)) ||
+		!sendUpdaterPacket(UPDATER_START) ||
+		!flushWrites())
+	{
+		MTNB_DEBUG(println(F("Failed starting stage-2 updater")));
+		return false;
+	}
+	// the updater puts its ID in the ack payload for each query
+	m_Radio.clearReadFifo();
+	for (uint8_t retries = 0; retries < 8; ++retries)
+	{
+		if (!sendUpdaterPacket(UPDATER_QUERY) || !flushWrites())
 			return false;
+		while (m_Radio.available())
+		{
+			uint8_t buf[32];
+			if (m_Radio.read(buf).packetsize == 4 && memcmp(buf, "MTZ2", 4) == 0)
+				return true;
 		}
-		if ((nvmstatus & 3) == 0)
-			return true;
-		uint16_t t = millis() - startTime;
-		if (t > 200)
+	}
+	MTNB_DEBUG(println(F("No response from stage-2 updater")));
+	return false;
+}
+bool BootLoader::writeCompressed(const void* data, uint16_t length)
+{
+	const uint8_t* u8data = (const uint8_t*) data;
+	while (length)
+	{
+		uint8_t chunk = UPDATER_DATA_SIZE - m_UpdaterLength;
+		if (chunk > length)
+			chunk = length;
+		memcpy(m_UpdaterPacket + 2 + m_UpdaterLength, u8data, chunk);
+		m_UpdaterLength += chunk;
+		u8data += chunk;
+		length -= chunk;
+		if (m_UpdaterLength == UPDATER_DATA_SIZE)
 		{
-			MTNB_DEBUG(println(F("Timed out waiting for EEPROM writes!")));
-			return false;
+			// drop the status bytes the bootloader sends after each page
+			m_Radio.clearReadFifo();
+			if (!sendUpdaterPacket(UPDATER_DATA))
+			{
+				MTNB_DEBUG(println(F("Failed sending compressed data")));
+				return false;
+			}
+		}
+	}
+	return true;
+}
+bool BootLoader::endCompressed()
+{
+	if ((m_UpdaterLength && !sendUpdaterPacket(UPDATER_DATA)) ||
+		!sendUpdaterPacket(UPDATER_END) ||
+		!flushWrites())
+	{
+		MTNB_DEBUG(println(F("Failed sending compressed data")));
+		return false;
+	}
+	// the status comes back in an ack payload once the first page is written
+	m_Radio.clearReadFifo();
+	for (uint8_t retries = 0; retries < 16; ++retries)
+	{
+		Packet syncPacket;
+		if (!m_Radio.write(syncPacket) || !m_Radio.flush())
+			break;
+		while (m_Radio.available())
+		{
+			uint8_t buf[32];
+			if (m_Radio.read(buf).packetsize == 1 && buf[0] != UPDATER_BUSY)
+			{
+				if (buf[0] == UPDATER_OK)
+					return true;
+				MTNB_DEBUG(print(F("Stage-2 updater failed, status = ")));
+				MTNB_DEBUG(println(buf[0]));
+				return false;
+			}
 		}
 	}
+	MTNB_DEBUG(println(F("No status from stage-2 updater")));
+	return false;
 }
 
-bool BootLoader::performCrcCheck()
+bool BootLoader::joinGroup(const char* group, uint8_t channel)
 {
-	MTNB_DEBUG(println(F("Requesting CRC check")));
-	// set CRCSCAN.ENABLE=1
-	uint8_t vals [] = { 1, 0 };
-	int16_t crcstatus = writeAndReadMemory(0x120, vals, 2);
-	if (crcstatus < 0)
+	if (m_FlashSize == 0 && !readDeviceSignature())
+		return false;
+	const uint8_t* sig = m_Signature;
+	if (m_GroupSize == 0)
+	{
+		memcpy(m_Group, group, 3);
+		m_GroupChannel = channel;
+		memcpy(m_GroupSignature, sig, 3);
+		m_GroupBootEnd = m_BootEnd;
+	}
+	else if (memcmp(m_Group, group, 3) != 0 || m_GroupChannel != channel ||
+		memcmp(m_GroupSignature, sig, 3) != 0 || m_GroupBootEnd != m_BootEnd)
 	{
-		MTNB_DEBUG(println(F("Failed to read CRC check status!")));
+		MTNB_DEBUG(println(F("Device doesn't match the rest of the group")));
 		return false;
 	}
-	if ((crcstatus & 3) == 2)
+	// like the channel switcher, a first flash page that restarts the
+	// bootloader's radio with new settings.  a command packet pointing X at
+	// the group address joins the group and one pointing at USERROW goes
+	// back to the device's own address and channel.  anything a device takes
+	// for a command after missing the real one is ignored.  after a watchdog
+	// reset it carries on in the bootloader on its own address so the
+	// bridge can send it the real first page.
+	uint16_t app = getAppStart() / 2;
+	uint16_t waitForCommand = m_PackedWrites ? BOOT_PACKED_WAIT_FOR_COMMAND : BOOT_WAIT_FOR_COMMAND;
+	const uint16_t groupData = 0x8000 + getAppStart() + 36;
+	struct
+	{
+		uint16_t code[18];
+		uint8_t address[3];
+		uint8_t channel;
+	} groupSwitcher =
+	{
+		{
+			loadImmediate(29, 0x3F), // command buffer (YH isn't set after a watchdog reset)
+			0xFC03, // sbrc r0, RSTCTRL_WDRF_bp
+			relativeJump(RJMP, app + 2, waitForCommand),
+			compareImmediate(26, groupData & 255),
+			loadImmediate(18, groupData >> 8),
+			CPC_R27_R18,
+			branch(BREQ, 6, 11),
+			compareImmediate(26, 0x00), // USERROW
+			loadImmediate(18, 0x13),
+			CPC_R27_R18,
+			branch(BRNE, 10, 16),
+			relativeJump(RCALL, app + 11, BOOT_SET_CONFIG_R21),
+			loadImmediate(20, 3),
+			loadImmediate(24, W_REGISTER | RX_ADDR_P1),
+			relativeJump(RCALL, app + 14, BOOT_WRITE_LOOP),
+			relativeJump(RJMP, app + 15, BOOT_CUSTOM_CHANNEL),
+			loadImmediate(20, 0), // next packet is a command
+			relativeJump(RJMP, app + 17, waitForCommand),
+		},
+		{ (uint8_t) group[0], (uint8_t) group[1], (uint8_t) group[2] },
+		channel,
+	};
+	Packet joinPacket;
+	joinPacket.command = 0; // r21 config value
+	joinPacket.addresslo = groupData & 255;
+	joinPacket.addresshi = groupData >> 8;
+	if (!writeMemory(0x8000 + getAppStart(), &groupSwitcher, sizeof(groupSwitcher)) ||
+		!m_Radio.write(joinPacket) ||
+		!m_Radio.flush())
 	{
-		MTNB_DEBUG(println(F("CRC check passed OK!")));
+		MTNB_DEBUG(println(F("Failed to join group")));
+		return false;
+	}
+	++m_GroupSize;
+	MTNB_DEBUG(print(F("Joined group, ")));
+	MTNB_DEBUG(print(m_GroupSize));
+	MTNB_DEBUG(println(F(" devices")));
+	// don't let the earlier members time out while we joined this one
+	Packet syncPacket;
+	return sendGroupPacket(&syncPacket, sizeof(syncPacket));
+}
+
+bool BootLoader::beginGroup()
+{
+	if (m_GroupSize == 0)
+		return false;
+	m_Radio.readRegister(RX_ADDR_P1, m_DeviceAddress, 3);
+	m_DeviceChannel = m_Radio.getChannel();
+	m_Radio.setAddress(m_Group, 3);
+	m_Radio.setChannel(m_GroupChannel);
+	m_InGroup = true;
+	m_GroupHeldPages = 0;
+	return true;
+}
+
+void BootLoader::endGroup()
+{
+	if (m_GroupSize)
+	{
+		// any device that misses this goes back when its watchdog runs out
+		Packet leavePacket;
+		leavePacket.command = 0;
+		leavePacket.addresslo = 0x00; // USERROW
+		leavePacket.addresshi = 0x13;
+		for (uint8_t i = 0; i < 3; ++i)
+			sendGroupPacket(&leavePacket, sizeof(leavePacket));
+	}
+	if (m_InGroup)
+	{
+		m_Radio.setAddress(m_DeviceAddress, 3);
+		m_Radio.setChannel(m_DeviceChannel);
+		m_InGroup = false;
+		m_FlashSize = 0;
+	}
+	m_GroupSize = 0;
+}
+
+void BootLoader::keepGroupAlive(uint16_t t)
+{
+	if (m_GroupSize && t - m_LastGroupSync > 250)
+	{
+		m_LastGroupSync = t;
+		Packet syncPacket;
+		sendGroupPacket(&syncPacket, sizeof(syncPacket));
+	}
+}
+
+bool BootLoader::sendGroupPacket(const void* data, uint8_t size)
+{
+	if (m_InGroup)
+	{
+		waitForGroupPage();
+		return m_Radio.writeMulticast(data, size) && m_Radio.flush();
+	}
+	// between joins the radio is set up for a single device
+	uint8_t address[3];
+	m_Radio.readRegister(TX_ADDR, address, 3);
+	uint8_t channel = m_Radio.getChannel();
+	const uint8_t group[3] = { 'P', m_Group[1], m_Group[2] };
+	m_Radio.writeRegister(TX_ADDR, group, 3);
+	m_Radio.setChannel(m_GroupChannel);
+	bool sent = m_Radio.writeMulticast(data, size) && m_Radio.flush();
+	m_Radio.writeRegister(TX_ADDR, address, 3);
+	m_Radio.setChannel(channel);
+	return sent;
+}
+
+// a device that missed a packet takes later ones as commands.  the group
+// switcher ignores most of those but a data packet starting with
+// CPU_CCP_SPM_gc would write somewhere else, so packets are ended early
+// rather than start with one
+static uint8_t groupPacketSize(const uint8_t* data, uint8_t length)
+{
+	uint8_t size = length > 32 ? 32 : length;
+	while (size > 1 && size < length && data[size] == 0x9D)
+		--size;
+	return size;
+}
+
+bool BootLoader::writeGroupMemory(uint16_t address, const uint8_t* data, uint8_t length)
+{
+	Packet packet;
+	if (address < 0x8000)
+	{
+		MTNB_DEBUG(println(F("Only flash can be sent to a group")));
+		return false;
+	}
+	if (data[0] == packet.command)
+	{
+		// the first packet can't be shortened to move the byte along, so
+		// the page is left for the visit to each device afterwards
+		++m_GroupHeldPages;
 		return true;
 	}
-	MTNB_DEBUG(print(F("CRC status = ")));
-	MTNB_DEBUG(print(crcstatus, HEX));
-	MTNB_DEBUG(println(F("\nCRC check failed!")));
-	return false;
+	for (uint8_t pos = 0; pos < length; pos += groupPacketSize(data + pos, length - pos))
+		++packet.numpackets;
+	packet.addresshi = address >> 8;
+	packet.addresslo = address & 255;
+	waitForGroupPage();
+	m_GroupPageStart = micros();
+	if (!m_Radio.writeMulticast(&packet, sizeof(packet)))
+		return false;
+	for (uint8_t pos = 0; pos < length; )
+	{
+		uint8_t size = groupPacketSize(data + pos, length - pos);
+		if (!m_Radio.writeMulticast(data + pos, size))
+			return false;
+		pos += size;
+	}
+	if (!m_Radio.flush())
+		return false;
+	// nothing is acknowledged, so the next packet to the group waits until
+	// the slowest device should have written the page.  the caller gets on
+	// with receiving the next one meanwhile
+	m_GroupPageTime = (packet.numpackets + 1) * GROUP_PACKET_TIME + GROUP_PAGE_WRITE_TIME;
+	return true;
+}
+
+void BootLoader::waitForGroupPage()
+{
+	while ((uint32_t) (micros() - m_GroupPageStart) < m_GroupPageTime)
+		;
+	m_GroupPageTime = 0;
 }
 
 bool BootLoader::reprogramAddress(const char* addr)
@@ -294,32 +1103,46 @@ bool BootLoader::reprogramChannel(uint8_t channel)
 bool BootLoader::changeRadioSettings(uint8_t channel, BitRate bitrate)
 {
 	bool success = false;
+	// the application section starts after 256 or 512 bytes of bootloader
+	if (m_FlashSize == 0 && !readDeviceSignature())
+	{
+		MTNB_DEBUG(println(F("Failed reading device signature")));
+		return false;
+	}
+	uint16_t app = getAppStart() / 2;
+	uint16_t waitForCommand = m_PackedWrites ? BOOT_PACKED_WAIT_FOR_COMMAND : BOOT_WAIT_FOR_COMMAND;
 	// reprogram the first flash page with a small program to restart 
 	// the bootloader with new radio settings. the radio reverts
 	// back to its original settings if the watchdog kicks in.
-	static const uint8_t reprogramApp [] PROGMEM =
+	const uint16_t reprogramApp [] =
 	{
-		0x03, 0xFC, // sbrc r0, RSTCTRL_WDRF_bp 
-		0xEC, 0xCF,	// rjmp wait_for_command
-		0xA0, 0xDF, // rcall nrf24_set_config_r21
-		0xDB, 0xCF, // rjmp start_bootloader_custom_channel
+		0xFC03, // sbrc r0, RSTCTRL_WDRF_bp 
+		relativeJump(RJMP, app + 1, waitForCommand),
+		relativeJump(RCALL, app + 2, BOOT_SET_CONFIG_R21),
+		loadImmediate(24, W_REGISTER | RF_SETUP),
+		relativeJump(RCALL, app + 4, BOOT_COMMAND_DATA_X), // RF_SETUP from X
+		relativeJump(RJMP, app + 5, BOOT_CUSTOM_CHANNEL), // then RF_CH
 	};
+	const uint8_t settings[] = { (uint8_t)(bitrate | RF24_PA_MAX), channel };
 	Packet resetPacket;
 	resetPacket.command = 0; // r21 config value
 	resetPacket.addresslo = sizeof(reprogramApp);
-	resetPacket.addresshi = 0x81;
+	resetPacket.addresshi = 0x80 | m_BootEnd;
 	resetPacket.numpackets = 0;
 	Packet packet;
 	packet.addresslo = 0;
-	packet.addresshi = 0x81; // PROGMEM
+	packet.addresshi = 0x80 | m_BootEnd; // PROGMEM
 	packet.numpackets = 2;
+	m_NextPage = 0;
 	if (m_Radio.write(packet) &&
 		m_Radio.write(reprogramApp) &&
-		m_Radio.write(channel) &&
-		m_Radio.write(resetPacket) &&
-		m_Radio.flush())
+		m_Radio.write(settings) &&
+		m_Radio.write(resetPacket))
 	{
-		MTNB_DEBUG(println(F("Sent channel change request OK")));
+		// the reset packet may have been taken with its ack lost, leaving
+		// the device on the new settings, so they're tried either way
+		if (m_Radio.flush())
+			MTNB_DEBUG(println(F("Sent channel change request OK")));
 		// change our radio settings
 		m_Radio.powerDown();
 		BitRate oldBitRate = m_Radio.getBitRate();
@@ -327,7 +1150,8 @@ bool BootLoader::changeRadioSettings(uint8_t channel, BitRate bitrate)
 		m_Radio.setChannel(channel);
 		m_Radio.setBitRate(bitrate);
 
-		if (enterBootLoader())
+		beginEnter();
+		if (runAsync())
 		{
 			success = true;
 		}
@@ -340,7 +1164,8 @@ bool BootLoader::changeRadioSettings(uint8_t channel, BitRate bitrate)
 			m_Radio.setChannel(oldChannel);
 			m_Radio.setBitRate(oldBitRate);
 
-			enterBootLoader();
+			beginEnter();
+			runAsync();
 		}
 
 		// it's only necessary to erase the channel switcher program because
@@ -348,10 +1173,10 @@ bool BootLoader::changeRadioSettings(uint8_t channel, BitRate bitrate)
 		// trigger a full software reset to reboot the bootloader with the
 		// new radio settings.  we could rely on the watchdog timeout instead to
 		// reboot but it would be slower.
-		static const uint8_t standbyProgram [] PROGMEM =
+		const uint16_t standbyProgram [] =
 		{
-			0x86, 0xDF,// rcall nrf24_poll_reset
-			0xFE, 0xCF,// rjmp .-4
+			relativeJump(RCALL, app, BOOT_POLL_RESET),
+			0xCFFE, // rjmp .-4
 		};
 		packet.numpackets = 1;
 		if (m_Radio.write(packet) &&
@@ -373,6 +1198,126 @@ bool BootLoader::changeRadioSettings(uint8_t channel, BitRate bitrate)
 	return success;
 }
 
+// settings adaptLink() steps down through after the sketch's own
+struct LinkLevel
+{
+	BitRate bitrate;
+	uint8_t setupRetr; // ARD and ARC
+	uint8_t mcuRetries;
+};
+static const LinkLevel s_LinkLevels[] =
+{
+	{ RF24_2MBPS, (3 << ARD) | 15, 16 },	// 1ms between retransmits rides out short bursts
+	{ RF24_1MBPS, (1 << ARD) | 15, 16 },	// 3dB more sensitive
+	{ RF24_250KBPS, (2 << ARD) | 15, 8 },	// 12dB more sensitive, acks need longer
+};
+static const uint8_t LINK_LEVELS = sizeof(s_LinkLevels) / sizeof(s_LinkLevels[0]);
+static const uint8_t LINK_PROBE_PACKETS = 16;
+
+// one transmission of a full packet and the wait for its ack in us
+static uint16_t transmitTime(BitRate bitrate, uint8_t setupRetr)
+{
+	// 38 bytes on air with a 3 byte address, after 130us to start up
+	uint16_t air = bitrate == RF24_2MBPS ? 152 : bitrate == RF24_1MBPS ? 304 : 1216;
+	return air + 130 + 250 * ((setupRetr >> ARD) + 1);
+}
+
+bool BootLoader::adaptLink()
+{
+	if (!m_AdaptLink || m_InGroup)
+		return true;
+	if (!m_Radio.flush())
+		return false;
+	if (m_LinkLevel == 0)
+	{
+		m_BaseBitRate = m_Radio.getBitRate();
+		m_BaseSetupRetr = m_Radio.readRegister(SETUP_RETR);
+		m_BaseRetries = m_Radio.getMcuRetries();
+	}
+	bool good;
+	uint16_t bestTime = probeLink(good);
+	uint8_t best = m_LinkLevel;
+	for (uint8_t level = m_LinkLevel + 1; !good && level <= LINK_LEVELS; ++level)
+	{
+		if (!setLinkLevel(level))
+			break;
+		uint16_t time = probeLink(good);
+		// a level without losses is taken over a faster one that had them
+		if (good || time < bestTime)
+		{
+			bestTime = time;
+			best = level;
+		}
+	}
+	if (best != m_LinkLevel && !setLinkLevel(best))
+		return false;
+	MTNB_DEBUG(print(F("Link level ")));
+	MTNB_DEBUG(print(m_LinkLevel));
+	MTNB_DEBUG(print(F(", ")));
+	MTNB_DEBUG(print(bestTime));
+	MTNB_DEBUG(println(F("us per packet")));
+	return bestTime != 0xFFFF;
+}
+
+uint16_t BootLoader::probeLink(bool& good)
+{
+	uint8_t setupRetr = m_Radio.readRegister(SETUP_RETR);
+	uint8_t retries = m_Radio.getMcuRetries();
+	// every MAX_RT has to count, so flush() mustn't retry
+	m_Radio.setRetries(setupRetr >> ARD, setupRetr & 15, 0);
+	m_Radio.clearReadFifo();
+	uint16_t transmissions = 0;
+	uint8_t delivered = 0;
+	Packet syncPacket;
+	for (uint8_t i = 0; i < LINK_PROBE_PACKETS; ++i)
+	{
+		if (m_Radio.write(syncPacket) && m_Radio.flush())
+			++delivered;
+		// ARC_CNT is 15 after MAX_RT
+		transmissions += (m_Radio.readRegister(OBSERVE_TX) & 15) + 1;
+	}
+	m_Radio.setRetries(setupRetr >> ARD, setupRetr & 15, retries);
+	good = delivered == LINK_PROBE_PACKETS && transmissions <= LINK_PROBE_PACKETS * 5 / 4;
+	if (!delivered)
+		return 0xFFFF;
+	uint32_t time = (uint32_t) transmissions * transmitTime(m_Radio.getBitRate(), setupRetr) / delivered;
+	return time < 0xFFFF ? time : 0xFFFE;
+}
+
+bool BootLoader::setLinkLevel(uint8_t level)
+{
+	BitRate bitrate = level ? s_LinkLevels[level - 1].bitrate : m_BaseBitRate;
+	bool changed = bitrate != m_Radio.getBitRate();
+	if (changed && !changeRadioSettings(m_Radio.getChannel(), bitrate))
+		return false;
+	useLinkLevel(level);
+	// entering the bootloader again forgot which part it is
+	return !changed || readDeviceSignature();
+}
+
+void BootLoader::useLinkLevel(uint8_t level)
+{
+	BitRate bitrate = m_BaseBitRate;
+	uint8_t setupRetr = m_BaseSetupRetr;
+	uint8_t retries = m_BaseRetries;
+	if (level)
+	{
+		bitrate = s_LinkLevels[level - 1].bitrate;
+		setupRetr = s_LinkLevels[level - 1].setupRetr;
+		retries = s_LinkLevels[level - 1].mcuRetries;
+	}
+	m_Radio.setBitRate(bitrate);
+	m_Radio.setRetries(setupRetr >> ARD, setupRetr & 15, retries);
+	m_LinkLevel = level;
+	MTNB_TRACE(TRACE_LINK, level);
+}
+
+void BootLoader::restoreLink()
+{
+	if (m_LinkLevel)
+		useLinkLevel(0);
+}
+
 void BootLoader::printAddresses()
 {
 #if !DISABLE_MTNB_DEBUG
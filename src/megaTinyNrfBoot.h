@@ -1,6 +1,8 @@
 #pragma once
 
 #include "megaTinyNrf24.h"
+#include "megaTinyNrfLz.h"
+#include "megaTinyNrfStats.h"
 
 //#define DISABLE_MTNB_DEBUG 1
 
@@ -16,6 +18,10 @@ public:
     Radio& getRadio();
     // set stream to write debug messages to
     void setDebugStream(Stream* debugStream);
+#if !DISABLE_MTNB_STATS
+    // keep link statistics for each session in 'stats' (nullptr to stop)
+    void setLinkStats(LinkStats* stats);
+#endif
     // reset the remote device into bootloader mode. returns true is successful
     bool enterBootLoader();
     // tell the remote device to leave the bootloader and run the application
@@ -26,12 +32,23 @@ public:
     uint16_t getFlashSize() const;
     // get remote device's flash page size in bytes (must call readDeviceSignature first)
     uint8_t getFlashPageSize() const;
+    // get the start of the remote device's application section (must call readDeviceSignature first)
+    uint16_t getAppStart() const;
+    // true if the remote device runs the extended bootloader that can read memory (must call readDeviceSignature first)
+    bool canReadMemory() const;
+    // true if whole flash pages that follow on from the last one go without a command packet (PACKED_WRITES build, must call readDeviceSignature first)
+    bool canPackWrites() const;
     // send a packet to the remote radio programming pipe and return true if it was received
     bool sendSyncPacket();
     // send a packet every 250ms to prevent the remote device from timing out of bootloader mode
     void keepAlive(uint16_t currentMillisValue);
     // write to a single page of device memory
     bool writeMemory(uint16_t address, const void* data, uint8_t length);
+    // write to a single page of device memory with the data following in
+    // writeMemoryData() calls of up to 32 bytes as it becomes available (not
+    // for a group)
+    bool beginWriteMemory(uint16_t address, uint8_t length);
+    bool writeMemoryData(const void* data, uint8_t length);
     // write multiple pages of device memory
     bool writeMemoryLong(uint16_t address, const void* data, uint16_t length);
     // write a single byte of device memory
@@ -46,7 +63,40 @@ public:
     int16_t writeAndReadMemory(uint16_t address, const void* data, uint8_t len, uint8_t retries = 16);
     // write only a single byte and return byte from next address
     int16_t writeAndReadMemory(uint16_t address, uint8_t value, uint8_t retries = 16);
+    // read device memory 32 bytes per packet (extended bootloader only).  a
+    // short read may be asked again for more bytes than that, up to 32
+    bool readMemory(uint16_t address, void* data, uint16_t length, uint8_t retries = 16);
     
+    // start a compressed upload through the stage-2 updater at byte address
+    // updater, writing flash from start up to end (false if no updater responds)
+    bool beginCompressed(uint16_t updater, uint16_t start, uint16_t end);
+    // send more of the LZ compressed stream
+    bool writeCompressed(const void* data, uint16_t length);
+    // finish a compressed upload and check the updater wrote everything
+    bool endCompressed();
+
+    // move the device in the bootloader into programming group 'group' (3
+    // byte address) on 'channel'.  it stops answering on its own address and
+    // takes unacknowledged packets sent to the group until endGroup() or
+    // until the group is quiet for a watchdog period, then goes back to its
+    // own address still in the bootloader.  the signature is only read if
+    // readDeviceSignature() hasn't been since the device was entered.
+    bool joinGroup(const char* group, uint8_t channel);
+    // number of devices that have joined the group
+    uint8_t getGroupSize() const;
+    // talk to every device in the group instead of a single one until
+    // endGroup().  only flash can be written, each page is sent once without
+    // acknowledgements and paced for the devices to keep up.
+    bool beginGroup();
+    // send the group's devices back to their own addresses and forget them
+    void endGroup();
+    bool inGroup() const;
+    // flash pages starting with 0x9D that weren't sent to the group and
+    // still have to be written to each device on its own
+    uint8_t getGroupHeldPages() const;
+    // send a packet to the group every 250ms to keep its devices listening
+    void keepGroupAlive(uint16_t currentMillisValue);
+
     // temporarily change the remote device's radio settings and reestablish a connection (erases flash!)
     bool changeRadioSettings(uint8_t channel, BitRate bitrate);
     // permanently reprogram the remote device's radio address
@@ -54,16 +104,158 @@ public:
     // permanently reprogram the remote device's radio channel
     bool reprogramChannel(uint8_t channel);
 
+    // link adaptation: when a session is about to write the first page of
+    // the application, adaptLink() is called to probe the link with sync
+    // packets.  if too many need retransmitting it steps down through
+    // longer retransmit delays and slower bitrates until the link holds up,
+    // changing the device's bitrate with changeRadioSettings() (which only
+    // erases that first page).  the device goes back to its own settings
+    // when it resets, and the bridge to the sketch's in startEnterBootLoader(),
+    // exitBootLoader() and restoreLink().  the application started by
+    // exitBootLoader() stays on the adapted bitrate, so the next
+    // startEnterBootLoader() tries that first.  off by default.
+    void setLinkAdaptation(bool enabled);
+    bool getLinkAdaptation() const;
+    // probe the link and adapt it now, false if the device stopped answering
+    bool adaptLink();
+    // go back to the bitrate and retries the sketch configured
+    void restoreLink();
+
     // log current radio address information to debug stream
     void printAddresses();
 
+    // enterBootLoader(), waitForEepromWrites(), readDeviceSignature(),
+    // writeAndReadMemory() and performCrcCheck() as operations that run a
+    // step at a time from poll() instead of blocking, so a sketch can keep
+    // serving serial, TCP clients etc. while the device is being reset or
+    // is busy.  one operation runs at a time and no other calls should be
+    // made until it has finished.  poll() returns ASYNC_PENDING until then,
+    // after that the result of the last operation.
+    enum eAsyncStatus : uint8_t
+    {
+        ASYNC_PENDING,
+        ASYNC_DONE,
+        ASYNC_FAILED,
+    };
+    void startEnterBootLoader();
+    void startWaitForEepromWrites();
+    // the signature ends up in getSignature()
+    void startReadDeviceSignature();
+    // 'data' has to stay valid until the operation has finished, the byte
+    // read back is in getReadValue()
+    void startWriteAndReadMemory(uint16_t address, const void* data, uint8_t len, uint8_t retries = 16);
+    void startWriteAndReadMemory(uint16_t address, uint8_t value, uint8_t retries = 16);
+    void startCrcCheck();
+    eAsyncStatus poll();
+    // signature from the last readDeviceSignature()
+    const uint8_t* getSignature() const;
+    // byte from the last writeAndReadMemory(), -1 if it failed
+    int16_t getReadValue() const;
+    bool isBusy() const;
+    // finish the operation blocking, sleeping through its waits
+    bool runAsync();
+
 private:
+    enum eAsyncOperation : uint8_t
+    {
+        OP_NONE,
+        OP_ENTER,
+        OP_ENTER_APP_LINK,  // OP_ENTER starting on the link exitBootLoader() left
+        OP_ENTER_GROUP,
+        OP_EEPROM,
+        OP_SIGNATURE,
+        OP_READ,
+        OP_CRC,             // OP_READ of the CRCSCAN status
+    };
+    // send a write and read request: -1 if it failed, 0 if nothing came
+    // back (yet) or 1 with the value that came back
+    int8_t requestRead(uint16_t address, const void* data, uint8_t len, int16_t& value);
+    void startAsync(eAsyncOperation op);
+    eAsyncStatus finishAsync(bool success);
+    // set up requestRead() for pollRead(), which sends it again until
+    // something comes back or the retries run out
+    void beginRead(uint16_t address, const void* data, uint8_t len, uint8_t retries);
+    int8_t pollRead();
+    eAsyncStatus pollSignature();
+    bool readMemoryChunks(uint8_t* data, uint16_t address, uint16_t length, uint8_t retries);
+    bool sendUpdaterPacket(uint8_t command);
+    uint8_t countUpdaterPages(const uint8_t* data);
+    bool sendGroupPacket(const void* data, uint8_t size);
+    bool writeGroupMemory(uint16_t address, const uint8_t* data, uint8_t length);
+    void waitForGroupPage();
+    // startEnterBootLoader() without going back to the sketch's radio settings
+    void beginEnter();
+    // send sync packets and estimate the time per delivered packet in us
+    // (0xFFFF if none got through), good if few needed retransmitting
+    uint16_t probeLink(bool& good);
+    // 0 for the sketch's settings, then each of the link levels in turn
+    bool setLinkLevel(uint8_t level);
+    // the bridge's side of setLinkLevel()
+    void useLinkLevel(uint8_t level);
+
     Radio& m_Radio;
 #if !DISABLE_MTNB_DEBUG
     Stream* m_DebugLog;
+#endif
+#if !DISABLE_MTNB_STATS
+    LinkStats* m_Stats = nullptr;
 #endif
     uint8_t m_FlashSize = 0;
+    uint8_t m_BootEnd = 1; // BOOTEND fuse
+    bool m_ReadCommand = false;
+    // replies to a read that was given up on may still be queued in the device
+    bool m_ReadFailed = false;
+    bool m_PackedWrites = false;
+    // where the device carries on if the next page comes without a command
+    uint16_t m_NextPage = 0;
     uint16_t m_LastKeepAlive = 0;
+    uint8_t m_UpdaterLength = 0;
+    uint8_t m_UpdaterPacket[32];
+    // follows the updater's output position to know when it writes pages
+    LzDecoder m_UpdaterDecoder;
+    uint16_t m_UpdaterStart = 0;
+    uint16_t m_UpdaterEnd = 0;
+    uint16_t m_UpdaterPos = 0;
+    // programming group: its address and channel, the part every member
+    // has to be, and the single device address to go back to
+    uint8_t m_Group[3];
+    uint8_t m_GroupChannel = 0;
+    uint8_t m_GroupSize = 0;
+    uint8_t m_GroupSignature[3];
+    uint8_t m_GroupBootEnd = 1;
+    bool m_InGroup = false;
+    uint8_t m_GroupHeldPages = 0;
+    uint16_t m_LastGroupSync = 0;
+    // when the last page went to the group and how long its devices take
+    uint32_t m_GroupPageStart = 0;
+    uint16_t m_GroupPageTime = 0;
+    uint8_t m_DeviceAddress[3];
+    uint8_t m_DeviceChannel = 0;
+    // link adaptation, and the sketch's settings to go back to
+    bool m_AdaptLink = false;
+    uint8_t m_LinkLevel = 0;
+    uint8_t m_ExitLinkLevel = 0;    // the application's link after exitBootLoader()
+    BitRate m_BaseBitRate = RF24_2MBPS;
+    uint8_t m_BaseSetupRetr = 0;
+    uint8_t m_BaseRetries = 0;
+    // operation run by poll()
+    eAsyncOperation m_AsyncOp = OP_NONE;
+    eAsyncStatus m_AsyncStatus = ASYNC_DONE;
+    uint8_t m_AsyncCount = 0;
+    uint8_t m_AsyncRetries = 0;
+    uint8_t m_AsyncWait = 0;
+    uint16_t m_AsyncTime = 0;
+    uint16_t m_AsyncStart = 0;
+    // the read poll() is waiting for
+    uint16_t m_AsyncAddress = 0;
+    const void* m_AsyncData = nullptr;
+    uint8_t m_AsyncLength = 0;
+    uint8_t m_AsyncByte = 0;
+    int16_t m_AsyncValue = -1;
+#if !DISABLE_MTNB_STATS && !DISABLEMILLIS
+    uint32_t m_ReadStart = 0;
+#endif
+    uint8_t m_Signature[3] = {};
 };
 
 inline Radio& BootLoader::getRadio()
@@ -78,11 +270,61 @@ inline uint8_t BootLoader::getFlashPageSize() const
 {
     return m_FlashSize >= 5 ? 0x80 : 0x40;
 }
+inline uint16_t BootLoader::getAppStart() const
+{
+    return m_BootEnd << 8;
+}
+inline bool BootLoader::canReadMemory() const
+{
+    return m_ReadCommand;
+}
+inline bool BootLoader::canPackWrites() const
+{
+    return m_PackedWrites;
+}
+inline bool BootLoader::getLinkAdaptation() const
+{
+    return m_AdaptLink;
+}
+inline void BootLoader::setLinkAdaptation(bool enabled)
+{
+    m_AdaptLink = enabled;
+}
+inline uint8_t BootLoader::getGroupSize() const
+{
+    return m_GroupSize;
+}
+inline uint8_t BootLoader::getGroupHeldPages() const
+{
+    return m_GroupHeldPages;
+}
+inline bool BootLoader::inGroup() const
+{
+    return m_InGroup;
+}
+inline bool BootLoader::isBusy() const
+{
+    return m_AsyncOp != OP_NONE;
+}
+inline const uint8_t* BootLoader::getSignature() const
+{
+    return m_Signature;
+}
+inline int16_t BootLoader::getReadValue() const
+{
+    return m_AsyncValue;
+}
 inline void BootLoader::setDebugStream(Stream* debugStream)
 {
 #if !DISABLE_MTNB_DEBUG
     m_DebugLog = debugStream;
 #endif
 }
+#if !DISABLE_MTNB_STATS
+inline void BootLoader::setLinkStats(LinkStats* stats)
+{
+    m_Stats = stats;
+}
+#endif
 
 } // namespace mtnrf
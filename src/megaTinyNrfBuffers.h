@@ -0,0 +1,100 @@
+#pragma once
+
+#include <Arduino.h>
+
+namespace mtnrf {
+
+// fixed size byte queue.  when it's full the oldest byte is dropped to make
+// room for a new one.  Size has to be a power of 2 no larger than 128.
+template<uint8_t Size>
+class RingBuffer
+{
+    static_assert(Size && (Size & (Size - 1)) == 0 && Size <= 128, "RingBuffer size must be a power of 2 up to 128");
+
+public:
+    void clear() { m_Head = m_Tail = 0; }
+    bool empty() const { return m_Head == m_Tail; }
+    uint8_t size() const { return m_Head - m_Tail; }
+    uint8_t space() const { return Size - size(); }
+    // false if the oldest byte was dropped
+    bool push(uint8_t c)
+    {
+        bool room = size() < Size;
+        if (!room)
+            ++m_Tail;
+        m_Data[m_Head++ & (Size - 1)] = c;
+        return room;
+    }
+    // -1 when empty
+    int pop() { return empty() ? -1 : m_Data[m_Tail++ & (Size - 1)]; }
+    int peek() const { return empty() ? -1 : m_Data[m_Tail & (Size - 1)]; }
+
+private:
+    uint8_t m_Data[Size];
+    // free running, wrapped when indexing
+    uint8_t m_Head = 0;
+    uint8_t m_Tail = 0;
+};
+
+// fixed size character buffer that's filled up and then used and emptied in
+// one go.  it's kept NUL terminated so it can be parsed as a string.
+template<uint8_t Size>
+class LineBuffer
+{
+public:
+    LineBuffer() { clear(); }
+
+    void clear() { m_Length = 0; m_Data[0] = 0; }
+    uint8_t length() const { return m_Length; }
+    bool full() const { return m_Length == Size; }
+    const char* c_str() const { return m_Data; }
+    // false if there's no room
+    bool append(char c)
+    {
+        if (full())
+            return false;
+        m_Data[m_Length++] = c;
+        m_Data[m_Length] = 0;
+        return true;
+    }
+    bool startsWith(const __FlashStringHelper* prefix) const
+    {
+        PGM_P p = reinterpret_cast<PGM_P>(prefix);
+        return strncmp_P(m_Data, p, strlen_P(p)) == 0;
+    }
+
+private:
+    char m_Data[Size + 1];
+    uint8_t m_Length;
+};
+
+// follows a stream a character at a time, tracking how much of the start of
+// a command sequence it currently ends with so nothing has to be kept to
+// search through
+class SequenceMatcher
+{
+public:
+    SequenceMatcher(const char* seq, uint8_t length) : m_Seq(seq), m_Length(length), m_Matched(0) {}
+
+    void reset() { m_Matched = 0; }
+    uint8_t matched() const { return m_Matched; }
+    bool complete() const { return m_Matched == m_Length; }
+    // returns the new match length
+    uint8_t feed(char c)
+    {
+        // the stream already ended with the first m_Matched characters of
+        // the sequence, so only the sequence itself needs comparing
+        uint8_t len = m_Matched < m_Length ? m_Matched + 1 : m_Length;
+        for (; len > 0; --len)
+            if (m_Seq[len - 1] == c && memcmp(m_Seq, m_Seq + m_Matched + 1 - len, len - 1) == 0)
+                break;
+        return m_Matched = len;
+    }
+
+private:
+    const char* m_Seq;
+    uint8_t m_Length;
+    uint8_t m_Matched;
+};
+
+} // namespace mtnrf
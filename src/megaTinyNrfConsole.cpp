@@ -2,6 +2,7 @@
 #include "megaTinyNrfConsole.h"
 #include "megaTinyNrfStk500.h"
 #include "stk500.h"
+#include "stk500v2.h"
 
 namespace mtnrf {
 
@@ -9,18 +10,35 @@ Console::Console(BootLoader& device)
 :	m_Device(device)
 ,	m_Stream(nullptr)
 ,	m_Stk500(device)
+,	m_SignOnMatch(0)
+,	m_SyncMatch("0 0 ", 4)
+,	m_ConfigMatch("*cfg", 4)
+,	m_Tunnel(false)
+,	m_MonitorCount(0)
+,	m_Scan(SCAN_OFF)
+,	m_DeviceCommand(DEVICE_NONE)
+,	m_Spectrum(device.getRadio())
+#if !DISABLE_MTNB_STATS
+,	m_LinkStats(device.getRadio())
+#endif
 {
 }
 
 void Console::begin(Stream& stream)
 {
 	m_Stream = &stream;
+#if !DISABLE_MTNB_STATS
+	m_Device.setLinkStats(&m_LinkStats);
+#endif
 	openConfig();
 	//openUart();
 }
 
 void Console::end()
 {
+#if !DISABLE_MTNB_STATS
+	m_Device.setLinkStats(nullptr);
+#endif
 	m_Stream = nullptr;
 }
 
@@ -31,20 +49,84 @@ void Console::handle()
 
 	switch (m_Mode)
 	{
+	case MODE_ENTERING: handleEnterBootLoader(); break;
 	case MODE_STK500: handleStk500(); break;
 	case MODE_UART: handleUart(); break;
+	case MODE_TUNNEL: handleTunnel(); break;
 	case MODE_CONFIGURE: handleConfigure(); break;
 	}
 }
 
 void Console::openUart()
 {
-	m_Mode = MODE_UART;
 	auto& radio = m_Device.getRadio();
 	radio.powerDown();
 	radio.openWritingPipe('U');
-	radio.startListening(_BV(0));
-	m_SerialBuf = "";
+	if (m_Tunnel)
+	{
+		m_Mode = MODE_TUNNEL;
+		radio.clearWriteFifo();
+		radio.clearReadFifo();
+		radio.clearWriteFailed();
+		// an ack with a full payload takes longer than the shortest retransmit delay
+		m_TunnelSetupRetr = radio.readRegister(SETUP_RETR);
+		uint8_t ard = radio.getBitRate() == RF24_250KBPS ? 5 : 1;
+		if ((m_TunnelSetupRetr >> ARD) < ard)
+			radio.writeRegister(SETUP_RETR, (ard << ARD) | (m_TunnelSetupRetr & 15));
+		radio.stopListening();
+		radio.ce(HIGH);
+		m_TunnelBusy = false;
+		m_TunnelRetry = false;
+		// first poll once the radio has powered up
+		waitTunnel(5000);
+		m_TunnelDataTime = m_TunnelTime;
+	}
+	else
+	{
+		m_Mode = MODE_UART;
+		radio.startListening(openUartPipes());
+	}
+	resetSerialBuffer();
+}
+
+uint8_t Console::openUartPipes()
+{
+	m_MonitorTarget = 1;
+	m_MonitorLine = 0;
+	m_MonitorSelecting = false;
+	if (!m_MonitorCount)
+		return _BV(0);
+	auto& radio = m_Device.getRadio();
+	uint8_t pipes = 0;
+	for (uint8_t pipe = 1; pipe <= m_MonitorCount; ++pipe)
+	{
+		radio.openReadingPipe(m_MonitorAddr[pipe - 1], pipe);
+		pipes |= _BV(pipe);
+	}
+	return pipes;
+}
+
+void Console::setMonitor(const char* lsbs)
+{
+	m_MonitorCount = 0;
+	while (m_MonitorCount < MONITOR_PIPES && lsbs[m_MonitorCount] > ' ')
+	{
+		m_MonitorAddr[m_MonitorCount] = lsbs[m_MonitorCount];
+		++m_MonitorCount;
+	}
+	if (!m_MonitorCount)
+		return;
+	// the targets answer with Radio::write(), so it can't be tunnelled
+	m_Tunnel = false;
+	m_Stream->print(F("Monitoring"));
+	for (uint8_t pipe = 1; pipe <= m_MonitorCount; ++pipe)
+	{
+		m_Stream->print(F(" ["));
+		m_Stream->print(pipe);
+		m_Stream->print(F("] "));
+		m_Stream->print(m_MonitorAddr[pipe - 1]);
+	}
+	m_Stream->println();
 }
 
 void Console::openConfig()
@@ -56,10 +138,25 @@ void Console::openConfig()
 		" addr <xyz> [channel]   - set radio address\n"
 		" ch <channel>           - set radio channel\n"
 		" setid <xyz> [channel]  - reprogram target device's radio address\n"
-		" setch <channel>        - reprogram target device's radio channel (erases application)\n"
+		" setch <channel|auto>   - reprogram target device's radio channel (erases application),\n"
+		"                          auto [last] picks the quietest up to 83 or last after a scan\n"
 		" reset                  - reset target device\n"
+		" join <xyz> [channel]   - move target device into programming group xyz\n"
+		" group                  - program the whole group in the next STK500 session\n"
 		" crc                    - perform a CRC check of device flash\n"
-		" scan                   - scan RF channels\n\n"));
+		" pipe <0|1>             - answer STK500 page writes before the device has them\n"
+		" link <0|1>             - slow the link down for a session if it's losing packets\n"
+		" tunnel <0|1>           - carry UART data in ack payloads (target uses UartTunnel)\n"
+		" monitor [lsbs]         - UART to up to 5 targets at once, [n] tags their output and\n"
+		"                          Ctrl-A n sends to the nth, no lsbs for a single target\n"
+		" scan [b] [sweeps]      - scan RF channels until a key is pressed, b for binary frames\n"));
+#if !DISABLE_MTNB_STATS
+	m_Stream->print(F(" stats [clear]          - link statistics per session and target address\n"));
+#endif
+#if MTNB_TRACE_SIZE
+	m_Stream->print(F(" trace [clear]          - dump the packet trace as a binary frame\n"));
+#endif
+	m_Stream->print(F("\n"));
 	m_Device.printAddresses();
 #if !DISABLE_MTNB_STATS
 	auto& radio = m_Device.getRadio();
@@ -74,43 +171,75 @@ void Console::openConfig()
 	while (m_Stream->available())
 		m_Stream->read();
 
-	m_SerialBuf = "";
+	resetSerialBuffer();
 }
 
-uint8_t Console::matchSerialCommand(const char* seq, uint8_t len)
+void Console::resetSerialBuffer()
 {
-	uint8_t buflen = m_SerialBuf.length();
-	const char* buf = m_SerialBuf.c_str();
-	if (len > buflen)
-		len = buflen;
-	for (; len > 0; --len)
-		if (memcmp(&buf[buflen - len], seq, len) == 0)
-			break;
-	return len;
+	m_SerialBuf.clear();
+	m_SyncMatch.reset();
+	m_ConfigMatch.reset();
 }
 
 void Console::respondToStk500Sync()
 {
-	m_SerialBuf = "";
+	resetSerialBuffer();
 	m_Device.setDebugStream(&m_Debug);
 	m_Stream->write(STK_INSYNC);
 	m_Stream->write(STK_OK);
 	m_Stream->write(STK_INSYNC);
-	bool success = m_Device.enterBootLoader();
-	m_Stream->write(success ? STK_OK : STK_FAILED);
-	if (m_AllowStk500Debug)
-		m_Debug.flush(*m_Stream);
+	m_Stk500v2 = false;
+	m_Mode = MODE_ENTERING;
+	m_Device.startEnterBootLoader();
+}
+
+uint8_t Console::matchStk500v2SignOn(uint8_t c)
+{
+	// MESSAGE_START, sequence, size 1, TOKEN, CMD_SIGN_ON, checksum
+	static const uint8_t signOn[] = { MESSAGE_START, 0, 0, 1, TOKEN, CMD_SIGN_ON };
+	if (m_SignOnMatch == 1)
+		m_SignOnSequence = c;
+	else if (m_SignOnMatch == sizeof(signOn))
+		return m_SignOnMatch = c == (MESSAGE_START ^ m_SignOnSequence ^ 1 ^ TOKEN ^ CMD_SIGN_ON) ? 7 : 0;
+	else if (c != signOn[m_SignOnMatch])
+		return m_SignOnMatch = c == MESSAGE_START;
+	return ++m_SignOnMatch;
+}
+
+void Console::respondToStk500v2SignOn()
+{
+	m_SignOnMatch = 0;
+	resetSerialBuffer();
+	m_Device.setDebugStream(&m_Debug);
+	m_Stk500v2 = true;
+	m_Mode = MODE_ENTERING;
+	m_Device.startEnterBootLoader();
+}
+
+void Console::handleEnterBootLoader()
+{
+	// the device is reset a step at a time so the sketch keeps running
+	BootLoader::eAsyncStatus status = m_Device.poll();
+	if (status == BootLoader::ASYNC_PENDING)
+		return;
+	bool success = status == BootLoader::ASYNC_DONE;
+	m_Stk500.begin(*m_Stream);
+	if (m_Stk500v2)
+	{
+		m_Stk500.signOn(m_SignOnSequence, success);
+	}
+	else
+	{
+		m_Stream->write(success ? STK_OK : STK_FAILED);
+		if (m_AllowStk500Debug)
+			m_Debug.flush(*m_Stream);
+	}
 	m_Stream->flush();
 	m_Debug.clear();
 	if (success)
-	{
 		m_Mode = MODE_STK500;
-		m_Stk500.begin(*m_Stream);
-	}
 	else
-	{
 		openUart();
-	}
 }
 
 void Console::handleStk500()
@@ -124,6 +253,13 @@ void Console::handleStk500()
 
 	if (finished)
 	{
+		if (m_Device.inGroup() && m_Device.getGroupHeldPages())
+		{
+			m_Stream->print(m_Device.getGroupHeldPages());
+			m_Stream->println(F(" pages starting with 0x9D have to be written to each device"));
+		}
+		m_Device.endGroup();
+		m_Device.restoreLink();
 		m_Stream->println(F("Closing STK500 interface"));
 		m_AllowStk500Debug = false;
 		openUart();
@@ -139,41 +275,65 @@ void Console::handleUart()
 #endif
 	uint8_t stk500match = 0;
 
-	if (m_SerialBuf.length() < 32 && m_Stream->available())
-		m_SerialBuf += (char)m_Stream->read();
+	if (!m_SerialBuf.full() && m_Stream->available())
+	{
+		char ch = m_Stream->read();
+		if (m_MonitorSelecting)
+		{
+			m_MonitorSelecting = false;
+			if (ch > '0' && ch <= '0' + m_MonitorCount)
+				m_MonitorTarget = ch - '0';
+			return;
+		}
+		if (ch == MONITOR_SELECT && m_MonitorCount)
+		{
+			// what's been typed so far still goes to the previous target
+			sendSerialBuffer();
+			m_MonitorSelecting = true;
+			return;
+		}
+		m_SerialBuf.append(ch);
+		m_SyncMatch.feed(ch);
+		m_ConfigMatch.feed(ch);
+		if (matchStk500v2SignOn(ch) == 7)
+		{
+			respondToStk500v2SignOn();
+			return;
+		}
+	}
 
-	stk500match = matchSerialCommand("0 0 ", 4);
-	if (stk500match == 4)
+	stk500match = m_SyncMatch.matched();
+	if (m_SyncMatch.complete())
 	{
 		respondToStk500Sync();
 		return;
 	}
+	stk500match |= m_SignOnMatch;
 	auto& radio = m_Device.getRadio();
 	if (!stk500match) // don't talk back on serial if STK500 is being initiated
 	{
 		while (radio.available())
 		{
+			uint8_t pipe = radio.readPipe();
 			uint8_t buf[32];
 			uint8_t bytes = radio.read(buf).packetsize;
-			m_Stream->write(buf, bytes);
+			if (m_MonitorCount)
+				writeMonitored(pipe, buf, bytes);
+			else
+				m_Stream->write(buf, bytes);
 		}
 	}
 
-	uint8_t idcmd = matchSerialCommand("*cfg\n", 4);
-	if (idcmd == 4)
+	uint8_t idcmd = m_ConfigMatch.matched();
+	if (m_ConfigMatch.complete())
 	{
 		openConfig();
 		return;
 	}
 
-	if (m_SerialBuf.length() == 32 || (m_SerialBuf.length() > 0 && t - m_LastSendTime > 100 && !stk500match && !idcmd))
+	if (m_SerialBuf.full() || (m_SerialBuf.length() > 0 && t - m_LastSendTime > 100 && !stk500match && !idcmd))
 	{
-		radio.stopListening();
-		delay(5);
-		radio.writeLong(m_SerialBuf.c_str(), m_SerialBuf.length());
-		radio.flush();
-		radio.startListening(_BV(0));
-		m_SerialBuf = "";
+		sendSerialBuffer();
 	}
 	if (m_SerialBuf.length() == 0)
 	{
@@ -181,21 +341,175 @@ void Console::handleUart()
 	}
 }
 
+void Console::sendSerialBuffer()
+{
+	if (m_SerialBuf.length() == 0)
+		return;
+	auto& radio = m_Device.getRadio();
+	// TX mode leaves only pipe 0 enabled
+	uint8_t pipes = radio.readRegister(EN_RXADDR);
+	radio.stopListening();
+	if (m_MonitorCount)
+		radio.openWritingPipe(m_MonitorAddr[m_MonitorTarget - 1]);
+	delay(5);
+	radio.writeLong(m_SerialBuf.c_str(), m_SerialBuf.length());
+	radio.flush();
+	radio.startListening(pipes);
+	resetSerialBuffer();
+}
+
+void Console::writeMonitored(uint8_t pipe, const uint8_t* data, uint8_t size)
+{
+	for (uint8_t i = 0; i < size; ++i)
+	{
+		if (m_MonitorLine != pipe)
+		{
+			// another target's line is cut short rather than mixed in
+			if (m_MonitorLine)
+				m_Stream->println();
+			m_Stream->write('[');
+			m_Stream->write('0' + pipe);
+			m_Stream->print(F("] "));
+			m_MonitorLine = pipe;
+		}
+		m_Stream->write(data[i]);
+		if (data[i] == '\n')
+			m_MonitorLine = 0;
+	}
+}
+
+void Console::waitTunnel(uint16_t us)
+{
+#if !DISABLEMILLIS
+	m_TunnelTime = micros();
+#endif
+	m_TunnelWait = us;
+}
+
+void Console::handleTunnel()
+{
+	auto& radio = m_Device.getRadio();
+#if !DISABLEMILLIS
+	unsigned long t = micros();
+	uint16_t ms = millis();
+	bool due = t - m_TunnelTime >= m_TunnelWait;
+#else
+	unsigned long t = 0;
+	uint16_t ms = 0;
+	bool due = true;
+#endif
+
+	if (m_TunnelBusy)
+	{
+		if (radio.writeFailed())
+		{
+			// keep the packet so a retry reuses its PID and the target
+			// drops it if only the acks were lost
+			radio.ce(LOW);
+			radio.clearWriteFailed();
+			m_TunnelBusy = false;
+			m_TunnelRetry = true;
+			waitTunnel(TUNNEL_RETRY_TIME);
+		}
+		else if (radio.writeCompleted())
+		{
+			bool moved = m_TunnelSentData;
+			while (radio.available())
+			{
+				uint8_t buf[32];
+				uint8_t bytes = radio.read(buf).packetsize;
+				m_Stream->write(buf, bytes);
+				moved = true;
+			}
+			m_TunnelBusy = false;
+			if (moved)
+				m_TunnelDataTime = t;
+			waitTunnel(t - m_TunnelDataTime < TUNNEL_ACTIVE_TIME ? 0 : TUNNEL_POLL_INTERVAL);
+		}
+	}
+
+	while (m_SerialBuf.length() < TUNNEL_PAYLOAD && m_Stream->available())
+	{
+		char ch = m_Stream->read();
+		m_SerialBuf.append(ch);
+		m_SyncMatch.feed(ch);
+		m_ConfigMatch.feed(ch);
+		bool v2 = matchStk500v2SignOn(ch) == 7;
+		if (v2 || m_SyncMatch.complete() || m_ConfigMatch.complete())
+		{
+			// drop any packet still waiting to be retried, CE has to be
+			// high again for the bootloader commands
+			radio.clearWriteFifo();
+			radio.ce(HIGH);
+			radio.writeRegister(SETUP_RETR, m_TunnelSetupRetr);
+			if (v2)
+				respondToStk500v2SignOn();
+			else if (m_SyncMatch.complete())
+				respondToStk500Sync();
+			else
+				openConfig();
+			return;
+		}
+	}
+	if (m_SerialBuf.length() == 0)
+		m_LastSendTime = ms;
+
+	if (m_TunnelBusy || !due)
+		return;
+	if (m_TunnelRetry)
+	{
+		m_TunnelRetry = false;
+		m_TunnelBusy = true;
+		radio.ce(HIGH);
+		return;
+	}
+	// hold back what may be the start of an escape sequence for a while
+	uint8_t len = m_SerialBuf.length();
+	bool partial = m_SyncMatch.matched() || m_ConfigMatch.matched() || m_SignOnMatch;
+	if (partial && len < TUNNEL_PAYLOAD && uint16_t(ms - m_LastSendTime) < TUNNEL_HOLD_TIME)
+		len = 0;
+	uint8_t packet[32];
+	packet[0] = TUNNEL_HEADER;
+	memcpy(&packet[1], m_SerialBuf.c_str(), len);
+	radio.writeImmediate(packet, len + 1);
+	m_TunnelBusy = true;
+	m_TunnelSentData = len != 0;
+	if (len)
+		m_SerialBuf.clear();
+}
+
 void Console::handleConfigure()
 {
-	if (m_Scanning)
-		scanChannels();
+	if (m_DeviceCommand != DEVICE_NONE)
+	{
+		handleDeviceCommand();
+		return;
+	}
+	if (m_Scan != SCAN_OFF)
+		handleScan();
+#if !DISABLEMILLIS
+	if (!m_Spectrum.measuring())
+		m_Device.keepGroupAlive(millis());
+#endif
 
 	if (!m_Stream->available())
 		return;
 	char ch = m_Stream->read();
+	stopScan();
+	if (matchStk500v2SignOn(ch) == 7)
+	{
+		respondToStk500v2SignOn();
+		return;
+	}
+	if (m_SignOnMatch)
+		return; // don't echo what may be a STK500v2 message
 	m_Stream->write(ch);
 	if (ch == '\r')
 		return;
 	if (ch == '\n')
 		ch = 0;
-	m_SerialBuf += ch;
-	if (matchSerialCommand("0 0 ", 4) == 4)
+	m_SerialBuf.append(ch);
+	if (m_SyncMatch.feed(ch) == 4)
 	{
 		respondToStk500Sync();
 		return;
@@ -203,7 +517,6 @@ void Console::handleConfigure()
 	if (ch != 0)
 		return;
 	const char* serialbuf = m_SerialBuf.c_str();
-	m_Scanning = false;
 	if (serialbuf[0] == 'q')
 	{
 		m_Stream->println("done.");
@@ -212,24 +525,40 @@ void Console::handleConfigure()
 	}
 	if (serialbuf[0] == 'r')
 	{
-		if (m_Device.enterBootLoader() && m_Device.exitBootLoader())
+		startDeviceCommand(DEVICE_RESET);
+		return;
+	}
+	else if (m_SerialBuf.startsWith(F("sc")))
+	{
+		// scan [b] [sweeps]
+		const char* arg = strchr(serialbuf, ' ');
+		m_Scan = SCAN_TEXT;
+		m_ScanSweeps = 50;
+		if (arg && arg[1] == 'b')
 		{
-			openUart();
-			return;
+			m_Scan = SCAN_BINARY;
+			m_ScanSweeps = 4;
+			arg = strchr(arg + 1, ' ');
 		}
+		int sweeps = arg ? atoi(arg + 1) : 0;
+		if (sweeps > 0)
+			m_ScanSweeps = sweeps < 255 ? sweeps : 255;
+		if (m_Scan == SCAN_TEXT)
+			outputChannelHeader();
+		m_Spectrum.begin();
+		resetSerialBuffer();
+		return;
 	}
-	else if (m_SerialBuf.startsWith(F("sc")))
+	else if (m_SerialBuf.startsWith(F("*cfg")))
 	{
-		m_Scanning = true;
-		m_ScanNo = 0;
-		outputChannelHeader();
-		m_SerialBuf = "";
+		// already configuring: print the banner and addresses again
+		openConfig();
 		return;
 	}
 	else if (m_SerialBuf.startsWith(F("crc")))
 	{
-		if (m_Device.enterBootLoader())
-			m_Device.performCrcCheck();
+		startDeviceCommand(DEVICE_CRC);
+		return;
 	}
 	else if (serialbuf[0] == 'c' && serialbuf[1] == 'h' && strchr(serialbuf, ' '))
 	{
@@ -237,7 +566,7 @@ void Console::handleConfigure()
 	}
 	else if (serialbuf[0] == 'a' && serialbuf[1] == 'd' && strchr(serialbuf, ' '))
 	{
-		char* addr = strchr(serialbuf, ' ') + 1;
+		const char* addr = strchr(serialbuf, ' ') + 1;
 		m_Device.getRadio().setAddress(addr, 3);
 		if (addr[3] == ' ' || addr[3] == ',' || addr[3] == ':')
 			m_Device.getRadio().setChannel(atoi(&addr[4]));
@@ -248,53 +577,160 @@ void Console::handleConfigure()
 		m_Device.getRadio().setAddress(&serialbuf[3], 3);
 		m_Device.printAddresses();
 	}
+	else if (m_SerialBuf.startsWith(F("join ")))
+	{
+		const char* group = &serialbuf[5];
+		memcpy(m_JoinGroup, group, 3);
+		m_JoinChannel = m_Device.getRadio().getChannel();
+		if (group[3] == ' ' || group[3] == ',' || group[3] == ':')
+			m_JoinChannel = atoi(&group[4]);
+		startDeviceCommand(DEVICE_JOIN);
+		return;
+	}
+	else if (m_SerialBuf.startsWith(F("group")))
+	{
+		if (m_Device.beginGroup())
+			m_Stream->println(F("Next STK500 session programs the group"));
+		else
+			m_Stream->println(F("No devices have joined a group"));
+	}
 	else if (m_SerialBuf.startsWith(F("setid ")))
 	{
 		m_Device.reprogramAddress(&serialbuf[6]);
 	}
+	else if (m_SerialBuf.startsWith(F("setch a")))
+	{
+		// setch auto [last channel], reprogrammed once the scan is done
+		const char* arg = strchr(&serialbuf[6], ' ');
+		int last = arg ? atoi(arg + 1) : 0;
+		m_ScanLast = last > 0 && last < Spectrum::CHANNELS ? last : Spectrum::ISM_LAST_CHANNEL;
+		m_Scan = SCAN_SETCH;
+		m_ScanSweeps = 32;
+		m_Spectrum.begin();
+		resetSerialBuffer();
+		return;
+	}
 	else if (m_SerialBuf.startsWith(F("setch ")))
 	{
 		m_Device.reprogramChannel(atoi(&serialbuf[6]));
 	}
+	else if (m_SerialBuf.startsWith(F("pipe ")))
+	{
+		m_Stk500.setPipelined(serialbuf[5] != '0');
+	}
+	else if (m_SerialBuf.startsWith(F("link ")))
+	{
+		m_Device.setLinkAdaptation(serialbuf[5] != '0');
+	}
+	else if (m_SerialBuf.startsWith(F("tunnel ")))
+	{
+		m_Tunnel = serialbuf[7] != '0';
+		if (m_Tunnel)
+			m_MonitorCount = 0;
+	}
+	else if (m_SerialBuf.startsWith(F("monitor")))
+	{
+		setMonitor(serialbuf[7] == ' ' ? &serialbuf[8] : "");
+	}
+#if !DISABLE_MTNB_STATS
+	else if (m_SerialBuf.startsWith(F("stats")))
+	{
+		if (serialbuf[5] == ' ' && serialbuf[6] == 'c')
+			m_LinkStats.clear();
+		else
+			m_LinkStats.print(*m_Stream);
+	}
+#endif
+#if MTNB_TRACE_SIZE
+	else if (m_SerialBuf.startsWith(F("trace")))
+	{
+		if (serialbuf[5] == ' ' && serialbuf[6] == 'c')
+			Trace::clear();
+		else
+			Trace::writeFrame(*m_Stream);
+	}
+#endif
 	else if (serialbuf[0] == 'v')
 	{
 		m_AllowStk500Debug = true;
 	}
-	m_SerialBuf = "";
+	resetSerialBuffer();
 	m_Stream->write(">");
 	m_Stream->flush();
 }
 
-void Console::scanChannels()
+void Console::startDeviceCommand(eDeviceCommand command)
 {
-	auto& radio = m_Device.getRadio();
-	radio.ce(LOW);
-	radio.startListening(0);
-	uint8_t channel = radio.getChannel();
-	for (uint8_t i = 0; i < CHANNELS; i++)
-	{
-		// select a new channel
-		radio.setChannel((128 * i) / CHANNELS);
-
-		// switch on RX
-		radio.ce(HIGH);
-		delayMicroseconds(130);
-		// this is actually the point where the RPD-flag
-		// is set, when CE goes low
-		radio.ce(LOW);
+	resetSerialBuffer();
+	m_DeviceCommand = command;
+	m_DeviceEntered = false;
+	m_Device.startEnterBootLoader();
+}
 
-		// read out RPD flag; set to 1 if
-		// received power > -64dBm
-		if (radio.readRegister(RPD) > 0)
-			m_Channel[i]++;
+void Console::handleDeviceCommand()
+{
+	// like a STK500 session the device is reset and then asked a step at a
+	// time, typed commands wait until it's done
+	BootLoader::eAsyncStatus status = m_Device.poll();
+	if (status == BootLoader::ASYNC_PENDING)
+		return;
+	if (status == BootLoader::ASYNC_DONE && !m_DeviceEntered)
+	{
+		m_DeviceEntered = true;
+		if (m_DeviceCommand == DEVICE_CRC)
+		{
+			m_Device.startCrcCheck();
+			return;
+		}
+		if (m_DeviceCommand == DEVICE_JOIN)
+		{
+			// joinGroup() uses the signature read here
+			m_Device.startReadDeviceSignature();
+			return;
+		}
+		if (m_Device.exitBootLoader())
+		{
+			m_DeviceCommand = DEVICE_NONE;
+			openUart();
+			return;
+		}
 	}
-	radio.setChannel(channel);
-	radio.ce(HIGH);
-	if (++m_ScanNo == 200)
+	else if (status == BootLoader::ASYNC_DONE && m_DeviceCommand == DEVICE_JOIN)
 	{
-		outputChannels();
-		m_ScanNo = 0;
+		m_Device.joinGroup(m_JoinGroup, m_JoinChannel);
 	}
+	m_DeviceCommand = DEVICE_NONE;
+	m_Stream->write(">");
+	m_Stream->flush();
+}
+
+void Console::handleScan()
+{
+	if (!m_Spectrum.poll() || m_Spectrum.getSweeps() < m_ScanSweeps)
+		return;
+	if (m_Scan == SCAN_SETCH)
+	{
+		stopScan();
+		uint8_t channel = m_Spectrum.quietestChannel(0, m_ScanLast);
+		m_Stream->print(F("Quietest channel is "));
+		m_Stream->println(channel);
+		m_Device.reprogramChannel(channel);
+		m_Stream->write(">");
+		return;
+	}
+	if (m_Scan == SCAN_TEXT)
+		outputChannels();
+	else
+		m_Spectrum.writeFrame(*m_Stream);
+	m_Spectrum.clear();
+}
+
+void Console::stopScan()
+{
+	if (m_Scan == SCAN_OFF)
+		return;
+	m_Spectrum.end();
+	m_Scan = SCAN_OFF;
 }
 
 void Console::outputChannelHeader()
@@ -314,27 +750,29 @@ void Console::outputChannels()
 	uint8_t norm = 0;
 
 	// find the maximal count in channel array
-	for (int i = 0; i < CHANNELS; i++)
-		if (m_Channel[i] > norm) norm = m_Channel[i];
+	for (uint8_t i = 0; i < Spectrum::CHANNELS; i++)
+		if (m_Spectrum.getHits(i) > norm) norm = m_Spectrum.getHits(i);
 
 	// now output the data
 	m_Stream->print('|');
-	for (int i = 0; i < CHANNELS; i++)
+	for (uint8_t i = 0; i < CHANNELS; i++)
 	{
 		uint8_t pos;
+		uint8_t hits = 0;
+		for (uint8_t ch = 2 * i; ch < 2 * i + 2 && ch < Spectrum::CHANNELS; ch++)
+			if (m_Spectrum.getHits(ch) > hits) hits = m_Spectrum.getHits(ch);
 
 		// calculate grey value position
-		if (norm != 0) pos = (uint16_t(m_Channel[i]) * 10) / norm;
+		if (norm != 0) pos = (uint16_t(hits) * 10) / norm;
 		else          pos = 0;
 
 		// boost low values
-		if (pos == 0 && m_Channel[i] > 0) pos++;
+		if (pos == 0 && hits > 0) pos++;
 
 		// clamp large values
 		if (pos > 9) pos = 9;
 
 		m_Stream->write((char)pgm_read_byte(PSTR(" .:-=+*aRW") + pos));
-		m_Channel[i] = 0;
 	}
 
 	// indicate overall power
@@ -3,6 +3,9 @@
 #include "megaTinyNrfBoot.h"
 #include "megaTinyNrfStk500.h"
 #include "megaTinyNrfDebugStream.h"
+#include "megaTinyNrfBuffers.h"
+#include "megaTinyNrfTunnel.h"
+#include "megaTinyNrfSpectrum.h"
 
 namespace mtnrf {
 
@@ -20,13 +23,38 @@ public:
 private:
     void openUart();
     void handleUart();
+    // send what's been typed to the 'U' address, or the monitor's selected target
+    void sendSerialBuffer();
+    // pipes the UART mode listens on, opening the monitor's pipes
+    uint8_t openUartPipes();
+    // print a chunk from one of the monitor's pipes behind its "[n] " tag
+    void writeMonitored(uint8_t pipe, const uint8_t* data, uint8_t size);
+    void setMonitor(const char* lsbs);
+    void handleTunnel();
+    void waitTunnel(uint16_t us);
     void openConfig();
     void handleConfigure();
-    uint8_t matchSerialCommand(const char* seq, uint8_t len);
+    enum eDeviceCommand : uint8_t
+    {
+        DEVICE_NONE,
+        DEVICE_RESET,   // r
+        DEVICE_CRC,     // crc
+        DEVICE_JOIN,    // join
+    };
+    // reset the device into the bootloader for a configuration command,
+    // which handleDeviceCommand() carries out once it's there
+    void startDeviceCommand(eDeviceCommand command);
+    void handleDeviceCommand();
+    void resetSerialBuffer();
     void respondToStk500Sync();
+    // count the bytes of a STK500v2 CMD_SIGN_ON seen so far, 7 once complete
+    uint8_t matchStk500v2SignOn(uint8_t c);
+    void respondToStk500v2SignOn();
+    void handleEnterBootLoader();
     void handleStk500();
 
-    void scanChannels();
+    void handleScan();
+    void stopScan();
     void outputChannels();
     void outputChannelHeader();
 
@@ -34,22 +62,73 @@ private:
     Stream* m_Stream;
     Stk500 m_Stk500;
     bool m_AllowStk500Debug;
+    uint8_t m_SignOnMatch;
+    uint8_t m_SignOnSequence;
+    bool m_Stk500v2;
     DebugStream m_Debug;
 
     enum eMode
     {
         MODE_UART,
+        MODE_TUNNEL,
+        MODE_ENTERING,
         MODE_STK500,
         MODE_CONFIGURE,
     };
     eMode m_Mode;
-    String m_SerialBuf;
+    // serial data for the next radio packet, or the command being typed
+    LineBuffer<32> m_SerialBuf;
+    SequenceMatcher m_SyncMatch;
+    SequenceMatcher m_ConfigMatch;
     uint16_t m_LastSendTime;
-    bool m_Scanning;
+    // tunnel mode: keep the bridge in TX and collect the target's serial
+    // data from ack payloads (see UartTunnel)
+    bool m_Tunnel;
+    bool m_TunnelBusy;      // packet in the air
+    bool m_TunnelRetry;     // packet left in the FIFO after MAX_RT
+    bool m_TunnelSentData;  // the packet isn't just a poll
+    unsigned long m_TunnelTime;
+    unsigned long m_TunnelDataTime;
+    uint16_t m_TunnelWait;
+    uint8_t m_TunnelSetupRetr;
+    // monitor mode: UART mode on pipes 1 to m_MonitorCount, which get these
+    // address LSBs under the bridge's own upper address bytes
+    static const uint8_t MONITOR_PIPES = 5;
+    // Ctrl-A followed by 1 to 5 sends the following serial data to that pipe's target
+    static const char MONITOR_SELECT = 1;
+    char m_MonitorAddr[MONITOR_PIPES];
+    uint8_t m_MonitorCount;
+    uint8_t m_MonitorTarget;    // pipe host data goes to
+    uint8_t m_MonitorLine;      // pipe whose line is being printed, 0 at the start of a line
+    bool m_MonitorSelecting;    // MONITOR_SELECT seen, waiting for the pipe number
+    // poll back to back for this long after data moved, then every TUNNEL_POLL_INTERVAL
+    static const uint16_t TUNNEL_ACTIVE_TIME = 20000;
+    static const uint16_t TUNNEL_POLL_INTERVAL = 1000;
+    static const uint16_t TUNNEL_RETRY_TIME = 10000;
+    // longest an escape sequence may be held back, in ms
+    static const uint8_t TUNNEL_HOLD_TIME = 50;
+    enum eScan
+    {
+        SCAN_OFF,
+        SCAN_TEXT,      // grey map line every m_ScanSweeps
+        SCAN_BINARY,    // Spectrum frame every m_ScanSweeps
+        SCAN_SETCH,     // reprogram the device to the quietest channel
+    };
+    eScan m_Scan;
+    // configuration command waiting for the device
+    eDeviceCommand m_DeviceCommand;
+    bool m_DeviceEntered;
+    char m_JoinGroup[3];
+    uint8_t m_JoinChannel;
+    uint8_t m_ScanSweeps;
+    uint8_t m_ScanLast;         // highest channel setch auto picks
     uint8_t m_ScanLine;
-    uint8_t m_ScanNo;
+    Spectrum m_Spectrum;
+    // columns of the grey map, each covering 2 channels
     static const int CHANNELS = 64;
-    uint8_t m_Channel[CHANNELS];
+#if !DISABLE_MTNB_STATS
+    LinkStats m_LinkStats;
+#endif
 };
 
 inline Stream* Console::getStream() { return m_Stream; }
@@ -1,9 +1,16 @@
 #pragma once
 
 #include <Arduino.h>
+#include "megaTinyNrfBuffers.h"
+
+#ifndef MTNB_DEBUG_LOG_SIZE
+#define MTNB_DEBUG_LOG_SIZE 128
+#endif
 
 namespace mtnrf {
 
+// collects debug output to pass on later.  only the last
+// MTNB_DEBUG_LOG_SIZE bytes are kept, older output is dropped.
 class DebugStream : public Stream
 {
 public:
@@ -11,10 +18,20 @@ public:
     int read() override { return -1; }
     int peek() override { return -1; }
     void flush() override {}
-    size_t write(uint8_t c) override { m_String += (char) c; return 1; };
-    void flush(Stream& target) { target.print(m_String); clear(); }
-    void clear() { m_String = ""; }
-    String m_String;
+    size_t write(uint8_t c) override { m_Dropped |= !m_Log.push(c); return 1; };
+    void flush(Stream& target)
+    {
+        if (m_Dropped)
+            target.print(F("..."));
+        for (int c; (c = m_Log.pop()) >= 0; )
+            target.write((uint8_t) c);
+        clear();
+    }
+    void clear() { m_Log.clear(); m_Dropped = false; }
+
+private:
+    RingBuffer<MTNB_DEBUG_LOG_SIZE> m_Log;
+    bool m_Dropped = false;
 };
 
 } // namespace mtnrf
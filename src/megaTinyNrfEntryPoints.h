@@ -0,0 +1,66 @@
+#pragma once
+
+#include <stdint.h>
+#if MTNRF_ASSEMBLED_BOOTLOADERS
+#include "bootloader_256.h"
+#include "bootloader_extended.h"
+#include "bootloader_packed.h"
+#endif
+
+namespace mtnrf {
+
+// Word addresses in the bootloader (extras/NRF24BootLoader.X/main.S) that
+// the channel and group switchers and the updater call or jump to.  They're
+// the same in the 256 byte and EXTENDED_BOOTLOADER builds, the PACKED_WRITES
+// build's clr r19 moves write_nvm and everything after it a word later.
+enum
+{
+    BOOT_POLL_RESET = 0x07,
+    BOOT_SET_CONFIG_R21 = 0x23,
+    BOOT_WRITE_LOOP = 0x46,
+    BOOT_COMMAND_DATA_X = 0x48,
+    BOOT_CUSTOM_CHANNEL = 0x5F,
+    BOOT_WRITE_NVM = 0x69,
+    BOOT_SEND_ACK_PAYLOAD = 0x6C,
+    BOOT_WAIT_FOR_COMMAND = 0x6E,
+    BOOT_PACKED_WAIT_FOR_COMMAND = 0x6F,
+};
+// the PACKED_WRITES build saves X two instructions into wait_for_command,
+// which is how it's told apart from the others
+static const uint16_t MOVW_R2_X = 0x011D;
+
+#if MTNRF_ASSEMBLED_BOOTLOADERS
+// the host build assembles the three builds from main.S (avrasm, see
+// extras/host/CMakeLists.txt) and checks the addresses against them,
+// moved is 1 for the ones after the PACKED_WRITES build's clr r19
+#define MTNRF_CHECK_ENTRY(address, label, moved) \
+    static_assert(address == BOOT256_##label && address == BOOT512_##label && \
+        address + moved == PACKED_##label, #label " has moved in main.S")
+MTNRF_CHECK_ENTRY(BOOT_POLL_RESET, nrf24_poll_reset, 0);
+MTNRF_CHECK_ENTRY(BOOT_SET_CONFIG_R21, nrf24_set_config_r21, 0);
+MTNRF_CHECK_ENTRY(BOOT_WRITE_LOOP, write_loop, 0);
+MTNRF_CHECK_ENTRY(BOOT_COMMAND_DATA_X, nrf24_command_data_x, 0);
+MTNRF_CHECK_ENTRY(BOOT_CUSTOM_CHANNEL, start_bootloader_custom_channel, 0);
+MTNRF_CHECK_ENTRY(BOOT_WRITE_NVM, write_nvm, 1);
+MTNRF_CHECK_ENTRY(BOOT_SEND_ACK_PAYLOAD, send_ack_payload, 1);
+MTNRF_CHECK_ENTRY(BOOT_WAIT_FOR_COMMAND, wait_for_command, 1);
+#undef MTNRF_CHECK_ENTRY
+static_assert(BOOT_PACKED_WAIT_FOR_COMMAND == PACKED_wait_for_command,
+    "wait_for_command has moved in the PACKED_WRITES build");
+
+constexpr uint16_t extendedWord(uint16_t address)
+{
+    constexpr uint16_t words[] = BOOT512_WORDS;
+    return words[address];
+}
+constexpr uint16_t packedWord(uint16_t address)
+{
+    constexpr uint16_t words[] = PACKED_WORDS;
+    return words[address];
+}
+static_assert(packedWord(BOOT_PACKED_WAIT_FOR_COMMAND + 2) == MOVW_R2_X &&
+    extendedWord(BOOT_PACKED_WAIT_FOR_COMMAND + 2) != MOVW_R2_X,
+    "the PACKED_WRITES build can't be recognised by its movw r2, X");
+#endif
+
+} // namespace mtnrf
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "megaTinyNrf24.h"
+#include <SPI.h>
+
+#if !MEGA_TINY_NRF24_BOOT
+namespace mtnrf {
+
+// Radio with its pins fixed at compile time.  CE and CSN become single
+// VPORT bit instructions (digitalWriteFast) and the SPI0 registers are used
+// directly at up to 10MHz, the fastest the nRF24L01+ allows, without the SPI
+// library's transactions or Radio's 5us CSN delays.  At 20MHz one cycle
+// already covers the radio's 50ns minimum CSN high time.  It's otherwise a
+// Radio and can be passed to BootLoader, Console etc.
+//
+//     FastRadio<PIN_PA4, PIN_PA5> radio;
+//
+// SPI0 is reconfigured at the start of every command so it can still share
+// the bus with devices that use the SPI library.
+template<uint8_t CePin, uint8_t CsnPin, uint32_t SpiClock = 10000000>
+class FastRadio : public Radio
+{
+    static_assert(SpiClock <= 10000000, "the nRF24L01+ SPI clock is limited to 10MHz");
+
+public:
+    FastRadio() : Radio(CePin, CsnPin, s_Bus) {}
+
+private:
+#if !HOST_BUILD
+    // fastest SPI0 clock that isn't above SpiClock
+    static constexpr uint8_t spiControl()
+    {
+        return SPI_MASTER_bm | SPI_ENABLE_bm | (
+            F_CPU / 2 <= SpiClock ? SPI_CLK2X_bm | SPI_PRESC_DIV4_gc :
+            F_CPU / 4 <= SpiClock ? SPI_PRESC_DIV4_gc :
+            F_CPU / 8 <= SpiClock ? SPI_CLK2X_bm | SPI_PRESC_DIV16_gc :
+            F_CPU / 16 <= SpiClock ? SPI_PRESC_DIV16_gc :
+            F_CPU / 32 <= SpiClock ? SPI_CLK2X_bm | SPI_PRESC_DIV64_gc :
+            F_CPU / 64 <= SpiClock ? SPI_PRESC_DIV64_gc : SPI_PRESC_DIV128_gc);
+    }
+#endif
+    static inline uint8_t exchange(uint8_t data)
+    {
+#if HOST_BUILD
+        return SPI.transferRaw(data, SpiClock);
+#else
+        SPI0.DATA = data;
+        while (!(SPI0.INTFLAGS & SPI_IF_bm))
+            ;
+        return SPI0.DATA;
+#endif
+    }
+    static void busBegin(Radio&)
+    {
+        SPI.begin();
+        pinMode(CePin, OUTPUT);
+        pinMode(CsnPin, OUTPUT);
+        digitalWriteFast(CePin, HIGH);
+        digitalWriteFast(CsnPin, HIGH);
+    }
+    static uint8_t busTransfer(Radio&, uint8_t cmd, const uint8_t* out, uint8_t* in, uint8_t count)
+    {
+#if MTNB_RADIO_IRQ
+        RadioLock lock;
+#endif
+#if !HOST_BUILD
+        SPI0.CTRLA = spiControl();
+        SPI0.CTRLB = SPI_SSD_bm | SPI_MODE_0_gc;
+#endif
+        digitalWriteFast(CsnPin, LOW);
+        uint8_t result = exchange(cmd);
+        while (count--)
+        {
+            result = exchange(out ? *out++ : NOP);
+            if (in)
+                *in++ = result;
+        }
+        digitalWriteFast(CsnPin, HIGH);
+        return result;
+    }
+    static void busCe(Radio&, uint8_t state)
+    {
+        digitalWriteFast(CePin, state ? HIGH : LOW);
+    }
+
+    static const RadioBus s_Bus;
+};
+
+template<uint8_t CePin, uint8_t CsnPin, uint32_t SpiClock>
+const RadioBus FastRadio<CePin, CsnPin, SpiClock>::s_Bus = { &busBegin, &busTransfer, &busCe };
+
+} // namespace mtnrf
+#endif
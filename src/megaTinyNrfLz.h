@@ -0,0 +1,86 @@
+#pragma once
+
+#include <stdint.h>
+
+namespace mtnrf {
+
+// Decoder for the LZSS streams sent to the stage-2 updater.  A flag byte
+// announces the next 8 items, lowest bit first.  A clear bit is a literal
+// byte and a set bit a 2 byte back reference into the last 4096 bytes of
+// output: the low 8 bits of (distance - 1), then the top 4 bits of
+// (distance - 1) in the high nybble and (length - 3) in the low nybble.
+//
+// The decoder doesn't keep any history itself.  Feed it compressed bytes
+// with decode() and while copying() is true output the byte getDistance()
+// back and call copied().
+class LzDecoder
+{
+public:
+    static const uint16_t MAX_DISTANCE = 4096;
+    static const uint8_t MIN_LENGTH = 3;
+    static const uint8_t MAX_LENGTH = 18;
+
+    void begin();
+    // add a byte of compressed stream. returns the byte if it's a literal
+    // or -1 if there's nothing to output yet
+    int16_t decode(uint8_t c);
+    // true while there are bytes of a back reference left to copy
+    bool copying() const;
+    uint16_t getDistance() const;
+    void copied();
+
+private:
+    uint16_t m_Flags;   // flag bits still to use above a marker bit
+    uint16_t m_Distance;
+    uint8_t m_Length;
+    uint8_t m_Low;
+    bool m_HaveLow;
+};
+
+///////////////////////////////////////////////////////////////////////////////
+// inlines
+
+inline void LzDecoder::begin()
+{
+    m_Flags = 0;
+    m_Length = 0;
+    m_HaveLow = false;
+}
+inline int16_t LzDecoder::decode(uint8_t c)
+{
+    if (m_Flags <= 1)
+    {
+        m_Flags = c | 0x100;
+        return -1;
+    }
+    if (!(m_Flags & 1))
+    {
+        m_Flags >>= 1;
+        return c;
+    }
+    if (!m_HaveLow)
+    {
+        m_Low = c;
+        m_HaveLow = true;
+        return -1;
+    }
+    m_HaveLow = false;
+    m_Flags >>= 1;
+    m_Distance = (((c & 0xF0) << 4) | m_Low) + 1;
+    m_Length = (c & 15) + MIN_LENGTH;
+    return -1;
+}
+inline bool LzDecoder::copying() const
+{
+    return m_Length != 0;
+}
+inline uint16_t LzDecoder::getDistance() const
+{
+    return m_Distance;
+}
+inline void LzDecoder::copied()
+{
+    --m_Length;
+}
+
+} // namespace mtnrf
@@ -0,0 +1,109 @@
+#if !MEGA_TINY_NRF24_BOOT
+#include "megaTinyNrfSpectrum.h"
+
+namespace mtnrf {
+
+Spectrum::Spectrum(Radio& radio)
+:	m_Radio(radio)
+,	m_Channel(0)
+,	m_RadioChannel(0)
+,	m_Measuring(false)
+,	m_Start(0)
+,	m_Sweeps(0)
+{
+	memset(m_Hits, 0, sizeof(m_Hits));
+}
+
+void Spectrum::begin()
+{
+	m_RadioChannel = m_Radio.getChannel();
+	m_Channel = 0;
+	m_Measuring = false;
+	clear();
+}
+
+void Spectrum::end()
+{
+	m_Radio.ce(LOW);
+	m_Radio.setChannel(m_RadioChannel);
+	m_Radio.ce(HIGH);
+	m_Measuring = false;
+}
+
+void Spectrum::clear()
+{
+	m_Sweeps = 0;
+	memset(m_Hits, 0, sizeof(m_Hits));
+}
+
+bool Spectrum::poll()
+{
+	if (!m_Measuring)
+	{
+		m_Radio.ce(LOW);
+		m_Radio.setChannel(m_Channel);
+		// also puts the radio back into RX if it was used in between
+		m_Radio.startListening(0);
+		m_Radio.ce(HIGH);
+#if DISABLEMILLIS
+		delayMicroseconds(SETTLE_TIME);
+#else
+		m_Start = micros();
+		m_Measuring = true;
+		return false;
+#endif
+	}
+#if !DISABLEMILLIS
+	else if (uint16_t(micros() - m_Start) < SETTLE_TIME)
+	{
+		return false;
+	}
+#endif
+	// RPD is latched when CE goes low
+	m_Radio.ce(LOW);
+	m_Measuring = false;
+	if (m_Radio.readRegister(RPD) && m_Hits[m_Channel] < 255)
+		++m_Hits[m_Channel];
+	if (++m_Channel < CHANNELS)
+		return false;
+	m_Channel = 0;
+	if (m_Sweeps < 255)
+		++m_Sweeps;
+	return true;
+}
+
+uint8_t Spectrum::quietestChannel(uint8_t first, uint8_t last) const
+{
+	if (last >= CHANNELS)
+		last = CHANNELS - 1;
+	uint8_t best = first;
+	uint16_t bestScore = 0xFFFF;
+	for (uint8_t channel = first; channel <= last; ++channel)
+	{
+		// off the end of the band counts the same as the channel itself
+		uint8_t below = channel > 0 ? m_Hits[channel - 1] : m_Hits[channel];
+		uint8_t above = channel < CHANNELS - 1 ? m_Hits[channel + 1] : m_Hits[channel];
+		uint16_t score = 2 * m_Hits[channel] + below + above;
+		if (score <= bestScore)
+		{
+			best = channel;
+			bestScore = score;
+		}
+	}
+	return best;
+}
+
+void Spectrum::writeFrame(Print& out) const
+{
+	uint8_t sum = m_Sweeps;
+	out.write(SPECTRUM_SYNC1);
+	out.write(SPECTRUM_SYNC2);
+	out.write(m_Sweeps);
+	for (uint8_t channel = 0; channel < CHANNELS; ++channel)
+		sum += m_Hits[channel];
+	out.write(m_Hits, CHANNELS);
+	out.write(sum);
+}
+
+} // namespace mtnrf
+#endif
@@ -0,0 +1,80 @@
+#pragma once
+
+#include "megaTinyNrf24.h"
+
+#if !MEGA_TINY_NRF24_BOOT
+class Print;
+
+namespace mtnrf {
+
+// Frames written by Spectrum::writeFrame() ("scan b" in configuration mode):
+// SPECTRUM_SYNC1, SPECTRUM_SYNC2, the number of sweeps counted, one hit
+// count per channel from 0 to 125 and the low byte of the sum of the
+// sweeps and counts.
+static const uint8_t SPECTRUM_SYNC1 = 0xA5;
+static const uint8_t SPECTRUM_SYNC2 = 0x5A;
+
+// Counts how often the radio's received power detector (RPD, above -64dBm)
+// fires on each channel.  poll() measures one channel at a time and returns
+// straight away while the receiver settles, so a sweep of every channel
+// is spread over many calls and other work carries on in between.
+//
+//     spectrum.begin();
+//     ...
+//     if (spectrum.poll() && spectrum.getSweeps() == 32)
+//         radio.setChannel(spectrum.quietestChannel());
+//
+// The radio is left in RX mode with no pipes enabled between measurements.
+// It can be used for something else while measuring() is false, and is put
+// back on its own channel by end().
+class Spectrum
+{
+public:
+    static const uint8_t CHANNELS = 126;
+    // top of the 2.4GHz ISM band (2483MHz), the radio tunes further but
+    // channels above this aren't allowed in most places
+    static const uint8_t ISM_LAST_CHANNEL = 83;
+    // from CE high until RPD is valid: RX settling plus the detector's 40us
+    static const uint8_t SETTLE_TIME = 170;
+
+    Spectrum(Radio& radio);
+
+    // clear the counts and start sweeping from channel 0
+    void begin();
+    // stop and put the radio back on the channel it had in begin()
+    void end();
+    // measure the next channel if the radio is ready, returns true each
+    // time a sweep of all channels completes
+    bool poll();
+    // a channel is being measured, the radio can't be used until poll() has finished with it
+    bool measuring() const;
+    // clear the counts, sweeping carries on where it was
+    void clear();
+
+    // sweeps since the counts were cleared (up to 255)
+    uint8_t getSweeps() const;
+    // times the channel was busy (up to 255)
+    uint8_t getHits(uint8_t channel) const;
+    // channel between first and last with the fewest hits on it and the
+    // channels either side, which a 2Mbps link also occupies.  ties go to
+    // the higher channel, further from Wi-Fi.
+    uint8_t quietestChannel(uint8_t first = 0, uint8_t last = ISM_LAST_CHANNEL) const;
+    // write the counts as a binary frame (see SPECTRUM_SYNC1)
+    void writeFrame(Print& out) const;
+
+private:
+    Radio& m_Radio;
+    uint8_t m_Channel;
+    uint8_t m_RadioChannel;
+    bool m_Measuring;
+    uint16_t m_Start;
+    uint8_t m_Sweeps;
+    uint8_t m_Hits[CHANNELS];
+};
+
+inline bool Spectrum::measuring() const { return m_Measuring; }
+inline uint8_t Spectrum::getSweeps() const { return m_Sweeps; }
+inline uint8_t Spectrum::getHits(uint8_t channel) const { return m_Hits[channel]; }
+
+} // namespace mtnrf
+#endif
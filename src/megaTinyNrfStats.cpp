@@ -0,0 +1,199 @@
+#if !MEGA_TINY_NRF24_BOOT && !DISABLE_MTNB_STATS
+#include "megaTinyNrfStats.h"
+
+namespace mtnrf {
+
+// counter increase since 'last', which was the value at the last update.
+// less than last means the counter was reset (Radio::resetStats) since.
+template <typename T>
+static T advance(T now, T& last)
+{
+	T d = now >= last ? now - last : now;
+	last = now;
+	return d;
+}
+
+LinkStats::LinkStats(Radio& radio)
+:	m_Radio(radio)
+{
+	clear();
+}
+
+void LinkStats::clear()
+{
+	memset(&m_Session, 0, sizeof(m_Session));
+	memset(m_Targets, 0, sizeof(m_Targets));
+	m_InSession = false;
+	m_TargetCount = 0;
+	m_NextTarget = 0;
+	m_PagePending = false;
+}
+
+void LinkStats::update()
+{
+	if (!m_InSession)
+		return;
+	m_Session.packets += advance<uint16_t>(m_Radio.getSendCount(), m_LastSends);
+	m_Session.mcuRetries += advance<uint16_t>(m_Radio.getResendCount(), m_LastResends);
+	m_Session.bytes += advance(m_Radio.getByteCount(), m_LastBytes);
+	m_Session.maxRt += advance(m_Radio.getMaxRtCount(), m_LastMaxRt);
+	m_Session.autoRetransmits += advance(m_Radio.getAutoRetransmits(), m_LastAutoRetransmits);
+}
+
+void LinkStats::beginSession(const uint8_t* address)
+{
+	endSession();
+	memset(&m_Session, 0, sizeof(m_Session));
+	m_Session.address[0] = address[1];
+	m_Session.address[1] = address[2];
+	m_Session.sessions = 1;
+	m_Session.enters = 1;
+	m_InSession = true;
+	m_LastSends = m_Radio.getSendCount();
+	m_LastResends = m_Radio.getResendCount();
+	m_LastBytes = m_Radio.getByteCount();
+	m_LastMaxRt = m_Radio.getMaxRtCount();
+	m_LastAutoRetransmits = m_Radio.getAutoRetransmits();
+}
+
+void LinkStats::endSession()
+{
+	if (!m_InSession)
+		return;
+	update();
+	m_InSession = false;
+	m_PagePending = false;
+	uint8_t index = 0;
+	while (index < m_TargetCount &&
+		(m_Targets[index].address[0] != m_Session.address[0] || m_Targets[index].address[1] != m_Session.address[1]))
+		++index;
+	if (index == m_TargetCount)
+	{
+		// a new target, taking the place of the oldest when the table is full
+		if (m_TargetCount < TARGETS)
+			++m_TargetCount;
+		else
+			index = m_NextTarget++ % TARGETS;
+		memset(&m_Targets[index], 0, sizeof(Record));
+		m_Targets[index].address[0] = m_Session.address[0];
+		m_Targets[index].address[1] = m_Session.address[1];
+	}
+	Record& target = m_Targets[index];
+	target.sessions += m_Session.sessions;
+	target.enters += m_Session.enters;
+	target.enterFailures += m_Session.enterFailures;
+	target.packets += m_Session.packets;
+	target.bytes += m_Session.bytes;
+	target.maxRt += m_Session.maxRt;
+	target.mcuRetries += m_Session.mcuRetries;
+	target.autoRetransmits += m_Session.autoRetransmits;
+	for (uint8_t bucket = 0; bucket < BUCKETS; ++bucket)
+	{
+		target.pageTimes[bucket] += m_Session.pageTimes[bucket];
+		target.readTimes[bucket] += m_Session.readTimes[bucket];
+	}
+}
+
+void LinkStats::enterFinished(bool success)
+{
+	if (m_InSession && !success)
+		++m_Session.enterFailures;
+}
+
+void LinkStats::beginPage()
+{
+	endPage();
+#if !DISABLEMILLIS
+	m_PageStart = micros();
+	m_PagePending = m_InSession;
+#endif
+}
+
+void LinkStats::endPage()
+{
+#if !DISABLEMILLIS
+	if (m_PagePending)
+		addTime(m_Session.pageTimes, micros() - m_PageStart);
+	m_PagePending = false;
+#endif
+}
+
+void LinkStats::addReadTime(uint32_t us)
+{
+	if (m_InSession)
+		addTime(m_Session.readTimes, us);
+}
+
+void LinkStats::addTime(uint16_t* histogram, uint32_t us)
+{
+	uint8_t bucket = 0;
+	while (bucket < BUCKETS - 1 && us >= (uint32_t) FIRST_BUCKET << bucket)
+		++bucket;
+	if (histogram[bucket] < 0xFFFF)
+		++histogram[bucket];
+}
+
+const LinkStats::Record& LinkStats::getSession()
+{
+	update();
+	return m_Session;
+}
+
+void LinkStats::printRecord(Print& out, const __FlashStringHelper* kind, const Record& record)
+{
+	out.print(kind);
+	out.print(F(" addr="));
+	out.write(record.address, 2);
+	out.print(F(" sessions="));
+	out.print(record.sessions);
+	out.print(F(" enters="));
+	out.print(record.enters);
+	out.print(F(" enterfails="));
+	out.print(record.enterFailures);
+	out.print(F(" packets="));
+	out.print(record.packets);
+	out.print(F(" bytes="));
+	out.print(record.bytes);
+	out.print(F(" maxrt="));
+	out.print(record.maxRt);
+	out.print(F(" retries="));
+	out.print(record.mcuRetries);
+	out.print(F(" arc="));
+	out.print(record.autoRetransmits);
+	out.print(F(" pages="));
+	for (uint8_t bucket = 0; bucket < BUCKETS; ++bucket)
+	{
+		if (bucket)
+			out.print(',');
+		out.print(record.pageTimes[bucket]);
+	}
+	out.print(F(" reads="));
+	for (uint8_t bucket = 0; bucket < BUCKETS; ++bucket)
+	{
+		if (bucket)
+			out.print(',');
+		out.print(record.readTimes[bucket]);
+	}
+	out.println();
+}
+
+void LinkStats::print(Print& out)
+{
+	// upper bounds of all but the last bucket in microseconds
+	out.print(F("stats buckets="));
+	for (uint8_t bucket = 0; bucket < BUCKETS - 1; ++bucket)
+	{
+		if (bucket)
+			out.print(',');
+		out.print((uint32_t) FIRST_BUCKET << bucket);
+	}
+	out.println();
+	const Record& session = getSession();
+	if (session.sessions)
+		printRecord(out, m_InSession ? F("session open=1") : F("session open=0"), session);
+	for (uint8_t index = 0; index < m_TargetCount; ++index)
+		printRecord(out, F("target"), m_Targets[index]);
+}
+
+} // namespace mtnrf
+#endif
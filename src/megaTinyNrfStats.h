@@ -0,0 +1,100 @@
+#pragma once
+
+#include "megaTinyNrf24.h"
+
+#ifndef MTNB_STATS_TARGETS
+#define MTNB_STATS_TARGETS 4
+#endif
+
+#if !MEGA_TINY_NRF24_BOOT && !DISABLE_MTNB_STATS
+class Print;
+
+namespace mtnrf {
+
+// Link statistics for each bootloader session and each target address,
+// kept by a BootLoader given one with setLinkStats().  A session runs from
+// startEnterBootLoader() until exitBootLoader() or the next session, and
+// when it ends it's added to its target's totals.  The radio's counters
+// are read when the session ends or when the stats are asked for.
+//
+// Page write times run from a flash page's first packet until the next
+// page starts or the writes are flushed, so with pipelined STK500 writes
+// they show the pace pages go out at.  Read times are whole
+// writeAndReadMemory() calls including their retries.  Neither is
+// measured with DISABLEMILLIS.
+class LinkStats
+{
+public:
+    // times go in bucket n if they're under FIRST_BUCKET << n
+    // microseconds, the last bucket takes everything longer
+    static const uint8_t BUCKETS = 8;
+    static const uint16_t FIRST_BUCKET = 512;
+    static const uint8_t TARGETS = MTNB_STATS_TARGETS;
+
+    struct Record
+    {
+        uint8_t address[2];         // the 2 upper address bytes, which pick the device
+        uint16_t sessions;
+        uint16_t enters;            // enterBootLoader() attempts
+        uint16_t enterFailures;
+        uint32_t packets;
+        uint32_t bytes;
+        uint16_t maxRt;             // MAX_RT events
+        uint16_t mcuRetries;        // Radio::flush() restarting a packet after MAX_RT
+        uint32_t autoRetransmits;   // OBSERVE_TX ARC_CNT, see Radio::getAutoRetransmits()
+        uint16_t pageTimes[BUCKETS];
+        uint16_t readTimes[BUCKETS];
+    };
+
+    LinkStats(Radio& radio);
+
+    // forget every session and target
+    void clear();
+    // write the stats as text lines of key=value pairs:
+    //   stats buckets=512,1024,...
+    //   session open=1 addr=01 sessions=1 enters=1 ... pages=0,12,... reads=...
+    //   target addr=01 sessions=3 ...
+    void print(Print& out);
+
+    // the session in progress, or the last one
+    const Record& getSession();
+    bool inSession() const;
+    uint8_t getTargetCount() const;
+    const Record& getTarget(uint8_t index) const;
+
+    // called by BootLoader
+    void beginSession(const uint8_t* address);
+    void endSession();
+    void enterFinished(bool success);
+    void beginPage();
+    void endPage();
+    void addReadTime(uint32_t us);
+
+private:
+    // add what the radio counted since the last update to the session
+    void update();
+    static void addTime(uint16_t* histogram, uint32_t us);
+    static void printRecord(Print& out, const __FlashStringHelper* kind, const Record& record);
+
+    Radio& m_Radio;
+    Record m_Session;
+    bool m_InSession;
+    Record m_Targets[TARGETS];
+    uint8_t m_TargetCount;
+    uint8_t m_NextTarget;       // replaced when a new target doesn't fit
+    // radio counters at the last update
+    uint16_t m_LastSends;
+    uint16_t m_LastResends;
+    uint32_t m_LastBytes;
+    uint16_t m_LastMaxRt;
+    uint16_t m_LastAutoRetransmits;
+    bool m_PagePending;
+    uint32_t m_PageStart;
+};
+
+inline bool LinkStats::inSession() const { return m_InSession; }
+inline uint8_t LinkStats::getTargetCount() const { return m_TargetCount; }
+inline const LinkStats::Record& LinkStats::getTarget(uint8_t index) const { return m_Targets[index]; }
+
+} // namespace mtnrf
+#endif
@@ -2,17 +2,28 @@
 #include "megaTinyNrfStk500.h"
 #include "megaTinyNrfBoot.h"
 #include "stk500.h"
+#include "stk500v2.h"
 
 namespace mtnrf {
 
 Stk500::Stk500(BootLoader& device)
 :	m_Stream(nullptr)
 ,	m_Device(device)
+,	m_Pipelined(true)
+,	m_WritesPending(false)
+,	m_EepromPending(false)
+,	m_WriteFailed(false)
+,	m_Version2(false)
 {}
 
 void Stk500::begin(Stream& stream)
 {
 	m_Stream = &stream;
+	m_WritesPending = false;
+	m_EepromPending = false;
+	m_WriteFailed = false;
+	m_Version2 = false;
+	memset(m_Signature, 0, sizeof(m_Signature));
 #if !DISABLEMILLIS
 	m_LastCommandTime = millis();
 #else
@@ -31,9 +42,20 @@ bool Stk500::handle()
 	{
 		if ((m_CommandStartTime - m_LastCommandTime) > 5000)
 			return true; // timed out
+		// nothing more coming for now, find out how the last pages went
+		if (m_EepromPending)
+		{
+			if (m_Device.poll() != BootLoader::ASYNC_PENDING)
+				finishEepromWrites();
+			return false;
+		}
+		if (m_WritesPending && (m_CommandStartTime - m_LastCommandTime) > 20)
+			finishWrites();
 		m_Device.keepAlive(m_CommandStartTime);
 		return false;
 	}
+	if (m_Version2)
+		return handleMessage();
 	bool finished = false;
 	m_ValidCommand = false;
 	m_Success = true;
@@ -43,7 +65,7 @@ bool Stk500::handle()
 	case STK_GET_SYNC:
 	{
 		if (endCommand())
-			m_Success &= m_Device.sendSyncPacket();
+			m_Success &= finishWrites() && m_Device.sendSyncPacket();
 		break;
 	}
 	case STK_GET_PARAMETER:
@@ -103,26 +125,40 @@ bool Stk500::handle()
 		m_Success = false;
 		if (length <= 128)
 		{
-			char packetbuf[128];
-			for (uint8_t i = 0; i < length; ++i)
-				packetbuf[i] = getch();
-
-			if (desttype == 'F')
+			if (desttype == 'S')
 			{
-				m_ProgramAddress += 0x8000; // progmem
+				// start a compressed upload: flash start and end addresses
+				// for the stage-2 updater loaded at m_ProgramAddress
+				uint8_t range[4];
+				for (uint8_t i = 0; i < length; ++i)
+				{
+					uint8_t c = getch();
+					if (i < 4)
+						range[i] = c;
+				}
+				m_Success = length == 4 && finishWrites() && m_Device.beginCompressed(m_ProgramAddress,
+					range[0] | (range[1] << 8), range[2] | (range[3] << 8));
 			}
-			else if (desttype == 'E')
+			else if (desttype == 'Z')
 			{
-				m_ProgramAddress += 0x1400; // eeprom
+				// compressed stream, an empty page ends it.  the bootloader
+				// collects it into updater packets as it arrives
+				m_Success = finishEepromWrites();
+				for (uint8_t i = 0; i < length; ++i)
+				{
+					uint8_t c = getch();
+					m_Success = m_Success && m_Device.writeCompressed(&c, 1);
+				}
+				if (length == 0)
+					m_Success = m_Device.endCompressed();
 			}
-			else if (desttype == 'U')
+			else if (m_Device.inGroup())
 			{
-				m_ProgramAddress += 0x1300; // userrow
+				m_Success = writeGroupPage(getMemoryAddress(desttype), length);
 			}
-			if (m_Device.writeMemory(m_ProgramAddress, packetbuf, length))
+			else
 			{
-				m_Success = m_Device.flushWrites();
-				m_Success &= m_ProgramAddress >= 0x8000 || m_Device.waitForEepromWrites();
+				m_Success = writePage(getMemoryAddress(desttype), length);
 			}
 		}
 		endCommand();
@@ -132,12 +168,11 @@ bool Stk500::handle()
 	{
 		int16_t length = getch() << 8;
 		length |= getch();
-		/*uint8_t desttype =*/ getch();
-		if (endCommand())
+		uint8_t desttype = getch();
+		if (endCommand() && length > 0)
 		{
-			do {
-				m_Stream->write(0xFF);
-			} while (--length);
+			finishWrites();
+			m_Success = readPage(getMemoryAddress(desttype), length);
 		}
 		break;
 	}
@@ -147,7 +182,7 @@ bool Stk500::handle()
 		if (endCommand())
 		{
 			uint8_t sig[3];
-			m_Success = m_Device.readDeviceSignature(sig);
+			m_Success = finishWrites() && m_Device.readDeviceSignature(sig);
 			m_Stream->write(sig, 3);
 		}
 		break;
@@ -156,7 +191,7 @@ bool Stk500::handle()
 	{
 		if (endCommand())
 		{
-			finished = m_Success = m_Device.exitBootLoader();
+			finished = m_Success = finishWrites() && m_Device.exitBootLoader();
 		}
 		break;
 	}
@@ -168,12 +203,246 @@ bool Stk500::handle()
 	}
 	if (m_ValidCommand)
 	{
+		m_Success &= !m_WriteFailed;
 		m_Stream->write(m_Success ? STK_OK : STK_FAILED);
 		m_LastCommandTime = m_CommandStartTime;
 	}
 	return finished;
 }
 
+void Stk500::signOn(uint8_t sequence, bool success)
+{
+	m_Version2 = true;
+	m_Sequence = sequence;
+	if (!success)
+	{
+		reply(CMD_SIGN_ON, STATUS_CMD_FAILED);
+		return;
+	}
+	beginReply(11);
+	put(CMD_SIGN_ON);
+	put(STATUS_CMD_OK);
+	put(8);
+	put((const uint8_t*) "STK500_2", 8);
+	endReply();
+}
+
+bool Stk500::handleMessage()
+{
+	if (m_Stream->read() != MESSAGE_START)
+		return false; // out of step, wait for the start of a message
+	m_Checksum = MESSAGE_START;
+	m_ValidCommand = true;
+	m_Success = true;
+	m_Sequence = getch();
+	uint16_t size = getch() << 8;
+	size |= getch();
+	if (getch() != TOKEN || size == 0 || !m_ValidCommand)
+		return false;
+	m_Remaining = size;
+	bool finished = false;
+	uint8_t command = getch();
+	switch (command)
+	{
+	case CMD_SIGN_ON:
+	{
+		if (endMessage(command))
+			signOn(m_Sequence, true);
+		break;
+	}
+	case CMD_GET_PARAMETER:
+	{
+		uint8_t which = getch();
+		if (endMessage(command))
+		{
+			beginReply(3);
+			put(command);
+			put(STATUS_CMD_OK);
+			if (which == PARAM_SW_MAJOR)
+				put(2);
+			else if (which == PARAM_SW_MINOR)
+				put(10);
+			else if (which == PARAM_HW_VER)
+				put(2);
+			else if (which == PARAM_VTARGET)
+				put(50);
+			else
+				put(0);
+			endReply();
+		}
+		break;
+	}
+	case CMD_LOAD_ADDRESS:
+	{
+		// the top bits select extended addressing, which isn't needed
+		getch();
+		getch();
+		uint16_t address = getch() << 8;
+		address |= getch();
+		if (endMessage(command))
+		{
+			m_ProgramAddress = address;
+			reply(command, STATUS_CMD_OK);
+		}
+		break;
+	}
+	case CMD_ENTER_PROGMODE_ISP:
+	{
+		// ISP timing parameters are ignored
+		if (endMessage(command))
+		{
+			m_Success = finishWrites() && m_Device.readDeviceSignature(m_Signature);
+			reply(command, getStatus());
+		}
+		break;
+	}
+	case CMD_PROGRAM_FLASH_ISP:
+	case CMD_PROGRAM_EEPROM_ISP:
+	{
+		uint16_t length = getch() << 8;
+		length |= getch();
+		// mode, delay, instructions and poll values are for ISP
+		for (uint8_t i = 0; i < 7; ++i)
+			getch();
+		uint8_t desttype = command == CMD_PROGRAM_FLASH_ISP ? 'F' : 'E';
+		// pages are sent on before the checksum arrives.  if it turns out
+		// to be wrong the address goes back to the start of the block, so
+		// a retry of the command rewrites the same pages
+		uint16_t address = m_ProgramAddress;
+		m_Success = length <= m_Remaining && writeBlock(desttype, length);
+		if (endMessage(command))
+			reply(command, getStatus());
+		else
+			m_ProgramAddress = address;
+		break;
+	}
+	case CMD_READ_FLASH_ISP:
+	case CMD_READ_EEPROM_ISP:
+	{
+		uint16_t length = getch() << 8;
+		length |= getch();
+		getch();
+		if (endMessage(command))
+		{
+			uint8_t desttype = command == CMD_READ_FLASH_ISP ? 'F' : 'E';
+			uint16_t address = getMemoryAddress(desttype);
+			finishWrites();
+			beginReply(length + 3);
+			put(command);
+			put(STATUS_CMD_OK);
+			for (uint16_t pos = 0; pos < length; pos += 128)
+			{
+				uint16_t size = length - pos < 128 ? length - pos : 128;
+				m_Success = readPage(address + pos, size) && m_Success;
+			}
+			m_ProgramAddress += desttype == 'F' ? length >> 1 : length;
+			put(getStatus());
+			endReply();
+		}
+		break;
+	}
+	case CMD_READ_SIGNATURE_ISP:
+	case CMD_READ_FUSE_ISP:
+	case CMD_READ_LOCK_ISP:
+	case CMD_READ_OSCCAL_ISP:
+	{
+		// the signature byte index is in the third ISP instruction byte
+		uint8_t index = 0;
+		for (uint8_t i = 0; m_Remaining > 0 && i < 5; ++i)
+		{
+			uint8_t c = getch();
+			if (i == 3)
+				index = c;
+		}
+		if (endMessage(command))
+		{
+			beginReply(4);
+			put(command);
+			put(STATUS_CMD_OK);
+			put(command == CMD_READ_SIGNATURE_ISP && index < 3 ? m_Signature[index] : 0);
+			put(STATUS_CMD_OK);
+			endReply();
+		}
+		break;
+	}
+	case CMD_PROGRAM_FUSE_ISP:
+	case CMD_PROGRAM_LOCK_ISP:
+	{
+		// ignore
+		if (endMessage(command))
+		{
+			beginReply(3);
+			put(command);
+			put(STATUS_CMD_OK);
+			put(STATUS_CMD_OK);
+			endReply();
+		}
+		break;
+	}
+	case CMD_SPI_MULTI:
+	{
+		// raw ISP instructions are ignored and read back as zero
+		getch();
+		uint8_t rxcount = getch();
+		if (endMessage(command))
+		{
+			beginReply(rxcount + 3);
+			put(command);
+			put(STATUS_CMD_OK);
+			for (uint8_t i = 0; i < rxcount; ++i)
+				put(0);
+			put(STATUS_CMD_OK);
+			endReply();
+		}
+		break;
+	}
+	case CMD_SET_PARAMETER:
+	case CMD_SET_DEVICE_PARAMETERS:
+	case CMD_OSCCAL:
+	case CMD_CHIP_ERASE_ISP:
+	{
+		// ignore
+		if (endMessage(command))
+			reply(command, STATUS_CMD_OK);
+		break;
+	}
+	case CMD_LEAVE_PROGMODE_ISP:
+	{
+		if (endMessage(command))
+		{
+			finished = m_Success = finishWrites() && m_Device.exitBootLoader();
+			reply(command, getStatus());
+		}
+		break;
+	}
+	default:
+	{
+		if (endMessage(command))
+			reply(command, STATUS_CMD_UNKNOWN);
+		break;
+	}
+	}
+	if (m_ValidCommand)
+		m_LastCommandTime = m_CommandStartTime;
+	return finished;
+}
+
+uint16_t Stk500::getMemoryAddress(uint8_t desttype) const
+{
+	if (desttype == 'F')
+	{
+		// STK500v2 flash addresses are in words
+		if (m_Version2)
+			return (m_ProgramAddress << 1) + 0x8000;
+		return m_ProgramAddress + 0x8000; // progmem
+	}
+	if (desttype == 'E')
+		return m_ProgramAddress + 0x1400; // eeprom
+	if (desttype == 'U')
+		return m_ProgramAddress + 0x1300; // userrow
+	return m_ProgramAddress;
+}
+
 int Stk500::getch()
 {
 	while (!m_Stream->available())
@@ -187,7 +456,140 @@ int Stk500::getch()
 		}
 #endif
 	}
-	return m_Stream->read();
+#if !DISABLEMILLIS
+	// a block of several pages can take longer than that to arrive
+	if (m_Version2)
+		m_CommandStartTime = millis();
+#endif
+	int c = m_Stream->read();
+	m_Checksum ^= c;
+	--m_Remaining;
+	return c;
+}
+
+bool Stk500::writePage(uint16_t address, uint8_t length)
+{
+	// the first application page is about to be replaced, which is when
+	// the device's bitrate can be changed
+	bool sent = finishEepromWrites();
+	if (address == 0x8000 + m_Device.getAppStart() && m_Device.getLinkAdaptation())
+		sent = finishWrites() && m_Device.adaptLink();
+	// each 32 bytes go to the radio as soon as they arrive so the page is
+	// mostly in the air by the time its last byte comes in over serial
+	sent = sent && m_Device.beginWriteMemory(address, length);
+	uint8_t chunk[32];
+	for (uint8_t pos = 0; pos < length; )
+	{
+		uint8_t size = length - pos < 32 ? length - pos : 32;
+		for (uint8_t i = 0; i < size; ++i)
+			chunk[i] = getch();
+		// after a failure keep reading to stay in step with the host
+		sent = sent && m_Device.writeMemoryData(chunk, size);
+		pos += size;
+	}
+	if (!sent)
+	{
+		// the packets that failed may belong to an earlier page
+		m_WriteFailed = m_Pipelined;
+		return false;
+	}
+	m_WritesPending = true;
+	bool success = (m_Pipelined && address >= 0x8000) || finishWrites();
+	if (!success || address >= 0x8000)
+		return success;
+	if (!m_Pipelined)
+		return m_Device.waitForEepromWrites();
+	// answered now, the device is asked when it's done from handle() or
+	// before it's next needed
+	m_Device.startWaitForEepromWrites();
+	m_EepromPending = true;
+	return true;
+}
+
+bool Stk500::writeBlock(uint8_t desttype, uint16_t length)
+{
+	uint16_t address = getMemoryAddress(desttype);
+	m_ProgramAddress += desttype == 'F' ? length >> 1 : length;
+	uint8_t pageSize = desttype == 'F' ? m_Device.getFlashPageSize() : 32;
+	bool success = true;
+	while (length)
+	{
+		uint8_t pageLength = pageSize - ((uint8_t)address & (pageSize - 1));
+		if (pageLength > length)
+			pageLength = length;
+		// after a failure keep reading to stay in step with the host
+		if (m_Device.inGroup())
+			success = writeGroupPage(address, pageLength) && success;
+		else
+			success = writePage(address, pageLength) && success;
+		address += pageLength;
+		length -= pageLength;
+	}
+	return success;
+}
+
+bool Stk500::readPage(uint16_t address, int16_t length)
+{
+	// replies to read requests overlap with the requests, so unlike
+	// writePage() the page is collected before going back over serial
+	uint8_t page[128];
+	if (length <= 128 && m_Device.readMemory(address, page, length))
+	{
+		put(page, length);
+		return true;
+	}
+	do {
+		put(0xFF);
+	} while (--length);
+	// the 256 byte bootloader can't read memory
+	return !m_Device.canReadMemory();
+}
+
+bool Stk500::writeGroupPage(uint16_t address, uint8_t length)
+{
+	// how a page is split into group packets depends on all of it, so it
+	// has to be read first
+	uint8_t page[128];
+	for (uint8_t i = 0; i < length; ++i)
+		page[i] = getch();
+	if (!m_Device.writeMemory(address, page, length))
+	{
+		m_WriteFailed = m_Pipelined;
+		return false;
+	}
+	m_WritesPending = true;
+	return m_Pipelined || finishWrites();
+}
+
+bool Stk500::finishEepromWrites()
+{
+	if (!m_EepromPending)
+		return true;
+	m_EepromPending = false;
+	if (!m_Device.runAsync())
+	{
+		// the page has already been answered
+		m_WriteFailed = true;
+		return false;
+	}
+	return true;
+}
+
+bool Stk500::finishWrites()
+{
+	if (!finishEepromWrites())
+		return false;
+	if (m_WritesPending)
+	{
+		m_WritesPending = false;
+		if (!m_Device.flushWrites())
+		{
+			// pipelined pages have already been answered
+			m_WriteFailed = m_Pipelined;
+			return false;
+		}
+	}
+	return !m_WriteFailed;
 }
 
 bool Stk500::endCommand()
@@ -197,5 +599,61 @@ bool Stk500::endCommand()
 	return m_ValidCommand;
 }
 
+bool Stk500::endMessage(uint8_t command)
+{
+	while (m_Remaining > 0 && m_ValidCommand)
+		getch();
+	getch();
+	if (!m_ValidCommand)
+		return false; // timed out, the host will try again
+	if (m_Checksum != 0)
+	{
+		reply(command, STATUS_CKSUM_ERROR);
+		return false;
+	}
+	return true;
+}
+
+void Stk500::beginReply(uint16_t size)
+{
+	m_Checksum = 0;
+	put(MESSAGE_START);
+	put(m_Sequence);
+	put(size >> 8);
+	put(size);
+	put(TOKEN);
+}
+
+void Stk500::endReply()
+{
+	m_Stream->write(m_Checksum);
+}
+
+void Stk500::reply(uint8_t command, uint8_t status)
+{
+	beginReply(2);
+	put(command);
+	put(status);
+	endReply();
+}
+
+uint8_t Stk500::getStatus() const
+{
+	return m_Success && !m_WriteFailed ? STATUS_CMD_OK : STATUS_CMD_FAILED;
+}
+
+void Stk500::put(uint8_t c)
+{
+	m_Checksum ^= c;
+	m_Stream->write(c);
+}
+
+void Stk500::put(const uint8_t* data, uint8_t length)
+{
+	for (uint8_t i = 0; i < length; ++i)
+		m_Checksum ^= data[i];
+	m_Stream->write(data, length);
+}
+
 } // namespace mtnrf
 #endif
@@ -8,20 +8,57 @@ namespace mtnrf {
 
 class BootLoader;
 
-// handle STK500v2 programming protocol (from avrdude etc)
+// handle STK500 programming protocol (from avrdude etc).  Sessions use the
+// original protocol unless they're started with signOn(), after which
+// STK500v2 messages are expected instead.  Those can carry blocks of several
+// pages which are split up here and forwarded a page at a time.
 class Stk500
 {
 public:
     Stk500(BootLoader& device);
 
     void begin(Stream& stream);
+    // answer a STK500v2 CMD_SIGN_ON with the given sequence number and
+    // switch the session to STK500v2 messages
+    void signOn(uint8_t sequence, bool success);
 
     // returns true when programming completed or operation timed out
     bool handle();
 
+    // answer flash page writes once they're queued for the radio instead of
+    // once the device has them, so the next page comes in over serial while
+    // this one is in the air (on by default).  EEPROM pages are answered
+    // before the device has finished writing them.  a failed page is then
+    // reported by the next command that waits for the device, at the latest
+    // STK_LEAVE_PROGMODE, and every command after it fails too.
+    void setPipelined(bool pipelined);
+    bool isPipelined() const;
+
 private:
+    bool handleMessage();
     int getch();
     bool endCommand();
+    // read the rest of a STK500v2 message and check its checksum
+    bool endMessage(uint8_t command);
+    void beginReply(uint16_t size);
+    void endReply();
+    void reply(uint8_t command, uint8_t status);
+    uint8_t getStatus() const;
+    void put(uint8_t c);
+    void put(const uint8_t* data, uint8_t length);
+    // split a STK500v2 block into pages
+    bool writeBlock(uint8_t desttype, uint16_t length);
+    // wait for pipelined pages to reach the device, false if any failed
+    bool finishWrites();
+    // wait for the device to finish the last EEPROM page
+    bool finishEepromWrites();
+    // forward a page from the stream to the device
+    bool writePage(uint16_t address, uint8_t length);
+    // these need a whole page buffered, on the stack only while they run
+    bool writeGroupPage(uint16_t address, uint8_t length) __attribute__((noinline));
+    bool readPage(uint16_t address, int16_t length) __attribute__((noinline));
+    // data space address for the last STK_LOAD_ADDRESS in the given memory
+    uint16_t getMemoryAddress(uint8_t desttype) const;
 
     Stream* m_Stream;
     BootLoader& m_Device;
@@ -30,6 +67,18 @@ private:
     uint16_t m_ProgramAddress;
     bool m_ValidCommand;
     bool m_Success;
+    bool m_Pipelined;
+    bool m_WritesPending;
+    bool m_EepromPending;   // BootLoader::poll() is waiting for EEPROM writes
+    bool m_WriteFailed;
+    bool m_Version2;
+    uint8_t m_Sequence;
+    uint8_t m_Checksum;
+    int16_t m_Remaining;
+    uint8_t m_Signature[3];
 };
 
+inline void Stk500::setPipelined(bool pipelined) { m_Pipelined = pipelined; }
+inline bool Stk500::isPipelined() const { return m_Pipelined; }
+
 } // namespace mtnrf
@@ -0,0 +1,60 @@
+#include "megaTinyNrfTrace.h"
+#if MTNB_TRACE_SIZE && !MEGA_TINY_NRF24_BOOT
+
+namespace mtnrf {
+
+Trace::Record Trace::s_Records[MTNB_TRACE_SIZE];
+uint16_t Trace::s_Head = 0;
+uint16_t Trace::s_Count = 0;
+uint32_t Trace::s_LastTicks = 0;
+
+void Trace::store(uint8_t event, uint8_t data, uint16_t time)
+{
+	Record& record = s_Records[s_Head++ & (MTNB_TRACE_SIZE - 1)];
+	record.time[0] = time & 255;
+	record.time[1] = time >> 8;
+	record.event = event;
+	record.data = data;
+	if (s_Count < MTNB_TRACE_SIZE)
+		++s_Count;
+}
+
+void Trace::record(uint8_t event, uint8_t data)
+{
+#if DISABLEMILLIS
+	store(event, data, 0);
+#else
+	uint32_t ticks = micros() >> TRACE_TICK_SHIFT;
+	uint32_t elapsed = ticks - s_LastTicks;
+	s_LastTicks = ticks;
+	// the decoder can't tell how often the 16 bit time wrapped on its own
+	if (elapsed > 0xFFFF && s_Count)
+		store(TRACE_TIME, elapsed > 0xFFFFFF ? 255 : elapsed >> 16, ticks);
+	store(event, data, ticks);
+#endif
+}
+
+void Trace::clear()
+{
+	s_Head = 0;
+	s_Count = 0;
+}
+
+void Trace::writeFrame(Print& out)
+{
+	uint8_t header[] = { TRACE_TICK_SHIFT, (uint8_t) (s_Count & 255), (uint8_t) (s_Count >> 8) };
+	uint8_t sum = header[0] + header[1] + header[2];
+	out.write(TRACE_SYNC1);
+	out.write(TRACE_SYNC2);
+	out.write(header, sizeof(header));
+	for (uint16_t i = s_Head - s_Count; i != s_Head; ++i)
+	{
+		const Record& record = s_Records[i & (MTNB_TRACE_SIZE - 1)];
+		out.write((const uint8_t*) &record, sizeof(record));
+		sum += record.time[0] + record.time[1] + record.event + record.data;
+	}
+	out.write(sum);
+}
+
+} // namespace mtnrf
+#endif
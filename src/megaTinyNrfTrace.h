@@ -0,0 +1,88 @@
+#pragma once
+
+#include <Arduino.h>
+
+// records kept by the packet trace, a power of 2.  0 leaves it out.
+#ifndef MTNB_TRACE_SIZE
+#define MTNB_TRACE_SIZE 0
+#endif
+
+namespace mtnrf {
+
+// what a trace record is for, and what its data byte holds
+enum eTraceEvent : uint8_t
+{
+    TRACE_TIME,         // more than 65535 ticks since the last record: how many times 65536 more
+    TRACE_TX,           // W_TX_PAYLOAD: length
+    TRACE_TX_NO_ACK,    // W_TX_PAYLOAD_NO_ACK: length
+    TRACE_TX_DONE,      // flush() found the TX FIFO empty: ARC_CNT of the last packet
+    TRACE_MAX_RT,       // MAX_RT: MCU retries left, 0 when flush() gives up
+    TRACE_FLUSH_TX,     // FLUSH_TX
+    TRACE_RX,           // ack payload or packet read: length
+    TRACE_MODE,         // radio mode switch: eTraceMode
+    TRACE_ENTER,        // BootLoader starts resetting the device into the bootloader
+    TRACE_ENTERED,      // 1 if it's in the bootloader, 0 if it gave up
+    TRACE_SYNC,         // BootLoader sync packet (keep alive, entering, reads)
+    TRACE_PAGE,         // flash page write begins: address high byte, TRACE_DATA follows
+    TRACE_DATA,         // low byte for the record before
+    TRACE_READ,         // writeAndReadMemory() begins: address high byte, TRACE_DATA follows
+    TRACE_EXIT,         // BootLoader sends the device back to its application
+    TRACE_LINK,         // link adaptation picked a level: the level
+};
+
+enum eTraceMode : uint8_t
+{
+    TRACE_MODE_POWER_DOWN,
+    TRACE_MODE_RX,
+    TRACE_MODE_TX,
+};
+
+// Frames written by Trace::writeFrame() ("trace" in configuration mode):
+// TRACE_SYNC1, TRACE_SYNC2, TRACE_TICK_SHIFT, the number of records (2
+// bytes, low byte first), the records oldest first and the low byte of the
+// sum of every byte after the sync bytes.  Each record is its time in
+// ticks of 1 << TRACE_TICK_SHIFT microseconds (2 bytes, low byte first,
+// wrapping), the eTraceEvent and its data byte.
+static const uint8_t TRACE_SYNC1 = 0xA5;
+static const uint8_t TRACE_SYNC2 = 0x7E;
+static const uint8_t TRACE_TICK_SHIFT = 4;
+
+#if MTNB_TRACE_SIZE && !MEGA_TINY_NRF24_BOOT
+// Timestamped radio and bootloader events in a fixed ring of
+// MTNB_TRACE_SIZE records of 4 bytes, the oldest overwritten when it's
+// full.  Radio and BootLoader record into it with MTNB_TRACE(), which is
+// only called outside interrupts.  Times aren't recorded with DISABLEMILLIS.
+class Trace
+{
+public:
+    static_assert((MTNB_TRACE_SIZE & (MTNB_TRACE_SIZE - 1)) == 0, "MTNB_TRACE_SIZE must be a power of 2");
+
+    static void record(uint8_t event, uint8_t data);
+    static void clear();
+    static uint16_t size();
+    // write the records as a binary frame (see TRACE_SYNC1)
+    static void writeFrame(Print& out);
+
+private:
+    struct Record
+    {
+        uint8_t time[2];
+        uint8_t event;
+        uint8_t data;
+    };
+    static void store(uint8_t event, uint8_t data, uint16_t time);
+
+    static Record s_Records[MTNB_TRACE_SIZE];
+    static uint16_t s_Head;
+    static uint16_t s_Count;
+    static uint32_t s_LastTicks;
+};
+
+inline uint16_t Trace::size() { return s_Count; }
+
+#define MTNB_TRACE(EVENT, DATA) Trace::record(EVENT, DATA)
+#else
+#define MTNB_TRACE(EVENT, DATA) do {} while (0)
+#endif
+
+} // namespace mtnrf
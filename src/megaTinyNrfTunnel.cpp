@@ -0,0 +1,83 @@
+#include "megaTinyNrfTunnel.h"
+
+namespace mtnrf {
+
+UartTunnel::UartTunnel(Radio& radio)
+:	m_Radio(radio)
+,	m_Pipe(1)
+,	m_Connected(true)
+{
+}
+
+void UartTunnel::begin(uint8_t pipe)
+{
+	m_Pipe = pipe;
+	m_Connected = true;
+	m_Rx.clear();
+	m_Tx.clear();
+	m_Radio.openReadingPipe('U', pipe);
+	// ack payloads left over from before would go out first
+	m_Radio.clearWriteFifo();
+	m_Radio.startListening(_BV(pipe) | _BV(5));
+}
+
+void UartTunnel::poll()
+{
+	m_Radio.bootPoll();
+	uint8_t packet[32];
+	while (m_Rx.space() >= TUNNEL_PAYLOAD && m_Radio.available() && m_Radio.readPipe() == m_Pipe)
+	{
+		uint8_t size = m_Radio.read(packet).packetsize;
+		m_Connected = true;
+		if (packet[0] != TUNNEL_HEADER)
+			continue;
+		for (uint8_t i = 1; i < size; ++i)
+			m_Rx.push(packet[i]);
+	}
+	// a payload is sent with every ack until the next new packet arrives,
+	// so the radio's 3 deep FIFO covers the bridge's next 3 packets
+	while (!m_Tx.empty() && !(m_Radio.readRegister(FIFO_STATUS) & _BV(FIFO_FULL)))
+	{
+		uint8_t size = 0;
+		while (size < sizeof(packet) && !m_Tx.empty())
+			packet[size++] = m_Tx.pop();
+		m_Radio.writeAckPayload(packet, size, m_Pipe);
+	}
+}
+
+int UartTunnel::available()
+{
+	poll();
+	return m_Rx.size();
+}
+
+size_t UartTunnel::write(uint8_t c)
+{
+	if (!m_Tx.space())
+		poll();
+#if !DISABLEMILLIS
+	for (unsigned long start = millis(); !m_Tx.space() && m_Connected; poll())
+		if (millis() - start >= TIMEOUT)
+			m_Connected = false;
+#endif
+	if (!m_Tx.space())
+		return 0;
+	m_Tx.push(c);
+	return 1;
+}
+
+void UartTunnel::flush()
+{
+	poll();
+#if !DISABLEMILLIS
+	for (unsigned long start = millis(); m_Connected; poll())
+	{
+		if (m_Tx.empty() && (m_Radio.readRegister(FIFO_STATUS) & _BV(TX_EMPTY)))
+			break;
+		if (millis() - start >= TIMEOUT)
+			m_Connected = false;
+	}
+#endif
+}
+
+} // namespace mtnrf
@@ -0,0 +1,71 @@
+#pragma once
+
+#include "megaTinyNrf24.h"
+#include "megaTinyNrfBuffers.h"
+
+namespace mtnrf {
+
+// Packets the bridge sends in tunnel mode start with TUNNEL_HEADER followed
+// by up to TUNNEL_PAYLOAD bytes of serial data.  A header on its own is a
+// poll for whatever the target has queued.  Other header values are
+// reserved and their packets ignored.
+static const uint8_t TUNNEL_HEADER = 0;
+static const uint8_t TUNNEL_PAYLOAD = 31;
+
+// Application end of the bridge's UART tunnel ("tunnel 1" in configuration
+// mode).  The bridge stays in TX mode sending serial data to the 'U' address
+// as it arrives and polling when there's none, and whatever is written here
+// goes back to it in the acknowledgements, so neither radio ever switches
+// between RX and TX.
+//
+//     UartTunnel tunnel(radio);
+//     tunnel.begin();
+//     ...
+//     while (tunnel.available())
+//         tunnel.write(tunnel.read());
+//
+// Packets are only taken from the radio while the receive buffer has room
+// for them, otherwise the radio stops acknowledging and the bridge holds on
+// to its data until the application catches up.  The radio's TX FIFO holds
+// the ack payloads so Radio::write() can't be used while the tunnel is open.
+// Packets on other pipes are left for the application to read, and poll()
+// resets into the bootloader when a programming packet arrives on pipe 5.
+class UartTunnel : public Stream
+{
+public:
+    // longest write() and flush() wait for the bridge to collect data
+    static const uint16_t TIMEOUT = 100;
+
+    UartTunnel(Radio& radio);
+
+    // listen for the bridge on 'U' on the given pipe, and on pipe 5 for the bootloader
+    void begin(uint8_t pipe = 1);
+    // take packets from the radio and keep its ack payloads loaded.  it's
+    // called by available(), write() and flush(), an application that
+    // does neither often should call it itself.
+    void poll();
+
+    int available() override;
+    int read() override;
+    int peek() override;
+    // waits up to TIMEOUT for room, unless the bridge already failed to
+    // collect data in time and hasn't been heard from since
+    size_t write(uint8_t c) override;
+    using Print::write;
+    int availableForWrite() override;
+    // wait until the bridge has collected everything written
+    void flush() override;
+
+private:
+    Radio& m_Radio;
+    uint8_t m_Pipe;
+    bool m_Connected;
+    RingBuffer<64> m_Rx;
+    RingBuffer<64> m_Tx;
+};
+
+inline int UartTunnel::read() { return m_Rx.pop(); }
+inline int UartTunnel::peek() { return m_Rx.peek(); }
+inline int UartTunnel::availableForWrite() { return m_Tx.space(); }
+
+} // namespace mtnrf
@@ -0,0 +1,199 @@
+#if MEGA_TINY_NRF24_BOOT
+#include "megaTinyNrfUpdater.h"
+#include "megaTinyNrf24.h"
+#include "megaTinyNrfEntryPoints.h"
+#include <avr/wdt.h>
+
+namespace mtnrf {
+
+// the bootloader reads command packets into the last 128 bytes of SRAM
+static uint8_t* const s_CommandBuffer = (uint8_t*) 0x3F80;
+static const uint8_t STATE_VALID = 0xA5;
+
+// everything the updater needs to survive each trip through the bootloader
+struct UpdaterState
+{
+	uint8_t valid;
+	uint8_t status;
+	uint16_t start;
+	uint16_t end;
+	uint16_t pos;
+	LzDecoder decoder;
+	uint8_t packetPos;
+	uint8_t packet[UPDATER_PACKET_SIZE];
+	uint8_t firstPage[PROGMEM_PAGE_SIZE];
+	uint8_t page[PROGMEM_PAGE_SIZE];
+};
+static UpdaterState s_State __attribute__((section(".noinit")));
+
+// Jump into the bootloader's main loop with the registers it expects there.
+// At BOOT_WRITE_NVM it writes the flash page buffer first.  Either way the
+// status byte goes back in the next ack payload.  VPORTA/VPORTB must match
+// VPORT1/VPORT2 in main.S.  r19 = 0 so no page follows without a command.
+static void __attribute__((noreturn)) returnToBootLoader(uint16_t entry)
+{
+	if (*(const uint16_t*) (MAPPED_PROGMEM_START + (BOOT_PACKED_WAIT_FOR_COMMAND + 2) * 2) == MOVW_R2_X)
+		++entry;
+	asm volatile(
+		"push %A[entry]\n\t"
+		"push %B[entry]\n\t"
+		"in r16, %[dir1]\n\t"
+		"in r17, %[dir2]\n\t"
+		"clr r19\n\t"
+		"ldi r20, 0\n\t"
+		"ldi r21, %[spm]\n\t"
+		"ldi r26, lo8(%[status])\n\t"
+		"ldi r27, hi8(%[status])\n\t"
+		"ldi r28, 0x80\n\t"
+		"ldi r29, 0x3F\n\t"
+		"ldi r30, %[erasewrite]\n\t"
+		"ret"
+		:
+		: [entry] "r" (entry),
+		  [dir1] "I" (_SFR_IO_ADDR(VPORTA_DIR)),
+		  [dir2] "I" (_SFR_IO_ADDR(VPORTB_DIR)),
+		  [spm] "M" (CPU_CCP_SPM_gc),
+		  [status] "i" (&s_State.status),
+		  [erasewrite] "M" (NVMCTRL_CMD_PAGEERASEWRITE_gc));
+	__builtin_unreachable();
+}
+
+static void __attribute__((noreturn)) fail(uint8_t status)
+{
+	s_State.status = status;
+	s_State.valid = 0;
+	returnToBootLoader(BOOT_SEND_ACK_PAYLOAD);
+}
+
+static void __attribute__((noreturn)) writePage(uint16_t address, const uint8_t* data)
+{
+	uint8_t* dst = (uint8_t*) (MAPPED_PROGMEM_START + address);
+	for (uint8_t i = 0; i < PROGMEM_PAGE_SIZE; ++i)
+		dst[i] = data[i];
+	returnToBootLoader(BOOT_WRITE_NVM);
+}
+
+static uint8_t readHistory(const UpdaterState& s, uint16_t address)
+{
+	uint16_t offset = address - s.start;
+	if (offset < PROGMEM_PAGE_SIZE)
+		return s.firstPage[offset];
+	if (address >= (s.pos & ~(PROGMEM_PAGE_SIZE - 1)))
+		return s.page[address & (PROGMEM_PAGE_SIZE - 1)];
+	return *(const uint8_t*) (MAPPED_PROGMEM_START + address);
+}
+
+static void decompressPacket(UpdaterState& s)
+{
+	for (;;)
+	{
+		int16_t c;
+		if (s.decoder.copying())
+		{
+			uint16_t distance = s.decoder.getDistance();
+			if (distance > s.pos - s.start)
+				fail(UPDATER_BAD_REFERENCE);
+			c = readHistory(s, s.pos - distance);
+			s.decoder.copied();
+		}
+		else if (s.packetPos < UPDATER_PACKET_SIZE)
+		{
+			c = s.decoder.decode(s.packet[s.packetPos++]);
+			if (c < 0)
+				continue;
+		}
+		else
+		{
+			return;
+		}
+		// anything after the end is padding
+		if (s.pos == s.end)
+			continue;
+		uint8_t* buffer = s.pos - s.start < PROGMEM_PAGE_SIZE ? s.firstPage : s.page;
+		buffer[s.pos & (PROGMEM_PAGE_SIZE - 1)] = c;
+		if ((++s.pos & (PROGMEM_PAGE_SIZE - 1)) == 0 && buffer == s.page)
+			writePage(s.pos - PROGMEM_PAGE_SIZE, s.page);
+	}
+}
+
+void Updater::run()
+{
+	cli();
+	UpdaterState& s = s_State;
+	Radio radio(0, 0);
+	// decompression is CPU bound, run at 10MHz rather than the 3.3MHz
+	// the bootloader leaves us with (the prescaler stays until reset)
+	_PROTECTED_WRITE(CLKCTRL.MCLKCTRLB, CLKCTRL_PDIV_2X_gc | CLKCTRL_PEN_bm);
+	// the packet that started the application is in the command buffer
+	bool fromBootLoader = true;
+	for (;;)
+	{
+		if (s.valid == STATE_VALID)
+			decompressPacket(s);
+		s.packetPos = UPDATER_PACKET_SIZE;
+
+		if (fromBootLoader)
+		{
+			fromBootLoader = false;
+			memcpy(s.packet, s_CommandBuffer, UPDATER_PACKET_SIZE);
+			// don't resume from a stale packet after a watchdog reset
+			s_CommandBuffer[0] = 0;
+		}
+		else
+		{
+			while (!radio.available())
+				;
+			wdt_reset();
+			radio.read(s.packet);
+		}
+
+		if (s.packet[0] != UPDATER_PACKET)
+		{
+			// keep alive packets from the bridge
+			if (s.packet[0] == CPU_CCP_SPM_gc && s.packet[1] == 0)
+				continue;
+			// anything else is for the bootloader, wait to be reset into it
+			for (;;)
+				radio.bootPoll();
+		}
+		switch (s.packet[1])
+		{
+		case UPDATER_START:
+			s.start = s.packet[2] | (s.packet[3] << 8);
+			s.end = s.packet[4] | (s.packet[5] << 8);
+			s.pos = s.start;
+			s.decoder.begin();
+			s.status = UPDATER_BUSY;
+			s.valid = STATE_VALID;
+			// fall through
+		case UPDATER_QUERY:
+			radio.clearWriteFifo();
+			radio.writeAckPayload("MTZ2", 4, 5);
+			break;
+		case UPDATER_DATA:
+			if (s.valid != STATE_VALID)
+			{
+				if (s.status == UPDATER_OK || s.status == UPDATER_BUSY)
+					s.status = UPDATER_NOT_STARTED;
+				returnToBootLoader(BOOT_SEND_ACK_PAYLOAD);
+			}
+			s.packetPos = 2;
+			break;
+		case UPDATER_END:
+			if (s.valid != STATE_VALID)
+			{
+				if (s.status == UPDATER_BUSY)
+					s.status = UPDATER_NOT_STARTED;
+				returnToBootLoader(BOOT_SEND_ACK_PAYLOAD);
+			}
+			if (s.pos != s.end)
+				fail(UPDATER_INCOMPLETE);
+			s.status = UPDATER_OK;
+			s.valid = 0;
+			writePage(s.start, s.firstPage);
+		}
+	}
+}
+
+} // namespace mtnrf
+#endif
@@ -0,0 +1,49 @@
+#pragma once
+
+#include "megaTinyNrfLz.h"
+
+namespace mtnrf {
+
+// Packets understood by the stage-2 updater.  The first byte is
+// UPDATER_PACKET and the second one of these commands.  All but
+// UPDATER_WAKE are 32 bytes long.
+enum UpdaterCommand
+{
+    UPDATER_PACKET = 'Z',
+    UPDATER_START = 'S', // flash start and end byte addresses (little endian)
+    UPDATER_QUERY = '?', // updater replies "MTZ2" in the next ack payload
+    UPDATER_DATA = 'D',  // 30 bytes of LZ compressed stream
+    UPDATER_END = 'E',   // write the first page, status comes back in an ack payload
+    // after each page write the bootloader takes one packet before it returns
+    // to the updater, so one of these follows each data packet per page it fills
+    UPDATER_WAKE = 'W',
+};
+static const uint8_t UPDATER_PACKET_SIZE = 32;
+static const uint8_t UPDATER_DATA_SIZE = UPDATER_PACKET_SIZE - 2;
+
+// status byte returned in the ack payload after UPDATER_END
+enum UpdaterStatus
+{
+    UPDATER_OK = 0,
+    UPDATER_BUSY,          // still decompressing
+    UPDATER_INCOMPLETE,    // stream ended before reaching the end address
+    UPDATER_BAD_REFERENCE, // back reference to before the start address
+    UPDATER_NOT_STARTED,   // data without a start packet
+};
+
+#if MEGA_TINY_NRF24_BOOT
+// Resident stage-2 updater which decompresses an image into flash.  It lives
+// at the top of flash (see the Stage2Updater example) and is entered through
+// a jump the programming bridge writes to the start of the application.
+// Each finished page is handed to the bootloader's NVM write code which
+// returns to the application, and so the updater, on the next updater packet.
+// The first page is kept in RAM and written last, replacing the jump.
+class Updater
+{
+public:
+    // take over from the bootloader (never returns)
+    static void run() __attribute__((noreturn));
+};
+#endif
+
+} // namespace mtnrf